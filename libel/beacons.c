@@ -39,7 +39,220 @@
 #define PUT_IN_CACHE true
 #define GET_FROM_CACHE false
 
-static bool beacon_compare(Sky_ctx_t *ctx, Beacon_t *new, Beacon_t *wb, int *diff);
+/*! \brief accumulate bytes into an FNV-1a hash
+ *
+ *  @param h hash so far
+ *  @param p pointer to bytes
+ *  @param n number of bytes
+ *
+ *  @return updated hash
+ */
+static uint32_t fnv_bytes(uint32_t h, const void *p, size_t n)
+{
+    const uint8_t *b = p;
+
+    while (n--)
+        h = (h ^ *b++) * 16777619u;
+    return h;
+}
+
+/*! \brief hash the identity of an AP or cell
+ *
+ *  Any two beacons which the plugins consider equal must have the same key, so
+ *  only the fields compared by the equal() plugin operations contribute.
+ *
+ *  @param b pointer to beacon
+ *
+ *  @return 32 bit key
+ */
+static uint32_t beacon_key(Beacon_t *b)
+{
+    uint32_t h = fnv_bytes(2166136261u, &b->h.type, sizeof(b->h.type));
+    int32_t id3 = b->cell.id3, freq = b->cell.freq; /* copies, cell fields may be bit-fields */
+    int64_t id4 = b->cell.id4;
+    int16_t id5 = b->cell.id5;
+
+    if (is_ap_type(b))
+        return fnv_bytes(h, b->ap.mac, MAC_SIZE);
+    h = fnv_bytes(h, &b->cell.id1, sizeof(b->cell.id1));
+    h = fnv_bytes(h, &b->cell.id2, sizeof(b->cell.id2));
+    if (b->h.type == SKY_BEACON_GSM || b->h.type == SKY_BEACON_CDMA)
+        h = fnv_bytes(h, &id3, sizeof(id3));
+    h = fnv_bytes(h, &id4, sizeof(id4));
+    /* nmr are identified by pci and channel */
+    if (b->cell.id1 == SKY_UNKNOWN_ID1 || b->cell.id2 == SKY_UNKNOWN_ID2 ||
+        b->cell.id4 == SKY_UNKNOWN_ID4) {
+        h = fnv_bytes(h, &id5, sizeof(id5));
+        h = fnv_bytes(h, &freq, sizeof(freq));
+    }
+    return h;
+}
+
+/*! \brief add workspace beacon to the index of beacon identities
+ *
+ *  The index holds the slot of each beacon, which does not change as beacons
+ *  are inserted and removed ahead of it in the order.
+ *
+ *  @param ctx Skyhook request context
+ *  @param idx index of beacon in workspace
+ */
+static void index_add(Sky_ctx_t *ctx, int idx)
+{
+    uint32_t i;
+
+    if (!is_ap_type(&BEACON_AT(ctx, idx)) && !is_cell_type(&BEACON_AT(ctx, idx)))
+        return;
+    i = beacon_key(&BEACON_AT(ctx, idx)) % BEACON_INDEX_SIZE;
+    while (ctx->beacon_index[i])
+        i = (i + 1) % BEACON_INDEX_SIZE;
+    ctx->beacon_index[i] = ctx->order[idx] + 1;
+}
+
+/*! \brief remove workspace beacon from the index of beacon identities
+ *
+ *  Entries which follow in the same run are shifted back so that no
+ *  deleted markers are needed.
+ *
+ *  @param ctx Skyhook request context
+ *  @param idx index of beacon in workspace
+ */
+static void index_remove(Sky_ctx_t *ctx, int idx)
+{
+    uint32_t i, j, home;
+
+    if (!is_ap_type(&BEACON_AT(ctx, idx)) && !is_cell_type(&BEACON_AT(ctx, idx)))
+        return;
+    i = beacon_key(&BEACON_AT(ctx, idx)) % BEACON_INDEX_SIZE;
+    while (ctx->beacon_index[i] != ctx->order[idx] + 1) {
+        if (!ctx->beacon_index[i])
+            return; /* not indexed */
+        i = (i + 1) % BEACON_INDEX_SIZE;
+    }
+    for (j = (i + 1) % BEACON_INDEX_SIZE; ctx->beacon_index[j]; j = (j + 1) % BEACON_INDEX_SIZE) {
+        home = beacon_key(&ctx->slot[ctx->beacon_index[j] - 1]) % BEACON_INDEX_SIZE;
+        /* move entry back unless its home slot lies between the hole and where it is */
+        if (i < j ? (home <= i || home > j) : (home <= i && home > j)) {
+            ctx->beacon_index[i] = ctx->beacon_index[j];
+            i = j;
+        }
+    }
+    ctx->beacon_index[i] = 0;
+}
+
+#if SKY_AP_MIRROR
+/*! \brief copy AP into the AP mirror, moving later APs up
+ *
+ *  @param ctx Skyhook request context
+ *  @param idx index of AP in workspace, NUM_APS not yet counting it
+ */
+static void mirror_insert(Sky_ctx_t *ctx, int idx)
+{
+    Sky_ap_mirror_t *m = &ctx->aps;
+    Beacon_t *b = &BEACON_AT(ctx, idx);
+    int n = NUM_APS(ctx) - idx;
+
+    memmove(&m->mac[idx + 1], &m->mac[idx], n * sizeof(m->mac[0]));
+    memmove(&m->rssi[idx + 1], &m->rssi[idx], n * sizeof(m->rssi[0]));
+    memmove(&m->age[idx + 1], &m->age[idx], n * sizeof(m->age[0]));
+    memmove(&m->freq[idx + 1], &m->freq[idx], n * sizeof(m->freq[0]));
+    m->mac[idx] = pack_mac(b->ap.mac);
+    m->rssi[idx] = b->h.rssi;
+    m->age[idx] = b->h.age;
+    m->freq[idx] = b->ap.freq;
+}
+
+/*! \brief remove AP from the AP mirror, moving later APs down
+ *
+ *  @param ctx Skyhook request context
+ *  @param idx index of AP in workspace, NUM_APS no longer counting it
+ */
+static void mirror_remove(Sky_ctx_t *ctx, int idx)
+{
+    Sky_ap_mirror_t *m = &ctx->aps;
+    int n = NUM_APS(ctx) - idx;
+
+    memmove(&m->mac[idx], &m->mac[idx + 1], n * sizeof(m->mac[0]));
+    memmove(&m->rssi[idx], &m->rssi[idx + 1], n * sizeof(m->rssi[0]));
+    memmove(&m->age[idx], &m->age[idx + 1], n * sizeof(m->age[0]));
+    memmove(&m->freq[idx], &m->freq[idx + 1], n * sizeof(m->freq[0]));
+}
+#endif
+
+/*! \brief rebuild the index of beacon identities, and AP mirror, from the workspace
+ *
+ *  @param ctx Skyhook request context
+ */
+void reindex_beacons(Sky_ctx_t *ctx)
+{
+    ctx->aps_distinct = false;
+    memset(ctx->beacon_index, 0, sizeof(ctx->beacon_index));
+    for (int i = 0; i < NUM_BEACONS(ctx); i++)
+        index_add(ctx, i);
+#if SKY_AP_MIRROR
+    {
+        int n = NUM_APS(ctx);
+
+        for (NUM_APS(ctx) = 0; NUM_APS(ctx) < n; NUM_APS(ctx)++)
+            mirror_insert(ctx, NUM_APS(ctx));
+    }
+#endif
+}
+
+/*! \brief find workspace beacon equal to a new beacon
+ *
+ *  Only when one is found is the order searched for its index.
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno pointer to errno
+ *  @param b new beacon
+ *
+ *  @return index of equal beacon in workspace or -1 if none
+ */
+static int find_duplicate(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b)
+{
+    uint32_t i = beacon_key(b) % BEACON_INDEX_SIZE;
+    int j, slot;
+
+    for (; ctx->beacon_index[i]; i = (i + 1) % BEACON_INDEX_SIZE) {
+        slot = ctx->beacon_index[i] - 1;
+        if (sky_plugin_equal(ctx, sky_errno, b, &ctx->slot[slot], NULL) == SKY_SUCCESS) {
+            for (j = 0; j < NUM_BEACONS(ctx); j++)
+                if (ctx->order[j] == slot)
+                    return j;
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/*! \brief pack the priority of a beacon into an integer, lower is better
+ *
+ *  Workspace beacons are kept in ascending order of priority, which gives the
+ *  same order as beacon_compare:
+ *   . fully qualified before nmr
+ *   . then by type
+ *   . APs by strongest, then most virtual APs
+ *   . cells by connected, then youngest, then strongest
+ *
+ *  Bits are nmr (61), type (60-57), not connected (56), age (55-24),
+ *  signal strength (23-8) and virtual group size (7-0). The key takes a few shifts,
+ *  so it is worked out for each comparison rather than kept with each beacon.
+ *
+ *  @param b pointer to beacon
+ *
+ *  @return priority
+ */
+static uint64_t beacon_priority(Beacon_t *b)
+{
+    uint64_t key = ((uint64_t)is_cell_nmr(b) << 61) | ((uint64_t)(b->h.type & 0xF) << 57);
+    uint64_t strength = (uint16_t)(0x7FFF - EFFECTIVE_RSSI(b->h.rssi));
+
+    if (is_ap_type(b))
+        return key | (strength << 8) | (uint8_t)(0xFF - b->ap.vg_len);
+    if (!is_cell_type(b) || b->h.connected)
+        return key; /* connected cells of a type are equivalent */
+    return key | (1ULL << 56) | ((uint64_t)b->h.age << 24) | (strength << 8);
+}
 
 /*! \brief shuffle list to remove the beacon at index
  *
@@ -50,14 +263,23 @@ static bool beacon_compare(Sky_ctx_t *ctx, Beacon_t *new, Beacon_t *wb, int *dif
  */
 Sky_status_t remove_beacon(Sky_ctx_t *ctx, int index)
 {
+    uint8_t slot;
+
     if (index >= NUM_BEACONS(ctx))
         return SKY_ERROR;
 
-    if (is_ap_type(&ctx->beacon[index]))
+    if (is_ap_type(&BEACON_AT(ctx, index))) {
         NUM_APS(ctx) -= 1;
+#if SKY_AP_MIRROR
+        mirror_remove(ctx, index);
+#endif
+    }
 
-    memmove(&ctx->beacon[index], &ctx->beacon[index + 1],
-        sizeof(Beacon_t) * (NUM_BEACONS(ctx) - index - 1));
+    index_remove(ctx, index);
+    /* close the gap in the order, and return the slot to the free slots after it */
+    slot = ctx->order[index];
+    memmove(&ctx->order[index], &ctx->order[index + 1], NUM_BEACONS(ctx) - index - 1);
+    ctx->order[NUM_BEACONS(ctx) - 1] = slot;
     LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "idx:%d", index);
     NUM_BEACONS(ctx) -= 1;
 #ifdef VERBOSE_DEBUG
@@ -66,107 +288,207 @@ Sky_status_t remove_beacon(Sky_ctx_t *ctx, int index)
     return SKY_SUCCESS;
 }
 
-/*! \brief insert beacon in list based on type and AP rssi
+/*! \brief remove a set of beacons in one pass over the workspace
+ *
+ *  Beacons which stay keep their order, and the slots of those removed are
+ *  returned to the free slots.
  *
  *  @param ctx Skyhook request context
- *  @param sky_errno pointer to errno
- *  @param b beacon to add
- *  @param index pointer where to save the insert position
+ *  @param gone for each of the first n beacons, true if it is to be removed
+ *  @param n number of beacons in gone
  *
- *  @return sky_status_t SKY_SUCCESS (if code is SKY_ERROR_NONE) or SKY_ERROR
+ *  @return number of beacons removed
  */
-Sky_status_t insert_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b, int *index)
+int remove_beacons(Sky_ctx_t *ctx, const bool gone[], int n)
+{
+    uint8_t free_slot[STAGED_BEACONS];
+    int i, j, removed = 0, aps = 0, num_aps = NUM_APS(ctx);
+
+    if (n > NUM_BEACONS(ctx))
+        n = NUM_BEACONS(ctx);
+    for (i = j = 0; i < NUM_BEACONS(ctx); i++) {
+        if (i < n && gone[i]) {
+            LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "idx:%d", i);
+            index_remove(ctx, i);
+            free_slot[removed++] = ctx->order[i];
+            aps += i < num_aps;
+            continue;
+        }
+#if SKY_AP_MIRROR
+        if (i < num_aps && j < i) {
+            ctx->aps.mac[j] = ctx->aps.mac[i];
+            ctx->aps.rssi[j] = ctx->aps.rssi[i];
+            ctx->aps.age[j] = ctx->aps.age[i];
+            ctx->aps.freq[j] = ctx->aps.freq[i];
+        }
+#endif
+        ctx->order[j++] = ctx->order[i];
+    }
+    memcpy(&ctx->order[j], free_slot, removed);
+    NUM_BEACONS(ctx) = j;
+    NUM_APS(ctx) -= aps;
+#ifdef VERBOSE_DEBUG
+    DUMP_WORKSPACE(ctx);
+#endif
+    return removed;
+}
+
+/*! \brief restore the priority order of the workspace APs after their virtual groups change
+ *
+ *  Insertion sort, which keeps APs of equal priority in order. Only APs of equal
+ *  rssi can be out of order, so it takes linear time unless many are.
+ *
+ *  @param ctx Skyhook request context
+ */
+void sort_aps(Sky_ctx_t *ctx)
+{
+    uint64_t key;
+    uint8_t slot;
+    int i, j;
+
+    for (i = 1; i < NUM_APS(ctx); i++) {
+        slot = ctx->order[i];
+        key = beacon_priority(&ctx->slot[slot]);
+        for (j = i; j > 0 && beacon_priority(&BEACON_AT(ctx, j - 1)) > key; j--)
+            ctx->order[j] = ctx->order[j - 1];
+        ctx->order[j] = slot;
+    }
+#if SKY_AP_MIRROR
+    for (i = 0; i < NUM_APS(ctx); i++) {
+        ctx->aps.mac[i] = pack_mac(BEACON_AT(ctx, i).ap.mac);
+        ctx->aps.rssi[i] = BEACON_AT(ctx, i).h.rssi;
+        ctx->aps.age[i] = BEACON_AT(ctx, i).h.age;
+        ctx->aps.freq[i] = BEACON_AT(ctx, i).ap.freq;
+    }
+#endif
+#ifdef VERBOSE_DEBUG
+    DUMP_WORKSPACE(ctx);
+#endif
+}
+
+/*! \brief find where a beacon belongs in the workspace, ahead of any of equal priority
+ *
+ *  @param ctx Skyhook request context
+ *  @param b beacon to place
+ *
+ *  @return index at which beacon would be inserted
+ */
+static int insert_position(Sky_ctx_t *ctx, Beacon_t *b)
 {
-    int j, diff = 0;
+    int lo, mid, hi;
+    uint64_t key = beacon_priority(b);
+
+    for (lo = 0, hi = NUM_BEACONS(ctx); lo < hi;) {
+        mid = (lo + hi) / 2;
+        if (beacon_priority(&BEACON_AT(ctx, mid)) < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-    /* sanity checks */
+/*! \brief test whether a beacon may be inserted in the workspace
+ *
+ *  @param ctx Skyhook request context
+ *  @param b beacon to add
+ *
+ *  @return true if workspace and beacon are valid
+ */
+static bool insertable(Sky_ctx_t *ctx, Beacon_t *b)
+{
     if (!validate_workspace(ctx) || b->h.magic != BEACON_MAGIC || b->h.type >= SKY_BEACON_MAX) {
         LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Invalid params. Beacon type %s", sky_pbeacon(b));
-        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+        return false;
     }
+    return true;
+}
+
+/*! \brief insert beacon at a position already found
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno pointer to errno
+ *  @param b beacon to add
+ *  @param j index of duplicate beacon from find_duplicate, or -1
+ *  @param pos index at which to insert from insert_position
+ *  @param index pointer where to save the insert position
+ *
+ *  @return sky_status_t SKY_SUCCESS (if code is SKY_ERROR_NONE) or SKY_ERROR
+ */
+static Sky_status_t insert_beacon_at(
+    Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b, int j, int pos, int *index)
+{
+    uint8_t slot;
 
     /* check for duplicate */
     if (is_ap_type(b)) { /* If new beacon is AP */
-        for (j = 0; j < NUM_APS(ctx); j++) {
-            if (sky_plugin_equal(ctx, sky_errno, b, &ctx->beacon[j], NULL) == SKY_SUCCESS) {
-                /* reject new beacon if already have connected AP, or it is older or weaker */
-                if (ctx->beacon[j].h.connected) {
-                    LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate AP (not connected)");
-                    return set_error_status(sky_errno, SKY_ERROR_NONE);
-                } else if (b->h.connected && ctx->beacon[j].ap.vg_len) {
-                    LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate VAP (marked connected)");
-                    ctx->beacon[j].h.connected = b->h.connected;
-                    return set_error_status(sky_errno, SKY_ERROR_NONE);
-                } else if (b->h.connected) {
-                    LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Keep new duplicate AP (connected)");
-                    break; /* fall through to remove exiting duplicate */
-                } else if (b->h.age > ctx->beacon[j].h.age) {
-                    LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate AP (older)");
-                    return set_error_status(sky_errno, SKY_ERROR_NONE);
-                } else if (b->h.age < ctx->beacon[j].h.age) {
-                    LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Keep new duplicate AP (younger)");
-                    break; /* fall through to remove exiting duplicate */
-                } else if (EFFECTIVE_RSSI(b->h.rssi) <= EFFECTIVE_RSSI(ctx->beacon[j].h.rssi)) {
-                    LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate AP (weaker)");
-                    return set_error_status(sky_errno, SKY_ERROR_NONE);
-                } else {
-                    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Keep new duplicate AP (stronger signal)");
-                    break; /* fall through to remove exiting duplicate */
-                }
+        if (j >= 0) {
+            /* reject new beacon if already have connected AP, or it is older or weaker */
+            if (BEACON_AT(ctx, j).h.connected) {
+                LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate AP (not connected)");
+                return set_error_status(sky_errno, SKY_ERROR_NONE);
+            } else if (b->h.connected && BEACON_AT(ctx, j).ap.vg_len) {
+                LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate VAP (marked connected)");
+                BEACON_AT(ctx, j).h.connected = b->h.connected;
+                return set_error_status(sky_errno, SKY_ERROR_NONE);
+            } else if (b->h.connected) {
+                LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Keep new duplicate AP (connected)");
+            } else if (b->h.age > BEACON_AT(ctx, j).h.age) {
+                LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate AP (older)");
+                return set_error_status(sky_errno, SKY_ERROR_NONE);
+            } else if (b->h.age < BEACON_AT(ctx, j).h.age) {
+                LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Keep new duplicate AP (younger)");
+            } else if (EFFECTIVE_RSSI(b->h.rssi) <= EFFECTIVE_RSSI(BEACON_AT(ctx, j).h.rssi)) {
+                LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate AP (weaker)");
+                return set_error_status(sky_errno, SKY_ERROR_NONE);
+            } else {
+                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Keep new duplicate AP (stronger signal)");
             }
-        }
-        /* if a better duplicate was found, remove existing worse beacon */
-        if (j < NUM_APS(ctx))
+            /* a better duplicate was found, remove existing worse beacon */
             remove_beacon(ctx, j);
+            if (j < pos)
+                pos--;
+        }
     } else if (is_cell_type(b)) { /* If new beacon is one of the cell types */
-        for (j = NUM_APS(ctx); j < NUM_BEACONS(ctx); j++) {
-            if (sky_plugin_equal(ctx, sky_errno, b, &ctx->beacon[j], NULL) == SKY_SUCCESS) {
-                /* reject new beacon if already have connected cell, or it is older or weaker */
-                if (ctx->beacon[j].h.connected) {
-                    LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate cell (not connected)");
-                    return set_error_status(sky_errno, SKY_ERROR_NONE);
-                } else if (b->h.connected) {
-                    LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Keep new duplicate cell (connected)");
-                    break; /* fall through to remove exiting duplicate */
-                } else if (get_cell_age(b) > get_cell_age(&ctx->beacon[j])) {
-                    LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate cell (older)");
-                    return set_error_status(sky_errno, SKY_ERROR_NONE);
-                } else if (get_cell_age(b) < get_cell_age(&ctx->beacon[j])) {
-                    LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Keep new duplicate cell (younger)");
-                    break; /* fall through to remove exiting duplicate */
-                } else if (EFFECTIVE_RSSI(get_cell_rssi(b)) <=
-                           EFFECTIVE_RSSI(get_cell_rssi(&ctx->beacon[j]))) {
-                    LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate cell (weaker)");
-                    return set_error_status(sky_errno, SKY_ERROR_NONE);
-                } else {
-                    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Keep new duplicate cell (stronger signal)");
-                    break; /* fall through to remove exiting duplicate */
-                }
+        if (j >= 0) {
+            /* reject new beacon if already have connected cell, or it is older or weaker */
+            if (BEACON_AT(ctx, j).h.connected) {
+                LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate cell (not connected)");
+                return set_error_status(sky_errno, SKY_ERROR_NONE);
+            } else if (b->h.connected) {
+                LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Keep new duplicate cell (connected)");
+            } else if (get_cell_age(b) > get_cell_age(&BEACON_AT(ctx, j))) {
+                LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate cell (older)");
+                return set_error_status(sky_errno, SKY_ERROR_NONE);
+            } else if (get_cell_age(b) < get_cell_age(&BEACON_AT(ctx, j))) {
+                LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Keep new duplicate cell (younger)");
+            } else if (EFFECTIVE_RSSI(get_cell_rssi(b)) <=
+                       EFFECTIVE_RSSI(get_cell_rssi(&BEACON_AT(ctx, j)))) {
+                LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Reject duplicate cell (weaker)");
+                return set_error_status(sky_errno, SKY_ERROR_NONE);
+            } else {
+                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Keep new duplicate cell (stronger signal)");
             }
-        }
-        /* if a better duplicate was found, remove existing worse beacon */
-        if (j < NUM_BEACONS(ctx))
+            /* a better duplicate was found, remove existing worse beacon */
             remove_beacon(ctx, j);
+            if (j < pos)
+                pos--;
+        }
     } else
         LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Unsupported beacon type");
 
-    /* find correct position to insert based on priority */
-    for (j = 0; j < NUM_BEACONS(ctx); j++) {
-        if (beacon_compare(ctx, b, &ctx->beacon[j], &diff) == false)
-            if (diff >= 0) // stop if the new beacon is better
-                break;
-    }
+    j = pos;
 
-    /* add beacon at the end */
-    if (j == NUM_BEACONS(ctx)) {
-        ctx->beacon[j] = *b;
-        NUM_BEACONS(ctx)++;
-    } else {
-        /* shift beacons to make room for the new one */
-        memmove(&ctx->beacon[j + 1], &ctx->beacon[j], sizeof(Beacon_t) * (NUM_BEACONS(ctx) - j));
-        ctx->beacon[j] = *b;
-        NUM_BEACONS(ctx)++;
-    }
+    /* take the first free slot, and make room for it in the order. That may be the slot
+     * of a beacon dropped by selection, so those held are no longer a whole scan */
+    ctx->dropped = 0;
+    slot = ctx->order[NUM_BEACONS(ctx)];
+    if (j < NUM_BEACONS(ctx))
+        memmove(&ctx->order[j + 1], &ctx->order[j], NUM_BEACONS(ctx) - j);
+    ctx->order[j] = slot;
+    ctx->slot[slot] = *b;
+    NUM_BEACONS(ctx)++;
+    index_add(ctx, j);
     /* report back the position beacon was added */
     if (index != NULL)
         *index = j;
@@ -174,11 +496,61 @@ Sky_status_t insert_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b,
     LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Beacon type %s inserted idx: %d %s", sky_pbeacon(b), j,
         b->h.connected ? "* " : "");
 
-    if (is_ap_type(b))
+    if (is_ap_type(b)) {
+#if SKY_AP_MIRROR
+        mirror_insert(ctx, j);
+#endif
         NUM_APS(ctx)++;
+        ctx->aps_distinct = false;
+    }
     return SKY_SUCCESS;
 }
 
+/*! \brief insert beacon in list based on type and AP rssi
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno pointer to errno
+ *  @param b beacon to add
+ *  @param index pointer where to save the insert position
+ *
+ *  @return sky_status_t SKY_SUCCESS (if code is SKY_ERROR_NONE) or SKY_ERROR
+ */
+Sky_status_t insert_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b, int *index)
+{
+    if (!insertable(ctx, b))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+    return insert_beacon_at(
+        ctx, sky_errno, b, find_duplicate(ctx, sky_errno, b), insert_position(ctx, b), index);
+}
+
+/*! \brief test whether workspace holds more beacons than a request may carry
+ *
+ *  @param ctx Skyhook request context
+ *
+ *  @return true if some beacons must be removed
+ */
+static bool beacons_over_limit(Sky_ctx_t *ctx)
+{
+    return NUM_APS(ctx) > CONFIG(ctx->state, max_ap_beacons) ||
+           NUM_CELLS(ctx) >
+               (CONFIG(ctx->state, total_beacons) - CONFIG(ctx->state, max_ap_beacons));
+}
+
+/*! \brief test whether adding a beacon would take workspace over the limits of a request
+ *
+ *  @param ctx Skyhook request context
+ *  @param b beacon to add
+ *
+ *  @return true if a beacon would have to be removed
+ */
+static bool beacons_at_limit(Sky_ctx_t *ctx, Beacon_t *b)
+{
+    if (is_ap_type(b))
+        return NUM_APS(ctx) >= CONFIG(ctx->state, max_ap_beacons);
+    return NUM_CELLS(ctx) >=
+           (CONFIG(ctx->state, total_beacons) - CONFIG(ctx->state, max_ap_beacons));
+}
+
 /*! \brief add beacon to list in workspace context
  *
  *   if beacon is not AP and workspace is full (of non-AP), pick best one
@@ -193,10 +565,16 @@ Sky_status_t insert_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b,
  *   If AP just added is known in cache,
  *    . set cached and copy Used property from cache
  *
+ *   If workspace is full and plugins tell that the new beacon would be the one removed,
+ *    . skip it (see sky_plugin_admit)
+ *
  *   If AP just added fills workspace, remove one AP,
  *    . Remove one virtual AP if there is a match
  *    . If haven't removed one AP, remove one based on rssi distribution
  *
+ *   When selection is deferred, nothing is removed until the workspace holds
+ *   STAGED_BEACONS, see select_beacons
+ *
  *  @param ctx Skyhook request context
  *  @param sky_errno skyErrno is set to the error code
  *
@@ -204,8 +582,9 @@ Sky_status_t insert_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b,
  */
 Sky_status_t add_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b)
 {
-    int n, i = -1;
+    int n, dup, pos, i = -1;
 
+    RECORD_BEACON(ctx->instance, TRACE_ADD_BEACON, b);
     if (is_ap_type(b)) {
         if (!validate_mac(b->ap.mac, ctx))
             return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
@@ -215,9 +594,26 @@ Sky_status_t add_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b)
     if (is_cell_nmr(b))
         b->h.connected = false;
 
+    if (!insertable(ctx, b))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+
+    /* scan is summarized before filtering, as sky_scan_fingerprint sees the whole scan */
+    summary_add(&ctx->summary, b);
+
+    /* duplicate and position are found once, for admission and insertion */
+    dup = find_duplicate(ctx, sky_errno, b);
+    pos = insert_position(ctx, b);
+
+    /* when workspace is full, skip a new beacon which filtering would remove straight away */
+    if (!ctx->defer_selection && beacons_at_limit(ctx, b) && dup < 0 &&
+        sky_plugin_admit(ctx, sky_errno, b, pos) == SKY_FAILURE) {
+        LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Beacon type %s not admitted", sky_pbeacon(b));
+        return set_error_status(sky_errno, SKY_ERROR_NONE);
+    }
+
     /* insert the beacon */
     n = NUM_BEACONS(ctx);
-    if (insert_beacon(ctx, sky_errno, b, &i) == SKY_ERROR)
+    if (insert_beacon_at(ctx, sky_errno, b, dup, pos, &i) == SKY_ERROR)
         return SKY_ERROR;
     if (n == NUM_BEACONS(ctx)) // no beacon added, must be duplicate because there was no error
         return SKY_SUCCESS;
@@ -225,7 +621,7 @@ Sky_status_t add_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b)
 #if CACHE_SIZE
     /* Update the AP just added to workspace */
     if (is_ap_type(b)) {
-        Beacon_t *w = &ctx->beacon[i];
+        Beacon_t *w = &BEACON_AT(ctx, i);
         if (!beacon_in_cache(ctx, b, &w->ap.property)) {
             w->ap.property.in_cache = false;
             w->ap.property.used = false;
@@ -233,16 +629,19 @@ Sky_status_t add_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b)
     }
 #endif
 
-    /* done if no filtering needed */
-    if (NUM_APS(ctx) <= CONFIG(ctx->state, max_ap_beacons) &&
-        (NUM_CELLS(ctx) <=
-            (CONFIG(ctx->state, total_beacons) - CONFIG(ctx->state, max_ap_beacons)))) {
+    /* done if no filtering needed, or filtering is deferred and there is room for more */
+    if (!beacons_over_limit(ctx) ||
+        (ctx->defer_selection && NUM_BEACONS(ctx) < STAGED_BEACONS)) {
 #ifdef VERBOSE_DEBUG
         DUMP_WORKSPACE(ctx);
 #endif
         return SKY_SUCCESS;
     }
 
+    /* staging is full, so select from what is staged, which frees slots for the rest of scan */
+    if (ctx->defer_selection)
+        return select_beacons(ctx, sky_errno);
+
     /* beacon is AP and is subject to filtering */
     /* discard virtual duplicates of remove one based on rssi distribution */
     if (sky_plugin_remove_worst(ctx, sky_errno) == SKY_ERROR) {
@@ -255,6 +654,107 @@ Sky_status_t add_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b)
     return SKY_SUCCESS;
 }
 
+/*! \brief remove beacons until workspace holds no more than a request may carry
+ *
+ *   Used when selection has been deferred while beacons were added, see
+ *   sky_defer_selection. The same policy is applied as when each beacon is
+ *   added, but only once all the beacons of the scan are known. Each plugin
+ *   ranks its beacons and removes those over the limit in one pass. Plugins
+ *   without a select operation remove their worst beacon one at a time.
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *
+ *  @return SKY_SUCCESS if workspace is within limits or SKY_ERROR
+ */
+Sky_status_t select_beacons(Sky_ctx_t *ctx, Sky_errno_t *sky_errno)
+{
+    int n = NUM_BEACONS(ctx), dropped = ctx->dropped;
+
+    if (!beacons_over_limit(ctx))
+        return SKY_SUCCESS;
+
+    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "select from %d APs of %d beacons", NUM_APS(ctx),
+        NUM_BEACONS(ctx));
+    while (beacons_over_limit(ctx)) {
+        if (sky_plugin_select(ctx, sky_errno) == SKY_ERROR &&
+            sky_plugin_remove_worst(ctx, sky_errno) == SKY_ERROR) {
+            LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Unexpected failure removing worst beacon");
+            return set_error_status(sky_errno, SKY_ERROR_INTERNAL);
+        }
+    }
+    /* slots of beacons removed follow those kept, with data intact, see sky_new_request_from */
+    ctx->dropped = dropped + n - NUM_BEACONS(ctx);
+    DUMP_WORKSPACE(ctx);
+    return SKY_SUCCESS;
+}
+
+/*! \brief replace the workspace beacon with the same identity by a new report of it
+ *
+ *   The beacon is moved to its place for the new values. Workspace keeps the
+ *   same number of beacons, so no filtering is needed, and the cache properties
+ *   and virtual group of an AP are kept as they depend only on its identity. If the
+ *   beacon is not in the workspace, it is added as by add_beacon.
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param b beacon with new values
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t update_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b)
+{
+    int i;
+    bool distinct = ctx->aps_distinct;
+    Beacon_t old;
+
+    if (is_ap_type(b) && !validate_mac(b->ap.mac, ctx))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+    if ((i = find_duplicate(ctx, sky_errno, b)) < 0)
+        return add_beacon(ctx, sky_errno, b);
+
+    RECORD_BEACON(ctx->instance, TRACE_UPDATE_BEACON, b);
+    old = BEACON_AT(ctx, i);
+    if (is_ap_type(b)) {
+        b->ap.property = old.ap.property;
+        b->ap.vg_len = old.ap.vg_len;
+        memcpy(b->ap.vg, old.ap.vg, sizeof(b->ap.vg));
+        memcpy(b->ap.vg_prop, old.ap.vg_prop, sizeof(b->ap.vg_prop));
+    }
+    remove_beacon(ctx, i);
+    summary_remove(ctx, &old);
+    if (insert_beacon(ctx, sky_errno, b, &i) == SKY_ERROR)
+        return SKY_ERROR;
+    if (is_ap_type(b))
+        ctx->aps_distinct = distinct; /* same MACs as before */
+    summary_add(&ctx->summary, b);
+    return set_error_status(sky_errno, SKY_ERROR_NONE);
+}
+
+/*! \brief remove the workspace beacon with the same identity, if there is one
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param b beacon to look for
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t discard_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b)
+{
+    int i;
+    Beacon_t old;
+
+    RECORD_BEACON(ctx->instance, TRACE_REMOVE_BEACON, b);
+    if ((i = find_duplicate(ctx, sky_errno, b)) >= 0) {
+        old = BEACON_AT(ctx, i);
+        /* slot freed goes ahead of those of beacons dropped by selection */
+        ctx->dropped = 0;
+        remove_beacon(ctx, i);
+        summary_remove(ctx, &old);
+    }
+    return set_error_status(sky_errno, SKY_ERROR_NONE);
+}
+
 #if CACHE_SIZE
 /*! \brief check if a beacon is in cache
  *
@@ -319,20 +819,26 @@ bool beacon_in_cacheline(
     Sky_ctx_t *ctx, Beacon_t *b, Sky_cacheline_t *cl, Sky_beacon_property_t *prop)
 {
     int j;
+    bool found;
+    uint32_t seq;
 
     if (!cl || !b || !ctx) {
         LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "bad params");
         return false;
     }
 
-    if (cl->time == 0) {
-        return false;
-    }
-
-    for (j = 0; j < NUM_BEACONS(cl); j++)
-        if (sky_plugin_equal(ctx, NULL, b, &cl->beacon[j], prop) == 1)
-            return true;
-    return false;
+    do {
+        seq = CACHELINE_READ_BEGIN(cl);
+        found = false;
+        if (cl->time == 0)
+            continue;
+        for (j = 0; j < NUM_BEACONS(cl); j++)
+            if (sky_plugin_equal(ctx, NULL, b, &cl->beacon[j], prop) == 1) {
+                found = true;
+                break;
+            }
+    } while (CACHELINE_READ_RETRY(cl, seq));
+    return found;
 }
 
 /*! \brief find cache entry with oldest entry
@@ -360,125 +866,6 @@ int find_oldest(Sky_ctx_t *ctx)
 }
 #endif
 
-/*! \brief compare a beacon to one in workspace
- *
- *  if beacon is duplicate, return true
- *
- *  if both are AP, return false and set diff to difference in rssi
- *  if both are cell and same cell type, return false and set diff as below
- *   connected cell
- *   youngest
- *   in cache
- *   strongest
- *
- *  @param ctx Skyhook request context
- *  @param bA pointer to beacon A
- *  @param wb pointer to beacon B
- *
- *  @return true if match or false and set diff
- *   diff is 0 if beacons can't be compared
- *           +ve if beacon A is better
- *           -ve if beacon B is better
- */
-static bool beacon_compare(Sky_ctx_t *ctx, Beacon_t *new, Beacon_t *wb, int *diff)
-{
-    Sky_status_t equality = SKY_ERROR;
-    bool ret = false;
-    int better = 1; // beacon B is better (-ve), or A is better (+ve)
-
-    if (!ctx || !new || !wb) {
-        LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "bad params");
-        if (diff)
-            *diff = 0; /* can't compare */
-        return false;
-    }
-
-    /* if beacons can't be compared for equality (different types), order like this */
-    if ((equality = sky_plugin_equal(ctx, NULL, new, wb, NULL)) == SKY_ERROR) {
-        if (new->h.connected != wb->h.connected)
-            /* connected is best */
-            better = new->h.connected ? 1 : -1;
-        if (is_cell_nmr(new) != is_cell_nmr(wb))
-            /* fully qualified is next */
-            better = (!is_cell_nmr(new) ? 1 : -1);
-        else
-            /* then type which increase in value as they become lower priority */
-            /* so we have to invert the sign of the comparison value */
-            better = -(new->h.type - wb->h.type);
-#ifdef VERBOSE_DEBUG
-        dump_beacon(ctx, "A: ", new, __FILE__, __FUNCTION__);
-        dump_beacon(ctx, "B: ", wb, __FILE__, __FUNCTION__);
-        LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Different types %d (%s)", better,
-            better < 0 ? "B is better" : "A is better");
-#endif
-    } else if (equality == SKY_SUCCESS) // if beacons are equivalent, return true
-        ret = true;
-    else {
-        /* if the beacons can be compared and are not equivalent, determine which is better */
-        if (new->h.type == SKY_BEACON_AP || new->h.type == SKY_BEACON_BLE) {
-            /* Compare APs by rssi */
-            if (EFFECTIVE_RSSI(new->h.rssi) != EFFECTIVE_RSSI(wb->h.rssi)) {
-                better = EFFECTIVE_RSSI(new->h.rssi) - EFFECTIVE_RSSI(wb->h.rssi);
-#ifdef VERBOSE_DEBUG
-                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "WiFi rssi score %d (%s)", better,
-                    better < 0 ? "B is better" : "A is better");
-#endif
-            } else
-                /* vg with most members is better */
-                better = new->ap.vg_len - wb->ap.vg_len;
-        } else {
-        /* Compare cells of same type - priority is connected, non-nmr, youngest, or stongest */
-#ifdef VERBOSE_DEBUG
-            dump_beacon(ctx, "A: ", new, __FILE__, __FUNCTION__);
-            dump_beacon(ctx, "B: ", wb, __FILE__, __FUNCTION__);
-#endif
-            if (new->h.connected || wb->h.connected) {
-                better = (new->h.connected ? 1 : -1);
-#ifdef VERBOSE_DEBUG
-                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "cell connected score %d (%s)", better,
-                    better < 0 ? "B is better" : "A is better");
-#endif
-            } else if (is_cell_nmr(new) != is_cell_nmr(wb)) {
-                /* fully qualified is best */
-                better = (!is_cell_nmr(new) ? 1 : -1);
-#ifdef VERBOSE_DEBUG
-                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "cell nmr score %d (%s)", better,
-                    better < 0 ? "B is better" : "A is better");
-#endif
-            } else if (new->h.age != wb->h.age) {
-                /* youngest is best */
-                better = -(new->h.age - wb->h.age);
-#ifdef VERBOSE_DEBUG
-                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "cell age score %d (%s)", better,
-                    better < 0 ? "B is better" : "A is better");
-#endif
-            } else if (EFFECTIVE_RSSI(new->h.rssi) != EFFECTIVE_RSSI(wb->h.rssi)) {
-                /* highest signal strength is best */
-                better = EFFECTIVE_RSSI(new->h.rssi) - EFFECTIVE_RSSI(wb->h.rssi);
-#ifdef VERBOSE_DEBUG
-                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "cell signal strength score %d (%s)", better,
-                    better < 0 ? "B is better" : "A is better");
-#endif
-            } else {
-                better = 1;
-#ifdef VERBOSE_DEBUG
-                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "cell similar, pick one (%s)",
-                    better < 0 ? "B is better" : "A is better");
-#endif
-            }
-        }
-    }
-
-    if (!ret && diff)
-        *diff = better;
-
-#ifdef VERBOSE_DEBUG
-    if (ret)
-        LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Beacons match");
-#endif
-    return ret;
-}
-
 /*! \brief test serving cell in workspace has changed from that in cache
  *
  *  Cells in workspace are in priority order
@@ -518,7 +905,7 @@ int cell_changed(Sky_ctx_t *ctx, Sky_cacheline_t *cl)
         return false;
     }
 
-    w = &ctx->beacon[NUM_APS(ctx)];
+    w = &BEACON_AT(ctx, NUM_APS(ctx));
     c = &cl->beacon[NUM_APS(cl)];
     if (is_cell_nmr(w) || is_cell_nmr(c)) {
 #ifdef VERBOSE_DEBUG
@@ -544,6 +931,7 @@ int get_from_cache(Sky_ctx_t *ctx)
     uint32_t now = (*ctx->gettime)(NULL);
     int idx;
 
+    ctx->stale_from = -1;
     if (CACHE_SIZE < 1) {
         /* no match to cacheline */
         return (ctx->get_from = -1);
@@ -561,13 +949,17 @@ int get_from_cache(Sky_ctx_t *ctx)
 
 /*! \brief check if an AP beacon is in a virtual group
  *
- *  Both the b (in workspace) and vg in cache may be virtual groups
+ *  Both the va (in workspace) and vb in cache may be virtual groups
  *  if the two macs are similar and difference is same nibble as child, then
  *  if any of the children have matching macs, then match
  *
+ *  Members are compared pairwise. Groups are small and this is not on the
+ *  cache matching path, so sorted member lists would not pay for their space.
+ *
  *  @param ctx Skyhook request context
- *  @param b pointer to new beacon
- *  @param vg pointer to beacon in cacheline
+ *  @param va pointer to new beacon
+ *  @param vb pointer to beacon in cacheline
+ *  @param prop where to save the properties of the last match, or NULL
  *
  *  @return 0 if no matches otherwise return number of matching APs
  */
@@ -593,9 +985,9 @@ int ap_beacon_in_vg(Sky_ctx_t *ctx, Beacon_t *va, Beacon_t *vb, Sky_beacon_prope
         for (c = -1; c < NUM_VAPS(vb); c++) {
             int value, idx;
 
-            if (w == -1)
-                memcpy(mac_va, va->ap.mac, MAC_SIZE);
-            else {
+            /* each child differs from parent in one nibble */
+            memcpy(mac_va, va->ap.mac, MAC_SIZE);
+            if (w != -1) {
                 idx = va->ap.vg[VAP_FIRST_DATA + w].data.nibble_idx;
                 value = va->ap.vg[VAP_FIRST_DATA + w].data.value << (4 * ((~idx) & 1));
                 mac_va[va->ap.vg[VAP_FIRST_DATA + w].data.nibble_idx / 2] =
@@ -603,9 +995,8 @@ int ap_beacon_in_vg(Sky_ctx_t *ctx, Beacon_t *va, Beacon_t *vb, Sky_beacon_prope
                         ~NIBBLE_MASK(idx)) |
                     value;
             }
-            if (c == -1)
-                memcpy(mac_vb, vb->ap.mac, MAC_SIZE);
-            else {
+            memcpy(mac_vb, vb->ap.mac, MAC_SIZE);
+            if (c != -1) {
                 idx = vb->ap.vg[VAP_FIRST_DATA + c].data.nibble_idx;
                 value = vb->ap.vg[VAP_FIRST_DATA + c].data.value << (4 * ((~idx) & 1));
                 mac_vb[vb->ap.vg[VAP_FIRST_DATA + c].data.nibble_idx / 2] =
@@ -644,6 +1035,243 @@ int ap_beacon_in_vg(Sky_ctx_t *ctx, Beacon_t *va, Beacon_t *vb, Sky_beacon_prope
     return num_aps;
 }
 
+/*! \brief spread the bits of a key, so that sums of keys rarely collide
+ *
+ *  @param x key
+ *
+ *  @return mixed key
+ */
+static uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+/*! \brief accumulate bytes into a 64 bit FNV-1a hash
+ *
+ *  @param h hash so far
+ *  @param p pointer to bytes
+ *  @param n number of bytes
+ *
+ *  @return updated hash
+ */
+static uint64_t fnv64_bytes(uint64_t h, const void *p, size_t n)
+{
+    const uint8_t *b = p;
+
+    while (n--)
+        h = (h ^ *b++) * 1099511628211ULL;
+    return h;
+}
+
+/*! \brief fingerprint the beacons in the workspace
+ *
+ *  Only the identity of each beacon contributes, so scans of the same beacons
+ *  with different signal strengths or ages have the same fingerprint. The hashes
+ *  of the beacons are summed, so the order of beacons in the workspace does not
+ *  matter either.
+ *
+ *  @param ctx Skyhook request context
+ *
+ *  @return 64 bit fingerprint of the beacons in the workspace
+ */
+uint64_t scan_fingerprint(Sky_ctx_t *ctx)
+{
+    uint64_t h, fp = 0;
+    Beacon_t *b;
+
+    for (int i = 0; i < NUM_BEACONS(ctx); i++) {
+        b = &BEACON_AT(ctx, i);
+        h = fnv64_bytes(14695981039346656037ULL, &b->h.type, sizeof(b->h.type));
+        if (b->h.type == SKY_BEACON_AP)
+            h = fnv64_bytes(h, b->ap.mac, MAC_SIZE);
+        else if (b->h.type == SKY_BEACON_BLE) {
+            h = fnv64_bytes(h, b->ble.mac, MAC_SIZE);
+            h = fnv64_bytes(h, &b->ble.major, sizeof(b->ble.major));
+            h = fnv64_bytes(h, &b->ble.minor, sizeof(b->ble.minor));
+            h = fnv64_bytes(h, b->ble.uuid, sizeof(b->ble.uuid));
+        } else {
+            /* copies, cell fields may be bit-fields */
+            int32_t id3 = b->cell.id3, freq = b->cell.freq;
+            int64_t id4 = b->cell.id4;
+            int16_t id5 = b->cell.id5;
+
+            h = fnv64_bytes(h, &b->cell.id1, sizeof(b->cell.id1));
+            h = fnv64_bytes(h, &b->cell.id2, sizeof(b->cell.id2));
+            h = fnv64_bytes(h, &id3, sizeof(id3));
+            h = fnv64_bytes(h, &id4, sizeof(id4));
+            h = fnv64_bytes(h, &id5, sizeof(id5));
+            h = fnv64_bytes(h, &freq, sizeof(freq));
+        }
+        fp += mix64(h);
+    }
+    return fp;
+}
+
+/*! \brief check whether two workspaces hold the same beacons
+ *
+ *  Beacons are compared by identity, in any order, as for scan_fingerprint.
+ *  Workspaces with beacons other than APs and cells never compare the same.
+ *
+ *  @param ctx Skyhook request context
+ *  @param other Skyhook request context to compare with
+ *
+ *  @return true if every beacon of each is in the other
+ */
+bool same_beacons(Sky_ctx_t *ctx, Sky_ctx_t *other)
+{
+    Sky_errno_t sky_errno;
+    Beacon_t *b;
+
+    if (NUM_BEACONS(ctx) != NUM_BEACONS(other) || NUM_APS(ctx) != NUM_APS(other))
+        return false;
+    for (int i = 0; i < NUM_BEACONS(ctx); i++) {
+        b = &BEACON_AT(ctx, i);
+        if ((!is_ap_type(b) && !is_cell_type(b)) || find_duplicate(other, &sky_errno, b) < 0)
+            return false;
+    }
+    return true;
+}
+
+/*! \brief note a serving cell of a scan in its summary
+ *
+ *   A cell reported again is noted once. Only the SKY_FINGERPRINT_CELLS lowest keys
+ *   are kept, so the summary does not depend on the order cells are noted.
+ *
+ *  @param s the summary
+ *  @param key key of the cell, see beacon_key
+ */
+static void summary_add_cell(Sky_scan_summary_t *s, uint32_t key)
+{
+    int i, n;
+
+    for (i = 0; i < s->cell_len && s->cell[i] < key; i++)
+        ;
+    if ((i < s->cell_len && s->cell[i] == key) || i == SKY_FINGERPRINT_CELLS)
+        return;
+    n = s->cell_len < SKY_FINGERPRINT_CELLS ? s->cell_len : SKY_FINGERPRINT_CELLS - 1;
+    memmove(&s->cell[i + 1], &s->cell[i], (n - i) * sizeof(s->cell[0]));
+    s->cell[i] = key;
+    s->cell_len = n + 1;
+}
+
+/*! \brief note an AP or serving cell of a scan in its summary
+ *
+ *   Only the SKY_FINGERPRINT_APS strongest APs are kept, each with its strongest
+ *   report, so the summary does not depend on the order beacons are noted.
+ *
+ *  @param s the summary
+ *  @param b pointer to beacon
+ */
+void summary_add(Sky_scan_summary_t *s, Beacon_t *b)
+{
+    int i, n;
+    uint64_t key;
+    int16_t rssi;
+
+    if (is_cell_type(b) && b->h.connected && !is_cell_nmr(b)) {
+        summary_add_cell(s, beacon_key(b));
+        return;
+    }
+    if (!is_ap_type(b))
+        return;
+
+    key = pack_mac(b->ap.mac);
+    rssi = (b->h.rssi > -10 || b->h.rssi < -127) ? -1 : b->h.rssi;
+    for (i = 0; i < s->ap_len && s->ap[i] != key; i++)
+        ;
+    if (i < s->ap_len) {
+        if (EFFECTIVE_RSSI(rssi) <= EFFECTIVE_RSSI(s->rssi[i]))
+            return;
+        /* stronger report of an AP already noted */
+        memmove(&s->ap[i], &s->ap[i + 1], (s->ap_len - i - 1) * sizeof(s->ap[0]));
+        memmove(&s->rssi[i], &s->rssi[i + 1], (s->ap_len - i - 1) * sizeof(s->rssi[0]));
+        s->ap_len--;
+    }
+
+    /* strongest first, equal strength by MAC */
+    for (i = s->ap_len; i > 0; i--) {
+        if (EFFECTIVE_RSSI(rssi) < EFFECTIVE_RSSI(s->rssi[i - 1]) ||
+            (EFFECTIVE_RSSI(rssi) == EFFECTIVE_RSSI(s->rssi[i - 1]) && key < s->ap[i - 1]))
+            break;
+    }
+    if (i == SKY_FINGERPRINT_APS)
+        return;
+    n = s->ap_len < SKY_FINGERPRINT_APS ? s->ap_len : SKY_FINGERPRINT_APS - 1;
+    memmove(&s->ap[i + 1], &s->ap[i], (n - i) * sizeof(s->ap[0]));
+    memmove(&s->rssi[i + 1], &s->rssi[i], (n - i) * sizeof(s->rssi[0]));
+    s->ap[i] = key;
+    s->rssi[i] = rssi;
+    s->ap_len = n + 1;
+}
+
+/*! \brief forget an AP or serving cell of a scan which has gone or is to be reported again
+ *
+ *   An AP or cell among those noted gives its place to the next of the other APs or
+ *   serving cells in the workspace, which holds the whole scan while selection is deferred.
+ *
+ *  @param ctx Skyhook request context, with beacon already removed
+ *  @param b pointer to beacon
+ */
+void summary_remove(Sky_ctx_t *ctx, Beacon_t *b)
+{
+    Sky_scan_summary_t *s = &ctx->summary;
+    uint64_t key;
+    int i;
+    bool full = s->ap_len == SKY_FINGERPRINT_APS;
+
+    if (is_cell_type(b) && b->h.connected && !is_cell_nmr(b)) {
+        key = beacon_key(b);
+        for (i = 0; i < s->cell_len && s->cell[i] != key; i++)
+            ;
+        if (i == s->cell_len)
+            return;
+        full = s->cell_len == SKY_FINGERPRINT_CELLS;
+        memmove(&s->cell[i], &s->cell[i + 1], (s->cell_len - i - 1) * sizeof(s->cell[0]));
+        s->cell_len--;
+        if (full) {
+            for (i = NUM_APS(ctx); i < NUM_BEACONS(ctx); i++)
+                summary_add(s, &BEACON_AT(ctx, i));
+        }
+        return;
+    }
+    if (!is_ap_type(b))
+        return;
+
+    key = pack_mac(b->ap.mac);
+    for (i = 0; i < s->ap_len && s->ap[i] != key; i++)
+        ;
+    if (i == s->ap_len)
+        return;
+    memmove(&s->ap[i], &s->ap[i + 1], (s->ap_len - i - 1) * sizeof(s->ap[0]));
+    memmove(&s->rssi[i], &s->rssi[i + 1], (s->ap_len - i - 1) * sizeof(s->rssi[0]));
+    s->ap_len--;
+    /* APs noted already are kept as they are, so only the place left is filled */
+    if (full) {
+        for (i = 0; i < NUM_APS(ctx); i++)
+            summary_add(s, &BEACON_AT(ctx, i));
+    }
+}
+
+/*! \brief fingerprint the strongest APs and serving cells of a scan
+ *
+ *  @param s the summary of the scan
+ *
+ *  @return 64 bit fingerprint, 0 if scan has no APs or serving cells
+ */
+uint64_t summary_fingerprint(Sky_scan_summary_t *s)
+{
+    uint64_t fp = 0;
+    int i;
+
+    for (i = 0; i < s->cell_len; i++)
+        fp += mix64(s->cell[i]);
+    for (i = 0; i < s->ap_len; i++)
+        fp += mix64(s->ap[i]);
+    return fp;
+}
+
 #ifdef UNITTESTS
 
 #include "beacons.ut.c"
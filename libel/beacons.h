@@ -29,6 +29,8 @@
 #include <time.h>
 
 #define SKY_MAGIC 0xD1967806
+/* magic of a state buffer, changed whenever fields are added other than at its end */
+#define SKY_STATE_MAGIC 0xD1967807
 #define BEACON_MAGIC 0xf0f0
 
 #define MAC_SIZE 6
@@ -57,6 +59,33 @@
 
 #define has_gps(c) ((c) != NULL && !isnan((c)->gps.lat))
 
+/* workspace beacon by index in priority order */
+#define BEACON_AT(c, i) ((c)->slot[(c)->order[(i)]])
+
+/* fields of workspace AP by index, from the AP mirror when configured */
+#if SKY_AP_MIRROR
+#define AP_RSSI(c, i) ((c)->aps.rssi[(i)])
+#define AP_AGE(c, i) ((c)->aps.age[(i)])
+#define AP_MAC(c, i) ((c)->aps.mac[(i)])
+#else
+#define AP_RSSI(c, i) (BEACON_AT((c), (i)).h.rssi)
+#define AP_AGE(c, i) (BEACON_AT((c), (i)).h.age)
+#define AP_MAC(c, i) pack_mac(BEACON_AT((c), (i)).ap.mac)
+#endif
+
+#if STAGED_BEACONS > 256
+#error "STAGED_BEACONS must fit order[] entries"
+#endif
+
+/* open addressing index of workspace beacons, kept at most half full */
+#define BEACON_INDEX_SIZE (2 * STAGED_BEACONS)
+/* index entries hold slot + 1, so are a byte unless there are 256 slots */
+#if STAGED_BEACONS < 256
+typedef uint8_t Sky_index_t;
+#else
+typedef uint16_t Sky_index_t;
+#endif
+
 #define IS_CACHE_HIT(c) ((c)->get_from != -1)
 #define IS_CACHE_MISS(c) ((c)->get_from == -1)
 
@@ -83,6 +112,20 @@ typedef struct {
     uint8_t used : 1;
 } Sky_beacon_property_t;
 
+#if SKY_COMPACT_BEACONS
+/* ages of older scans are held at MAX_BEACON_AGE */
+#define MAX_BEACON_AGE UINT16_MAX
+
+struct header {
+    uint16_t magic; /* Indication that this beacon entry is valid */
+    uint16_t age; /* age of scan in seconds relative to when this request was started */
+    int16_t rssi; // -255 unkonwn - map it to - 128
+    uint8_t type; /* sky_beacon_type_t */
+    int8_t connected; /* beacon connected */
+};
+#else
+#define MAX_BEACON_AGE UINT32_MAX
+
 struct header {
     uint16_t magic; /* Indication that this beacon entry is valid */
     uint16_t type; /* sky_beacon_type_t */
@@ -90,6 +133,7 @@ struct header {
     int16_t rssi; // -255 unkonwn - map it to - 128
     int8_t connected; /* beacon connected */
 };
+#endif
 
 /*! \brief Virtual AP member
  */
@@ -107,7 +151,11 @@ typedef union {
 struct ap {
     struct header h;
     uint8_t mac[MAC_SIZE];
+#if SKY_COMPACT_BEACONS
+    uint16_t freq; /* 2400-6000 MHz, or 0 */
+#else
     uint32_t freq;
+#endif
     Sky_beacon_property_t property; /* ap is in cache and used? */
     uint8_t vg_len;
     Vap_t vg[MAX_VAP_PER_AP + 2]; /* Virtual APs */
@@ -115,6 +163,22 @@ struct ap {
 };
 
 // http://wiki.opencellid.org/wiki/API
+#if SKY_COMPACT_BEACONS
+/* Fields are wide enough for the largest value accepted by sky_add_cell_*_beacon plus sign,
+ * so that the SKY_UNKNOWN_* values (-1) are held as is. Only int32_t bit-fields are used,
+ * as other bit-field types are not portable C99
+ */
+struct cell {
+    struct header h;
+    uint16_t id1; // mcc (gsm, umts, lte, nr, nb-iot). SKY_UNKNOWN_ID1 if unknown.
+    uint16_t id2; // mnc (gsm, umts, lte, nr, nb-iot) or sid (cdma). SKY_UNKNOWN_ID2 if unknown.
+    int32_t id3 : 17; // lac, tac or nid (0-65535). SKY_UNKNOWN_ID3 if unknown.
+    int32_t ta : 14; // (0-7690). SKY_UNKNOWN_TA if unknown.
+    int64_t id4; // cell id, 28 bit or 36 bit (nr). SKY_UNKNOWN_ID4 if unknown.
+    int32_t freq; // arfcn (0-3279165). SKY_UNKNOWN_ID6 if unknown.
+    int16_t id5; // bsic, psc, pci or ncid (0-1007). SKY_UNKNOWN_ID5 if unknown.
+};
+#else
 struct cell {
     struct header h;
     uint16_t id1; // mcc (gsm, umts, lte, nr, nb-iot). SKY_UNKNOWN_ID1 if unknown.
@@ -128,6 +192,7 @@ struct cell {
         freq; // arfcn(gsm), uarfcn (umts), earfcn (lte, nb-iot), nrarfcn (nr). SKY_UNKNOWN_ID6 if unknown.
     int32_t ta; // SKY_UNKNOWN_TA if unknown.
 };
+#endif
 
 // blue tooth
 struct ble {
@@ -165,9 +230,13 @@ typedef struct sky_header {
 } Sky_header_t;
 
 typedef struct sky_cacheline {
+#if SKY_THREAD_SAFE
+    volatile uint32_t seq; /* even when line is stable, odd while it is being written */
+#endif
     uint16_t len; /* number of beacons */
     uint16_t ap_len; /* number of AP beacons in list (0 == none) */
     uint32_t time;
+    uint64_t fingerprint; /* of scan which gave location, see sky_scan_fingerprint */
     Beacon_t beacon[TOTAL_BEACONS]; /* beacons */
     Sky_location_t loc; /* Skyhook location */
 } Sky_cacheline_t;
@@ -178,6 +247,14 @@ typedef enum sky_tbr_state {
     STATE_TBR_REGISTERED /* we have a valid token */
 } Sky_tbr_state_t;
 
+typedef enum sky_step_state {
+    STEP_IDLE, /* request not yet finalized */
+    STEP_SENDING, /* waiting for request to be sent */
+    STEP_RECEIVING, /* waiting for response */
+    STEP_WAITING, /* waiting for backoff period to end */
+    STEP_DONE /* location reported */
+} Sky_step_state_t;
+
 /* Access the cache config parameters */
 #define CONFIG(state, param) (state->config.param)
 
@@ -201,8 +278,6 @@ typedef struct sky_state {
     uint32_t sky_id_len; /* device ID len */
     uint8_t sky_device_id[MAX_DEVICE_ID]; /* device ID */
     uint32_t sky_token_id; /* TBR token ID */
-    uint32_t sky_ul_app_data_len; /* uplink app data length */
-    uint8_t sky_ul_app_data[SKY_MAX_UL_APP_DATA]; /* uplink app data */
     uint32_t sky_dl_app_data_len; /* downlink app data length */
     uint8_t sky_dl_app_data[SKY_MAX_DL_APP_DATA]; /* downlink app data */
     char sky_sku[MAX_SKU_LEN + 1]; /* product family ID */
@@ -213,13 +288,127 @@ typedef struct sky_state {
 #if CACHE_SIZE
     int len; /* number of cache lines */
     Sky_cacheline_t cacheline[CACHE_SIZE]; /* beacons */
+    uint32_t cache_expiry; /* no cacheline ages out until after this time, 0 to check now */
+    uint32_t cache_changes; /* count of cacheline writes, see sky_new_request_from */
 #endif
     Sky_config_t config; /* dynamic config parameters */
     uint8_t cache_hits; /* count the client cache hits */
 } Sky_state_t;
 
+/*! \brief Library instance, holds everything which is set up by sky_open
+ */
+struct sky_instance {
+    bool open_flag; /* keep track of when the user has opened the instance */
+    Sky_loggerfn_t logf;
+    Sky_randfn_t rand_bytes;
+    Sky_log_level_t min_level;
+    Sky_timefn_t gettime;
+    bool debounce;
+    struct plugin_table *plugin; /* base of plugin chain */
+    uint8_t *pool; /* preallocated workspaces, see sky_workspace_pool_init */
+    uint32_t pool_len; /* number of workspaces in pool */
+    volatile uint32_t pool_head; /* tagged index of first free workspace */
+    uint32_t tokens; /* request credit in seconds of rate, see sky_schedule_request */
+    uint32_t token_time; /* time tokens were last updated (0 if never) */
+    uint32_t generation; /* number of times a store has reused the instance for a device */
+    bool batched; /* marks the instance while sky_batch_init checks items are distinct */
+    Sky_state_t state; /* persistent state of the device */
+};
+
+/*! \brief Admission control for requests of many devices
+ */
+struct sky_scheduler {
+    uint32_t magic; /* SKY_MAGIC while scheduler is open */
+    uint32_t max_in_flight; /* maximum requests sent and not done */
+    volatile uint32_t in_flight; /* requests sent and not done */
+    uint32_t rate; /* requests per hour allowed for each device, 0 for unlimited */
+    uint32_t burst; /* requests a device may make without waiting */
+    Sky_timefn_t gettime;
+};
+
+/*! \brief Resident device in a store
+ */
+typedef struct sky_store_entry {
+    Sky_instance_t inst;
+    uint32_t key; /* hash of device ID */
+    uint32_t last_used; /* store clock when instance was last requested */
+} Sky_store_entry_t;
+
+/*! \brief Store of instances, indexed by device ID
+ */
+struct sky_store {
+    uint32_t magic; /* SKY_MAGIC while store is open */
+    uint16_t len; /* number of entries */
+    uint16_t hash_mask; /* number of hash slots - 1 */
+    int16_t *hash; /* open addressed index, entry + 1 or 0 if empty */
+    uint32_t clock; /* incremented on each lookup */
+    /* parameters common to all devices */
+    uint32_t partner_id;
+    uint8_t aes_key[AES_KEYLEN];
+    char sku[MAX_SKU_LEN + 1];
+    uint32_t cc;
+    Sky_log_level_t min_level;
+    Sky_loggerfn_t logf;
+    Sky_randfn_t rand_bytes;
+    Sky_timefn_t gettime;
+    bool debounce;
+    Sky_savefn_t save;
+    Sky_loadfn_t load;
+    Sky_state_t scratch; /* state being loaded for a device */
+    Sky_store_entry_t entry[]; /* resident devices, followed by hash slots */
+};
+
+typedef enum sky_flight_state {
+    FLIGHT_FREE, /* slot unused */
+    FLIGHT_PENDING, /* request sent, waiting for response */
+    FLIGHT_DONE /* result available to parked requests */
+} Sky_flight_state_t;
+
+/*! \brief Request in flight, shared by requests with the same beacons
+ */
+typedef struct sky_flight {
+    uint64_t fingerprint; /* fingerprint of beacons in request, see scan_fingerprint */
+    struct sky_ctx *leader; /* workspace of request which was sent */
+    uint8_t state; /* Sky_flight_state_t */
+    uint16_t waiters; /* parked requests which have not collected the result */
+    Sky_errno_t sky_errno; /* result of decoding response */
+    Sky_location_t loc;
+} Sky_flight_t;
+
+/*! \brief Requests in flight, see sky_finalize_coalesced
+ */
+struct sky_coalescer {
+    uint32_t magic; /* SKY_MAGIC while coalescer is open */
+    uint16_t len; /* number of flights */
+    Sky_flight_t flight[];
+};
+
+#if SKY_AP_MIRROR
+/*! \brief Workspace AP fields as arrays, in workspace order
+ */
+typedef struct sky_ap_mirror {
+    uint64_t mac[STAGED_BEACONS]; /* see pack_mac */
+    int16_t rssi[STAGED_BEACONS];
+    uint32_t age[STAGED_BEACONS];
+    uint32_t freq[STAGED_BEACONS];
+} Sky_ap_mirror_t;
+#endif
+
+/*! \brief Strongest APs and serving cells of a scan, see sky_scan_fingerprint
+ */
+typedef struct sky_scan_summary {
+    uint64_t ap[SKY_FINGERPRINT_APS]; /* packed MACs, strongest first */
+    int16_t rssi[SKY_FINGERPRINT_APS]; /* strongest report of each AP */
+    uint8_t ap_len;
+    uint8_t cell_len;
+    uint32_t cell[SKY_FINGERPRINT_CELLS]; /* keys of serving cells, lowest first */
+} Sky_scan_summary_t;
+
 typedef struct sky_ctx {
     Sky_header_t header; /* magic, size, timestamp, crc32 */
+    uint32_t generation; /* number of times workspace has been reset for a new request */
+    uint32_t token; /* see workspace_token */
+    uint32_t inst_generation; /* generation of instance when request was started */
     Sky_loggerfn_t logf;
     Sky_randfn_t rand_bytes;
     Sky_log_level_t min_level;
@@ -227,19 +416,45 @@ typedef struct sky_ctx {
     bool debounce;
     uint16_t len; /* number of beacons in list (0 == none) */
     uint16_t ap_len; /* number of AP beacons in list (0 == none) */
-    Beacon_t beacon[TOTAL_BEACONS + 1]; /* beacon data */
+    uint16_t dropped; /* beacons removed by select_beacons, held next in order */
+    Beacon_t slot[STAGED_BEACONS]; /* beacon data, in no particular order, see BEACON_AT */
+    uint8_t order[STAGED_BEACONS]; /* slots of beacons in priority order, then free slots */
+    Sky_index_t beacon_index[BEACON_INDEX_SIZE]; /* beacon slot + 1 by identity, 0 if empty */
+#if SKY_AP_MIRROR
+    Sky_ap_mirror_t aps; /* copy of fields of APs in workspace */
+#endif
     Gps_t gps; /* GNSS info */
     /* Assume worst case is that beacons and gps info takes twice the bare structure size */
     int16_t get_from; /* cacheline with good match to scan (-1 for miss) */
     int16_t save_to; /* cacheline with best match for saving scan*/
+    int16_t stale_from; /* cacheline nearly matching scan (-1 if none) */
+    bool allow_stale; /* report stale location from stale_from while refreshing */
+    bool defer_selection; /* filter beacons once all are added, see select_beacons */
+    bool aps_distinct; /* no two APs in workspace are similar, see remove_virtual_ap */
+#if CACHE_SIZE
+    uint32_t cache_changes; /* cache_changes of state when request was started */
+#endif
+    Sky_scan_summary_t summary; /* of beacons added, see sky_scan_fingerprint */
+    Sky_instance_t *instance; /* instance which started this request */
     Sky_state_t *state;
     void *plugin;
     Sky_tbr_state_t auth_state; /* tbr disabled, need to register or got token */
+    uint8_t step; /* Sky_step_state_t of request driven by sky_step */
+    uint8_t step_retries; /* authentication retries made by sky_step */
+    int16_t flight; /* coalescer flight + 1 of request, negated if parked, 0 if none */
+    struct sky_coalescer *coalescer; /* coalescer holding flight, or NULL */
+    struct sky_scheduler *volatile scheduled; /* holds slot of request admitted, or NULL */
+    uint32_t sky_ul_app_data_len; /* uplink app data length */
+    uint8_t sky_ul_app_data[SKY_MAX_UL_APP_DATA]; /* uplink app data */
     uint32_t sky_dl_app_data_len; /* downlink app data length */
     uint8_t sky_dl_app_data[SKY_MAX_DL_APP_DATA]; /* downlink app data */
 } Sky_ctx_t;
 
 Sky_status_t add_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b);
+Sky_status_t select_beacons(Sky_ctx_t *ctx, Sky_errno_t *sky_errno);
+Sky_status_t update_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b);
+Sky_status_t discard_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b);
+void reindex_beacons(Sky_ctx_t *ctx);
 int ap_beacon_in_vg(Sky_ctx_t *ctx, Beacon_t *va, Beacon_t *vb, Sky_beacon_property_t *prop);
 bool beacon_in_cache(Sky_ctx_t *ctx, Beacon_t *b, Sky_beacon_property_t *prop);
 bool beacon_in_cacheline(
@@ -249,5 +464,12 @@ int find_oldest(Sky_ctx_t *ctx);
 int get_from_cache(Sky_ctx_t *ctx);
 Sky_status_t insert_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b, int *index);
 Sky_status_t remove_beacon(Sky_ctx_t *ctx, int index);
+int remove_beacons(Sky_ctx_t *ctx, const bool gone[], int n);
+void sort_aps(Sky_ctx_t *ctx);
+uint64_t scan_fingerprint(Sky_ctx_t *ctx);
+bool same_beacons(Sky_ctx_t *ctx, Sky_ctx_t *other);
+void summary_add(Sky_scan_summary_t *s, Beacon_t *b);
+void summary_remove(Sky_ctx_t *ctx, Beacon_t *b);
+uint64_t summary_fingerprint(Sky_scan_summary_t *s);
 
 #endif
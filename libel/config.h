@@ -25,6 +25,21 @@
 #ifndef SKY_CONFIG_H
 #define SKY_CONFIG_H
 
+/*! \brief Size-optimized build profile for parts with little RAM
+ *
+ *  Makes options which trade features or speed for workspace and state size default to
+ *  the smaller choice (see SKY_COMPACT_BEACONS). Options may still be set individually,
+ *  except STAGED_BEACONS, which must be left at its minimum.
+ *
+ *  This shrinks the beacons only. The workspace also holds the beacon order, index and scan
+ *  summary, and uplink app data (previously in the state), so with the default options on
+ *  x86-64 the workspace is 1368 bytes (1536 without the profile, 1248 in earlier releases)
+ *  and the state is 1120 bytes (1280 without the profile, 1368 in earlier releases).
+ */
+#ifndef SKY_SIZE_PROFILE
+#define SKY_SIZE_PROFILE false
+#endif
+
 /* Change to false to remove all calls to logging */
 #ifndef SKY_DEBUG
 #define SKY_DEBUG true
@@ -46,6 +61,20 @@
 #define MAX_AP_BEACONS 15
 #endif
 
+/*! \brief The maximum number of beacons held in the workspace while selection is deferred
+ *  (see sky_defer_selection). At least TOTAL_BEACONS + 1, and no more than 256. The default
+ *  keeps the workspace at its usual size. A larger scan is then selected from each time the
+ *  staging area fills, which frees the slots of those over the limits of a request. To
+ *  select once from a whole scan, size this for the scan (e.g. 4 * TOTAL_BEACONS). Each
+ *  beacon staged adds a Beacon_t and two index entries to the workspace
+ */
+#ifndef STAGED_BEACONS
+#define STAGED_BEACONS (TOTAL_BEACONS + 1)
+#endif
+#if SKY_SIZE_PROFILE && STAGED_BEACONS != TOTAL_BEACONS + 1
+#error "SKY_SIZE_PROFILE requires STAGED_BEACONS of TOTAL_BEACONS + 1"
+#endif
+
 /*! \brief The maximum number of child APs in a Virtual Group. No more than 16 allowed
  */
 #ifndef MAX_VAP_PER_AP
@@ -73,6 +102,17 @@
 #define CACHE_AGE_THRESHOLD 24
 #endif
 
+/*! \brief When stale locations are allowed (see sky_allow_stale), a cacheline scoring
+ *   within CACHE_STALE_MARGIN of the match threshold, or a matching cacheline older than
+ *   CACHE_STALE_AGE (in hr), provides a stale location while a request refreshes it.
+ */
+#ifndef CACHE_STALE_MARGIN
+#define CACHE_STALE_MARGIN 20
+#endif
+#ifndef CACHE_STALE_AGE
+#define CACHE_STALE_AGE 12
+#endif
+
 /*! \brief If there are CACHE_BEACON_THRESHOLD or more beacons in workspace
  *   after filtering, then the cache match score is compared to
  *   CACHE_MATCH_THRESHOLD, otherwise 100% match is required to return the cached
@@ -88,6 +128,34 @@
 #define CACHE_RSSI_THRESHOLD 90
 #endif
 
+/*! \brief The number of strongest APs of a scan which make up its fingerprint
+ *  (see sky_scan_fingerprint)
+ */
+#ifndef SKY_FINGERPRINT_APS
+#define SKY_FINGERPRINT_APS 6
+#endif
+
+/*! \brief The number of serving cells of a scan which make up its fingerprint
+ *  (see sky_scan_fingerprint)
+ */
+#ifndef SKY_FINGERPRINT_CELLS
+#define SKY_FINGERPRINT_CELLS 2
+#endif
+
+/*! \brief Keep a copy of workspace AP fields as arrays (see Sky_ap_mirror_t) so that loops
+ *  over APs read contiguous memory, at the cost of workspace space
+ */
+#ifndef SKY_AP_MIRROR
+#define SKY_AP_MIRROR false
+#endif
+
+/*! \brief Store beacons in a compact layout (narrow and bit-packed fields) to reduce the size
+ *  of the workspace and of the cache in state. Scan ages are then limited to 18 hours.
+ */
+#ifndef SKY_COMPACT_BEACONS
+#define SKY_COMPACT_BEACONS SKY_SIZE_PROFILE
+#endif
+
 /*! \brief The number of entries in the scan/response cache
  */
 #ifndef CACHE_SIZE
@@ -100,12 +168,58 @@
 #define MAX_CLIENTCONFIG_SIZE 100
 #endif
 
+/*! \brief Thread safe cache access
+ *   When true, each cacheline carries a sequence count (seqlock) so that workspaces on
+ *   different threads may read the cache without locking while another thread updates it.
+ *   SKY_MEMORY_BARRIER and SKY_CAS may be defined for compilers other than gcc/clang.
+ */
+#ifndef SKY_THREAD_SAFE
+#define SKY_THREAD_SAFE false
+#endif
+#if SKY_THREAD_SAFE
+#ifndef SKY_MEMORY_BARRIER
+#define SKY_MEMORY_BARRIER() __sync_synchronize()
+#endif
+#ifndef SKY_CAS
+#define SKY_CAS(p, old, new) __sync_bool_compare_and_swap((p), (old), (new))
+#endif
+#endif
+
+/*! \brief Workspace validation
+ *
+ *   By default public calls check the workspace header and its generation token
+ *   (see workspace_token), and internal calls trust the workspace. Change to true to check
+ *   the header CRC and every beacon slot on every call, public or internal.
+ */
+#ifndef SKY_DEBUG_WORKSPACE
+#define SKY_DEBUG_WORKSPACE false
+#endif
+
+/*! \brief Session recording
+ *   When true, calls may be recorded with sky_trace_start for replay by sky_replay.
+ */
+#ifndef SKY_TRACE
+#define SKY_TRACE false
+#endif
+
+/*! \brief Alignment of each workspace in a workspace pool
+ */
+#ifndef SKY_CACHE_LINE_BYTES
+#define SKY_CACHE_LINE_BYTES 64
+#endif
+
 /*! \brief TBR Authentication
  */
 #ifndef SKY_TBR_DEVICE_ID
 #define SKY_TBR_DEVICE_ID true // Include device_id in location requests (typically omitted)
 #endif
 
+/*! \brief Authentication retries made by sky_step before reporting an error
+ */
+#ifndef SKY_STEP_MAX_RETRIES
+#define SKY_STEP_MAX_RETRIES 3
+#endif
+
 /*! \brief Application Data
  */
 #ifndef SKY_MAX_DL_APP_DATA
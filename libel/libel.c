@@ -23,6 +23,7 @@
  *
  */
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -46,26 +47,46 @@
 /* The following definition is intended to be changed only for QA purposes */
 #define BACKOFF_UNITS_PER_HR 3600 // time in seconds
 
-static Sky_state_t state;
+/*! \brief default instance used by the single device API (sky_open etc) */
+static Sky_instance_t sky_default_instance;
 
-/*! \brief keep track of when the user has opened the library */
-static uint32_t sky_open_flag = 0;
-
-/*! \brief keep track of logging function */
-static Sky_randfn_t sky_rand_bytes;
-static Sky_loggerfn_t sky_logf;
-static Sky_log_level_t sky_min_level;
-static Sky_timefn_t sky_time;
-static bool sky_debounce;
-
-/*! \brief base of plugin chain */
+/*! \brief base of plugin chain, linked once and shared by all instances */
 static Sky_plugin_table_t *sky_plugins = NULL;
+static volatile uint32_t plugins_linked; /* 0 if not linked, 1 while being linked, 2 once linked */
 
 /* Local functions */
 static bool validate_device_id(uint8_t *device_id, uint32_t id_len);
 static bool validate_partner_id(uint32_t partner_id);
 static bool validate_aes_key(uint8_t aes_key[AES_SIZE]);
 static size_t strnlen_(char *s, size_t maxlen);
+static Sky_status_t decode_response(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, void *response_buf,
+    uint32_t bufsize, Sky_location_t *loc);
+static void flight_leave(Sky_ctx_t *ctx, Sky_errno_t reason);
+
+/*! \brief link the plugin chain, the first time an instance is opened
+ *
+ *  The plugin tables are static and their next pointers form the chain, so they
+ *  are only written once. Other instances may be walking the chain.
+ *
+ *  @return sky_status_t SKY_SUCCESS or SKY_ERROR
+ */
+static Sky_status_t link_plugins(void)
+{
+    Sky_plugin_table_t *root = NULL;
+
+    if (plugins_linked != 2 && ATOMIC_CAS(&plugins_linked, 0, 1)) {
+        if (sky_register_plugins(&root) != SKY_SUCCESS) {
+            plugins_linked = 0;
+            return SKY_ERROR;
+        }
+        sky_plugins = root;
+        (void)ATOMIC_CAS(&plugins_linked, 1, 2); /* a barrier, so the chain is seen first */
+    }
+    /* another thread may be linking the chain */
+    while (plugins_linked == 1)
+        ;
+    return plugins_linked == 2 ? SKY_SUCCESS : SKY_ERROR;
+}
 
 /*! \brief Copy state buffer
  *
@@ -94,9 +115,10 @@ static Sky_status_t copy_state(Sky_errno_t *sky_errno, Sky_state_t *dest, Sky_st
     return set_error_status(sky_errno, SKY_ERROR_BAD_STATE);
 }
 
-/*! \brief Initialize Skyhook library and verify access to resources
+/*! \brief Initialize an instance of the library and verify access to resources
  *
- *  @param sky_errno if sky_open returns failure, sky_errno is set to the error code
+ *  @param inst the instance to be opened
+ *  @param sky_errno if init_instance returns failure, sky_errno is set to the error code
  *  @param device_id Device unique ID (example mac address of the device)
  *  @param id_len length if the Device ID, typically 6, Max 16 bytes
  *  @param partner_id Skyhook assigned credentials
@@ -111,24 +133,20 @@ static Sky_status_t copy_state(Sky_errno_t *sky_errno, Sky_state_t *dest, Sky_st
  *  @param debounce true if cached beacons should be added to request rather than newly scanned
  *
  *  @return sky_status_t SKY_SUCCESS or SKY_ERROR
- *
- *  sky_open can be called many times with the same parameters. This does
- *  nothing and returns SKY_SUCCESS. However, sky_close must be called
- *  in order to change the parameter values. Device ID length will
- *  be truncated to 16 if larger, without causing an error.
  */
-Sky_status_t sky_open(Sky_errno_t *sky_errno, uint8_t *device_id, uint32_t id_len,
-    uint32_t partner_id, uint8_t aes_key[AES_KEYLEN], char *sku, uint32_t cc, void *state_buf,
-    Sky_log_level_t min_level, Sky_loggerfn_t logf, Sky_randfn_t rand_bytes, Sky_timefn_t gettime,
-    bool debounce)
+static Sky_status_t init_instance(Sky_instance_t *inst, Sky_errno_t *sky_errno,
+    uint8_t *device_id, uint32_t id_len, uint32_t partner_id, uint8_t aes_key[AES_KEYLEN],
+    char *sku, uint32_t cc, void *state_buf, Sky_log_level_t min_level, Sky_loggerfn_t logf,
+    Sky_randfn_t rand_bytes, Sky_timefn_t gettime, bool debounce)
 {
 #if SKY_DEBUG
     char buf[SKY_LOG_LENGTH];
 #endif
     Sky_state_t *sky_state = state_buf;
+    Sky_state_t *state = &inst->state;
     uint32_t sku_len = 0;
 
-    memset(&state, 0, sizeof(state));
+    memset(state, 0, sizeof(*state));
     /* Only consider up to 16 bytes. Ignore any extra */
     id_len = (id_len > MAX_DEVICE_ID) ? MAX_DEVICE_ID : id_len;
     sku = !sku ? "" : sku;
@@ -140,40 +158,42 @@ Sky_status_t sky_open(Sky_errno_t *sky_errno, uint8_t *device_id, uint32_t id_le
         sky_state = NULL;
     }
 
-    sky_min_level = min_level;
-    sky_logf = logf;
-    sky_rand_bytes = rand_bytes == NULL ? sky_rand_fn : rand_bytes;
-    sky_time = (gettime == NULL) ? &time : gettime;
-    sky_debounce = debounce;
+    inst->min_level = min_level;
+    inst->logf = logf;
+    inst->rand_bytes = rand_bytes == NULL ? sky_rand_fn : rand_bytes;
+    inst->gettime = (gettime == NULL) ? &time : gettime;
+    inst->debounce = debounce;
+    inst->tokens = inst->token_time = 0;
 
-    if (sky_register_plugins(&sky_plugins) != SKY_SUCCESS)
+    if (link_plugins() != SKY_SUCCESS)
         return set_error_status(sky_errno, SKY_ERROR_NO_PLUGIN);
+    inst->plugin = sky_plugins;
 
     /* if open already */
-    if (sky_open_flag && sky_state) {
+    if (inst->open_flag && sky_state) {
         /* if library is already open and sky_open parameters match those we already have, */
         /* we can ignore this call to sky_open, otherwise report error already open */
         if (memcmp(device_id, sky_state->sky_device_id, id_len) == 0 &&
-            id_len == sky_state->sky_id_len && sky_state->header.size == sizeof(state) &&
+            id_len == sky_state->sky_id_len && sky_state->header.size == sizeof(*state) &&
             partner_id == sky_state->sky_partner_id &&
             memcmp(aes_key, sky_state->sky_aes_key, sizeof(sky_state->sky_aes_key)) == 0 &&
             strcmp(sku, sky_state->sky_sku) == 0 && cc == sky_state->sky_cc)
             return set_error_status(sky_errno, SKY_ERROR_NONE);
         else
             return set_error_status(sky_errno, SKY_ERROR_ALREADY_OPEN);
-    } else if (!sky_state || copy_state(sky_errno, &state, sky_state) != SKY_SUCCESS) {
-        memset(&state, 0, sizeof(state));
-        state.header.magic = SKY_MAGIC;
-        state.header.size = sizeof(state);
-        state.header.time = (uint32_t)(*sky_time)(NULL);
-        state.header.crc32 = sky_crc32(
-            &state.header.magic, (uint8_t *)&state.header.crc32 - (uint8_t *)&state.header.magic);
+    } else if (!sky_state || copy_state(sky_errno, state, sky_state) != SKY_SUCCESS) {
+        memset(state, 0, sizeof(*state));
+        state->header.magic = SKY_STATE_MAGIC;
+        state->header.size = sizeof(*state);
+        state->header.time = (uint32_t)(*inst->gettime)(NULL);
+        state->header.crc32 = sky_crc32(&state->header.magic,
+            (uint8_t *)&state->header.crc32 - (uint8_t *)&state->header.magic);
 #if CACHE_SIZE
-        state.len = CACHE_SIZE;
+        state->len = CACHE_SIZE;
         for (int i = 0; i < CACHE_SIZE; i++) {
             for (int j = 0; j < TOTAL_BEACONS; j++) {
-                state.cacheline[i].beacon[j].h.magic = BEACON_MAGIC;
-                state.cacheline[i].beacon[j].h.type = SKY_BEACON_MAX;
+                state->cacheline[i].beacon[j].h.magic = BEACON_MAGIC;
+                state->cacheline[i].beacon[j].h.type = SKY_BEACON_MAX;
             }
         }
 #endif
@@ -187,23 +207,27 @@ Sky_status_t sky_open(Sky_errno_t *sky_errno, uint8_t *device_id, uint32_t id_le
         }
 #endif
     }
-    config_defaults(&state);
+    config_defaults(state);
+#if CACHE_SIZE && SKY_THREAD_SAFE
+    for (int i = 0; i < CACHE_SIZE; i++)
+        state->cacheline[i].seq = 0; /* a restored state has no writer in progress */
+#endif
 
     /* Sanity check */
     if (!validate_device_id(device_id, id_len) || !validate_partner_id(partner_id) ||
         !validate_aes_key(aes_key))
         return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
 
-    state.sky_id_len = id_len;
-    memcpy(state.sky_device_id, device_id, id_len);
-    state.sky_partner_id = partner_id;
-    memcpy(state.sky_aes_key, aes_key, sizeof(state.sky_aes_key));
+    state->sky_id_len = id_len;
+    memcpy(state->sky_device_id, device_id, id_len);
+    state->sky_partner_id = partner_id;
+    memcpy(state->sky_aes_key, aes_key, sizeof(state->sky_aes_key));
     if (sku_len) {
-        strncpy(state.sky_sku, sku, MAX_SKU_LEN); /* Only pass up to maximum characters of sku */
-        state.sky_sku[MAX_SKU_LEN] = '\0'; /* Guarentee sku is null terminated */
-        state.sky_cc = cc;
+        strncpy(state->sky_sku, sku, MAX_SKU_LEN); /* Only pass up to maximum characters of sku */
+        state->sky_sku[MAX_SKU_LEN] = '\0'; /* Guarentee sku is null terminated */
+        state->sky_cc = cc;
     }
-    sky_open_flag = true;
+    inst->open_flag = true;
 
     if (logf != NULL && SKY_LOG_LEVEL_DEBUG <= min_level)
         (*logf)(SKY_LOG_LEVEL_DEBUG, "Skyhook Embedded Library (Version: " VERSION ")");
@@ -211,6 +235,119 @@ Sky_status_t sky_open(Sky_errno_t *sky_errno, uint8_t *device_id, uint32_t id_le
     return set_error_status(sky_errno, SKY_ERROR_NONE);
 }
 
+/*! \brief Initialize an instance of the library, recording it if a trace is in progress
+ *
+ *  Parameters are those of init_instance. An instance which fails to open is
+ *  no longer recorded, so that another may be.
+ *
+ *  @return sky_status_t SKY_SUCCESS or SKY_ERROR
+ */
+static Sky_status_t open_instance(Sky_instance_t *inst, Sky_errno_t *sky_errno,
+    uint8_t *device_id, uint32_t id_len, uint32_t partner_id, uint8_t aes_key[AES_KEYLEN],
+    char *sku, uint32_t cc, void *state_buf, Sky_log_level_t min_level, Sky_loggerfn_t logf,
+    Sky_randfn_t rand_bytes, Sky_timefn_t gettime, bool debounce)
+{
+    Sky_status_t ret;
+
+    if (!RECORD_OPEN(inst, partner_id, sku, cc, state_buf, debounce, &rand_bytes, &gettime))
+        return set_error_status(sky_errno, SKY_ERROR_RESOURCE_UNAVAILABLE);
+    ret = init_instance(inst, sky_errno, device_id, id_len, partner_id, aes_key, sku, cc,
+        state_buf, min_level, logf, rand_bytes, gettime, debounce);
+    if (!inst->open_flag)
+        RECORD_CLOSE(inst);
+    return ret;
+}
+
+/*! \brief Initialize Skyhook library and verify access to resources
+ *
+ *  @param sky_errno if sky_open returns failure, sky_errno is set to the error code
+ *  @param device_id Device unique ID (example mac address of the device)
+ *  @param id_len length if the Device ID, typically 6, Max 16 bytes
+ *  @param partner_id Skyhook assigned credentials
+ *  @param aes_key Skyhook assigned encryption key
+ *  @param sku unique name of device family, must be non-empty to enable TBR Auth
+ *  @param cc County code where device is being registered, 0 if unknown
+ *  @param state_buf pointer to a state buffer (provided by sky_close) or NULL
+ *  @param min_level logging function is called for msg with equal or greater level
+ *  @param logf pointer to logging function
+ *  @param rand_bytes pointer to random function
+ *  @param gettime pointer to time function
+ *  @param debounce true if cached beacons should be added to request rather than newly scanned
+ *
+ *  @return sky_status_t SKY_SUCCESS or SKY_ERROR
+ *
+ *  sky_open can be called many times with the same parameters. This does
+ *  nothing and returns SKY_SUCCESS. However, sky_close must be called
+ *  in order to change the parameter values. Device ID length will
+ *  be truncated to 16 if larger, without causing an error.
+ */
+Sky_status_t sky_open(Sky_errno_t *sky_errno, uint8_t *device_id, uint32_t id_len,
+    uint32_t partner_id, uint8_t aes_key[AES_KEYLEN], char *sku, uint32_t cc, void *state_buf,
+    Sky_log_level_t min_level, Sky_loggerfn_t logf, Sky_randfn_t rand_bytes, Sky_timefn_t gettime,
+    bool debounce)
+{
+    return open_instance(&sky_default_instance, sky_errno, device_id, id_len, partner_id, aes_key,
+        sku, cc, state_buf, min_level, logf, rand_bytes, gettime, debounce);
+}
+
+/*! \brief Determines the size of the buffer required to hold a library instance
+ *
+ *  @return Size of instance buffer
+ */
+int32_t sky_sizeof_instance(void)
+{
+    return sizeof(Sky_instance_t);
+}
+
+/*! \brief Initialize an independent instance of the Skyhook library
+ *
+ *  Each instance holds its own state (cache, TBR token, config) and callbacks,
+ *  so many devices can be served from one address space. Requests are started
+ *  for an instance with sky_new_instance_request and the resulting workspace is
+ *  then used with the sky_add_*, sky_finalize_request and sky_decode_response
+ *  functions as normal.
+ *
+ *  @param instance_buf Pointer to instance buffer provided by user
+ *  @param bufsize Instance buffer size (from sky_sizeof_instance)
+ *  @param sky_errno if sky_open_instance returns NULL, sky_errno is set to the error code
+ *  @param device_id Device unique ID (example mac address of the device)
+ *  @param id_len length if the Device ID, typically 6, Max 16 bytes
+ *  @param partner_id Skyhook assigned credentials
+ *  @param aes_key Skyhook assigned encryption key
+ *  @param sku unique name of device family, must be non-empty to enable TBR Auth
+ *  @param cc County code where device is being registered, 0 if unknown
+ *  @param state_buf pointer to a state buffer (provided by sky_close_instance) or NULL
+ *  @param min_level logging function is called for msg with equal or greater level
+ *  @param logf pointer to logging function
+ *  @param rand_bytes pointer to random function
+ *  @param gettime pointer to time function
+ *  @param debounce true if cached beacons should be added to request rather than newly scanned
+ *
+ *  @return Pointer to the initialized instance or NULL
+ *
+ *  instance_buf is always initialized, so it must not hold an instance which is still open.
+ */
+Sky_instance_t *sky_open_instance(void *instance_buf, uint32_t bufsize, Sky_errno_t *sky_errno,
+    uint8_t *device_id, uint32_t id_len, uint32_t partner_id, uint8_t aes_key[AES_KEYLEN],
+    char *sku, uint32_t cc, void *state_buf, Sky_log_level_t min_level, Sky_loggerfn_t logf,
+    Sky_randfn_t rand_bytes, Sky_timefn_t gettime, bool debounce)
+{
+    Sky_instance_t *inst = instance_buf;
+
+    if (inst == NULL || bufsize != (uint32_t)sky_sizeof_instance()) {
+        set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+        return NULL;
+    }
+    memset(inst, 0, bufsize);
+
+    if (open_instance(inst, sky_errno, device_id, id_len, partner_id, aes_key, sku, cc, state_buf,
+            min_level, logf, rand_bytes, gettime, debounce) != SKY_SUCCESS) {
+        inst->open_flag = false;
+        return NULL;
+    }
+    return inst;
+}
+
 /*! \brief Determines the size of the non-volatile memory state buffer
  *
  *  @param sky_state Pointer to state buffer
@@ -226,7 +363,7 @@ int32_t sky_sizeof_state(void *sky_state)
      * header - Magic number, size of space, checksum
      * body - number of entries
      */
-    if (s->header.magic != SKY_MAGIC) {
+    if (s->header.magic != SKY_STATE_MAGIC) {
         return 0;
     } else if (s->header.crc32 == sky_crc32(&s->header.magic,
                                       (uint8_t *)&s->header.crc32 - (uint8_t *)&s->header.magic)) {
@@ -249,6 +386,198 @@ int32_t sky_sizeof_workspace(void)
     return sizeof(Sky_ctx_t);
 }
 
+/*! \brief give back the slot held by a request admitted by a scheduler, if any
+ *
+ *  Only the scheduler noted in the workspace is used, so the slot is given back
+ *  even if the workspace is no longer valid for a request.
+ *
+ *  @param ctx Skyhook request context
+ */
+static void schedule_release(Sky_ctx_t *ctx)
+{
+    Sky_scheduler_t *sched;
+    uint32_t n;
+
+    do {
+        if ((sched = ctx->scheduled) == NULL)
+            return;
+    } while (!ATOMIC_CAS(&ctx->scheduled, sched, NULL));
+    if (sched->magic != SKY_MAGIC)
+        return;
+    do {
+        n = sched->in_flight;
+    } while (n && !ATOMIC_CAS(&sched->in_flight, n, n - 1));
+}
+
+/* Each workspace in a pool is followed by a word which is set while it is in use */
+#define POOL_BUSY_OFFSET ((sizeof(Sky_ctx_t) + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1))
+/* Workspaces in a pool start on a cache line boundary */
+#define POOL_STRIDE                                                                                \
+    ((POOL_BUSY_OFFSET + sizeof(uint32_t) + SKY_CACHE_LINE_BYTES - 1) / SKY_CACHE_LINE_BYTES *     \
+        SKY_CACHE_LINE_BYTES)
+/* Free list head is the index + 1 of the first free workspace, tagged with a
+ * count in the upper half to avoid ABA when popped concurrently */
+#define POOL_HEAD(tag, idx) (((uint32_t)(tag) << 16) | (uint32_t)((idx) + 1))
+#define POOL_HEAD_IDX(head) ((int32_t)((head)&0xFFFF) - 1)
+#define POOL_HEAD_TAG(head) ((head) >> 16)
+/* While a workspace is free, its first word holds the free list link */
+#define POOL_NEXT(inst, idx) (*(volatile uint32_t *)((inst)->pool + (idx)*POOL_STRIDE))
+#define POOL_BUSY(inst, idx)                                                                       \
+    (*(volatile uint32_t *)((inst)->pool + (idx)*POOL_STRIDE + POOL_BUSY_OFFSET))
+
+/*! \brief Determines the size of the buffer required for a pool of workspaces
+ *
+ *  @param count number of workspaces in the pool (1 - 65534)
+ *
+ *  @return Size of pool buffer or 0 if count is invalid
+ */
+int32_t sky_sizeof_workspace_pool(uint32_t count)
+{
+    if (count == 0 || count >= 0xFFFF)
+        return 0;
+    /* allow for aligning the start of the buffer */
+    return count * POOL_STRIDE + SKY_CACHE_LINE_BYTES - 1;
+}
+
+/*! \brief Provide preallocated workspaces to an instance
+ *
+ *  Workspaces are then obtained with sky_workspace_acquire and returned with
+ *  sky_workspace_release, without any further memory allocation.
+ *
+ *  @param inst instance which will own the workspaces, or NULL for the instance opened by sky_open
+ *  @param sky_errno sky_errno is set to the error code
+ *  @param pool_buf buffer provided by user
+ *  @param bufsize size of pool_buf (from sky_sizeof_workspace_pool)
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ *
+ *  The pool must be set up before any workspace is acquired, and may not be
+ *  replaced while any of its workspaces are in use.
+ */
+Sky_status_t sky_workspace_pool_init(
+    Sky_instance_t *inst, Sky_errno_t *sky_errno, void *pool_buf, uint32_t bufsize)
+{
+    uint32_t count, i;
+    uintptr_t start;
+
+    inst = inst == NULL ? &sky_default_instance : inst;
+    if (!inst->open_flag)
+        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
+    if (pool_buf == NULL || bufsize < (uint32_t)sky_sizeof_workspace_pool(1))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+
+    start = ((uintptr_t)pool_buf + SKY_CACHE_LINE_BYTES - 1) & ~(uintptr_t)(SKY_CACHE_LINE_BYTES - 1);
+    count = (bufsize - (start - (uintptr_t)pool_buf)) / POOL_STRIDE;
+    if (count >= 0xFFFF)
+        count = 0xFFFE;
+
+    inst->pool = (uint8_t *)start;
+    inst->pool_len = count;
+    /* chain every workspace onto the free list */
+    for (i = 0; i < count; i++) {
+        POOL_NEXT(inst, i) = (i + 1 < count) ? POOL_HEAD(0, i + 1) : POOL_HEAD(0, -1);
+        POOL_BUSY(inst, i) = false;
+    }
+    inst->pool_head = POOL_HEAD(0, 0);
+
+    return set_error_status(sky_errno, SKY_ERROR_NONE);
+}
+
+/*! \brief Take a workspace from the pool of an instance
+ *
+ *  @param inst instance owning the pool, or NULL for the instance opened by sky_open
+ *
+ *  @return Pointer to workspace of sky_sizeof_workspace() bytes or NULL if none are free
+ *
+ *  The workspace is passed to sky_new_instance_request (or sky_new_request) as normal.
+ */
+void *sky_workspace_acquire(Sky_instance_t *inst)
+{
+    uint32_t head, next;
+    int32_t idx;
+
+    inst = inst == NULL ? &sky_default_instance : inst;
+    if (inst->pool == NULL)
+        return NULL;
+
+    do {
+        head = inst->pool_head;
+        if ((idx = POOL_HEAD_IDX(head)) < 0)
+            return NULL; /* pool exhausted */
+        next = POOL_NEXT(inst, idx);
+    } while (!ATOMIC_CAS(&inst->pool_head, head,
+        POOL_HEAD(POOL_HEAD_TAG(head) + 1, POOL_HEAD_IDX(next))));
+    POOL_BUSY(inst, idx) = true;
+    /* workspace holds no slot of a scheduler or flight until it is used for a request */
+    ((Sky_ctx_t *)(inst->pool + idx * POOL_STRIDE))->scheduled = NULL;
+    ((Sky_ctx_t *)(inst->pool + idx * POOL_STRIDE))->coalescer = NULL;
+
+    return inst->pool + idx * POOL_STRIDE;
+}
+
+/*! \brief Return a workspace to the pool of an instance
+ *
+ *  @param inst instance owning the pool, or NULL for the instance opened by sky_open
+ *  @param workspace_buf workspace obtained from sky_workspace_acquire
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR if the workspace does not belong to the pool or is not
+ *          in use
+ *
+ *  The workspace is invalidated, so it can not be used again until reacquired.
+ */
+Sky_status_t sky_workspace_release(Sky_instance_t *inst, void *workspace_buf)
+{
+    uint32_t head;
+    uint32_t offset;
+    int32_t idx;
+
+    inst = inst == NULL ? &sky_default_instance : inst;
+    if (inst->pool == NULL || (uint8_t *)workspace_buf < inst->pool)
+        return SKY_ERROR;
+    offset = (uint8_t *)workspace_buf - inst->pool;
+    idx = offset / POOL_STRIDE;
+    if (offset % POOL_STRIDE || idx >= (int32_t)inst->pool_len)
+        return SKY_ERROR;
+
+    /* only one release of an acquired workspace may put it back on the free list */
+    do {
+        if (!POOL_BUSY(inst, idx))
+            return SKY_ERROR;
+    } while (!ATOMIC_CAS(&POOL_BUSY(inst, idx), true, false));
+    schedule_release((Sky_ctx_t *)workspace_buf);
+    flight_leave((Sky_ctx_t *)workspace_buf, SKY_ERROR_SERVER_ERROR);
+
+    /* link overwrites the workspace magic number, which invalidates the workspace */
+    do {
+        head = inst->pool_head;
+        POOL_NEXT(inst, idx) = head;
+    } while (!ATOMIC_CAS(&inst->pool_head, head, POOL_HEAD(POOL_HEAD_TAG(head) + 1, idx)));
+
+    return SKY_SUCCESS;
+}
+
+/*! \brief length of the backoff period required after an authentication failure
+ *
+ *  @param backoff the backoff in progress
+ *
+ *  @return period in seconds, 0 if requests are allowed immediately
+ */
+static time_t backoff_period(Sky_errno_t backoff)
+{
+    switch (backoff) {
+    case SKY_AUTH_RETRY_8H:
+        return 8 * BACKOFF_UNITS_PER_HR;
+    case SKY_AUTH_RETRY_16H:
+        return 16 * BACKOFF_UNITS_PER_HR;
+    case SKY_AUTH_RETRY_1D:
+        return 24 * BACKOFF_UNITS_PER_HR;
+    case SKY_AUTH_RETRY_30D:
+        return 30 * 24 * BACKOFF_UNITS_PER_HR;
+    default:
+        return 0;
+    }
+}
+
 /*! \brief Validate backoff period
  *
  *  @param ctx Pointer to workspace provided by user
@@ -259,82 +588,306 @@ int32_t sky_sizeof_workspace(void)
 static bool backoff_violation(Sky_ctx_t *ctx, time_t now)
 {
     /* Enforce backoff period, check that enough time has passed since last request was received */
-    if (state.backoff != SKY_ERROR_NONE) { /* Retry backoff in progress */
+    if (ctx->state->backoff != SKY_ERROR_NONE) { /* Retry backoff in progress */
         LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Backoff: %s, %d seconds so far",
-            sky_perror(state.backoff), (int)(now - state.header.time));
-        switch (state.backoff) {
-        case SKY_AUTH_RETRY_8H:
-            if (now - state.header.time < (8 * BACKOFF_UNITS_PER_HR))
-                return true;
-            break;
-        case SKY_AUTH_RETRY_16H:
-            if (now - state.header.time < (16 * BACKOFF_UNITS_PER_HR))
-                return true;
-            break;
-        case SKY_AUTH_RETRY_1D:
-            if (now - state.header.time < (24 * BACKOFF_UNITS_PER_HR))
-                return true;
-            break;
-        case SKY_AUTH_RETRY_30D:
-            if (now - state.header.time < (30 * 24 * BACKOFF_UNITS_PER_HR))
-                return true;
-            break;
-        default:
-            break;
-        }
+            sky_perror(ctx->state->backoff), (int)(now - ctx->state->header.time));
+        if (now - ctx->state->header.time < backoff_period(ctx->state->backoff))
+            return true;
     }
     return false;
 }
 
-/*! \brief Initializes the workspace provided ready to build a request
+/*! \brief Determines the size of the buffer required for a request scheduler
+ *
+ *  @return Size of scheduler buffer
+ */
+int32_t sky_sizeof_scheduler(void)
+{
+    return sizeof(Sky_scheduler_t);
+}
+
+/*! \brief Initialize a scheduler which admits requests of many devices
  *
+ *  Requests satisfied by the cache are always admitted. Other requests are
+ *  admitted while fewer than max_in_flight are outstanding and the device has
+ *  credit: each device may make burst requests at once, and regains credit for
+ *  rate requests per hour.
+ *
+ *  @param scheduler_buf Pointer to buffer provided by user
+ *  @param bufsize Buffer size (from sky_sizeof_scheduler)
+ *  @param sky_errno if sky_open_scheduler returns NULL, sky_errno is set to the error code
+ *  @param max_in_flight maximum number of requests sent and not done
+ *  @param rate requests per hour allowed for each device, 0 for unlimited
+ *  @param burst requests a device may make without waiting
+ *  @param gettime pointer to time function
+ *
+ *  @return Pointer to the initialized scheduler or NULL
+ */
+Sky_scheduler_t *sky_open_scheduler(void *scheduler_buf, uint32_t bufsize, Sky_errno_t *sky_errno,
+    uint32_t max_in_flight, uint32_t rate, uint32_t burst, Sky_timefn_t gettime)
+{
+    Sky_scheduler_t *sched = scheduler_buf;
+
+    if (sched == NULL || bufsize < sizeof(Sky_scheduler_t) || max_in_flight == 0 ||
+        (rate != 0 && (burst == 0 || burst > 0xFFFFFFFF / SECONDS_IN_HOUR))) {
+        set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+        return NULL;
+    }
+    memset(sched, 0, sizeof(*sched));
+    sched->max_in_flight = max_in_flight;
+    sched->rate = rate;
+    sched->burst = burst;
+    sched->gettime = (gettime == NULL) ? &time : gettime;
+    sched->magic = SKY_MAGIC;
+    set_error_status(sky_errno, SKY_ERROR_NONE);
+    return sched;
+}
+
+/*! \brief Decide whether a request may be sent now
+ *
+ *  Must be called after sky_sizeof_request_buf, which determines whether the
+ *  request is satisfied by the cache.
+ *
+ *  @param sched the scheduler
+ *  @param ctx Skyhook request context
+ *  @param sky_errno sky_errno is set to the error code
+ *  @param retry_at if deferred, time at which request may be admitted, 0 when
+ *                  a request in flight is done
+ *
+ *  @return SKY_ADMIT_CACHE, SKY_ADMIT_SEND, SKY_ADMIT_DEFER or
+ *          SKY_ADMIT_ERROR and sets sky_errno with error code
+ */
+Sky_admit_t sky_schedule_request(
+    Sky_scheduler_t *sched, Sky_ctx_t *ctx, Sky_errno_t *sky_errno, time_t *retry_at)
+{
+    Sky_instance_t *inst;
+    uint32_t now, elapsed, n;
+    uint64_t credit = 0;
+
+    if (sched == NULL || sched->magic != SKY_MAGIC || retry_at == NULL) {
+        set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+        return SKY_ADMIT_ERROR;
+    }
+    if (!validate_workspace(ctx)) {
+        set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
+        return SKY_ADMIT_ERROR;
+    }
+    *retry_at = 0;
+    set_error_status(sky_errno, SKY_ERROR_NONE);
+
+    /* cache hits are never throttled */
+    if (IS_CACHE_HIT(ctx))
+        return SKY_ADMIT_CACHE;
+
+    now = (uint32_t)(*sched->gettime)(NULL);
+    if (backoff_violation(ctx, now)) {
+        *retry_at = ctx->state->header.time + backoff_period(ctx->state->backoff);
+        set_error_status(sky_errno, SKY_ERROR_SERVICE_DENIED);
+        return SKY_ADMIT_DEFER;
+    }
+
+    /* refill device token bucket, one request costs SECONDS_IN_HOUR */
+    inst = ctx->instance;
+    if (sched->rate) {
+        elapsed = (inst->token_time == 0 || now < inst->token_time) ? 0 : now - inst->token_time;
+        credit = inst->token_time == 0 ? (uint64_t)sched->burst * SECONDS_IN_HOUR :
+                                         inst->tokens + (uint64_t)elapsed * sched->rate;
+        if (credit > (uint64_t)sched->burst * SECONDS_IN_HOUR)
+            credit = (uint64_t)sched->burst * SECONDS_IN_HOUR;
+        if (credit < SECONDS_IN_HOUR) {
+            *retry_at = now + (SECONDS_IN_HOUR - credit + sched->rate - 1) / sched->rate;
+            LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Request deferred %d seconds by device rate",
+                (int)(*retry_at - now));
+            set_error_status(sky_errno, SKY_ERROR_RESOURCE_UNAVAILABLE);
+            return SKY_ADMIT_DEFER;
+        }
+    }
+
+    /* global limit on requests in flight */
+    do {
+        n = sched->in_flight;
+        if (n >= sched->max_in_flight) {
+            LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Request deferred, %d in flight", n);
+            set_error_status(sky_errno, SKY_ERROR_RESOURCE_UNAVAILABLE);
+            return SKY_ADMIT_DEFER;
+        }
+    } while (!ATOMIC_CAS(&sched->in_flight, n, n + 1));
+
+    if (sched->rate) {
+        inst->tokens = (uint32_t)(credit - SECONDS_IN_HOUR);
+        inst->token_time = now;
+    }
+    ctx->scheduled = sched;
+    return SKY_ADMIT_SEND;
+}
+
+/*! \brief Note that a request admitted by the scheduler is finished
+ *
+ *  May be called after the device of the request has been evicted from a store.
+ *  A workspace which is reused for a new request, or released to a pool, gives
+ *  back its slot then.
+ *
+ *  @param sched the scheduler
+ *  @param ctx Skyhook request context
+ */
+void sky_schedule_done(Sky_scheduler_t *sched, Sky_ctx_t *ctx)
+{
+    if (sched == NULL || sched->magic != SKY_MAGIC || ctx == NULL || ctx->scheduled != sched)
+        return;
+    schedule_release(ctx);
+}
+
+#if CACHE_SIZE
+/*! \brief Clear cachelines which have aged out or no longer suit the dynamic parameters
+ *
+ *  Also notes in state when the next cacheline will age out.
+ *
+ *  @param ctx Skyhook request context
+ *  @param now time in seconds (from 1970 epoch)
+ */
+static void sweep_cache(Sky_ctx_t *ctx, time_t now)
+{
+    int i;
+    Sky_cacheline_t *cl;
+    uint32_t age_threshold = ctx->state->config.cache_age_threshold * SECONDS_IN_HOUR;
+    uint32_t seq, cl_time;
+    bool too_big;
+
+    ctx->state->cache_expiry = UINT32_MAX;
+    for (i = 0; i < CACHE_SIZE; i++) {
+        cl = &ctx->state->cacheline[i];
+        do {
+            seq = CACHELINE_READ_BEGIN(cl);
+            cl_time = cl->time;
+            too_big = cl->ap_len > CONFIG(ctx->state, max_ap_beacons) ||
+                      cl->len > CONFIG(ctx->state, total_beacons);
+        } while (CACHELINE_READ_RETRY(cl, seq));
+        if (cl_time && (too_big || (now - cl_time) > age_threshold)) {
+            CACHELINE_WRITE_BEGIN(cl);
+            cl->time = 0;
+            CACHELINE_WRITE_END(cl);
+            cache_changed(ctx->state);
+            LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "cache %d of %d cleared due to %s", i, CACHE_SIZE,
+                too_big ? "new Dynamic Parameters" : "age");
+        } else if (cl_time)
+            cache_expires(ctx->state, cl_time + age_threshold);
+    }
+}
+#endif
+
+/*! \brief check that the beacon order of a workspace lists each slot once
+ *
+ *  Only the slots listed ahead of the free ones are cleared when a workspace is
+ *  reused, so it is cleared in full unless its order can be trusted.
+ *
+ *  @param ctx workspace whose header is valid
+ *
+ *  @return true if order is a permutation of the slots
+ */
+static bool order_valid(Sky_ctx_t *ctx)
+{
+    bool seen[STAGED_BEACONS] = { false };
+    int i;
+
+    if (ctx->len + ctx->dropped > STAGED_BEACONS || ctx->ap_len > ctx->len)
+        return false;
+    for (i = 0; i < STAGED_BEACONS; i++) {
+        if (ctx->order[i] >= STAGED_BEACONS || seen[ctx->order[i]])
+            return false;
+        seen[ctx->order[i]] = true;
+    }
+    return true;
+}
+
+/*! \brief Initializes the workspace provided ready to build a request for an instance
+ *
+ *  @param inst Pointer to the library instance
  *  @param workspace_buf Pointer to workspace provided by user
  *  @param bufsize Workspace buffer size (from sky_sizeof_workspace)
+ *  @param ul_app_data Pointer to uplink application data
+ *  @param ul_app_data_len Length of uplink application data
  *  @param sky_errno Pointer to error code
+ *  @param keep_beacons keep the beacons of a valid workspace, see sky_new_request_from
  *
  *  @return Pointer to the initialized workspace context buffer or NULL
  */
-Sky_ctx_t *sky_new_request(void *workspace_buf, uint32_t bufsize, uint8_t *ul_app_data,
-    uint32_t ul_app_data_len, Sky_errno_t *sky_errno)
+static Sky_ctx_t *new_request(Sky_instance_t *inst, void *workspace_buf, uint32_t bufsize,
+    uint8_t *ul_app_data, uint32_t ul_app_data_len, Sky_errno_t *sky_errno, bool keep_beacons)
 {
     int i;
     Sky_ctx_t *ctx = (Sky_ctx_t *)workspace_buf;
     time_t now;
+    uint32_t generation;
+    uint16_t len = 0, ap_len = 0;
 
-    if (!sky_open_flag) {
+    if (inst == NULL || !inst->open_flag) {
         *sky_errno = SKY_ERROR_NEVER_OPEN;
         return NULL;
     }
-    if (bufsize != (uint32_t)sky_sizeof_workspace() || workspace_buf == NULL) {
+    if (bufsize != (uint32_t)sky_sizeof_workspace() || workspace_buf == NULL ||
+        ul_app_data_len > SKY_MAX_UL_APP_DATA || (ul_app_data == NULL && ul_app_data_len != 0)) {
         *sky_errno = SKY_ERROR_BAD_PARAMETERS;
         return NULL;
     }
-    now = (uint32_t)(*sky_time)(NULL);
-
-    memset(ctx, 0, bufsize);
+    now = (uint32_t)(*inst->gettime)(NULL);
+
+    if (ctx->header.magic == SKY_MAGIC && ctx->header.size == bufsize &&
+        ctx->header.crc32 == sky_crc32(&ctx->header.magic,
+                                 (uint8_t *)&ctx->header.crc32 - (uint8_t *)&ctx->header.magic) &&
+        order_valid(ctx)) {
+        /* workspace is being reused, only clear the slots used by the last request */
+        generation = ctx->generation + 1;
+        schedule_release(ctx);
+        flight_leave(ctx, SKY_ERROR_SERVER_ERROR);
+        if (keep_beacons) {
+            len = ctx->len;
+            ap_len = ctx->ap_len;
+        } else {
+            for (i = 0; i < NUM_BEACONS(ctx); i++) {
+                memset(&BEACON_AT(ctx, i), 0, sizeof(Beacon_t));
+                BEACON_AT(ctx, i).h.magic = BEACON_MAGIC;
+                BEACON_AT(ctx, i).h.type = SKY_BEACON_MAX;
+            }
+            memset(ctx->beacon_index, 0, sizeof(ctx->beacon_index));
+        }
+        memset(ctx, 0, offsetof(Sky_ctx_t, slot));
+        memset(&ctx->gps, 0, offsetof(Sky_ctx_t, sky_dl_app_data) - offsetof(Sky_ctx_t, gps));
+        ctx->len = len;
+        ctx->ap_len = ap_len;
+    } else {
+        generation = 0;
+        memset(ctx, 0, bufsize);
+        for (i = 0; i < STAGED_BEACONS; i++) {
+            ctx->order[i] = i;
+            if (i < STAGED_BEACONS - 1) {
+                ctx->slot[i].h.magic = BEACON_MAGIC;
+                ctx->slot[i].h.type = SKY_BEACON_MAX;
+            }
+        }
+    }
     /* update header in workspace */
     ctx->header.magic = SKY_MAGIC;
     ctx->header.size = bufsize;
     ctx->header.time = now;
     ctx->header.crc32 = sky_crc32(
         &ctx->header.magic, (uint8_t *)&ctx->header.crc32 - (uint8_t *)&ctx->header.magic);
-
-    ctx->state = &state;
-    ctx->min_level = sky_min_level;
-    ctx->logf = sky_logf;
-    ctx->rand_bytes = sky_rand_bytes;
-    ctx->gettime = sky_time;
-    ctx->plugin = sky_plugins;
-    ctx->debounce = sky_debounce;
+    ctx->generation = generation;
+    ctx->inst_generation = inst->generation;
+    ctx->token = workspace_token(ctx);
+
+    ctx->instance = inst;
+    ctx->state = &inst->state;
+    ctx->min_level = inst->min_level;
+    ctx->logf = inst->logf;
+    ctx->rand_bytes = inst->rand_bytes;
+    ctx->gettime = inst->gettime;
+    ctx->plugin = inst->plugin;
+    ctx->debounce = inst->debounce;
     ctx->auth_state = !is_tbr_enabled(ctx) ?
                           STATE_TBR_DISABLED :
                           ctx->state->sky_token_id == TBR_TOKEN_UNKNOWN ? STATE_TBR_UNREGISTERED :
                                                                           STATE_TBR_REGISTERED;
     ctx->gps.lat = NAN; /* empty */
-    for (i = 0; i < TOTAL_BEACONS; i++) {
-        ctx->beacon[i].h.magic = BEACON_MAGIC;
-        ctx->beacon[i].h.type = SKY_BEACON_MAX;
-    }
 
     if (backoff_violation(ctx, now)) {
         *sky_errno = SKY_ERROR_SERVICE_DENIED;
@@ -342,38 +895,260 @@ Sky_ctx_t *sky_new_request(void *workspace_buf, uint32_t bufsize, uint8_t *ul_ap
     }
 
 #if CACHE_SIZE
-    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "%d cachelines present", ctx->state->len);
-    for (i = 0; i < CACHE_SIZE; i++) {
-        if (state.cacheline[i].ap_len > CONFIG(ctx->state, max_ap_beacons) ||
-            state.cacheline[i].len > CONFIG(ctx->state, total_beacons)) {
-            state.cacheline[i].time = 0;
-            LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG,
-                "cache %d of %d cleared due to new Dynamic Parameters. Total beacons %d vs %d, AP %d vs %d",
-                i, CACHE_SIZE, CONFIG(ctx->state, total_beacons), ctx->state->cacheline[i].len,
-                CONFIG(ctx->state, max_ap_beacons), ctx->state->cacheline[i].ap_len);
-        }
-        if (ctx->state->cacheline[i].time &&
-            (now - ctx->state->cacheline[i].time) >
-                ctx->state->config.cache_age_threshold * SECONDS_IN_HOUR) {
-            ctx->state->cacheline[i].time = 0;
-            LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "cache %d of %d cleared due to age (%d)", i,
-                CACHE_SIZE, now - ctx->state->cacheline[i].time);
+    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "%d cachelines present", ctx->state->len);
+    /* nothing to clear until a cacheline may have aged out, or parameters have changed */
+    if ((uint32_t)now > ctx->state->cache_expiry) {
+        sweep_cache(ctx, now);
+        DUMP_CACHE(ctx);
+    }
+    ctx->cache_changes = ctx->state->cache_changes;
+#else
+    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "No cachelines present");
+#endif
+    ctx->sky_ul_app_data_len = ul_app_data_len;
+    memcpy(ctx->sky_ul_app_data, ul_app_data, ul_app_data_len);
+    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Partner_id: %d, Sku: %s", ctx->state->sky_partner_id,
+        ctx->state->sky_sku);
+    dump_hex16(__FILE__, "Device_id", ctx, SKY_LOG_LEVEL_DEBUG, ctx->state->sky_device_id,
+        ctx->state->sky_id_len, 0);
+    DUMP_WORKSPACE(ctx);
+    return ctx;
+}
+
+/*! \brief Initializes the workspace provided ready to build a request for an instance
+ *
+ *  @param inst Pointer to the library instance
+ *  @param workspace_buf Pointer to workspace provided by user
+ *  @param bufsize Workspace buffer size (from sky_sizeof_workspace)
+ *  @param ul_app_data Pointer to uplink application data
+ *  @param ul_app_data_len Length of uplink application data
+ *  @param sky_errno Pointer to error code
+ *
+ *  @return Pointer to the initialized workspace context buffer or NULL
+ */
+Sky_ctx_t *sky_new_instance_request(Sky_instance_t *inst, void *workspace_buf, uint32_t bufsize,
+    uint8_t *ul_app_data, uint32_t ul_app_data_len, Sky_errno_t *sky_errno)
+{
+    RECORD_CALL(inst, TRACE_NEW_REQUEST, ul_app_data, ul_app_data_len);
+    return new_request(
+        inst, workspace_buf, bufsize, ul_app_data, ul_app_data_len, sky_errno, false);
+}
+
+/*! \brief Initializes the workspace provided ready to build a request
+ *
+ *  @param workspace_buf Pointer to workspace provided by user
+ *  @param bufsize Workspace buffer size (from sky_sizeof_workspace)
+ *  @param ul_app_data Pointer to uplink application data
+ *  @param ul_app_data_len Length of uplink application data
+ *  @param sky_errno Pointer to error code
+ *
+ *  @return Pointer to the initialized workspace context buffer or NULL
+ */
+Sky_ctx_t *sky_new_request(void *workspace_buf, uint32_t bufsize, uint8_t *ul_app_data,
+    uint32_t ul_app_data_len, Sky_errno_t *sky_errno)
+{
+    return sky_new_instance_request(
+        &sky_default_instance, workspace_buf, bufsize, ul_app_data, ul_app_data_len, sky_errno);
+}
+
+/*! \brief Age of a scan relative to the start of the request
+ *
+ *  @param ctx Skyhook request context
+ *  @param timestamp time in seconds (from 1970 epoch) indicating when the scan was performed
+ *
+ *  @return age in seconds, held at MAX_BEACON_AGE if older
+ */
+static uint32_t scan_age(Sky_ctx_t *ctx, time_t timestamp)
+{
+    uint32_t age = ctx->header.time - timestamp;
+
+#if SKY_COMPACT_BEACONS
+    if (age > MAX_BEACON_AGE)
+        age = MAX_BEACON_AGE;
+#endif
+    return age;
+}
+
+#if CACHE_SIZE
+/*! \brief Look up the cache properties of the virtual APs grouped with an AP
+ *
+ *  @param ctx Skyhook request context
+ *  @param b parent AP
+ */
+static void vg_in_cache(Sky_ctx_t *ctx, Beacon_t *b)
+{
+    Beacon_t child;
+    Vap_t *patch;
+    int j, n;
+
+    for (j = 0; j < NUM_VAPS(b) && j < MAX_VAP_PER_AP; j++) {
+        patch = &b->ap.vg[VAP_FIRST_DATA + j];
+        n = patch->data.nibble_idx;
+        memset(&child, 0, sizeof(child));
+        child.h.magic = BEACON_MAGIC;
+        child.h.type = SKY_BEACON_AP;
+        memcpy(child.ap.mac, b->ap.mac, MAC_SIZE);
+        child.ap.mac[n / 2] = (child.ap.mac[n / 2] & ~NIBBLE_MASK(n)) |
+                              (patch->data.value << (4 * ((~n) & 1)));
+        if (!beacon_in_cache(ctx, &child, &b->ap.vg_prop[j])) {
+            b->ap.vg_prop[j].in_cache = false;
+            b->ap.vg_prop[j].used = false;
+        }
+    }
+}
+#endif
+
+/*! \brief Initializes a workspace for a new request which starts with the beacons of the last
+ *
+ *  For a device which scans often, only the changes since the last scan need be applied, see
+ *  sky_update_ap_beacon and sky_remove_ap_beacon. Beacons are aged by the time since the last
+ *  request was started, unless their age is unknown. Selection is deferred, see
+ *  sky_defer_selection, and runs when the request is sized. If it was deferred in the last
+ *  request too, its whole scan is staged again: beacons dropped by selection are restored and
+ *  virtual APs are ungrouped, so the changes give the same request as adding the new scan
+ *  afresh. Otherwise, APs keep the virtual APs grouped with them. The summary of the scan,
+ *  see sky_scan_fingerprint, is carried over and kept up to date with each change. Cache
+ *  properties of APs and of their virtual APs are only looked up again if the cache has
+ *  changed since. If the request is denied, prev is left as it was.
+ *
+ *  @param workspace_buf Pointer to workspace provided by user, may be the same as prev
+ *  @param bufsize Workspace buffer size (from sky_sizeof_workspace)
+ *  @param prev Skyhook request context of the last request
+ *  @param ul_app_data Pointer to uplink application data
+ *  @param ul_app_data_len Length of uplink application data
+ *  @param sky_errno Pointer to error code
+ *
+ *  @return Pointer to the initialized workspace context buffer or NULL
+ */
+Sky_ctx_t *sky_new_request_from(void *workspace_buf, uint32_t bufsize, Sky_ctx_t *prev,
+    uint8_t *ul_app_data, uint32_t ul_app_data_len, Sky_errno_t *sky_errno)
+{
+    int i, dropped;
+    Sky_ctx_t *ctx;
+    Beacon_t *b, restored;
+    Sky_scan_summary_t summary;
+    uint32_t prev_time, elapsed;
+    bool distinct, staged;
+#if CACHE_SIZE
+    uint32_t cache_changes;
+#endif
+
+    if (!validate_workspace(prev)) {
+        *sky_errno = SKY_ERROR_BAD_WORKSPACE;
+        return NULL;
+    }
+    RECORD_CALL(prev->instance, TRACE_NEW_REQUEST_FROM, ul_app_data, ul_app_data_len);
+    if (bufsize != (uint32_t)sky_sizeof_workspace() || workspace_buf == NULL) {
+        *sky_errno = SKY_ERROR_BAD_PARAMETERS;
+        return NULL;
+    }
+    /* workspace may be prev itself, so it is not touched until the request is allowed */
+    if (backoff_violation(prev, (*prev->gettime)(NULL))) {
+        *sky_errno = SKY_ERROR_SERVICE_DENIED;
+        return NULL;
+    }
+    prev_time = prev->header.time;
+    distinct = prev->aps_distinct;
+    staged = prev->defer_selection;
+    dropped = prev->dropped;
+    summary = prev->summary;
+#if CACHE_SIZE
+    cache_changes = prev->cache_changes;
+#endif
+
+    /* a copy has the header of prev, so it is reused in the same way, but the
+     * scheduler slot and flight are still held by prev, so are not the copy's to give back */
+    if (workspace_buf != prev) {
+        memcpy(workspace_buf, prev, bufsize);
+        ((Sky_ctx_t *)workspace_buf)->scheduled = NULL;
+        ((Sky_ctx_t *)workspace_buf)->coalescer = NULL;
+        ((Sky_ctx_t *)workspace_buf)->flight = 0;
+    }
+    ctx = new_request(
+        prev->instance, workspace_buf, bufsize, ul_app_data, ul_app_data_len, sky_errno, true);
+    if (ctx == NULL)
+        return NULL;
+    ctx->defer_selection = true;
+    ctx->aps_distinct = distinct;
+    ctx->summary = summary;
+
+    if (staged) {
+        /* beacons dropped by selection are next in order, see select_beacons */
+        for (i = 0; i < dropped; i++) {
+            restored = ctx->slot[ctx->order[NUM_BEACONS(ctx)]];
+            if (insert_beacon(ctx, sky_errno, &restored, NULL) == SKY_ERROR)
+                break;
+        }
+        /* virtual APs were dropped too, so groups are formed again by selection */
+        for (i = NUM_APS(ctx) - 1; i >= 0; i--) {
+            if (!BEACON_AT(ctx, i).ap.vg_len)
+                continue;
+            restored = BEACON_AT(ctx, i);
+            restored.ap.vg_len = 0;
+            memset(restored.ap.vg, 0, sizeof(restored.ap.vg));
+            memset(restored.ap.vg_prop, 0, sizeof(restored.ap.vg_prop));
+            remove_beacon(ctx, i);
+            insert_beacon(ctx, sky_errno, &restored, NULL);
+        }
+    }
+
+    elapsed = ctx->header.time > prev_time ? ctx->header.time - prev_time : 0;
+    for (i = 0; i < NUM_BEACONS(ctx); i++) {
+        b = &BEACON_AT(ctx, i);
+        /* age 0 is unknown, and stays so */
+        if (b->h.age)
+            b->h.age = scan_age(ctx, (time_t)ctx->header.time - elapsed - b->h.age);
+        if (!is_ap_type(b))
+            continue;
+#if SKY_AP_MIRROR
+        ctx->aps.age[i] = b->h.age;
+#endif
+#if CACHE_SIZE
+        if (cache_changes != ctx->cache_changes) {
+            if (!beacon_in_cache(ctx, b, &b->ap.property)) {
+                b->ap.property.in_cache = false;
+                b->ap.property.used = false;
+            }
+            vg_in_cache(ctx, b);
         }
-    }
-    DUMP_CACHE(ctx);
-#else
-    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "No cachelines present");
 #endif
-    ctx->state->sky_ul_app_data_len = ul_app_data_len;
-    memcpy(ctx->state->sky_ul_app_data, ul_app_data, ul_app_data_len);
-    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Partner_id: %d, Sku: %s", ctx->state->sky_partner_id,
-        ctx->state->sky_sku);
-    dump_hex16(__FILE__, "Device_id", ctx, SKY_LOG_LEVEL_DEBUG, ctx->state->sky_device_id,
-        ctx->state->sky_id_len, 0);
+    }
     DUMP_WORKSPACE(ctx);
     return ctx;
 }
 
+/*! \brief Fill in an AP beacon from the values reported by a scan
+ *
+ *  @param ctx Skyhook request context
+ *  @param b beacon to fill in
+ *  @param mac pointer to mac address of the Wi-Fi beacon
+ *  @param timestamp time in seconds (from 1970 epoch) indicating when the scan was performed, (time_t)-1 if unknown
+ *  @param rssi Received Signal Strength Intensity, -10 through -127, -1 if unknown
+ *  @param frequency center frequency of channel in MHz, 2400 through 6000, -1 if unknown
+ *  @param is_connected this beacon is currently connected, false if unknown
+ */
+static void create_ap_beacon(Sky_ctx_t *ctx, Beacon_t *b, const uint8_t *mac, time_t timestamp,
+    int16_t rssi, int32_t frequency, bool is_connected)
+{
+    memset(b, 0, sizeof(*b));
+    b->h.magic = BEACON_MAGIC;
+    b->h.type = SKY_BEACON_AP;
+    b->h.connected = is_connected;
+    if (rssi > -10 || rssi < -127)
+        rssi = -1;
+    b->h.rssi = rssi;
+    memcpy(b->ap.mac, mac, MAC_SIZE);
+    /* If beacon has meaningful timestamp */
+    /* scan was before sky_new_request and since Mar 1st 2019 */
+    if (ctx->header.time > timestamp && timestamp > TIMESTAMP_2019_03_01)
+        b->h.age = scan_age(ctx, timestamp);
+    if (frequency < 2400 || frequency > 6000)
+        frequency = 0; /* 0's not sent to server */
+    b->ap.freq = frequency;
+    b->ap.property.in_cache = false;
+    b->ap.property.used = false;
+}
+
 /*! \brief  Adds the wifi ap information to the request context
  *
  *  @param ctx Skyhook request context
@@ -396,32 +1171,140 @@ Sky_status_t sky_add_ap_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, uint8_t m
         is_connected ? "serve " : "",
         (int)timestamp == -1 ? -1 : (int)(ctx->header.time - timestamp));
 
-    if (!sky_open_flag)
+    if (!validate_workspace(ctx))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
+
+    if (!ctx->instance->open_flag)
         return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
 
+    create_ap_beacon(ctx, &b, mac, timestamp, rssi, frequency, is_connected);
+    return add_beacon(ctx, sky_errno, &b);
+}
+
+/*! \brief Replace the Wi-Fi ap in request context with a new report of it, or add it
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param mac pointer to mac address of the Wi-Fi beacon
+ *  @param timestamp time in seconds (from 1970 epoch) indicating when the scan was performed, (time_t)-1 if unknown
+ *  @param rssi Received Signal Strength Intensity, -10 through -127, -1 if unknown
+ *  @param frequency center frequency of channel in MHz, 2400 through 6000, -1 if unknown
+ *  @param is_connected this beacon is currently connected, false if unknown
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_update_ap_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, uint8_t mac[6],
+    time_t timestamp, int16_t rssi, int32_t frequency, bool is_connected)
+{
+    Beacon_t b;
+
     if (!validate_workspace(ctx))
         return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
 
-    /* Create AP beacon */
-    memset(&b, 0, sizeof(b));
-    b.h.magic = BEACON_MAGIC;
-    b.h.type = SKY_BEACON_AP;
-    b.h.connected = is_connected;
-    if (rssi > -10 || rssi < -127)
-        rssi = -1;
-    b.h.rssi = rssi;
-    memcpy(b.ap.mac, mac, MAC_SIZE);
-    /* If beacon has meaningful timestamp */
-    /* scan was before sky_new_request and since Mar 1st 2019 */
-    if (ctx->header.time > timestamp && timestamp > TIMESTAMP_2019_03_01)
-        b.h.age = ctx->header.time - timestamp;
-    if (frequency < 2400 || frequency > 6000)
-        frequency = 0; /* 0's not sent to server */
-    b.ap.freq = frequency;
-    b.ap.property.in_cache = false;
-    b.ap.property.used = false;
+    if (!ctx->instance->open_flag)
+        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
 
-    return add_beacon(ctx, sky_errno, &b);
+    create_ap_beacon(ctx, &b, mac, timestamp, rssi, frequency, is_connected);
+    return update_beacon(ctx, sky_errno, &b);
+}
+
+/*! \brief Remove the Wi-Fi ap from request context, if it is there
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param mac pointer to mac address of the Wi-Fi beacon
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_remove_ap_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, uint8_t mac[6])
+{
+    Beacon_t b;
+
+    if (!validate_workspace(ctx))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
+
+    if (!ctx->instance->open_flag)
+        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
+
+    create_ap_beacon(ctx, &b, mac, (time_t)-1, -1, -1, false);
+    return discard_beacon(ctx, sky_errno, &b);
+}
+
+/*! \brief Check the parameters of a cell, as passed to sky_add_cell_<type>_beacon
+ *
+ *  @param type type of cell
+ *  @param mcc mobile country code, SKY_UNKNOWN_ID1 if unknown
+ *  @param mnc mobile network code or sid (cdma), SKY_UNKNOWN_ID2 if unknown
+ *  @param area lac, tac or nid (cdma), SKY_UNKNOWN_ID3 if unknown
+ *  @param id cell identifier, SKY_UNKNOWN_ID4 if unknown
+ *  @param pci pci, psc or ncid, SKY_UNKNOWN_ID5 if unknown
+ *  @param channel uarfcn, earfcn or nrarfcn, SKY_UNKNOWN_ID6 if unknown
+ *  @param ta timing advance, SKY_UNKNOWN_TA if unknown
+ *
+ *  @return true if the cell may be added
+ */
+static bool valid_cell(Sky_cell_type_t type, uint16_t mcc, uint32_t mnc, int32_t area, int64_t id,
+    int16_t pci, int32_t channel, int32_t ta)
+{
+    /* If at least one of the primary IDs is unvalued, then *all* primary IDs must
+     * be unvalued (meaning user is attempting to add a neighbor cell). Partial
+     * specification of primary IDs is considered an error.
+     */
+    switch (type) {
+    case SKY_CELL_GSM:
+        /* gsm has no neighbor cells */
+        if (mcc == SKY_UNKNOWN_ID1 || mnc == SKY_UNKNOWN_ID2 || area == SKY_UNKNOWN_ID3 ||
+            id == SKY_UNKNOWN_ID4)
+            return false;
+        break;
+    case SKY_CELL_CDMA:
+        break;
+    default:
+        if ((mcc == SKY_UNKNOWN_ID1 || mnc == SKY_UNKNOWN_ID2 || id == SKY_UNKNOWN_ID4) &&
+            !(mcc == SKY_UNKNOWN_ID1 && mnc == SKY_UNKNOWN_ID2 && id == SKY_UNKNOWN_ID4))
+            return false;
+        break;
+    }
+
+    /* range check parameters */
+    switch (type) {
+    case SKY_CELL_NR:
+        return !((mcc != SKY_UNKNOWN_ID1 && (mcc < 200 || mcc > 799)) ||
+                 (mnc != SKY_UNKNOWN_ID2 && mnc > 999) ||
+                 (id != SKY_UNKNOWN_ID4 && (id < 0 || id > 68719476735)) ||
+                 (area != SKY_UNKNOWN_ID3 && (area < 1 || area > 65535)) ||
+                 (pci != SKY_UNKNOWN_ID5 && (pci < 0 || pci > 1007)) ||
+                 (channel != SKY_UNKNOWN_ID6 && (channel < 0 || channel > 3279165)) ||
+                 (ta != SKY_UNKNOWN_TA && (ta < 0 || ta > 3846)));
+    case SKY_CELL_LTE:
+        return !((mcc != SKY_UNKNOWN_ID1 && (mcc < 200 || mcc > 799)) ||
+                 (mnc != SKY_UNKNOWN_ID2 && mnc > 999) ||
+                 (area != SKY_UNKNOWN_ID3 && (area < 1 || area > 65535)) ||
+                 (id != SKY_UNKNOWN_ID4 && (id < 0 || id > 268435455)) ||
+                 (pci != SKY_UNKNOWN_ID5 && pci > 503) ||
+                 (channel != SKY_UNKNOWN_ID6 && channel > 262143) ||
+                 (ta != SKY_UNKNOWN_TA && (ta < 0 || ta > 7690)));
+    case SKY_CELL_UMTS:
+        return !((mcc != SKY_UNKNOWN_ID1 && (mcc < 200 || mcc > 799)) ||
+                 (mnc != SKY_UNKNOWN_ID2 && (mnc > 999)) ||
+                 (id != SKY_UNKNOWN_ID4 && (id < 0 || id > 268435455)) ||
+                 (pci != SKY_UNKNOWN_ID5 && (pci < 0 || pci > 511)) ||
+                 (channel != SKY_UNKNOWN_ID6 && (channel < 412 || channel > 10838)));
+    case SKY_CELL_NBIOT:
+        return !((mcc != SKY_UNKNOWN_ID1 && (mcc < 200 || mcc > 799)) ||
+                 (mnc != SKY_UNKNOWN_ID2 && mnc > 999) ||
+                 (area != SKY_UNKNOWN_ID3 && (area < 1 || area > 65535)) ||
+                 (id != SKY_UNKNOWN_ID4 && (id < 0 || id > 268435455)) ||
+                 (pci != SKY_UNKNOWN_ID5 && (pci < 0 || pci > 503)) ||
+                 (channel != SKY_UNKNOWN_ID6 && (channel < 0 || channel > 262143)));
+    case SKY_CELL_CDMA:
+        return !(mnc > 32767 || area < 0 || area > 65535 || id < 0 || id > 65535);
+    case SKY_CELL_GSM:
+        return !(mcc < 200 || mcc > 799 || mnc > 999 || area == 0 ||
+                 (ta != SKY_UNKNOWN_TA && (ta < 0 || ta > 63)));
+    default:
+        return false;
+    }
 }
 
 /*! \brief Add an lte cell beacon to request context
@@ -452,29 +1335,15 @@ Sky_status_t sky_add_cell_lte_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, int
             mcc, mnc, tac, e_cellid, pci, earfcn, ta, rsrp, is_connected ? "serve, " : "",
             (int)(ctx->header.time - timestamp));
 
-    /* If at least one of the primary IDs is unvalued, then *all* primary IDs must
-     * be unvalued (meaning user is attempting to add a neighbor cell). Partial
-     * specification of primary IDs is considered an error.
-     */
-    if ((mcc == SKY_UNKNOWN_ID1 || mnc == SKY_UNKNOWN_ID2 || e_cellid == SKY_UNKNOWN_ID4) &&
-        !(mcc == SKY_UNKNOWN_ID1 && mnc == SKY_UNKNOWN_ID2 && e_cellid == SKY_UNKNOWN_ID4))
-        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
-
-    /* range check parameters */
-    if ((mcc != SKY_UNKNOWN_ID1 && (mcc < 200 || mcc > 799)) ||
-        (mnc != SKY_UNKNOWN_ID2 && mnc > 999) ||
-        (tac != SKY_UNKNOWN_ID3 && (tac < 1 || tac > 65535)) ||
-        (e_cellid != SKY_UNKNOWN_ID4 && (e_cellid < 0 || e_cellid > 268435455)) ||
-        (pci != SKY_UNKNOWN_ID5 && pci > 503) || (earfcn != SKY_UNKNOWN_ID6 && earfcn > 262143) ||
-        (ta != SKY_UNKNOWN_TA && (ta < 0 || ta > 7690)))
+    if (!valid_cell(SKY_CELL_LTE, mcc, mnc, tac, e_cellid, pci, earfcn, ta))
         return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
 
-    if (!sky_open_flag)
-        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
-
     if (!validate_workspace(ctx))
         return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
 
+    if (!ctx->instance->open_flag)
+        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
+
     /* Create LTE beacon */
     memset(&b, 0, sizeof(b));
     b.h.magic = BEACON_MAGIC;
@@ -486,7 +1355,7 @@ Sky_status_t sky_add_cell_lte_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, int
     /* If beacon has meaningful timestamp */
     /* scan was before sky_new_request and since Mar 1st 2019 */
     if (ctx->header.time > timestamp && timestamp > TIMESTAMP_2019_03_01)
-        b.h.age = ctx->header.time - timestamp;
+        b.h.age = scan_age(ctx, timestamp);
     b.cell.id1 = mcc;
     b.cell.id2 = mnc;
     b.cell.id3 = tac;
@@ -545,25 +1414,15 @@ Sky_status_t sky_add_cell_gsm_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, int
     LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "%u, %u, %d, %lld, ta %d, rssi %d, %sage %d", lac, ci, mcc,
         mnc, ta, rssi, is_connected ? "serve, " : "", (int)(ctx->header.time - timestamp));
 
-    /* If at least one of the primary IDs is unvalued, then *all* primary IDs must
-     * be unvalued (meaning user is attempting to add a neighbor cell). Partial
-     * specification of primary IDs is considered an error.
-     */
-    if (mcc == SKY_UNKNOWN_ID1 || mnc == SKY_UNKNOWN_ID2 || lac == SKY_UNKNOWN_ID3 ||
-        ci == SKY_UNKNOWN_ID4)
-        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
-
-    /* range check parameters */
-    if (mcc < 200 || mcc > 799 || mnc > 999 || lac == 0 ||
-        (ta != SKY_UNKNOWN_TA && (ta < 0 || ta > 63)))
+    if (!valid_cell(SKY_CELL_GSM, mcc, mnc, lac, ci, SKY_UNKNOWN_ID5, SKY_UNKNOWN_ID6, ta))
         return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
 
-    if (!sky_open_flag)
-        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
-
     if (!validate_workspace(ctx))
         return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
 
+    if (!ctx->instance->open_flag)
+        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
+
     /* Create GSM beacon */
     memset(&b, 0, sizeof(b));
     b.h.magic = BEACON_MAGIC;
@@ -575,7 +1434,7 @@ Sky_status_t sky_add_cell_gsm_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, int
     /* If beacon has meaningful timestamp */
     /* scan was before sky_new_request and since Mar 1st 2019 */
     if (ctx->header.time > timestamp && timestamp > TIMESTAMP_2019_03_01)
-        b.h.age = ctx->header.time - timestamp;
+        b.h.age = scan_age(ctx, timestamp);
     b.cell.id1 = mcc;
     b.cell.id2 = mnc;
     b.cell.id3 = lac;
@@ -612,28 +1471,15 @@ Sky_status_t sky_add_cell_umts_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, in
             mnc, lac, ucid, psc, uarfcn, rscp, is_connected ? "serve, " : "",
             (int)timestamp == -1 ? -1 : (int)(ctx->header.time - timestamp));
 
-    /* If at least one of the primary IDs is unvalued, then *all* primary IDs must
-     * be unvalued (meaning user is attempting to add a neighbor cell). Partial
-     * specification of primary IDs is considered an error.
-     */
-    if ((mcc == SKY_UNKNOWN_ID1 || mnc == SKY_UNKNOWN_ID2 || ucid == SKY_UNKNOWN_ID4) &&
-        !(mcc == SKY_UNKNOWN_ID1 && mnc == SKY_UNKNOWN_ID2 && ucid == SKY_UNKNOWN_ID4))
-        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
-
-    /* range check parameters */
-    if ((mcc != SKY_UNKNOWN_ID1 && (mcc < 200 || mcc > 799)) ||
-        (mnc != SKY_UNKNOWN_ID2 && (mnc > 999)) ||
-        (ucid != SKY_UNKNOWN_ID4 && (ucid < 0 || ucid > 268435455)) ||
-        (psc != SKY_UNKNOWN_ID5 && (psc < 0 || psc > 511)) ||
-        (uarfcn != SKY_UNKNOWN_ID6 && (uarfcn < 412 || uarfcn > 10838)))
+    if (!valid_cell(SKY_CELL_UMTS, mcc, mnc, lac, ucid, psc, uarfcn, SKY_UNKNOWN_TA))
         return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
 
-    if (!sky_open_flag)
-        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
-
     if (!validate_workspace(ctx))
         return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
 
+    if (!ctx->instance->open_flag)
+        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
+
     /* Create UMTS beacon */
     memset(&b, 0, sizeof(b));
     b.h.magic = BEACON_MAGIC;
@@ -645,7 +1491,7 @@ Sky_status_t sky_add_cell_umts_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, in
     /* If beacon has meaningful timestamp */
     /* scan was before sky_new_request and since Mar 1st 2019 */
     if (ctx->header.time > timestamp && timestamp > TIMESTAMP_2019_03_01)
-        b.h.age = ctx->header.time - timestamp;
+        b.h.age = scan_age(ctx, timestamp);
     b.cell.id1 = mcc;
     b.cell.id2 = mnc;
     b.cell.id3 = lac;
@@ -697,16 +1543,16 @@ Sky_status_t sky_add_cell_cdma_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, ui
         is_connected ? "serve, " : "",
         (int)timestamp == -1 ? -1 : (int)(ctx->header.time - timestamp));
 
-    /* Range check parameters */
-    if (sid > 32767 || nid < 0 || nid > 65535 || bsid < 0 || bsid > 65535)
+    if (!valid_cell(SKY_CELL_CDMA, SKY_UNKNOWN_ID1, sid, nid, bsid, SKY_UNKNOWN_ID5,
+            SKY_UNKNOWN_ID6, SKY_UNKNOWN_TA))
         return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
 
-    if (!sky_open_flag)
-        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
-
     if (!validate_workspace(ctx))
         return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
 
+    if (!ctx->instance->open_flag)
+        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
+
     /* Create CDMA beacon */
     memset(&b, 0, sizeof(b));
     b.h.magic = BEACON_MAGIC;
@@ -718,7 +1564,7 @@ Sky_status_t sky_add_cell_cdma_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, ui
     /* If beacon has meaningful timestamp */
     /* scan was before sky_new_request and since Mar 1st 2019 */
     if (ctx->header.time > timestamp && timestamp > TIMESTAMP_2019_03_01)
-        b.h.age = ctx->header.time - timestamp;
+        b.h.age = scan_age(ctx, timestamp);
     b.cell.id2 = sid;
     b.cell.id3 = nid;
     b.cell.id4 = bsid;
@@ -753,29 +1599,15 @@ Sky_status_t sky_add_cell_nb_iot_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno,
             mnc, tac, e_cellid, ncid, earfcn, nrsrp, is_connected ? "serve, " : "",
             (int)timestamp == -1 ? -1 : (int)(ctx->header.time - timestamp));
 
-    /* If at least one of the primary IDs is unvalued, then *all* primary IDs must
-     * be unvalued (meaning user is attempting to add a neighbor cell). Partial
-     * specification of primary IDs is considered an error.
-     */
-    if ((mcc == SKY_UNKNOWN_ID1 || mnc == SKY_UNKNOWN_ID2 || e_cellid == SKY_UNKNOWN_ID4) &&
-        !(mcc == SKY_UNKNOWN_ID1 && mnc == SKY_UNKNOWN_ID2 && e_cellid == SKY_UNKNOWN_ID4))
+    if (!valid_cell(SKY_CELL_NBIOT, mcc, mnc, tac, e_cellid, ncid, earfcn, SKY_UNKNOWN_TA))
         return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
 
-    /* range check parameters */
-    if ((mcc != SKY_UNKNOWN_ID1 && (mcc < 200 || mcc > 799)) ||
-        (mnc != SKY_UNKNOWN_ID2 && mnc > 999) ||
-        (tac != SKY_UNKNOWN_ID3 && (tac < 1 || tac > 65535)) ||
-        (e_cellid != SKY_UNKNOWN_ID4 && (e_cellid < 0 || e_cellid > 268435455)) ||
-        (ncid != SKY_UNKNOWN_ID5 && (ncid < 0 || ncid > 503)) ||
-        (earfcn != SKY_UNKNOWN_ID6 && (earfcn < 0 || earfcn > 262143)))
-        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
-
-    if (!sky_open_flag)
-        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
-
     if (!validate_workspace(ctx))
         return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
 
+    if (!ctx->instance->open_flag)
+        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
+
     /* Create NB IoT beacon */
     memset(&b, 0, sizeof(b));
     b.h.magic = BEACON_MAGIC;
@@ -787,7 +1619,7 @@ Sky_status_t sky_add_cell_nb_iot_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno,
     /* If beacon has meaningful timestamp */
     /* scan was before sky_new_request and since Mar 1st 2019 */
     if (ctx->header.time > timestamp && timestamp > TIMESTAMP_2019_03_01)
-        b.h.age = ctx->header.time - timestamp;
+        b.h.age = scan_age(ctx, timestamp);
     b.cell.id1 = mcc;
     b.cell.id2 = mnc;
     b.cell.id3 = tac;
@@ -848,30 +1680,15 @@ Sky_status_t sky_add_cell_nr_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, uint
             mcc, mnc, tac, nci, pci, nrarfcn, ta, csi_rsrp, is_connected ? "serve, " : "",
             (int)timestamp == -1 ? -1 : (int)(ctx->header.time - timestamp));
 
-    /* If at least one of the primary IDs is unvalued, then *all* primary IDs must
-     * be unvalued (meaning user is attempting to add a neighbor cell). Partial
-     * specification of primary IDs is considered an error.
-     */
-    if ((mcc == SKY_UNKNOWN_ID1 || mnc == SKY_UNKNOWN_ID2 || nci == SKY_UNKNOWN_ID4) &&
-        !(mcc == SKY_UNKNOWN_ID1 && mnc == SKY_UNKNOWN_ID2 && nci == SKY_UNKNOWN_ID4))
-        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
-
-    /* range check parameters */
-    if ((mcc != SKY_UNKNOWN_ID1 && (mcc < 200 || mcc > 799)) ||
-        (mnc != SKY_UNKNOWN_ID2 && mnc > 999) ||
-        (nci != SKY_UNKNOWN_ID4 && (nci < 0 || nci > 68719476735)) ||
-        (tac != SKY_UNKNOWN_ID3 && (tac < 1 || tac > 65535)) ||
-        (pci != SKY_UNKNOWN_ID5 && (pci < 0 || pci > 1007)) ||
-        (nrarfcn != SKY_UNKNOWN_ID6 && (nrarfcn < 0 || nrarfcn > 3279165)) ||
-        (ta != SKY_UNKNOWN_TA && (ta < 0 || ta > 3846)))
+    if (!valid_cell(SKY_CELL_NR, mcc, mnc, tac, nci, pci, nrarfcn, ta))
         return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
 
-    if (!sky_open_flag)
-        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
-
     if (!validate_workspace(ctx))
         return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
 
+    if (!ctx->instance->open_flag)
+        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
+
     /* Create NR beacon */
     memset(&b, 0, sizeof(b));
     b.h.magic = BEACON_MAGIC;
@@ -880,7 +1697,7 @@ Sky_status_t sky_add_cell_nr_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, uint
     /* If beacon has meaningful timestamp */
     /* scan was before sky_new_request and since Mar 1st 2019 */
     if (ctx->header.time > timestamp && timestamp > TIMESTAMP_2019_03_01)
-        b.h.age = ctx->header.time - timestamp;
+        b.h.age = scan_age(ctx, timestamp);
     if (csi_rsrp > -40 || csi_rsrp < -140)
         csi_rsrp = -1;
     b.h.rssi = csi_rsrp;
@@ -895,28 +1712,310 @@ Sky_status_t sky_add_cell_nr_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, uint
     else
         b.cell.ta = SKY_UNKNOWN_TA;
 
-    return add_beacon(ctx, sky_errno, &b);
+    return add_beacon(ctx, sky_errno, &b);
+}
+
+/*! \brief Adds a NR cell neighbor beacon to the request context
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param physical cell ID (0-1007), SKY_UNKNOWN_ID5 if unknown
+ *  @param nrarfcn channel (0-3279165), SKY_UNKNOWN_ID6 if unknown
+ *  @param timestamp time in seconds (from 1970 epoch) indicating when the scan was performed, (time_t)-1 if unknown
+ *  @param nrsrp Narrowband Reference Signal Received Power, range -156 to -44dbm, -1 if unknown
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_add_cell_nr_neighbor_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, int16_t pci,
+    int32_t nrarfcn, time_t timestamp, int16_t csi_rsrp)
+{
+    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "%d, %d MHz, rsrp %d, age %d", pci, nrarfcn, csi_rsrp,
+        (int)timestamp == -1 ? -1 : (int)(ctx->header.time - timestamp));
+    return sky_add_cell_nr_beacon(ctx, sky_errno, SKY_UNKNOWN_ID1, SKY_UNKNOWN_ID2,
+        (int64_t)SKY_UNKNOWN_ID4, SKY_UNKNOWN_ID3, pci, nrarfcn, SKY_UNKNOWN_TA, timestamp,
+        csi_rsrp, false);
+}
+
+/*! \brief Adds all the Wi-Fi APs of a scan to the request context
+ *
+ *  Selection is deferred while the APs are added, and unless it was already deferred
+ *  by sky_defer_selection, the APs a request may carry are then chosen once from the
+ *  whole scan. The workspace and every mac address are checked before any AP is added,
+ *  so a scan with a bad mac address is rejected as a whole.
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param scan array of APs
+ *  @param count number of APs in scan
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_add_ap_beacons(
+    Sky_ctx_t *ctx, Sky_errno_t *sky_errno, const Sky_ap_scan_t *scan, uint32_t count)
+{
+    Beacon_t b;
+    uint32_t i;
+    bool defer;
+
+    if (!validate_workspace(ctx))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
+
+    if (!ctx->instance->open_flag)
+        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
+
+    if (scan == NULL && count)
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+
+    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "%u APs", count);
+    for (i = 0; i < count; i++) {
+        if (!validate_mac((uint8_t *)scan[i].mac, ctx))
+            return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+    }
+
+    /* Stage the whole scan, rather than filter the APs seen so far after each add */
+    defer = ctx->defer_selection;
+    sky_defer_selection(ctx, sky_errno, true);
+    for (i = 0; i < count; i++) {
+        create_ap_beacon(ctx, &b, scan[i].mac, scan[i].timestamp, scan[i].rssi,
+            scan[i].frequency, scan[i].is_connected);
+        if (add_beacon(ctx, sky_errno, &b) == SKY_ERROR)
+            break;
+    }
+    if (i < count) {
+        sky_defer_selection(ctx, NULL, defer);
+        return SKY_ERROR;
+    }
+    sky_defer_selection(ctx, sky_errno, defer);
+    if (!defer) {
+        RECORD_CALL(ctx->instance, TRACE_SELECT_BEACONS, NULL, 0);
+        if (select_beacons(ctx, sky_errno) == SKY_ERROR)
+            return SKY_ERROR;
+    }
+    return set_error_status(sky_errno, SKY_ERROR_NONE);
+}
+
+/*! \brief Adds all the cells of a scan to the request context
+ *
+ *  Each cell is added by the sky_add_cell_<type>_beacon function for its type, so the
+ *  workspace is left as if those had been called for each cell in turn.
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param scan array of cells
+ *  @param count number of cells in scan
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_add_cell_beacons(
+    Sky_ctx_t *ctx, Sky_errno_t *sky_errno, const Sky_cell_scan_t *scan, uint32_t count)
+{
+    const Sky_cell_scan_t *c;
+    Sky_status_t ret;
+    uint32_t i;
+
+    if (!validate_workspace(ctx))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
+
+    if (!ctx->instance->open_flag)
+        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
+
+    if (scan == NULL && count)
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+
+    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "%u cells", count);
+    for (i = 0; i < count; i++) {
+        c = &scan[i];
+        switch (c->type) {
+        case SKY_CELL_NR:
+            ret = sky_add_cell_nr_beacon(ctx, sky_errno, c->mcc, c->mnc, c->id, c->area, c->pci,
+                c->channel, c->ta, c->timestamp, c->rssi, c->is_connected);
+            break;
+        case SKY_CELL_LTE:
+            ret = sky_add_cell_lte_beacon(ctx, sky_errno, c->area, c->id, c->mcc, c->mnc, c->pci,
+                c->channel, c->ta, c->timestamp, c->rssi, c->is_connected);
+            break;
+        case SKY_CELL_UMTS:
+            /* uarfcn is passed as int16_t, so one which does not fit is out of range */
+            if (c->channel != (int16_t)c->channel)
+                return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+            ret = sky_add_cell_umts_beacon(ctx, sky_errno, c->area, c->id, c->mcc, c->mnc, c->pci,
+                (int16_t)c->channel, c->timestamp, c->rssi, c->is_connected);
+            break;
+        case SKY_CELL_NBIOT:
+            ret = sky_add_cell_nb_iot_beacon(ctx, sky_errno, c->mcc, c->mnc, c->id, c->area,
+                c->pci, c->channel, c->timestamp, c->rssi, c->is_connected);
+            break;
+        case SKY_CELL_CDMA:
+            ret = sky_add_cell_cdma_beacon(ctx, sky_errno, c->mnc, c->area, c->id, c->timestamp,
+                c->rssi, c->is_connected);
+            break;
+        case SKY_CELL_GSM:
+            ret = sky_add_cell_gsm_beacon(ctx, sky_errno, c->area, c->id, c->mcc, c->mnc, c->ta,
+                c->timestamp, c->rssi, c->is_connected);
+            break;
+        default:
+            LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Unknown cell type %d", (int)c->type);
+            return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+        }
+        if (ret == SKY_ERROR)
+            return SKY_ERROR;
+    }
+    return set_error_status(sky_errno, SKY_ERROR_NONE);
+}
+
+/*! \brief Fingerprint a scan, without building a request from it
+ *
+ *  The fingerprint covers the strongest APs and the serving cells of the scan, so it
+ *  does not change when only weak or neighbor beacons come and go. It is saved with
+ *  each location added to the cache, see sky_scan_unchanged. Beacons which would not be
+ *  added to a request are left out, and a serving cell reported twice is counted once.
+ *
+ *  @param aps APs of the scan, may be NULL if ap_count is 0
+ *  @param ap_count number of APs
+ *  @param cells cells of the scan, may be NULL if cell_count is 0
+ *  @param cell_count number of cells
+ *
+ *  @return fingerprint of scan, 0 if it has no APs or serving cells
+ */
+uint64_t sky_scan_fingerprint(const Sky_ap_scan_t *aps, uint32_t ap_count,
+    const Sky_cell_scan_t *cells, uint32_t cell_count)
+{
+    Sky_scan_summary_t s;
+    Beacon_t b;
+    uint32_t i;
+
+    memset(&s, 0, sizeof(s));
+    for (i = 0; aps != NULL && i < ap_count; i++) {
+        memset(&b, 0, sizeof(b));
+        b.h.type = SKY_BEACON_AP;
+        b.h.rssi = aps[i].rssi;
+        memcpy(b.ap.mac, aps[i].mac, MAC_SIZE);
+        /* skip what sky_add_ap_beacon would reject */
+        if (!validate_mac(b.ap.mac, NULL))
+            continue;
+        summary_add(&s, &b);
+    }
+    for (i = 0; cells != NULL && i < cell_count; i++) {
+        memset(&b, 0, sizeof(b));
+        switch (cells[i].type) {
+        case SKY_CELL_NR:
+            b.h.type = SKY_BEACON_NR;
+            break;
+        case SKY_CELL_LTE:
+            b.h.type = SKY_BEACON_LTE;
+            break;
+        case SKY_CELL_UMTS:
+            b.h.type = SKY_BEACON_UMTS;
+            break;
+        case SKY_CELL_NBIOT:
+            b.h.type = SKY_BEACON_NBIOT;
+            break;
+        case SKY_CELL_CDMA:
+            b.h.type = SKY_BEACON_CDMA;
+            break;
+        case SKY_CELL_GSM:
+            b.h.type = SKY_BEACON_GSM;
+            break;
+        default:
+            continue;
+        }
+        /* skip what sky_add_cell_beacons would reject */
+        if (!valid_cell(cells[i].type, cells[i].mcc, cells[i].mnc, cells[i].area, cells[i].id,
+                cells[i].pci, cells[i].channel, cells[i].ta) ||
+            (cells[i].type == SKY_CELL_UMTS && cells[i].channel != (int16_t)cells[i].channel))
+            continue;
+        b.h.connected = cells[i].is_connected;
+        b.cell.id1 = b.h.type == SKY_BEACON_CDMA ? 0 : cells[i].mcc;
+        b.cell.id2 = cells[i].mnc;
+        b.cell.id3 = cells[i].area;
+        b.cell.id4 = cells[i].id;
+        b.cell.id5 = cells[i].pci;
+        b.cell.freq = cells[i].channel;
+        summary_add(&s, &b);
+    }
+    return summary_fingerprint(&s);
+}
+
+/*! \brief Look for a cached location of a scan, see sky_scan_unchanged
+ *
+ *  @param inst instance to look in
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param fingerprint of scan, from sky_scan_fingerprint
+ *  @param loc where to save the cached location
+ *
+ *  @return SKY_SUCCESS if location found, SKY_FAILURE if not, or SKY_ERROR
+ */
+static Sky_status_t scan_unchanged(
+    Sky_instance_t *inst, Sky_errno_t *sky_errno, uint64_t fingerprint, Sky_location_t *loc)
+{
+#if CACHE_SIZE
+    Sky_state_t *state;
+    Sky_cacheline_t *cl;
+    uint32_t now, seq;
+    bool found;
+    int i;
+#endif
+
+    if (!inst->open_flag)
+        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
+    if (loc == NULL)
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+    *sky_errno = SKY_ERROR_NONE;
+
+#if CACHE_SIZE
+    state = &inst->state;
+    if (fingerprint == 0)
+        return SKY_FAILURE;
+    now = (uint32_t)(*inst->gettime)(NULL);
+    for (i = 0; i < CACHE_SIZE; i++) {
+        cl = &state->cacheline[i];
+        do {
+            seq = CACHELINE_READ_BEGIN(cl);
+            found = cl->time != 0 && cl->fingerprint == fingerprint &&
+                    now - cl->time <= CONFIG(state, cache_age_threshold) * SECONDS_IN_HOUR;
+            if (found)
+                *loc = cl->loc;
+        } while (CACHELINE_READ_RETRY(cl, seq));
+        if (found) {
+            /* let a request refresh the cache, as sky_finalize_request would */
+            if (!count_cache_hit(state))
+                return SKY_FAILURE;
+            loc->dl_app_data = NULL;
+            loc->dl_app_data_len = 0;
+            return SKY_SUCCESS;
+        }
+    }
+#else
+    (void)fingerprint; /* suppress warning of unused parameter */
+#endif
+    return SKY_FAILURE;
 }
 
-/*! \brief Adds a NR cell neighbor beacon to the request context
+/*! \brief Look for a cached location of a scan which is unchanged since it was located
  *
- *  @param ctx Skyhook request context
+ *  A stationary device may check the fingerprint of each new scan with this function
+ *  before building a request, and only build one if no location is found. The cache
+ *  hit is counted just as one found by sky_finalize_request.
+ *
+ *  @param inst instance to look in, or NULL for the instance opened by sky_open
  *  @param sky_errno skyErrno is set to the error code
- *  @param physical cell ID (0-1007), SKY_UNKNOWN_ID5 if unknown
- *  @param nrarfcn channel (0-3279165), SKY_UNKNOWN_ID6 if unknown
- *  @param timestamp time in seconds (from 1970 epoch) indicating when the scan was performed, (time_t)-1 if unknown
- *  @param nrsrp Narrowband Reference Signal Received Power, range -156 to -44dbm, -1 if unknown
+ *  @param fingerprint of scan, from sky_scan_fingerprint
+ *  @param loc where to save the cached location
  *
- *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ *  @return SKY_SUCCESS if location found, SKY_FAILURE if not, or SKY_ERROR
  */
-Sky_status_t sky_add_cell_nr_neighbor_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, int16_t pci,
-    int32_t nrarfcn, time_t timestamp, int16_t csi_rsrp)
+Sky_status_t sky_scan_unchanged(
+    Sky_instance_t *inst, Sky_errno_t *sky_errno, uint64_t fingerprint, Sky_location_t *loc)
 {
-    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "%d, %d MHz, rsrp %d, age %d", pci, nrarfcn, csi_rsrp,
-        (int)timestamp == -1 ? -1 : (int)(ctx->header.time - timestamp));
-    return sky_add_cell_nr_beacon(ctx, sky_errno, SKY_UNKNOWN_ID1, SKY_UNKNOWN_ID2,
-        (int64_t)SKY_UNKNOWN_ID4, SKY_UNKNOWN_ID3, pci, nrarfcn, SKY_UNKNOWN_TA, timestamp,
-        csi_rsrp, false);
+    Sky_status_t ret;
+
+    inst = inst == NULL ? &sky_default_instance : inst;
+    RECORD_CALL(inst, TRACE_SCAN_UNCHANGED, &fingerprint, sizeof(fingerprint));
+    ret = scan_unchanged(inst, sky_errno, fingerprint, loc);
+    /* location is only defined if one was found */
+    RECORD_RESULT(inst, ret, *sky_errno, ret == SKY_SUCCESS ? loc->hpe : 0,
+        ret == SKY_SUCCESS ? &loc->lat : NULL, 2 * sizeof(float));
+    return ret;
 }
 
 /*! \brief Adds the position of the device from GNSS to the request context
@@ -939,6 +2038,7 @@ Sky_status_t sky_add_gnss(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, float lat, flo
     uint16_t hpe, float altitude, uint16_t vpe, float speed, float bearing, uint16_t nsat,
     time_t timestamp)
 {
+    RECORD_GNSS(trace_instance(ctx), lat, lon, hpe, altitude, vpe, speed, bearing, nsat, timestamp);
     LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "%d.%06d,%d.%06d, hpe %d, alt %d.%02d, vpe %d,", (int)lat,
         (int)fabs(round(1000000 * (lat - (int)lat))), (int)lon,
         (int)fabs(round(1000000 * (lon - (int)lon))), hpe, (int)altitude,
@@ -995,8 +2095,11 @@ Sky_status_t sky_sizeof_request_buf(Sky_ctx_t *ctx, uint32_t *size, Sky_errno_t
     int rc, rq_config = false;
 #if CACHE_SIZE
     Sky_cacheline_t *cl;
+    uint32_t seq, now;
+    bool cleared, stale;
 #endif
 
+    RECORD_CALL(trace_instance(ctx), TRACE_SIZEOF, NULL, 0);
     if (!validate_workspace(ctx))
         return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
 
@@ -1014,6 +2117,10 @@ Sky_status_t sky_sizeof_request_buf(Sky_ctx_t *ctx, uint32_t *size, Sky_errno_t
     if (rq_config)
         ctx->state->config.last_config_time = 0; /* request on next serialize */
 
+    /* Apply any beacon selection deferred while beacons were added */
+    if (select_beacons(ctx, sky_errno) == SKY_ERROR)
+        return SKY_ERROR;
+
     /* Trim any excess vap from workspace i.e. total number of vap
      * in workspace cannot exceed max that a request can carry
      */
@@ -1026,27 +2133,46 @@ Sky_status_t sky_sizeof_request_buf(Sky_ctx_t *ctx, uint32_t *size, Sky_errno_t
     get_from_cache(ctx);
     if (IS_CACHE_HIT(ctx)) {
         cl = &ctx->state->cacheline[ctx->get_from];
-
-        /* cache hit */
+        now = (uint32_t)(*ctx->gettime)(NULL);
+        do {
+            seq = CACHELINE_READ_BEGIN(cl);
+            cleared = cl->time == 0;
+            stale = now - cl->time > CACHE_STALE_AGE * SECONDS_IN_HOUR;
+        } while (CACHELINE_READ_RETRY(cl, seq));
+        if (cleared) {
+            /* cacheline was cleared by another request since it was matched */
+            ctx->get_from = -1;
+        } else if (ctx->allow_stale && stale) {
+            /* aging cacheline, report it as stale and refresh it */
+            LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Cache %d is aging, refresh", ctx->get_from);
+            ctx->stale_from = ctx->get_from;
+            ctx->get_from = -1;
+            reset_cache_hits(ctx->state);
+        }
+    }
+    if (IS_CACHE_HIT(ctx)) {
         /* count of consecutive cache hits since last cache miss */
-        if (ctx->state->cache_hits < 127) {
-            ctx->state->cache_hits++;
+        if (count_cache_hit(ctx->state)) {
             if (ctx->debounce) {
                 /* overwrite workspace with cached beacons */
                 LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "populate workspace with cached beacons");
-                NUM_BEACONS(ctx) = cl->len;
-                NUM_APS(ctx) = cl->ap_len;
-                for (int j = 0; j < NUM_BEACONS(ctx); j++)
-                    ctx->beacon[j] = cl->beacon[j];
+                do {
+                    seq = CACHELINE_READ_BEGIN(cl);
+                    NUM_BEACONS(ctx) = cl->len;
+                    NUM_APS(ctx) = cl->ap_len;
+                    for (int j = 0; j < NUM_BEACONS(ctx); j++)
+                        BEACON_AT(ctx, j) = cl->beacon[j];
+                } while (CACHELINE_READ_RETRY(cl, seq));
+                reindex_beacons(ctx);
             }
         } else {
             ctx->get_from = -1; /* force cache miss after 127 consecutive cache hits */
-            ctx->state->cache_hits = 0; /* report 0 for cache miss */
+            reset_cache_hits(ctx->state); /* report 0 for cache miss */
         }
     }
 #else
     ctx->get_from = -1; /* cache miss */
-    ctx->state->cache_hits = 0; /* report 0 for cache miss */
+    reset_cache_hits(ctx->state); /* report 0 for cache miss */
 #endif
 
     /* encode request into the bit bucket, just to determine the length of the
@@ -1056,13 +2182,59 @@ Sky_status_t sky_sizeof_request_buf(Sky_ctx_t *ctx, uint32_t *size, Sky_errno_t
     if (rc > 0) {
         *size = (uint32_t)rc;
         LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "sizeof request %d", rc);
+        RECORD_RESULT(ctx->instance, SKY_SUCCESS, SKY_ERROR_NONE, *size, NULL, 0);
         return set_error_status(sky_errno, SKY_ERROR_NONE);
     } else {
         LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Failed to size request");
+        RECORD_RESULT(ctx->instance, SKY_ERROR, SKY_ERROR_ENCODE_ERROR, 0, NULL, 0);
         return set_error_status(sky_errno, SKY_ERROR_ENCODE_ERROR);
     }
 }
 
+/*! \brief allow sky_finalize_request to report a stale cached location
+ *
+ *  When allowed, a cache miss which nearly matched a cacheline, or a cache hit on
+ *  an aging cacheline, reports the cached location with SKY_FINALIZE_STALE
+ *  along with a request to refresh it. Decoding the response updates the cache.
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param allow true to allow stale locations
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_allow_stale(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, bool allow)
+{
+    if (!validate_workspace(ctx))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
+    RECORD_CALL(ctx->instance, TRACE_ALLOW_STALE, &allow, sizeof(allow));
+    ctx->allow_stale = allow;
+    return set_error_status(sky_errno, SKY_ERROR_NONE);
+}
+
+/*! \brief defer the selection of beacons until the request is finalized
+ *
+ *  By default, each beacon added beyond the number a request may carry causes
+ *  one beacon to be removed straight away. When deferred, up to STAGED_BEACONS
+ *  are kept and the selection is made once, by sky_sizeof_request_buf. A scan
+ *  larger than that is selected from each time the staging area fills, which
+ *  frees room for the rest of the scan.
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param defer true to defer selection
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_defer_selection(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, bool defer)
+{
+    if (!validate_workspace(ctx))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
+    RECORD_CALL(ctx->instance, TRACE_DEFER_SELECTION, &defer, sizeof(defer));
+    ctx->defer_selection = defer;
+    return set_error_status(sky_errno, SKY_ERROR_NONE);
+}
+
 /*! \brief generate a Skyhook request from the request context
  *
  *  @param ctx Skyhook request context
@@ -1072,8 +2244,12 @@ Sky_status_t sky_sizeof_request_buf(Sky_ctx_t *ctx, uint32_t *size, Sky_errno_t
  *  @param loc where to save device latitude, longitude etc from cache if known
  *  @param response_size the space required to hold the server response
  *
- *  @return SKY_FINALIZE_REQUEST, SKY_FINALIZE_LOCATION or
+ *  @return SKY_FINALIZE_REQUEST, SKY_FINALIZE_LOCATION, SKY_FINALIZE_STALE or
  *          SKY_FINALIZE_ERROR and sets sky_errno with error code
+ *
+ *  SKY_FINALIZE_STALE is only returned if allowed by sky_allow_stale. The request
+ *  must be sent to the server as for SKY_FINALIZE_REQUEST, but loc holds a
+ *  cached location which may be used until the response is decoded.
  */
 Sky_finalize_t sky_finalize_request(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, void *request_buf,
     uint32_t bufsize, Sky_location_t *loc, uint32_t *response_size)
@@ -1082,18 +2258,23 @@ Sky_finalize_t sky_finalize_request(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, void
     Sky_finalize_t ret = SKY_FINALIZE_ERROR;
 #if CACHE_SIZE
     Sky_cacheline_t *cl;
+    uint32_t seq;
 #endif
 
+    RECORD_CALL(trace_instance(ctx), TRACE_FINALIZE, &bufsize, sizeof(bufsize));
     if (!validate_workspace(ctx)) {
         *sky_errno = SKY_ERROR_BAD_WORKSPACE;
         return ret;
     }
 
-    if (backoff_violation(ctx, (uint32_t)(*sky_time)(NULL))) {
+    if (backoff_violation(ctx, (uint32_t)(*ctx->gettime)(NULL))) {
         *sky_errno = SKY_ERROR_SERVICE_DENIED;
         return ret;
     }
 
+    if (select_beacons(ctx, sky_errno) == SKY_ERROR)
+        return ret;
+
     /* There must be at least one beacon */
     if (NUM_BEACONS(ctx) == 0 && !has_gps(ctx)) {
         *sky_errno = SKY_ERROR_NO_BEACONS;
@@ -1106,7 +2287,10 @@ Sky_finalize_t sky_finalize_request(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, void
     if (IS_CACHE_HIT(ctx)) {
         cl = &ctx->state->cacheline[ctx->get_from];
         if (loc != NULL) {
-            *loc = cl->loc;
+            do {
+                seq = CACHELINE_READ_BEGIN(cl);
+                *loc = cl->loc;
+            } while (CACHELINE_READ_RETRY(cl, seq));
             /* no downlink data to report to user */
             loc->dl_app_data = NULL;
             loc->dl_app_data_len = 0;
@@ -1119,6 +2303,15 @@ Sky_finalize_t sky_finalize_request(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, void
             (ctx->header.time - cached_time));
 #endif
         ret = SKY_FINALIZE_LOCATION;
+    } else if (ctx->allow_stale && ctx->stale_from >= 0 && loc != NULL) {
+        cl = &ctx->state->cacheline[ctx->stale_from];
+        do {
+            seq = CACHELINE_READ_BEGIN(cl);
+            *loc = cl->loc;
+            ret = cl->time != 0 ? SKY_FINALIZE_STALE : SKY_FINALIZE_REQUEST;
+        } while (CACHELINE_READ_RETRY(cl, seq));
+        loc->dl_app_data = NULL;
+        loc->dl_app_data_len = 0;
     } else
         ret = SKY_FINALIZE_REQUEST;
 #else
@@ -1156,103 +2349,532 @@ Sky_finalize_t sky_finalize_request(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, void
             (ctx->debounce && ret == SKY_FINALIZE_LOCATION) ? "from cache(debounce)" :
                                                               "from workspace");
         LOG_BUFFER(ctx, SKY_LOG_LEVEL_DEBUG, request_buf, rc);
+        RECORD_RESULT(ctx->instance, ret, SKY_ERROR_NONE, rc, request_buf, rc);
+        replay_request_len(ctx, rc);
         return ret;
     } else {
         *sky_errno = SKY_ERROR_ENCODE_ERROR;
 
-        LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Failed to encode request");
+        LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Failed to encode request");
+        RECORD_RESULT(ctx->instance, SKY_FINALIZE_ERROR, SKY_ERROR_ENCODE_ERROR, 0, NULL, 0);
+        return SKY_FINALIZE_ERROR;
+    }
+}
+
+/*! \brief decodes a Skyhook server response
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param response_buf buffer holding the skyhook server response
+ *  @param bufsize Request size in bytes
+ *  @param loc where to save device latitude, longitude etc from cache if known
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_decode_response(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, void *response_buf,
+    uint32_t bufsize, Sky_location_t *loc)
+{
+    Sky_status_t ret;
+
+    RECORD_CALL(trace_instance(ctx), TRACE_DECODE, response_buf, bufsize);
+    ret = decode_response(ctx, sky_errno, response_buf, bufsize, loc);
+    /* location is only defined if decode succeeded */
+    RECORD_RESULT(trace_instance(ctx), ret, *sky_errno, ret == SKY_SUCCESS ? loc->hpe : 0,
+        ret == SKY_SUCCESS ? &loc->lat : NULL, 2 * sizeof(float));
+    return ret;
+}
+
+/*! \brief decode a server response and update the state
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param response_buf buffer holding the skyhook server response
+ *  @param bufsize Request size in bytes
+ *  @param loc where to save device latitude, longitude etc from cache if known
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+static Sky_status_t decode_response(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, void *response_buf,
+    uint32_t bufsize, Sky_location_t *loc)
+{
+    Sky_state_t *s = ctx->state;
+
+    if (loc == NULL || response_buf == NULL || bufsize == 0) {
+        LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Bad parameters");
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+    }
+
+    /* decode response to get lat/lon */
+    if (deserialize_response(ctx, response_buf, bufsize, loc) < 0) {
+        LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Response decode failure");
+        return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
+    } else {
+        /* if this is a response from a cache miss, clear cache_hits count */
+        if (IS_CACHE_MISS(ctx))
+            reset_cache_hits(ctx->state);
+
+        /* set error status based on server error code */
+        switch (loc->location_status) {
+        case SKY_LOCATION_STATUS_SUCCESS:
+            /* Server reports success so clear backoff period tracking */
+            s->backoff = SKY_ERROR_NONE;
+            loc->time = (*ctx->gettime)(NULL);
+
+            /* Add location and current beacons to Cache */
+            if (sky_plugin_add_to_cache(ctx, sky_errno, loc) != SKY_SUCCESS)
+                LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "failed to add to cache");
+
+            LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG,
+                "Location from server %d.%06d,%d.%06d hpe: %d, %d dl_app_data_len", (int)loc->lat,
+                (int)fabs(round(1000000 * (loc->lat - (int)loc->lat))), (int)loc->lon,
+                (int)fabs(round(1000000 * (loc->lon - (int)loc->lon))), loc->hpe,
+                loc->dl_app_data_len);
+
+            return set_error_status(sky_errno, SKY_ERROR_NONE);
+            break;
+        case SKY_LOCATION_STATUS_AUTH_ERROR:
+            LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Authentication required, retry.");
+            /* note the time of this server response in the state */
+            s->header.time = (uint32_t)(*ctx->gettime)(NULL);
+            s->header.crc32 = sky_crc32(
+                &s->header.magic, (uint8_t *)&s->header.crc32 - (uint8_t *)&s->header.magic);
+
+            if (ctx->auth_state ==
+                STATE_TBR_DISABLED) { /* Non-TBR Location request failed auth, error */
+                return set_error_status(sky_errno, SKY_ERROR_AUTH);
+            } else if (ctx->auth_state ==
+                       STATE_TBR_REGISTERED) { /* Location request failed auth, retry */
+                ctx->state->backoff = SKY_ERROR_NONE;
+                return set_error_status(sky_errno, SKY_AUTH_RETRY);
+            } else if (ctx->state->backoff ==
+                       SKY_ERROR_NONE) /* Registration request failed auth, retry */
+                return set_error_status(sky_errno, (ctx->state->backoff = SKY_AUTH_RETRY));
+            else if (ctx->state->backoff ==
+                     SKY_AUTH_RETRY) /* Registration request failed again, retry after 8hr */
+                return set_error_status(sky_errno, (ctx->state->backoff = SKY_AUTH_RETRY_8H));
+            else if (ctx->state->backoff ==
+                     SKY_AUTH_RETRY_8H) /* Registration request failed again, retry after 16hr */
+                return set_error_status(sky_errno, (ctx->state->backoff = SKY_AUTH_RETRY_16H));
+            else if (ctx->state->backoff ==
+                     SKY_AUTH_RETRY_16H) /* Registration request failed again, retry after 24hr */
+                return set_error_status(sky_errno, (ctx->state->backoff = SKY_AUTH_RETRY_1D));
+            else
+                return set_error_status(sky_errno, (ctx->state->backoff = SKY_AUTH_RETRY_30D));
+            break;
+        case SKY_LOCATION_STATUS_BAD_PARTNER_ID_ERROR:
+        case SKY_LOCATION_STATUS_DECODE_ERROR:
+            return set_error_status(sky_errno, SKY_ERROR_AUTH);
+            break;
+        case SKY_LOCATION_STATUS_UNABLE_TO_LOCATE:
+            return set_error_status(sky_errno, SKY_ERROR_LOCATION_UNKNOWN);
+            break;
+        default:
+            return set_error_status(sky_errno, SKY_ERROR_SERVER_ERROR);
+        }
+    }
+}
+
+/*! \brief finalize the request in the workspace and report the next step
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param io buffer provided by user and results
+ *
+ *  @return SKY_STEP_NEED_SEND, SKY_STEP_STALE, SKY_STEP_DONE, SKY_STEP_WAIT_UNTIL or
+ *          SKY_STEP_ERROR
+ */
+static Sky_step_t step_request(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Sky_step_io_t *io)
+{
+    uint32_t size, response_size;
+    Sky_finalize_t ret;
+
+    if (backoff_violation(ctx, (*ctx->gettime)(NULL))) {
+        io->until = ctx->state->header.time + backoff_period(ctx->state->backoff);
+        ctx->step = STEP_WAITING;
+        set_error_status(sky_errno, ctx->state->backoff);
+        return SKY_STEP_WAIT_UNTIL;
+    }
+    ctx->step = STEP_IDLE;
+    if (sky_sizeof_request_buf(ctx, &size, sky_errno) != SKY_SUCCESS)
+        return SKY_STEP_ERROR;
+    if (size > io->bufsize) {
+        LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Buffer too small for request of %d bytes", size);
+        io->len = size;
+        set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+        return SKY_STEP_ERROR;
+    }
+
+    switch (ret = sky_finalize_request(
+                ctx, sky_errno, io->buf, io->bufsize, &io->loc, &response_size)) {
+    case SKY_FINALIZE_LOCATION:
+        ctx->step = STEP_DONE;
+        return SKY_STEP_DONE;
+    case SKY_FINALIZE_REQUEST:
+    case SKY_FINALIZE_STALE:
+        if (response_size > io->bufsize) {
+            LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Buffer too small for response of %d bytes",
+                response_size);
+            io->len = response_size;
+            set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+            return SKY_STEP_ERROR;
+        }
+        io->len = size;
+        ctx->step = STEP_SENDING;
+        /* stale location in loc may be used until the response is received */
+        return ret == SKY_FINALIZE_STALE ? SKY_STEP_STALE : SKY_STEP_NEED_SEND;
+    default:
+        return SKY_STEP_ERROR;
+    }
+}
+
+/*! \brief Advance a request without blocking, one event at a time
+ *
+ *  After beacons have been added, report SKY_EVENT_START. Each call returns the
+ *  action required of the user, who reports the matching event when it is
+ *  complete: SKY_EVENT_SENT after NEED_SEND, SKY_EVENT_RECEIVED (with io->len set
+ *  to the bytes received) after NEED_RECV and SKY_EVENT_TIMER after WAIT_UNTIL.
+ *  Requests which must be repeated for TBR registration are retried internally.
+ *  STALE is reported instead of NEED_SEND when sky_allow_stale has been called and
+ *  the cache holds a stale location, which is in io->loc until SKY_EVENT_RECEIVED.
+ *
+ *  The same buffer, io->buf, is used for the request and the response, so it must
+ *  remain valid until SKY_STEP_DONE or SKY_STEP_ERROR is returned.
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param event event which has occurred
+ *  @param io buffer provided by user and results
+ *
+ *  @return action required of user, or SKY_STEP_ERROR and sets sky_errno with error code
+ */
+Sky_step_t sky_step(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Sky_event_t event, Sky_step_io_t *io)
+{
+    if (!validate_workspace(ctx)) {
+        set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
+        return SKY_STEP_ERROR;
+    }
+    if (io == NULL || io->buf == NULL) {
+        set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+        return SKY_STEP_ERROR;
+    }
+
+    switch (event) {
+    case SKY_EVENT_START:
+        ctx->step_retries = 0;
+        return step_request(ctx, sky_errno, io);
+    case SKY_EVENT_TIMER:
+        if (ctx->step != STEP_WAITING)
+            break;
+        return step_request(ctx, sky_errno, io);
+    case SKY_EVENT_SENT:
+        if (ctx->step != STEP_SENDING)
+            break;
+        io->len = get_maximum_response_size();
+        ctx->step = STEP_RECEIVING;
+        return SKY_STEP_NEED_RECV;
+    case SKY_EVENT_RECEIVED:
+        if (ctx->step != STEP_RECEIVING)
+            break;
+        if (sky_decode_response(ctx, sky_errno, io->buf, io->len, &io->loc) == SKY_SUCCESS) {
+            ctx->step = STEP_DONE;
+            return SKY_STEP_DONE;
+        }
+        /* repeat request now for authentication, or after backoff period */
+        if ((*sky_errno == SKY_AUTH_RETRY && ++ctx->step_retries <= SKY_STEP_MAX_RETRIES) ||
+            (*sky_errno >= SKY_AUTH_RETRY_8H && *sky_errno <= SKY_AUTH_RETRY_30D))
+            return step_request(ctx, sky_errno, io);
+        ctx->step = STEP_IDLE;
+        return SKY_STEP_ERROR;
+    default:
+        break;
+    }
+    LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Unexpected event %d in step %d", event, ctx->step);
+    set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+    return SKY_STEP_ERROR;
+}
+
+/*! \brief Determines the size of the buffer required to coalesce requests
+ *
+ *  @param count maximum number of distinct requests in flight
+ *
+ *  @return Size of coalescer buffer or 0 if count is invalid
+ */
+int32_t sky_sizeof_coalescer(uint32_t count)
+{
+    if (count == 0 || count > 0x7FFF)
+        return 0;
+    return sizeof(Sky_coalescer_t) + count * sizeof(Sky_flight_t);
+}
+
+/*! \brief Initialize a set of requests in flight
+ *
+ *  Requests finalized with sky_finalize_coalesced whose beacons match a request
+ *  already sent to the server are parked rather than sent, and collect the
+ *  location when that response is decoded.
+ *
+ *  @param coalescer_buf Pointer to buffer provided by user
+ *  @param bufsize Buffer size (from sky_sizeof_coalescer)
+ *  @param sky_errno if sky_open_coalescer returns NULL, sky_errno is set to the error code
+ *
+ *  @return Pointer to the initialized coalescer or NULL
+ *
+ *  The coalescer is not thread safe; calls using it must be serialized.
+ */
+Sky_coalescer_t *sky_open_coalescer(void *coalescer_buf, uint32_t bufsize, Sky_errno_t *sky_errno)
+{
+    Sky_coalescer_t *co = coalescer_buf;
+
+    if (co == NULL || bufsize < (uint32_t)sky_sizeof_coalescer(1)) {
+        set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+        return NULL;
+    }
+    memset(co, 0, bufsize);
+    co->len = (bufsize - sizeof(Sky_coalescer_t)) / sizeof(Sky_flight_t);
+    co->len = co->len > 0x7FFF ? 0x7FFF : co->len;
+    co->magic = SKY_MAGIC;
+    set_error_status(sky_errno, SKY_ERROR_NONE);
+    return co;
+}
+
+/*! \brief free a flight once the leader and all parked requests are finished with it
+ *
+ *  @param f the flight
+ */
+static void flight_release(Sky_flight_t *f)
+{
+    if (f->state == FLIGHT_DONE && f->waiters == 0)
+        f->state = FLIGHT_FREE;
+}
+
+/*! \brief note the result of a request in flight for the requests parked on it
+ *
+ *  Only a location, or the server being unable to locate the beacons, is shared.
+ *  Any other error is particular to the device which sent the request (e.g. it must
+ *  register or back off), so parked requests are told to send their own.
+ *
+ *  @param f the flight
+ *  @param ret result of decoding the response
+ *  @param sky_errno error code from decoding the response
+ *  @param loc location decoded
+ */
+static void flight_land(
+    Sky_flight_t *f, Sky_status_t ret, Sky_errno_t sky_errno, Sky_location_t *loc)
+{
+    if (ret == SKY_SUCCESS) {
+        f->sky_errno = SKY_ERROR_NONE;
+        f->loc = *loc;
+        /* downlink data belongs to the device which made the request */
+        f->loc.dl_app_data = NULL;
+        f->loc.dl_app_data_len = 0;
+    } else if (sky_errno == SKY_ERROR_LOCATION_UNKNOWN)
+        f->sky_errno = sky_errno;
+    else
+        f->sky_errno = SKY_ERROR_SERVER_ERROR;
+    f->leader = NULL;
+    f->state = FLIGHT_DONE;
+    flight_release(f);
+}
+
+/*! \brief generate a request, or park it on an identical request in flight
+ *
+ *  As sky_finalize_request, except that if the beacons in the workspace are the
+ *  same as those of a request in flight, no request is generated and
+ *  SKY_FINALIZE_PENDING is returned. The location is then collected with
+ *  sky_coalesced_result once the response to the matching request has been
+ *  decoded with sky_decode_coalesced. Requests with GNSS, which are satisfied by
+ *  the cache, or of a device which must register first are never coalesced.
+ *
+ *  The workspace of a request which is sent must be kept until the response is
+ *  decoded with sky_decode_coalesced, or the request is cancelled.
+ *
+ *  @param co the coalescer
+ *  @param ctx Skyhook request context
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param request_buf Request to send to Skyhook server
+ *  @param bufsize Request size in bytes
+ *  @param loc where to save device latitude, longitude etc from cache if known
+ *  @param response_size the space required to hold the server response
+ *
+ *  @return SKY_FINALIZE_REQUEST, SKY_FINALIZE_LOCATION, SKY_FINALIZE_PENDING or
+ *          SKY_FINALIZE_ERROR and sets sky_errno with error code
+ */
+Sky_finalize_t sky_finalize_coalesced(Sky_coalescer_t *co, Sky_ctx_t *ctx, Sky_errno_t *sky_errno,
+    void *request_buf, uint32_t bufsize, Sky_location_t *loc, uint32_t *response_size)
+{
+    Sky_finalize_t ret;
+    Sky_flight_t *f;
+    uint64_t fp;
+    int i, free_flight = -1;
+
+    if (co == NULL || co->magic != SKY_MAGIC) {
+        *sky_errno = SKY_ERROR_BAD_PARAMETERS;
+        return SKY_FINALIZE_ERROR;
+    }
+    if (!validate_workspace(ctx)) {
+        *sky_errno = SKY_ERROR_BAD_WORKSPACE;
         return SKY_FINALIZE_ERROR;
     }
+    if (ctx->flight != 0 || IS_CACHE_HIT(ctx) || has_gps(ctx) || NUM_BEACONS(ctx) == 0 ||
+        ctx->auth_state == STATE_TBR_UNREGISTERED)
+        return sky_finalize_request(ctx, sky_errno, request_buf, bufsize, loc, response_size);
+
+    fp = scan_fingerprint(ctx);
+    for (i = 0; i < co->len; i++) {
+        f = &co->flight[i];
+        if (f->state == FLIGHT_PENDING && f->fingerprint == fp) {
+            if (!validate_workspace(f->leader) || f->leader->flight != i + 1) {
+                /* workspace of request sent has been reused, result will never arrive */
+                flight_land(f, SKY_ERROR, SKY_ERROR_SERVER_ERROR, NULL);
+            } else if (same_beacons(ctx, f->leader)) {
+                f->waiters++;
+                ctx->flight = -(i + 1);
+                ctx->coalescer = co;
+                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Request parked on flight %d", i);
+                *sky_errno = SKY_ERROR_NONE;
+                return SKY_FINALIZE_PENDING;
+            }
+        }
+        if (f->state == FLIGHT_FREE && free_flight < 0)
+            free_flight = i;
+    }
+
+    ret = sky_finalize_request(ctx, sky_errno, request_buf, bufsize, loc, response_size);
+    if ((ret == SKY_FINALIZE_REQUEST || ret == SKY_FINALIZE_STALE) && free_flight >= 0) {
+        f = &co->flight[free_flight];
+        f->fingerprint = fp;
+        f->leader = ctx;
+        f->state = FLIGHT_PENDING;
+        f->waiters = 0;
+        ctx->flight = free_flight + 1;
+        ctx->coalescer = co;
+    }
+    return ret;
 }
 
-/*! \brief decodes a Skyhook server response
+/*! \brief decode a server response and share the result with parked requests
  *
+ *  @param co the coalescer
  *  @param ctx Skyhook request context
  *  @param sky_errno skyErrno is set to the error code
  *  @param response_buf buffer holding the skyhook server response
  *  @param bufsize Request size in bytes
- *  @param loc where to save device latitude, longitude etc from cache if known
+ *  @param loc where to save device latitude, longitude etc
  *
  *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
  */
-Sky_status_t sky_decode_response(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, void *response_buf,
-    uint32_t bufsize, Sky_location_t *loc)
+Sky_status_t sky_decode_coalesced(Sky_coalescer_t *co, Sky_ctx_t *ctx, Sky_errno_t *sky_errno,
+    void *response_buf, uint32_t bufsize, Sky_location_t *loc)
 {
-    Sky_state_t *s = ctx->state;
+    Sky_status_t ret = sky_decode_response(ctx, sky_errno, response_buf, bufsize, loc);
 
-    if (loc == NULL || response_buf == NULL || bufsize == 0) {
-        LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Bad parameters");
-        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+    if (co != NULL && co->magic == SKY_MAGIC && ctx->coalescer == co && ctx->flight > 0 &&
+        ctx->flight <= co->len) {
+        flight_land(&co->flight[ctx->flight - 1], ret, *sky_errno, loc);
+        ctx->flight = 0;
+        ctx->coalescer = NULL;
     }
+    return ret;
+}
 
-    /* decode response to get lat/lon */
-    if (deserialize_response(ctx, response_buf, bufsize, loc) < 0) {
-        LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Response decode failure");
-        return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
-    } else {
-        /* if this is a response from a cache miss, clear cache_hits count */
-        if (IS_CACHE_MISS(ctx))
-            ctx->state->cache_hits = 0;
+/*! \brief collect the location for a parked request
+ *
+ *  On success the location is also added to the cache of the parked request.
+ *  If the request it was parked on failed for a reason particular to the device
+ *  which sent it, SKY_ERROR_SERVER_ERROR is reported and the parked request may
+ *  be sent itself, see sky_finalize_request.
+ *
+ *  @param co the coalescer
+ *  @param ctx Skyhook request context, parked by sky_finalize_coalesced
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param loc where to save device latitude, longitude etc
+ *
+ *  @return SKY_SUCCESS if location is available, SKY_FAILURE if the response is
+ *          still awaited or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_coalesced_result(
+    Sky_coalescer_t *co, Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Sky_location_t *loc)
+{
+    Sky_flight_t *f;
 
-        /* set error status based on server error code */
-        switch (loc->location_status) {
-        case SKY_LOCATION_STATUS_SUCCESS:
-            /* Server reports success so clear backoff period tracking */
-            s->backoff = SKY_ERROR_NONE;
-            loc->time = (*ctx->gettime)(NULL);
+    if (co == NULL || co->magic != SKY_MAGIC || loc == NULL || ctx == NULL ||
+        ctx->coalescer != co || ctx->flight >= 0 || -ctx->flight > co->len)
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+    if (!validate_workspace(ctx)) {
+        /* device of request has been evicted, so it no longer waits for the result */
+        flight_leave(ctx, SKY_ERROR_SERVER_ERROR);
+        return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
+    }
 
-            /* Add location and current beacons to Cache */
-            if (sky_plugin_add_to_cache(ctx, sky_errno, loc) != SKY_SUCCESS)
-                LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "failed to add to cache");
+    f = &co->flight[-ctx->flight - 1];
+    if (f->state != FLIGHT_DONE) {
+        set_error_status(sky_errno, SKY_ERROR_NONE);
+        return SKY_FAILURE;
+    }
+    *loc = f->loc;
+    set_error_status(sky_errno, f->sky_errno);
+    f->waiters--;
+    flight_release(f);
+    ctx->flight = 0;
+    ctx->coalescer = NULL;
+
+    if (*sky_errno != SKY_ERROR_NONE)
+        return SKY_ERROR;
+    RECORD_LOCATION(ctx->instance, TRACE_SHARED_LOCATION, loc);
+    if (sky_plugin_add_to_cache(ctx, sky_errno, loc) != SKY_SUCCESS)
+        LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "failed to add to cache");
+    return set_error_status(sky_errno, SKY_ERROR_NONE);
+}
 
-            LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG,
-                "Location from server %d.%06d,%d.%06d hpe: %d, %d dl_app_data_len", (int)loc->lat,
-                (int)fabs(round(1000000 * (loc->lat - (int)loc->lat))), (int)loc->lon,
-                (int)fabs(round(1000000 * (loc->lon - (int)loc->lon))), loc->hpe,
-                loc->dl_app_data_len);
+/*! \brief take a request out of its flight, if it has one
+ *
+ *  Only the coalescer and flight noted in the workspace are used, so this works
+ *  even if the workspace is no longer valid for a request.
+ *
+ *  @param ctx Skyhook request context
+ *  @param reason error reported to parked requests if request was sent
+ */
+static void flight_leave(Sky_ctx_t *ctx, Sky_errno_t reason)
+{
+    Sky_coalescer_t *co = ctx->coalescer;
+    Sky_flight_t *f;
 
-            return set_error_status(sky_errno, SKY_ERROR_NONE);
-            break;
-        case SKY_LOCATION_STATUS_AUTH_ERROR:
-            LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Authentication required, retry.");
-            /* note the time of this server response in the state */
-            s->header.time = (uint32_t)(*sky_time)(NULL);
-            s->header.crc32 = sky_crc32(
-                &s->header.magic, (uint8_t *)&s->header.crc32 - (uint8_t *)&s->header.magic);
+    ctx->coalescer = NULL;
+    if (co == NULL || co->magic != SKY_MAGIC || ctx->flight == 0 || abs(ctx->flight) > co->len) {
+        ctx->flight = 0;
+        return;
+    }
 
-            if (ctx->auth_state ==
-                STATE_TBR_DISABLED) { /* Non-TBR Location request failed auth, error */
-                return set_error_status(sky_errno, SKY_ERROR_AUTH);
-            } else if (ctx->auth_state ==
-                       STATE_TBR_REGISTERED) { /* Location request failed auth, retry */
-                ctx->state->backoff = SKY_ERROR_NONE;
-                return set_error_status(sky_errno, SKY_AUTH_RETRY);
-            } else if (ctx->state->backoff ==
-                       SKY_ERROR_NONE) /* Registration request failed auth, retry */
-                return set_error_status(sky_errno, (ctx->state->backoff = SKY_AUTH_RETRY));
-            else if (ctx->state->backoff ==
-                     SKY_AUTH_RETRY) /* Registration request failed again, retry after 8hr */
-                return set_error_status(sky_errno, (ctx->state->backoff = SKY_AUTH_RETRY_8H));
-            else if (ctx->state->backoff ==
-                     SKY_AUTH_RETRY_8H) /* Registration request failed again, retry after 16hr */
-                return set_error_status(sky_errno, (ctx->state->backoff = SKY_AUTH_RETRY_16H));
-            else if (ctx->state->backoff ==
-                     SKY_AUTH_RETRY_16H) /* Registration request failed again, retry after 24hr */
-                return set_error_status(sky_errno, (ctx->state->backoff = SKY_AUTH_RETRY_1D));
-            else
-                return set_error_status(sky_errno, (ctx->state->backoff = SKY_AUTH_RETRY_30D));
-            break;
-        case SKY_LOCATION_STATUS_BAD_PARTNER_ID_ERROR:
-        case SKY_LOCATION_STATUS_DECODE_ERROR:
-            return set_error_status(sky_errno, SKY_ERROR_AUTH);
-            break;
-        case SKY_LOCATION_STATUS_UNABLE_TO_LOCATE:
-            return set_error_status(sky_errno, SKY_ERROR_LOCATION_UNKNOWN);
-            break;
-        default:
-            return set_error_status(sky_errno, SKY_ERROR_SERVER_ERROR);
+    f = &co->flight[abs(ctx->flight) - 1];
+    if (ctx->flight > 0) {
+        if (f->state == FLIGHT_PENDING && f->leader == ctx) {
+            f->sky_errno = reason == SKY_ERROR_NONE ? SKY_ERROR_SERVER_ERROR : reason;
+            f->leader = NULL;
+            f->state = FLIGHT_DONE;
         }
-    }
+    } else if (f->waiters)
+        f->waiters--;
+    flight_release(f);
+    ctx->flight = 0;
+}
+
+/*! \brief abandon a coalesced request
+ *
+ *  A request which was sent but will not be decoded (e.g. no response was
+ *  received) must be cancelled so that requests parked on it fail with reason.
+ *  A parked request which no longer needs its result may also be cancelled.
+ *  This may be done after the device of the request has been evicted from a
+ *  store. A workspace which is reused for a new request, or released to a pool,
+ *  is cancelled then.
+ *
+ *  @param co the coalescer
+ *  @param ctx Skyhook request context
+ *  @param reason error reported to parked requests
+ */
+void sky_coalesce_cancel(Sky_coalescer_t *co, Sky_ctx_t *ctx, Sky_errno_t reason)
+{
+    if (co == NULL || co->magic != SKY_MAGIC || ctx == NULL || ctx->coalescer != co)
+        return;
+    flight_leave(ctx, reason);
 }
 
 /*! \brief returns a string which describes the meaning of sky_errno codes
@@ -1418,38 +3040,422 @@ char *sky_pbeacon(Beacon_t *b)
     }
 }
 
-/*! \brief clean up library resourses
+/*! \brief clean up resources of a library instance
  *
+ *  @param inst the instance to be closed
  *  @param sky_errno skyErrno is set to the error code
  *  @param sky_state pointer to where the state buffer reference should be
  * stored
  *
  *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ *
+ *  The state buffer reference returned is within the instance buffer, so it
+ *  remains valid until the instance buffer is reused or freed.
  */
-Sky_status_t sky_close(Sky_errno_t *sky_errno, void **sky_state)
+Sky_status_t sky_close_instance(Sky_instance_t *inst, Sky_errno_t *sky_errno, void **sky_state)
 {
 #if SKY_DEBUG
     char buf[SKY_LOG_LENGTH];
 #endif
-    if (!sky_open_flag)
+    if (inst == NULL || !inst->open_flag)
         return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
 
-    sky_open_flag = false;
+    RECORD_CLOSE(inst);
+    inst->open_flag = false;
 
     if (sky_state != NULL) {
-        *sky_state = &state;
+        *sky_state = &inst->state;
 #if SKY_DEBUG
-        if (sky_logf != NULL && SKY_LOG_LEVEL_DEBUG <= sky_min_level) {
+        if (inst->logf != NULL && SKY_LOG_LEVEL_DEBUG <= inst->min_level) {
             snprintf(buf, sizeof(buf), "%s:%s() State buffer with CRC 0x%08X and size %d",
-                sky_basename(__FILE__), __FUNCTION__, sky_crc32(&state, state.header.size),
-                state.header.size);
-            (*sky_logf)(SKY_LOG_LEVEL_DEBUG, buf);
+                sky_basename(__FILE__), __FUNCTION__,
+                sky_crc32(&inst->state, inst->state.header.size), inst->state.header.size);
+            (*inst->logf)(SKY_LOG_LEVEL_DEBUG, buf);
         }
 #endif
     }
     return set_error_status(sky_errno, SKY_ERROR_NONE);
 }
 
+/*! \brief clean up library resourses
+ *
+ *  @param sky_errno skyErrno is set to the error code
+ *  @param sky_state pointer to where the state buffer reference should be
+ * stored
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_close(Sky_errno_t *sky_errno, void **sky_state)
+{
+    return sky_close_instance(&sky_default_instance, sky_errno, sky_state);
+}
+
+/*! \brief hash a device ID
+ *
+ *  @param device_id device ID
+ *  @param id_len length of device ID
+ *
+ *  @return 32 bit FNV-1a hash
+ */
+static uint32_t store_key(uint8_t *device_id, uint32_t id_len)
+{
+    uint32_t h = 2166136261u;
+
+    for (uint32_t i = 0; i < id_len; i++)
+        h = (h ^ device_id[i]) * 16777619u;
+    return h;
+}
+
+/*! \brief find the hash slot for a device ID
+ *
+ *  @param store the store to search
+ *  @param key hash of device ID
+ *  @param device_id device ID
+ *  @param id_len length of device ID
+ *
+ *  @return index of hash slot holding the device, or of empty slot where it belongs
+ */
+static uint32_t store_find(Sky_store_t *store, uint32_t key, uint8_t *device_id, uint32_t id_len)
+{
+    uint32_t i = key & store->hash_mask;
+    Sky_store_entry_t *e;
+
+    while (store->hash[i]) {
+        e = &store->entry[store->hash[i] - 1];
+        if (e->key == key && e->inst.state.sky_id_len == id_len &&
+            memcmp(e->inst.state.sky_device_id, device_id, id_len) == 0)
+            break;
+        i = (i + 1) & store->hash_mask;
+    }
+    return i;
+}
+
+/*! \brief remove a hash slot, closing the gap left in the probe sequence
+ *
+ *  @param store the store
+ *  @param i index of hash slot to remove
+ */
+static void store_unhash(Sky_store_t *store, uint32_t i)
+{
+    uint32_t j = i, home;
+
+    store->hash[i] = 0;
+    for (;;) {
+        j = (j + 1) & store->hash_mask;
+        if (store->hash[j] == 0)
+            return;
+        home = store->entry[store->hash[j] - 1].key & store->hash_mask;
+        /* move entry back unless its home lies cyclically in (i, j] */
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            store->hash[i] = store->hash[j];
+            store->hash[j] = 0;
+            i = j;
+        }
+    }
+}
+
+/*! \brief save the state of a resident device and close its instance
+ *
+ *  @param store the store
+ *  @param e the entry to be evicted
+ */
+static void store_evict(Sky_store_t *store, Sky_store_entry_t *e)
+{
+    Sky_errno_t sky_errno;
+    void *sky_state = NULL;
+
+    if (sky_close_instance(&e->inst, &sky_errno, &sky_state) == SKY_SUCCESS &&
+        store->save != NULL)
+        (*store->save)(e->inst.state.sky_device_id, e->inst.state.sky_id_len, sky_state,
+            sky_sizeof_state(sky_state));
+    store_unhash(store,
+        store_find(store, e->key, e->inst.state.sky_device_id, e->inst.state.sky_id_len));
+}
+
+/*! \brief Determines the size of the buffer required for a store of instances
+ *
+ *  @param count maximum number of resident devices (1 - 16383)
+ *
+ *  @return Size of store buffer or 0 if count is invalid
+ */
+int32_t sky_sizeof_store(uint32_t count)
+{
+    uint32_t slots = 2;
+
+    if (count == 0 || count > 0x3FFF)
+        return 0;
+    while (slots < 2 * count)
+        slots <<= 1;
+    return sizeof(Sky_store_t) + count * sizeof(Sky_store_entry_t) + slots * sizeof(int16_t);
+}
+
+/*! \brief Initialize a store which holds an instance for each of many devices
+ *
+ *  The most recently used devices stay resident in the store. When the store is
+ *  full, the state of the least recently used device is handed to the save
+ *  callback, and is requested from the load callback when that device is next used.
+ *
+ *  @param store_buf Pointer to store buffer provided by user
+ *  @param bufsize Store buffer size (from sky_sizeof_store)
+ *  @param sky_errno if sky_open_store returns NULL, sky_errno is set to the error code
+ *  @param partner_id Skyhook assigned credentials
+ *  @param aes_key Skyhook assigned encryption key
+ *  @param sku unique name of device family, must be non-empty to enable TBR Auth
+ *  @param cc County code where devices are being registered, 0 if unknown
+ *  @param min_level logging function is called for msg with equal or greater level
+ *  @param logf pointer to logging function
+ *  @param rand_bytes pointer to random function
+ *  @param gettime pointer to time function
+ *  @param debounce true if cached beacons should be added to request rather than newly scanned
+ *  @param save pointer to function which saves state of an evicted device, or NULL
+ *  @param load pointer to function which restores state of a device, or NULL
+ *
+ *  @return Pointer to the initialized store or NULL
+ *
+ *  The store is not thread safe; calls to sky_store_get_instance must be serialized.
+ */
+Sky_store_t *sky_open_store(void *store_buf, uint32_t bufsize, Sky_errno_t *sky_errno,
+    uint32_t partner_id, uint8_t aes_key[AES_KEYLEN], char *sku, uint32_t cc,
+    Sky_log_level_t min_level, Sky_loggerfn_t logf, Sky_randfn_t rand_bytes, Sky_timefn_t gettime,
+    bool debounce, Sky_savefn_t save, Sky_loadfn_t load)
+{
+    Sky_store_t *store = store_buf;
+    uint32_t count, slots = 2;
+
+    if (store == NULL || bufsize < (uint32_t)sky_sizeof_store(1) || !validate_partner_id(partner_id) ||
+        !validate_aes_key(aes_key)) {
+        set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+        return NULL;
+    }
+    /* find the largest count which fits in the buffer */
+    for (count = 1; count < 0x3FFF && (uint32_t)sky_sizeof_store(count + 1) <= bufsize; count++)
+        ;
+    while (slots < 2 * count)
+        slots <<= 1;
+
+    memset(store, 0, bufsize);
+    store->len = count;
+    store->hash_mask = slots - 1;
+    store->hash = (int16_t *)&store->entry[count];
+    store->partner_id = partner_id;
+    memcpy(store->aes_key, aes_key, sizeof(store->aes_key));
+    if (sku != NULL)
+        strncpy(store->sku, sku, MAX_SKU_LEN);
+    store->cc = cc;
+    store->min_level = min_level;
+    store->logf = logf;
+    store->rand_bytes = rand_bytes;
+    store->gettime = gettime;
+    store->debounce = debounce;
+    store->save = save;
+    store->load = load;
+    store->magic = SKY_MAGIC;
+
+    set_error_status(sky_errno, SKY_ERROR_NONE);
+    return store;
+}
+
+/*! \brief Find the instance for a device, making it resident if necessary
+ *
+ *  @param store the store
+ *  @param sky_errno if sky_store_get_instance returns NULL, sky_errno is set to the error code
+ *  @param device_id Device unique ID (example mac address of the device)
+ *  @param id_len length if the Device ID, typically 6, Max 16 bytes
+ *
+ *  @return Pointer to the open instance for the device or NULL
+ *
+ *  The instance returned may be evicted by any later call for a device which is
+ *  not resident. Calls for a request started before its device was evicted then
+ *  fail with SKY_ERROR_BAD_WORKSPACE, rather than act on the state of another device.
+ */
+Sky_instance_t *sky_store_get_instance(
+    Sky_store_t *store, Sky_errno_t *sky_errno, uint8_t *device_id, uint32_t id_len)
+{
+    Sky_store_entry_t *e = NULL;
+    uint32_t key, i, slot, generation;
+    void *state_buf = NULL;
+
+    if (store == NULL || store->magic != SKY_MAGIC) {
+        set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
+        return NULL;
+    }
+    if (!validate_device_id(device_id, id_len)) {
+        set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+        return NULL;
+    }
+    id_len = (id_len > MAX_DEVICE_ID) ? MAX_DEVICE_ID : id_len;
+    key = store_key(device_id, id_len);
+    store->clock++;
+
+    /* resident device */
+    if (store->hash[(i = store_find(store, key, device_id, id_len))]) {
+        e = &store->entry[store->hash[i] - 1];
+        e->last_used = store->clock;
+        set_error_status(sky_errno, SKY_ERROR_NONE);
+        return &e->inst;
+    }
+
+    /* use a free entry, otherwise evict the least recently used device */
+    for (slot = 0; slot < store->len; slot++) {
+        if (!store->entry[slot].inst.open_flag) {
+            e = &store->entry[slot];
+            break;
+        } else if (e == NULL || store->entry[slot].last_used < e->last_used)
+            e = &store->entry[slot];
+    }
+    if (e->inst.open_flag) {
+        store_evict(store, e);
+        i = store_find(store, key, device_id, id_len);
+    }
+
+    if (store->load != NULL &&
+        (*store->load)(device_id, id_len, &store->scratch, sizeof(store->scratch)) == SKY_SUCCESS)
+        state_buf = &store->scratch;
+    /* requests of the device which had this entry must not use it again */
+    generation = e->inst.generation + 1;
+    memset(&e->inst, 0, sizeof(e->inst));
+    e->inst.generation = generation;
+    if (open_instance(&e->inst, sky_errno, device_id, id_len, store->partner_id, store->aes_key,
+            store->sku, store->cc, state_buf, store->min_level, store->logf, store->rand_bytes,
+            store->gettime, store->debounce) != SKY_SUCCESS) {
+        e->inst.open_flag = false;
+        return NULL;
+    }
+    e->key = key;
+    e->last_used = store->clock;
+    store->hash[i] = (int16_t)(e - store->entry) + 1;
+    return &e->inst;
+}
+
+/*! \brief Save the state of all resident devices and close the store
+ *
+ *  @param store the store
+ *  @param sky_errno sky_errno is set to the error code
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_close_store(Sky_store_t *store, Sky_errno_t *sky_errno)
+{
+    if (store == NULL || store->magic != SKY_MAGIC)
+        return set_error_status(sky_errno, SKY_ERROR_NEVER_OPEN);
+
+    for (uint32_t i = 0; i < store->len; i++)
+        if (store->entry[i].inst.open_flag)
+            store_evict(store, &store->entry[i]);
+    store->magic = 0;
+    return set_error_status(sky_errno, SKY_ERROR_NONE);
+}
+
+/*! \brief Prepare a batch of scans to be processed by sky_locate_batch
+ *
+ *  Items may be processed at the same time, so each must have an instance of its
+ *  own, as an instance holds the state of one device. The instances are marked
+ *  while this is checked, so must not be passed to another sky_batch_init at
+ *  the same time.
+ *
+ *  @param batch the batch
+ *  @param sky_errno sky_errno is set to the error code
+ *  @param items array of scans, with inputs filled in by user
+ *  @param count number of scans
+ *  @param add_beacons pointer to function which adds the beacons of a scan to a request
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_batch_init(Sky_batch_t *batch, Sky_errno_t *sky_errno, Sky_batch_item_t *items,
+    uint32_t count, Sky_addfn_t add_beacons)
+{
+    uint32_t i;
+    bool distinct = true;
+
+    if (batch == NULL || (items == NULL && count != 0) || add_beacons == NULL)
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+    for (i = 0; i < count; i++) {
+        if (items[i].inst == NULL)
+            return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+        items[i].inst->batched = false;
+    }
+    /* an instance seen twice is already marked */
+    for (i = 0; i < count && distinct; i++) {
+        distinct = !items[i].inst->batched;
+        items[i].inst->batched = true;
+    }
+    for (i = 0; i < count; i++)
+        items[i].inst->batched = false;
+    if (!distinct)
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+
+    batch->item = items;
+    batch->count = count;
+    batch->add_beacons = add_beacons;
+    batch->next = 0;
+    return set_error_status(sky_errno, SKY_ERROR_NONE);
+}
+
+/*! \brief claim the next unprocessed item of a batch
+ *
+ *  @param batch the batch
+ *
+ *  @return index of item claimed, or batch count if none remain
+ */
+static uint32_t batch_claim(Sky_batch_t *batch)
+{
+#if SKY_THREAD_SAFE
+    uint32_t i;
+
+    do {
+        i = batch->next;
+    } while (i < batch->count && !SKY_CAS(&batch->next, i, i + 1));
+    return i < batch->count ? i : batch->count;
+#else
+    return batch->next < batch->count ? batch->next++ : batch->count;
+#endif
+}
+
+/*! \brief Build and finalize the request for each scan in a batch
+ *
+ *  For each item a new request is created in its workspace, the beacons are
+ *  added by the add_beacons callback and the request is finalized. Results are
+ *  saved in the item; responses are decoded by the user with sky_decode_response
+ *  using the ctx of the item.
+ *
+ *  When built with SKY_THREAD_SAFE, any number of threads may call
+ *  sky_locate_batch with the same batch, each claiming items until none remain.
+ *
+ *  @param batch the batch, prepared by sky_batch_init
+ *
+ *  @return number of items processed by this call, or -1 if batch is bad
+ */
+int32_t sky_locate_batch(Sky_batch_t *batch)
+{
+    Sky_batch_item_t *it;
+    int32_t done = 0;
+    uint32_t i;
+
+    if (batch == NULL || batch->add_beacons == NULL)
+        return -1;
+
+    while ((i = batch_claim(batch)) < batch->count) {
+        it = &batch->item[i];
+        it->result = SKY_FINALIZE_ERROR;
+        it->request_size = it->response_size = 0;
+        done++;
+
+        if ((it->ctx = sky_new_instance_request(it->inst, it->workspace_buf,
+                 sky_sizeof_workspace(), NULL, 0, &it->sky_errno)) == NULL)
+            continue;
+        if ((*batch->add_beacons)(it->ctx, &it->sky_errno, it->scan) != SKY_SUCCESS ||
+            sky_sizeof_request_buf(it->ctx, &it->request_size, &it->sky_errno) != SKY_SUCCESS)
+            continue;
+        if (it->request_size > it->request_bufsize) {
+            it->sky_errno = SKY_ERROR_BAD_PARAMETERS;
+            continue;
+        }
+        it->result = sky_finalize_request(it->ctx, &it->sky_errno, it->request_buf,
+            it->request_bufsize, &it->loc, &it->response_size);
+    }
+    return done;
+}
+
 /*******************************************************************************
  * Static helper functions
  ******************************************************************************/
@@ -1513,3 +3519,9 @@ static bool validate_aes_key(uint8_t aes_key[AES_SIZE])
     else
         return true; /* TODO check for non-trivial values? e.g. zero */
 }
+
+#ifdef UNITTESTS
+
+#include "libel.ut.c"
+
+#endif
@@ -67,6 +67,8 @@ typedef enum {
     SKY_FINALIZE_ERROR = -1,
     SKY_FINALIZE_LOCATION = 0,
     SKY_FINALIZE_REQUEST = 1,
+    SKY_FINALIZE_PENDING = 2,
+    SKY_FINALIZE_STALE = 3,
 } Sky_finalize_t;
 
 /*! \brief sky_loc_source location source
@@ -153,6 +155,45 @@ typedef int (*Sky_randfn_t)(uint8_t *rand_buf, uint32_t bufsize);
  */
 typedef time_t (*Sky_timefn_t)(time_t *t);
 
+/*! \brief pointer to callback function which appends data to a trace, see sky_trace_start
+ */
+typedef void (*Sky_tracefn_t)(const void *data, uint32_t len);
+
+/*! \brief opaque library instance, see sky_open_instance
+ */
+typedef struct sky_instance Sky_instance_t;
+
+/*! \brief opaque store of instances for many devices, see sky_open_store
+ */
+typedef struct sky_store Sky_store_t;
+
+/*! \brief opaque request scheduler, see sky_open_scheduler
+ */
+typedef struct sky_scheduler Sky_scheduler_t;
+
+/*! \brief sky_schedule_request return value
+ */
+typedef enum {
+    SKY_ADMIT_ERROR = -1,
+    SKY_ADMIT_CACHE = 0, /* request is satisfied by cache, finalize now */
+    SKY_ADMIT_SEND, /* request may be sent to server, call sky_schedule_done when finished */
+    SKY_ADMIT_DEFER, /* request must wait */
+} Sky_admit_t;
+
+/*! \brief opaque set of requests in flight, see sky_open_coalescer
+ */
+typedef struct sky_coalescer Sky_coalescer_t;
+
+/*! \brief pointer to callback function which saves the state of a device evicted from a store
+ */
+typedef Sky_status_t (*Sky_savefn_t)(
+    uint8_t *device_id, uint32_t id_len, void *sky_state, uint32_t size);
+
+/*! \brief pointer to callback function which restores the state of a device into state_buf
+ */
+typedef Sky_status_t (*Sky_loadfn_t)(
+    uint8_t *device_id, uint32_t id_len, void *state_buf, uint32_t bufsize);
+
 #ifndef SKY_LIBEL
 #include "aes.h"
 #include "crc32.h"
@@ -164,23 +205,151 @@ typedef void Sky_ctx_t;
 #include "beacons.h"
 #include "plugin.h"
 #include "utilities.h"
+#include "trace.h"
 #endif
 
+/*! \brief One Wi-Fi AP in a scan, see sky_add_ap_beacons
+ */
+typedef struct sky_ap_scan {
+    uint8_t mac[MAC_SIZE];
+    time_t timestamp; /* when the scan was performed, (time_t)-1 if unknown */
+    int16_t rssi; /* -10 through -127, -1 if unknown */
+    int32_t frequency; /* MHz, 2400 through 6000, -1 if unknown */
+    bool is_connected;
+} Sky_ap_scan_t;
+
+/*! \brief Cell types which may be added with sky_add_cell_beacons
+ */
+typedef enum {
+    SKY_CELL_NR = 0,
+    SKY_CELL_LTE,
+    SKY_CELL_UMTS,
+    SKY_CELL_NBIOT,
+    SKY_CELL_CDMA,
+    SKY_CELL_GSM,
+} Sky_cell_type_t;
+
+/*! \brief One cell in a scan, see sky_add_cell_beacons
+ *
+ *  Fields take the same values as the matching sky_add_cell_<type>_beacon parameters
+ */
+typedef struct sky_cell_scan {
+    Sky_cell_type_t type;
+    uint16_t mcc; /* SKY_UNKNOWN_ID1 for neighbor cells, unused by cdma */
+    uint16_t mnc; /* sid (cdma), SKY_UNKNOWN_ID2 for neighbor cells */
+    int32_t area; /* lac (gsm, umts), tac (lte, nb-iot, nr), nid (cdma) */
+    int64_t id; /* ci (gsm), ucid (umts), e_cellid (lte, nb-iot), nci (nr), bsid (cdma) */
+    int16_t pci; /* psc (umts), ncid (nb-iot), pci (lte, nr) */
+    int32_t channel; /* uarfcn (umts), earfcn (lte, nb-iot), nrarfcn (nr) */
+    int32_t ta; /* timing advance (gsm, lte, nr) */
+    time_t timestamp;
+    int16_t rssi; /* rssi, rscp, rsrp, nrsrp or csi_rsrp according to type */
+    bool is_connected;
+} Sky_cell_scan_t;
+
+/*! \brief pointer to callback function which adds the beacons of one scan to a request
+ */
+typedef Sky_status_t (*Sky_addfn_t)(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, void *scan);
+
+/*! \brief One scan in a batch of requests, see sky_locate_batch
+ */
+typedef struct sky_batch_item {
+    /* provided by user */
+    Sky_instance_t *inst; /* instance of device which made the scan, one for each item */
+    void *scan; /* passed to add_beacons callback */
+    void *workspace_buf; /* sky_sizeof_workspace() bytes */
+    void *request_buf;
+    uint32_t request_bufsize;
+    /* results */
+    Sky_ctx_t *ctx; /* request context, used to decode the response */
+    Sky_finalize_t result;
+    Sky_errno_t sky_errno;
+    uint32_t request_size; /* bytes encoded in request_buf */
+    uint32_t response_size; /* space required to hold the server response */
+    Sky_location_t loc; /* location from cache if result is SKY_FINALIZE_LOCATION */
+} Sky_batch_item_t;
+
+/*! \brief sky_step events reported by user
+ */
+typedef enum {
+    SKY_EVENT_START = 0, /* beacons have been added, begin request */
+    SKY_EVENT_SENT, /* request has been sent */
+    SKY_EVENT_RECEIVED, /* response has been received */
+    SKY_EVENT_TIMER, /* time requested by SKY_STEP_WAIT_UNTIL has been reached */
+} Sky_event_t;
+
+/*! \brief sky_step return value, the action required of the user
+ */
+typedef enum {
+    SKY_STEP_ERROR = -1, /* request failed, see sky_errno */
+    SKY_STEP_NEED_SEND = 0, /* send len bytes of buf to server */
+    SKY_STEP_NEED_RECV, /* receive up to len bytes of response into buf */
+    SKY_STEP_DONE, /* location is in loc */
+    SKY_STEP_WAIT_UNTIL, /* report SKY_EVENT_TIMER once time reaches until */
+    SKY_STEP_STALE, /* stale location is in loc, send len bytes of buf to refresh it */
+} Sky_step_t;
+
+/*! \brief Buffers and results exchanged with sky_step
+ */
+typedef struct sky_step_io {
+    void *buf; /* buffer for request and response, provided by user */
+    uint32_t bufsize; /* size of buf */
+    uint32_t len; /* bytes to send, bytes expected or bytes received */
+    time_t until; /* time to report SKY_EVENT_TIMER */
+    Sky_location_t loc;
+} Sky_step_io_t;
+
+/*! \brief Batch of requests shared by the threads which process it
+ */
+typedef struct sky_batch {
+    Sky_batch_item_t *item;
+    uint32_t count;
+    Sky_addfn_t add_beacons;
+    volatile uint32_t next; /* index of next item to be claimed */
+} Sky_batch_t;
+
 Sky_status_t sky_open(Sky_errno_t *sky_errno, uint8_t *device_id, uint32_t id_len,
     uint32_t partner_id, uint8_t aes_key[AES_KEYLEN], char *sku, uint32_t cc, void *state_buf,
     Sky_log_level_t min_level, Sky_loggerfn_t logf, Sky_randfn_t rand_bytes, Sky_timefn_t gettime,
     bool debounce);
 
+int32_t sky_sizeof_instance(void);
+
+Sky_instance_t *sky_open_instance(void *instance_buf, uint32_t bufsize, Sky_errno_t *sky_errno,
+    uint8_t *device_id, uint32_t id_len, uint32_t partner_id, uint8_t aes_key[AES_KEYLEN],
+    char *sku, uint32_t cc, void *state_buf, Sky_log_level_t min_level, Sky_loggerfn_t logf,
+    Sky_randfn_t rand_bytes, Sky_timefn_t gettime, bool debounce);
+
 int32_t sky_sizeof_state(void *sky_state);
 
 int32_t sky_sizeof_workspace(void);
 
+int32_t sky_sizeof_workspace_pool(uint32_t count);
+
+Sky_status_t sky_workspace_pool_init(
+    Sky_instance_t *inst, Sky_errno_t *sky_errno, void *pool_buf, uint32_t bufsize);
+
+void *sky_workspace_acquire(Sky_instance_t *inst);
+
+Sky_status_t sky_workspace_release(Sky_instance_t *inst, void *workspace_buf);
+
 Sky_ctx_t *sky_new_request(void *workspace_buf, uint32_t bufsize, uint8_t *ul_app_data,
     uint32_t ul_app_data_len, Sky_errno_t *sky_errno);
 
+Sky_ctx_t *sky_new_instance_request(Sky_instance_t *inst, void *workspace_buf, uint32_t bufsize,
+    uint8_t *ul_app_data, uint32_t ul_app_data_len, Sky_errno_t *sky_errno);
+
+Sky_ctx_t *sky_new_request_from(void *workspace_buf, uint32_t bufsize, Sky_ctx_t *prev,
+    uint8_t *ul_app_data, uint32_t ul_app_data_len, Sky_errno_t *sky_errno);
+
 Sky_status_t sky_add_ap_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, uint8_t mac[MAC_SIZE],
     time_t timestamp, int16_t rssi, int32_t freq, bool is_connected);
 
+Sky_status_t sky_update_ap_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, uint8_t mac[MAC_SIZE],
+    time_t timestamp, int16_t rssi, int32_t freq, bool is_connected);
+
+Sky_status_t sky_remove_ap_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, uint8_t mac[MAC_SIZE]);
+
 Sky_status_t sky_add_cell_lte_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, int32_t tac,
     int64_t e_cellid, uint16_t mcc, uint16_t mnc, int16_t pci, int32_t earfcn, int32_t ta,
     time_t timestamp, int16_t rsrp, bool is_connected);
@@ -216,10 +385,26 @@ Sky_status_t sky_add_cell_nr_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, uint
 Sky_status_t sky_add_cell_nr_neighbor_beacon(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, int16_t pci,
     int32_t nrarfcn, time_t timestamp, int16_t csi_rsrp);
 
+Sky_status_t sky_add_ap_beacons(
+    Sky_ctx_t *ctx, Sky_errno_t *sky_errno, const Sky_ap_scan_t *scan, uint32_t count);
+
+Sky_status_t sky_add_cell_beacons(
+    Sky_ctx_t *ctx, Sky_errno_t *sky_errno, const Sky_cell_scan_t *scan, uint32_t count);
+
+uint64_t sky_scan_fingerprint(const Sky_ap_scan_t *aps, uint32_t ap_count,
+    const Sky_cell_scan_t *cells, uint32_t cell_count);
+
+Sky_status_t sky_scan_unchanged(
+    Sky_instance_t *inst, Sky_errno_t *sky_errno, uint64_t fingerprint, Sky_location_t *loc);
+
 Sky_status_t sky_add_gnss(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, float lat, float lon,
     uint16_t hpe, float altitude, uint16_t vpe, float speed, float bearing, uint16_t nsat,
     time_t timestamp);
 
+Sky_status_t sky_allow_stale(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, bool allow);
+
+Sky_status_t sky_defer_selection(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, bool defer);
+
 Sky_finalize_t sky_finalize_request(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, void *request_buf,
     uint32_t bufsize, Sky_location_t *loc, uint32_t *response_size);
 
@@ -228,6 +413,33 @@ Sky_status_t sky_sizeof_request_buf(Sky_ctx_t *ctx, uint32_t *size, Sky_errno_t
 Sky_status_t sky_decode_response(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, void *response_buf,
     uint32_t bufsize, Sky_location_t *loc);
 
+Sky_step_t sky_step(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Sky_event_t event, Sky_step_io_t *io);
+
+int32_t sky_sizeof_scheduler(void);
+
+Sky_scheduler_t *sky_open_scheduler(void *scheduler_buf, uint32_t bufsize, Sky_errno_t *sky_errno,
+    uint32_t max_in_flight, uint32_t rate, uint32_t burst, Sky_timefn_t gettime);
+
+Sky_admit_t sky_schedule_request(
+    Sky_scheduler_t *sched, Sky_ctx_t *ctx, Sky_errno_t *sky_errno, time_t *retry_at);
+
+void sky_schedule_done(Sky_scheduler_t *sched, Sky_ctx_t *ctx);
+
+int32_t sky_sizeof_coalescer(uint32_t count);
+
+Sky_coalescer_t *sky_open_coalescer(void *coalescer_buf, uint32_t bufsize, Sky_errno_t *sky_errno);
+
+Sky_finalize_t sky_finalize_coalesced(Sky_coalescer_t *co, Sky_ctx_t *ctx, Sky_errno_t *sky_errno,
+    void *request_buf, uint32_t bufsize, Sky_location_t *loc, uint32_t *response_size);
+
+Sky_status_t sky_decode_coalesced(Sky_coalescer_t *co, Sky_ctx_t *ctx, Sky_errno_t *sky_errno,
+    void *response_buf, uint32_t bufsize, Sky_location_t *loc);
+
+Sky_status_t sky_coalesced_result(
+    Sky_coalescer_t *co, Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Sky_location_t *loc);
+
+void sky_coalesce_cancel(Sky_coalescer_t *co, Sky_ctx_t *ctx, Sky_errno_t reason);
+
 char *sky_perror(Sky_errno_t sky_errno);
 
 char *sky_pserver_status(Sky_loc_status_t status);
@@ -237,4 +449,33 @@ char *sky_pbeacon(Beacon_t *b);
 
 Sky_status_t sky_close(Sky_errno_t *sky_errno, void **sky_state);
 
+Sky_status_t sky_close_instance(Sky_instance_t *inst, Sky_errno_t *sky_errno, void **sky_state);
+
+Sky_status_t sky_trace_start(Sky_errno_t *sky_errno, Sky_tracefn_t out);
+
+void sky_trace_stop(void);
+
+int32_t sky_sizeof_replay(const void *trace, uint32_t len);
+
+Sky_status_t sky_replay(const void *trace, uint32_t len, uint8_t *device_id, uint32_t id_len,
+    uint8_t aes_key[AES_KEYLEN], uint32_t token_id, void *replay_buf, uint32_t bufsize,
+    Sky_log_level_t min_level, Sky_loggerfn_t logf, Sky_errno_t *sky_errno, uint32_t *mismatches);
+
+int32_t sky_sizeof_store(uint32_t count);
+
+Sky_store_t *sky_open_store(void *store_buf, uint32_t bufsize, Sky_errno_t *sky_errno,
+    uint32_t partner_id, uint8_t aes_key[AES_KEYLEN], char *sku, uint32_t cc,
+    Sky_log_level_t min_level, Sky_loggerfn_t logf, Sky_randfn_t rand_bytes, Sky_timefn_t gettime,
+    bool debounce, Sky_savefn_t save, Sky_loadfn_t load);
+
+Sky_instance_t *sky_store_get_instance(
+    Sky_store_t *store, Sky_errno_t *sky_errno, uint8_t *device_id, uint32_t id_len);
+
+Sky_status_t sky_close_store(Sky_store_t *store, Sky_errno_t *sky_errno);
+
+Sky_status_t sky_batch_init(Sky_batch_t *batch, Sky_errno_t *sky_errno, Sky_batch_item_t *items,
+    uint32_t count, Sky_addfn_t add_beacons);
+
+int32_t sky_locate_batch(Sky_batch_t *batch);
+
 #endif
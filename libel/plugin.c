@@ -95,7 +95,7 @@ Sky_status_t sky_plugin_equal(
     Sky_plugin_table_t *p;
     Sky_status_t ret = SKY_ERROR;
 
-    if (!validate_workspace(ctx)) {
+    if (!validate_workspace_internal(ctx)) {
         LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "invalid workspace");
         return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
     }
@@ -129,7 +129,7 @@ Sky_status_t sky_plugin_remove_worst(Sky_ctx_t *ctx, Sky_errno_t *sky_errno)
     Sky_plugin_table_t *p = ctx->plugin;
     Sky_status_t ret = SKY_ERROR;
 
-    if (!validate_workspace(ctx)) {
+    if (!validate_workspace_internal(ctx)) {
         LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "invalid workspace");
         return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
     }
@@ -150,6 +150,76 @@ Sky_status_t sky_plugin_remove_worst(Sky_ctx_t *ctx, Sky_errno_t *sky_errno)
     return set_error_status(sky_errno, SKY_ERROR_NO_PLUGIN);
 }
 
+/*! \brief call the admit operation in the registered plugins
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno pointer to errno
+ *  @param b beacon which is about to be added
+ *  @param idx index at which beacon would be inserted in workspace
+ *
+ *  @return SKY_FAILURE if adding the beacon would be undone by remove_worst,
+ *  SKY_SUCCESS if it should be added or SKY_ERROR if no plugin can tell
+ */
+Sky_status_t sky_plugin_admit(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Beacon_t *b, int idx)
+{
+    Sky_plugin_table_t *p = ctx->plugin;
+    Sky_status_t ret = SKY_ERROR;
+
+    if (!validate_workspace_internal(ctx)) {
+        LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "invalid workspace");
+        return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
+    }
+
+    while (p) {
+        if (p->admit)
+            ret = (*p->admit)(ctx, b, idx);
+#ifdef VERBOSE_DEBUG
+        LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "%s returned %s", p->name,
+            (ret == SKY_SUCCESS) ? "Success" : (ret == SKY_FAILURE) ? "Failure" : "Error");
+#endif
+        if (ret != SKY_ERROR) {
+            set_error_status(sky_errno, SKY_ERROR_NONE);
+            return ret;
+        }
+        p = (Sky_plugin_table_t *)p->next; /* move on to next plugin */
+    }
+    return set_error_status(sky_errno, SKY_ERROR_NO_PLUGIN);
+}
+
+/*! \brief call the select operation in the registered plugins
+ *
+ *  @param ctx Skyhook request context
+ *  @param sky_errno pointer to errno
+ *
+ *  @return SKY_SUCCESS if a plugin removed the beacons over its limit, or SKY_ERROR
+ *  if no plugin had any to remove
+ */
+Sky_status_t sky_plugin_select(Sky_ctx_t *ctx, Sky_errno_t *sky_errno)
+{
+    Sky_plugin_table_t *p = ctx->plugin;
+    Sky_status_t ret = SKY_ERROR;
+
+    if (!validate_workspace_internal(ctx)) {
+        LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "invalid workspace");
+        return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
+    }
+
+    while (p) {
+        if (p->select)
+            ret = (*p->select)(ctx);
+#ifdef VERBOSE_DEBUG
+        LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "%s returned %s", p->name,
+            (ret == SKY_SUCCESS) ? "Success" : (ret == SKY_FAILURE) ? "Failure" : "Error");
+#endif
+        if (ret != SKY_ERROR) {
+            set_error_status(sky_errno, SKY_ERROR_NONE);
+            return ret;
+        }
+        p = (Sky_plugin_table_t *)p->next; /* move on to next plugin */
+    }
+    return set_error_status(sky_errno, SKY_ERROR_NO_PLUGIN);
+}
+
 /*! \brief call the cache_match operation in the registered plugins
  *
  *  @param ctx Skyhook request context
@@ -163,7 +233,7 @@ Sky_status_t sky_plugin_get_matching_cacheline(Sky_ctx_t *ctx, Sky_errno_t *sky_
     Sky_plugin_table_t *p = ctx->plugin;
     Sky_status_t ret = SKY_ERROR;
 
-    if (!validate_workspace(ctx)) {
+    if (!validate_workspace_internal(ctx)) {
         LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "invalid workspace");
         return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
     }
@@ -197,7 +267,7 @@ Sky_status_t sky_plugin_add_to_cache(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, Sky
     Sky_plugin_table_t *p = ctx->plugin;
     Sky_status_t ret = SKY_ERROR;
 
-    if (!validate_workspace(ctx)) {
+    if (!validate_workspace_internal(ctx)) {
         LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "invalid workspace");
         return set_error_status(sky_errno, SKY_ERROR_BAD_WORKSPACE);
     }
@@ -330,6 +400,12 @@ TEST("should return SKY_ERROR if no plugin operation found to provide result", c
     errno = SKY_ERROR_NONE;
     ASSERT(SKY_ERROR == sky_plugin_get_matching_cacheline(ctx, &errno, &idx));
     ASSERT(errno == SKY_ERROR_NO_PLUGIN);
+    errno = SKY_ERROR_NONE;
+    ASSERT(SKY_ERROR == sky_plugin_admit(ctx, &errno, &a, 0));
+    ASSERT(errno == SKY_ERROR_NO_PLUGIN);
+    errno = SKY_ERROR_NONE;
+    ASSERT(SKY_ERROR == sky_plugin_select(ctx, &errno));
+    ASSERT(errno == SKY_ERROR_NO_PLUGIN);
 });
 
 END_TESTS();
@@ -78,6 +78,11 @@ static int16_t map_cell_type(Beacon_t *cell)
 
 static int64_t mac_to_int(Sky_ctx_t *ctx, uint32_t idx)
 {
+#if SKY_AP_MIRROR
+    // APs are already packed in the AP mirror, first byte most significant
+    //
+    return ctx->aps.mac[idx];
+#else
     size_t i;
 
     // This is a wrapper function around get_ap_mac(). It converts the 8-byte
@@ -91,6 +96,7 @@ static int64_t mac_to_int(Sky_ctx_t *ctx, uint32_t idx)
         ret_val = ret_val * 256 + mac[i];
 
     return ret_val;
+#endif
 }
 
 static int64_t flip_sign(int64_t value)
@@ -547,14 +553,14 @@ int32_t apply_used_info_to_ap(Sky_ctx_t *ctx, uint8_t *used, int size)
         return -1;
 
     for (i = 0; i < NUM_APS(ctx); i++) {
-        ctx->beacon[nap].ap.property.used = GET_USED_AP(used, size, nap);
+        BEACON_AT(ctx, nap).ap.property.used = GET_USED_AP(used, size, nap);
         if (nap++ > size * CHAR_BIT)
             break;
     }
     for (v = 0; v < CONFIG(ctx->state, max_vap_per_ap); v++) {
         for (i = 0; i < NUM_APS(ctx); i++) {
-            if (v < NUM_VAPS(&ctx->beacon[i])) {
-                ctx->beacon[i].ap.vg_prop[v].used = GET_USED_AP(used, size, nap);
+            if (v < NUM_VAPS(&BEACON_AT(ctx, i))) {
+                BEACON_AT(ctx, i).ap.vg_prop[v].used = GET_USED_AP(used, size, nap);
                 if (nap++ > size * CHAR_BIT)
                     break;
             }
@@ -784,5 +790,10 @@ static bool apply_config_overrides(Sky_state_t *s, Rs *rs)
 
     /* Add new config parameters here */
 
+#if CACHE_SIZE
+    /* cachelines are checked against the new parameters by the next sky_new_request */
+    if (override)
+        s->cache_expiry = 0;
+#endif
     return override;
 }
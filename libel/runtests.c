@@ -19,6 +19,7 @@ static Test_rs runtests(void)
     /*RUN_TEST(ap_plugin_vap_used);*/
     RUN_TEST(test_utilities);
     RUN_TEST(plugin_test);
+    RUN_TEST(libel_test);
     /*RUN_TEST(new_tests);*/
     /* END TEST LIST */
     return rs;
@@ -0,0 +1,817 @@
+/*! \file libel/trace.c
+ *  \brief Session record and replay - Skyhook Embedded Library
+ *
+ * Copyright (c) 2019 Skyhook, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <stdio.h>
+#define SKY_LIBEL
+#include "libel.h"
+#include "proto.h"
+
+/* Each record is an op byte and a 32 bit payload length, followed by the
+ * payload. Values are stored in host byte order, so a trace is replayed on a
+ * host with the same byte order as the one which recorded it.
+ */
+#define TRACE_HDR_SIZE 5
+#define TRACE_BEACON_SIZE 41
+#define TRACE_GNSS_SIZE 34
+#define TRACE_RESULT_SIZE 16
+#define TRACE_LOCATION_SIZE 16
+/* TBR token recorded in place of the token of a state, see trace_state */
+#define TRACE_TOKEN_REDACTED UINT32_MAX
+
+#define PUT(p, v) (memcpy((p), &(v), sizeof(v)), (p) += sizeof(v))
+#define GET(p, v) (memcpy(&(v), (p), sizeof(v)), (p) += sizeof(v))
+
+#if SKY_TRACE
+static Sky_tracefn_t trace_out; /* recording if not NULL */
+static Sky_instance_t *trace_inst; /* instance being recorded */
+static Sky_timefn_t trace_gettime; /* callbacks of instance being recorded */
+static Sky_randfn_t trace_rand_bytes;
+#endif
+
+/* replay in progress */
+static const uint8_t *replay_pos, *replay_end;
+static uint32_t replay_diverged;
+static time_t replay_now;
+static Sky_ctx_t *replay_ctx; /* request being finalized by replay */
+static uint32_t replay_len; /* length of request it encoded */
+
+/*! \brief Begin recording calls to the library
+ *
+ *  Calls made after an instance is opened, with the results of its callbacks
+ *  and the server responses it decodes, are passed to out as a binary trace
+ *  which may be replayed with sky_replay. Only one instance is recorded at a
+ *  time: the first opened while recording. Opening another instance fails with
+ *  SKY_ERROR_RESOURCE_UNAVAILABLE until it is closed, or until recording is
+ *  started again. The library must be built with SKY_TRACE.
+ *
+ *  @param sky_errno sky_errno is set to the error code
+ *  @param out pointer to function which appends data to the trace
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ */
+Sky_status_t sky_trace_start(Sky_errno_t *sky_errno, Sky_tracefn_t out)
+{
+#if SKY_TRACE
+    if (out == NULL)
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+    trace_out = out;
+    trace_inst = NULL;
+    return set_error_status(sky_errno, SKY_ERROR_NONE);
+#else
+    (void)out;
+    return set_error_status(sky_errno, SKY_ERROR_RESOURCE_UNAVAILABLE);
+#endif
+}
+
+/*! \brief Stop recording calls to the library
+ */
+void sky_trace_stop(void)
+{
+#if SKY_TRACE
+    trace_out = NULL;
+#endif
+}
+
+#if SKY_TRACE
+/*! \brief check if calls of an instance are being recorded
+ *
+ *  @param inst the instance
+ *
+ *  @return true if recording
+ */
+static bool recording(Sky_instance_t *inst)
+{
+    return trace_out != NULL && inst != NULL && inst == trace_inst;
+}
+
+/*! \brief instance of a workspace, if it is valid and recording is in progress
+ *
+ *  @param ctx Skyhook request context
+ *
+ *  @return instance of workspace or NULL
+ */
+Sky_instance_t *trace_instance(Sky_ctx_t *ctx)
+{
+    return trace_out != NULL && validate_workspace(ctx) ? ctx->instance : NULL;
+}
+
+/*! \brief append the header of a record to the trace
+ *
+ *  @param op record type
+ *  @param len length of payload which follows
+ */
+static void trace_header(Sky_trace_op_t op, uint32_t len)
+{
+    uint8_t hdr[TRACE_HDR_SIZE], *p = hdr;
+    uint8_t type = op;
+
+    PUT(p, type);
+    PUT(p, len);
+    (*trace_out)(hdr, sizeof(hdr));
+}
+
+/*! \brief gettime callback which records the time returned
+ */
+static time_t record_time(time_t *t)
+{
+    time_t now = (*trace_gettime)(t);
+    int64_t v = now;
+
+    if (trace_out != NULL) {
+        trace_header(TRACE_TIME, sizeof(v));
+        (*trace_out)(&v, sizeof(v));
+    }
+    return now;
+}
+
+/*! \brief rand_bytes callback which records the bytes returned
+ */
+static int record_rand(uint8_t *rand_buf, uint32_t bufsize)
+{
+    int ret = (*trace_rand_bytes)(rand_buf, bufsize);
+    uint32_t len = ret < 0 ? 0 : (uint32_t)ret > bufsize ? bufsize : (uint32_t)ret;
+
+    if (trace_out != NULL) {
+        trace_header(TRACE_RAND, len);
+        (*trace_out)(rand_buf, len);
+    }
+    return ret;
+}
+
+/*! \brief append a state buffer to the trace, without the credentials it holds
+ *
+ *  A TBR token is recorded as TRACE_TOKEN_REDACTED, so that replay knows to restore it
+ *
+ *  @param state the state buffer
+ *  @param len length of state buffer
+ */
+static void trace_state(const uint8_t *state, uint32_t len)
+{
+    uint8_t chunk[64];
+    uint32_t i, j, n, at, token = TBR_TOKEN_UNKNOWN;
+    const uint32_t token_at = offsetof(Sky_state_t, sky_token_id);
+
+    /* an unknown token is no secret, and is kept so that replay registers again */
+    if (len >= token_at + sizeof(token) &&
+        ((const Sky_state_t *)state)->sky_token_id != TBR_TOKEN_UNKNOWN)
+        token = TRACE_TOKEN_REDACTED;
+    for (i = 0; i < len; i += n) {
+        n = len - i < sizeof(chunk) ? len - i : sizeof(chunk);
+        memcpy(chunk, state + i, n);
+        for (j = 0; j < n; j++) {
+            at = i + j;
+            if ((at >= offsetof(Sky_state_t, sky_device_id) &&
+                    at < offsetof(Sky_state_t, sky_device_id) + MAX_DEVICE_ID) ||
+                (at >= offsetof(Sky_state_t, sky_aes_key) &&
+                    at < offsetof(Sky_state_t, sky_aes_key) + AES_KEYLEN))
+                chunk[j] = 0;
+            else if (at >= token_at && at < token_at + sizeof(token))
+                chunk[j] = ((uint8_t *)&token)[at - token_at];
+        }
+        (*trace_out)(chunk, n);
+    }
+}
+
+/*! \brief record the opening of an instance and interpose on its callbacks
+ *
+ *  The device ID, AES key and TBR token are not recorded, they are given to sky_replay.
+ *
+ *  @param inst the instance being opened
+ *  @param partner_id Skyhook assigned credentials
+ *  @param sku unique name of device family
+ *  @param cc County code where device is being registered
+ *  @param state_buf pointer to a state buffer (provided by sky_close) or NULL
+ *  @param debounce true if cached beacons should be added to request
+ *  @param rand_bytes pointer to random function, replaced if recording
+ *  @param gettime pointer to time function, replaced if recording
+ *
+ *  @return false if another instance is being recorded
+ */
+bool trace_open(Sky_instance_t *inst, uint32_t partner_id, char *sku, uint32_t cc,
+    void *state_buf, bool debounce, Sky_randfn_t *rand_bytes, Sky_timefn_t *gettime)
+{
+    uint8_t buf[MAX_SKU_LEN + 16], *p = buf;
+    uint8_t len8, flag = debounce;
+    uint32_t state_len = state_buf != NULL ? (uint32_t)sky_sizeof_state(state_buf) : 0;
+
+    if (trace_out == NULL)
+        return true;
+    /* callbacks of the recorded instance are held here, so only one is recorded */
+    if (trace_inst != NULL && trace_inst != inst)
+        return false;
+    trace_inst = inst;
+
+    PUT(p, partner_id);
+    for (len8 = 0; sku != NULL && len8 < MAX_SKU_LEN && sku[len8] != '\0'; len8++)
+        ;
+    PUT(p, len8);
+    if (len8)
+        memcpy(p, sku, len8), p += len8;
+    PUT(p, cc);
+    PUT(p, flag);
+    PUT(p, state_len);
+    trace_header(TRACE_OPEN, (p - buf) + state_len);
+    (*trace_out)(buf, p - buf);
+    if (state_len)
+        trace_state(state_buf, state_len);
+
+    trace_gettime = *gettime == NULL ? &time : *gettime;
+    trace_rand_bytes = *rand_bytes == NULL ? &sky_rand_fn : *rand_bytes;
+    *gettime = record_time;
+    *rand_bytes = record_rand;
+    return true;
+}
+
+/*! \brief record the closing of an instance, which is then no longer recorded
+ *
+ *  @param inst the instance being closed
+ */
+void trace_close(Sky_instance_t *inst)
+{
+    if (inst == NULL || inst != trace_inst)
+        return;
+    trace_op(inst, TRACE_CLOSE, NULL, 0);
+    trace_inst = NULL;
+}
+
+/*! \brief record a call with an opaque payload
+ *
+ *  @param inst instance of call
+ *  @param op record type
+ *  @param data payload
+ *  @param len length of payload
+ */
+void trace_op(Sky_instance_t *inst, Sky_trace_op_t op, const void *data, uint32_t len)
+{
+    if (!recording(inst))
+        return;
+    if (data == NULL)
+        len = 0;
+    trace_header(op, len);
+    if (len)
+        (*trace_out)(data, len);
+}
+
+/*! \brief record a beacon added to, updated in or removed from the workspace
+ *
+ *  @param inst instance of workspace
+ *  @param op record type
+ *  @param b pointer to beacon
+ */
+void trace_beacon(Sky_instance_t *inst, Sky_trace_op_t op, Beacon_t *b)
+{
+    uint8_t buf[TRACE_BEACON_SIZE], *p = buf;
+    uint16_t type = b->h.type, id1 = 0, id2 = 0;
+    int16_t rssi = b->h.rssi, id5 = 0;
+    uint32_t age = b->h.age;
+    int8_t connected = b->h.connected;
+    int32_t freq = 0, id3 = 0, ta = 0;
+    int64_t id4 = 0;
+    uint8_t mac[MAC_SIZE] = { 0 };
+
+    if (!recording(inst))
+        return;
+
+    if (type == SKY_BEACON_AP) {
+        memcpy(mac, b->ap.mac, MAC_SIZE);
+        freq = b->ap.freq;
+    } else if (type == SKY_BEACON_BLE) {
+        memcpy(mac, b->ble.mac, MAC_SIZE);
+    } else {
+        id1 = b->cell.id1;
+        id2 = b->cell.id2;
+        id3 = b->cell.id3;
+        id4 = b->cell.id4;
+        id5 = b->cell.id5;
+        freq = b->cell.freq;
+        ta = b->cell.ta;
+    }
+    PUT(p, type);
+    PUT(p, rssi);
+    PUT(p, age);
+    PUT(p, connected);
+    memcpy(p, mac, MAC_SIZE), p += MAC_SIZE;
+    PUT(p, freq);
+    PUT(p, id1);
+    PUT(p, id2);
+    PUT(p, id3);
+    PUT(p, id4);
+    PUT(p, id5);
+    PUT(p, ta);
+    trace_op(inst, op, buf, p - buf);
+}
+
+/*! \brief record GNSS added to the workspace
+ */
+void trace_add_gnss(Sky_instance_t *inst, float lat, float lon, uint16_t hpe, float altitude,
+    uint16_t vpe, float speed, float bearing, uint16_t nsat, time_t timestamp)
+{
+    uint8_t buf[TRACE_GNSS_SIZE], *p = buf;
+    int64_t ts = timestamp;
+
+    if (!recording(inst))
+        return;
+    PUT(p, lat);
+    PUT(p, lon);
+    PUT(p, hpe);
+    PUT(p, altitude);
+    PUT(p, vpe);
+    PUT(p, speed);
+    PUT(p, bearing);
+    PUT(p, nsat);
+    PUT(p, ts);
+    trace_op(inst, TRACE_ADD_GNSS, buf, p - buf);
+}
+
+/*! \brief record a location given to a workspace
+ *
+ *  @param inst instance of workspace
+ *  @param op record type
+ *  @param loc the location
+ */
+void trace_location(Sky_instance_t *inst, Sky_trace_op_t op, Sky_location_t *loc)
+{
+    uint8_t buf[TRACE_LOCATION_SIZE], *p = buf;
+    uint8_t source = loc->location_source, status = loc->location_status;
+
+    if (!recording(inst))
+        return;
+    PUT(p, loc->lat);
+    PUT(p, loc->lon);
+    PUT(p, loc->hpe);
+    PUT(p, loc->time);
+    PUT(p, source);
+    PUT(p, status);
+    trace_op(inst, op, buf, p - buf);
+}
+
+/*! \brief record the result of the preceding call
+ *
+ *  @param inst instance of call
+ *  @param status return value of call
+ *  @param sky_errno error code set by call
+ *  @param value size or length produced by call
+ *  @param out output of call
+ *  @param len length of output
+ */
+void trace_result(Sky_instance_t *inst, int32_t status, Sky_errno_t sky_errno, uint32_t value,
+    void *out, uint32_t len)
+{
+    uint8_t buf[TRACE_RESULT_SIZE], *p = buf;
+    uint32_t err = sky_errno, crc;
+
+    if (!recording(inst))
+        return;
+    crc = out != NULL && len ? sky_crc32(out, len) : 0;
+    PUT(p, status);
+    PUT(p, err);
+    PUT(p, value);
+    PUT(p, crc);
+    trace_op(inst, TRACE_RESULT, buf, p - buf);
+}
+#endif
+
+/*! \brief read the header of the next record of a trace
+ *
+ *  @param pos position of record, advanced past header
+ *  @param end end of trace
+ *  @param op record type
+ *  @param len payload length
+ *
+ *  @return true if a complete record follows
+ */
+static bool next_record(const uint8_t **pos, const uint8_t *end, uint8_t *op, uint32_t *len)
+{
+    const uint8_t *p = *pos;
+
+    if (end - p < TRACE_HDR_SIZE)
+        return false;
+    GET(p, *op);
+    GET(p, *len);
+    if ((uint32_t)(end - p) < *len)
+        return false;
+    *pos = p;
+    return true;
+}
+
+/*! \brief note the length of a request encoded, if it is being finalized by sky_replay
+ *
+ *  sky_finalize_request does not report the length it encodes, which the trace records
+ *
+ *  @param ctx Skyhook request context
+ *  @param len length of request encoded
+ */
+void replay_request_len(Sky_ctx_t *ctx, uint32_t len)
+{
+    if (ctx == replay_ctx)
+        replay_len = len;
+}
+
+/*! \brief gettime callback which returns the recorded time
+ */
+static time_t replay_time(time_t *t)
+{
+    const uint8_t *p = replay_pos;
+    uint8_t op;
+    uint32_t len;
+    int64_t v;
+
+    if (next_record(&p, replay_end, &op, &len) && op == TRACE_TIME && len == sizeof(v)) {
+        GET(p, v);
+        replay_now = (time_t)v;
+        replay_pos = p;
+    } else
+        replay_diverged++;
+    if (t != NULL)
+        *t = replay_now;
+    return replay_now;
+}
+
+/*! \brief rand_bytes callback which returns the recorded bytes
+ *
+ *  @return number of bytes recorded, or 0 if the callback was not recorded
+ */
+static int replay_rand(uint8_t *rand_buf, uint32_t bufsize)
+{
+    const uint8_t *p = replay_pos;
+    uint8_t op;
+    uint32_t len, n = 0;
+
+    memset(rand_buf, 0, bufsize);
+    if (next_record(&p, replay_end, &op, &len) && op == TRACE_RAND) {
+        n = len < bufsize ? len : bufsize;
+        memcpy(rand_buf, p, n);
+        replay_pos = p + len;
+    } else
+        replay_diverged++;
+    return (int)n;
+}
+
+/*! \brief read a beacon recorded by trace_beacon
+ *
+ *  @param p recorded beacon
+ *  @param b beacon to fill in
+ */
+static void replay_beacon(const uint8_t *p, Beacon_t *b)
+{
+    uint16_t type, id1, id2;
+    int16_t rssi, id5;
+    uint32_t age;
+    int8_t connected;
+    int32_t freq, id3, ta;
+    int64_t id4;
+
+    memset(b, 0, sizeof(*b));
+    GET(p, type);
+    GET(p, rssi);
+    GET(p, age);
+    GET(p, connected);
+    b->h.magic = BEACON_MAGIC;
+    b->h.type = type;
+    b->h.rssi = rssi;
+    b->h.age = age;
+    b->h.connected = connected;
+    if (type == SKY_BEACON_AP)
+        memcpy(b->ap.mac, p, MAC_SIZE);
+    else if (type == SKY_BEACON_BLE)
+        memcpy(b->ble.mac, p, MAC_SIZE);
+    p += MAC_SIZE;
+    GET(p, freq);
+    GET(p, id1);
+    GET(p, id2);
+    GET(p, id3);
+    GET(p, id4);
+    GET(p, id5);
+    GET(p, ta);
+    if (type == SKY_BEACON_AP)
+        b->ap.freq = freq;
+    else if (type != SKY_BEACON_BLE) {
+        b->cell.id1 = id1;
+        b->cell.id2 = id2;
+        b->cell.id3 = id3;
+        b->cell.id4 = id4;
+        b->cell.id5 = id5;
+        b->cell.freq = freq;
+        b->cell.ta = ta;
+    }
+}
+
+/*! \brief Determines the size of the buffer required to replay a trace
+ *
+ *  @param trace the recorded trace
+ *  @param len length of trace
+ *
+ *  @return Size of replay buffer or 0 if trace is invalid
+ */
+int32_t sky_sizeof_replay(const void *trace, uint32_t len)
+{
+    const uint8_t *p = trace, *end = p + len;
+    uint32_t need = 0, n;
+    uint8_t op;
+
+    if (trace == NULL)
+        return 0;
+    while (p < end) {
+        if (!next_record(&p, end, &op, &n))
+            return 0;
+        if (op == TRACE_FINALIZE && n == sizeof(uint32_t))
+            memcpy(&n, p, sizeof(n));
+        if (n > need)
+            need = n;
+        p += (op == TRACE_FINALIZE) ? sizeof(uint32_t) : n;
+    }
+    return sky_sizeof_instance() + sky_sizeof_workspace() + need;
+}
+
+/*! \brief Replay a recorded trace against this build of the library
+ *
+ *  Each recorded call is repeated with the recorded arguments, callbacks
+ *  return the recorded values and server responses are decoded from the
+ *  trace. The result of each call is compared with the recorded result.
+ *
+ *  @param trace the recorded trace
+ *  @param len length of trace
+ *  @param device_id Device unique ID of the device recorded, which is not in the trace
+ *  @param id_len length of the Device ID
+ *  @param aes_key Skyhook assigned encryption key of the device, which is not in the trace
+ *  @param token_id TBR token of the device in the state it was opened with, which is not
+ *                  in the trace either
+ *  @param replay_buf buffer provided by user (from sky_sizeof_replay)
+ *  @param bufsize size of replay buffer
+ *  @param min_level logging function is called for msg with equal or greater level
+ *  @param logf pointer to logging function
+ *  @param sky_errno sky_errno is set to the error code
+ *  @param mismatches set to number of results or callbacks which differed from the trace
+ *
+ *  @return SKY_SUCCESS or SKY_ERROR and sets sky_errno with error code
+ *
+ *  Replay is not re-entrant; only one trace may be replayed at a time.
+ */
+Sky_status_t sky_replay(const void *trace, uint32_t len, uint8_t *device_id, uint32_t id_len,
+    uint8_t aes_key[AES_KEYLEN], uint32_t token_id, void *replay_buf, uint32_t bufsize,
+    Sky_log_level_t min_level, Sky_loggerfn_t logf, Sky_errno_t *sky_errno, uint32_t *mismatches)
+{
+    Sky_instance_t *inst = replay_buf;
+    Sky_ctx_t *ctx = NULL;
+    uint8_t *ws, *io, op, len8;
+    uint32_t io_size, n, partner_id, cc, state_len, value = 0, crc_len = 0;
+    const uint8_t *p;
+    Sky_location_t loc;
+    Sky_errno_t err = SKY_ERROR_NONE;
+    int32_t status = 0;
+    void *out = NULL;
+    Beacon_t b;
+    uint64_t fingerprint;
+    bool flag;
+
+    if (trace == NULL || inst == NULL || mismatches == NULL || device_id == NULL ||
+        aes_key == NULL || bufsize < (uint32_t)(sky_sizeof_instance() + sky_sizeof_workspace()))
+        return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+
+    ws = (uint8_t *)replay_buf + sky_sizeof_instance();
+    io = ws + sky_sizeof_workspace();
+    io_size = bufsize - sky_sizeof_instance() - sky_sizeof_workspace();
+    *mismatches = 0;
+    memset(inst, 0, sky_sizeof_instance());
+    replay_pos = trace;
+    replay_end = replay_pos + len;
+    replay_diverged = 0;
+    replay_now = 0;
+
+    while (replay_pos < replay_end) {
+        if (!next_record(&replay_pos, replay_end, &op, &n))
+            return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
+        p = replay_pos;
+        replay_pos += n;
+
+        /* calls which need a request in progress */
+        if (ctx == NULL && op != TRACE_OPEN && op != TRACE_NEW_REQUEST && op != TRACE_CLOSE &&
+            op != TRACE_RESULT && op != TRACE_TIME && op != TRACE_RAND &&
+            op != TRACE_SCAN_UNCHANGED)
+            return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
+
+        switch (op) {
+        case TRACE_OPEN: {
+            uint8_t debounce;
+            char sku[MAX_SKU_LEN + 1];
+
+            /* record holds the sku and state lengths it claims, and no more */
+            if (n < sizeof(partner_id) + sizeof(len8))
+                return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
+            GET(p, partner_id);
+            GET(p, len8);
+            if (len8 > MAX_SKU_LEN || n < sizeof(partner_id) + sizeof(len8) + len8 + sizeof(cc) +
+                                              sizeof(debounce) + sizeof(state_len))
+                return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
+            memcpy(sku, p, len8), p += len8;
+            sku[len8] = '\0';
+            GET(p, cc);
+            GET(p, debounce);
+            GET(p, state_len);
+            if (state_len != n - (sizeof(partner_id) + sizeof(len8) + len8 + sizeof(cc) +
+                                     sizeof(debounce) + sizeof(state_len)))
+                return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
+            if (state_len > io_size)
+                return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+            memcpy(io, p, state_len);
+            if (state_len >= offsetof(Sky_state_t, sky_token_id) + sizeof(token_id) &&
+                ((Sky_state_t *)io)->sky_token_id == TRACE_TOKEN_REDACTED)
+                ((Sky_state_t *)io)->sky_token_id = token_id;
+            ctx = NULL;
+            status = sky_open_instance(inst, sky_sizeof_instance(), &err, device_id, id_len,
+                         partner_id, aes_key, sku, cc, state_len ? io : NULL, min_level, logf,
+                         replay_rand, replay_time, debounce) != NULL ?
+                         SKY_SUCCESS :
+                         SKY_ERROR;
+            out = NULL;
+            break;
+        }
+        case TRACE_NEW_REQUEST:
+            if (n > io_size)
+                return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+            memcpy(io, p, n);
+            ctx = sky_new_instance_request(
+                inst, ws, sky_sizeof_workspace(), n ? io : NULL, n, &err);
+            status = ctx != NULL ? SKY_SUCCESS : SKY_ERROR;
+            out = NULL;
+            break;
+        case TRACE_NEW_REQUEST_FROM:
+            if (n > io_size)
+                return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+            memcpy(io, p, n);
+            /* the workspace of the last request is always reused in place */
+            ctx = sky_new_request_from(ws, sky_sizeof_workspace(), ctx, n ? io : NULL, n, &err);
+            status = ctx != NULL ? SKY_SUCCESS : SKY_ERROR;
+            out = NULL;
+            break;
+        case TRACE_ADD_BEACON:
+        case TRACE_UPDATE_BEACON:
+        case TRACE_REMOVE_BEACON:
+            if (n != TRACE_BEACON_SIZE)
+                return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
+            replay_beacon(p, &b);
+            if (op == TRACE_ADD_BEACON)
+                status = add_beacon(ctx, &err, &b);
+            else if (op == TRACE_UPDATE_BEACON)
+                status = update_beacon(ctx, &err, &b);
+            else
+                status = discard_beacon(ctx, &err, &b);
+            out = NULL;
+            break;
+        case TRACE_ALLOW_STALE:
+        case TRACE_DEFER_SELECTION:
+            if (n != sizeof(flag))
+                return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
+            GET(p, flag);
+            status = op == TRACE_ALLOW_STALE ? sky_allow_stale(ctx, &err, flag) :
+                                               sky_defer_selection(ctx, &err, flag);
+            out = NULL;
+            break;
+        case TRACE_ADD_GNSS: {
+            float lat, lon, altitude, speed, bearing;
+            uint16_t hpe, vpe, nsat;
+            int64_t ts;
+
+            if (n != TRACE_GNSS_SIZE)
+                return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
+            GET(p, lat);
+            GET(p, lon);
+            GET(p, hpe);
+            GET(p, altitude);
+            GET(p, vpe);
+            GET(p, speed);
+            GET(p, bearing);
+            GET(p, nsat);
+            GET(p, ts);
+            status = sky_add_gnss(
+                ctx, &err, lat, lon, hpe, altitude, vpe, speed, bearing, nsat, (time_t)ts);
+            out = NULL;
+            break;
+        }
+        case TRACE_SIZEOF:
+            status = sky_sizeof_request_buf(ctx, &value, &err);
+            out = NULL;
+            break;
+        case TRACE_FINALIZE:
+            if (n != sizeof(uint32_t))
+                return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
+            GET(p, n);
+            if (n > io_size)
+                return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+            replay_ctx = ctx;
+            replay_len = 0;
+            status = sky_finalize_request(ctx, &err, io, n, &loc, &value);
+            replay_ctx = NULL;
+            /* finalize records length of request encoded, not response size */
+            value = replay_len;
+            out = io;
+            break;
+        case TRACE_DECODE:
+            if (n > io_size)
+                return set_error_status(sky_errno, SKY_ERROR_BAD_PARAMETERS);
+            memcpy(io, p, n);
+            status = sky_decode_response(ctx, &err, io, n, &loc);
+            value = status == SKY_SUCCESS ? loc.hpe : 0;
+            out = status == SKY_SUCCESS ? &loc.lat : NULL;
+            crc_len = 2 * sizeof(float);
+            break;
+        case TRACE_SCAN_UNCHANGED:
+            if (n != sizeof(fingerprint))
+                return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
+            GET(p, fingerprint);
+            status = sky_scan_unchanged(inst, &err, fingerprint, &loc);
+            value = status == SKY_SUCCESS ? loc.hpe : 0;
+            out = status == SKY_SUCCESS ? &loc.lat : NULL;
+            crc_len = 2 * sizeof(float);
+            break;
+        case TRACE_SHARED_LOCATION: {
+            uint8_t source, loc_status;
+
+            if (n != TRACE_LOCATION_SIZE)
+                return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
+            memset(&loc, 0, sizeof(loc));
+            GET(p, loc.lat);
+            GET(p, loc.lon);
+            GET(p, loc.hpe);
+            GET(p, loc.time);
+            GET(p, source);
+            GET(p, loc_status);
+            loc.location_source = source;
+            loc.location_status = loc_status;
+            status = sky_plugin_add_to_cache(ctx, &err, &loc);
+            out = NULL;
+            break;
+        }
+        case TRACE_SELECT_BEACONS:
+            status = select_beacons(ctx, &err);
+            out = NULL;
+            break;
+        case TRACE_CLOSE:
+            status = sky_close_instance(inst, &err, NULL);
+            ctx = NULL;
+            out = NULL;
+            break;
+        case TRACE_RESULT: {
+            int32_t r_status;
+            uint32_t r_errno, r_value, r_crc, crc = 0;
+
+            if (n != TRACE_RESULT_SIZE)
+                return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
+            GET(p, r_status);
+            GET(p, r_errno);
+            GET(p, r_value);
+            GET(p, r_crc);
+            if (out == io) {
+                /* compare the bytes recorded, a request of another length differs by value */
+                crc_len = r_value <= io_size ? r_value : io_size;
+            }
+            if (out != NULL && crc_len)
+                crc = sky_crc32(out, crc_len);
+            if (r_status != status || r_errno != (uint32_t)err || r_value != value || r_crc != crc) {
+                (*mismatches)++;
+                if (logf != NULL && SKY_LOG_LEVEL_WARNING <= min_level)
+                    (*logf)(SKY_LOG_LEVEL_WARNING, "Replay result differs from trace");
+            }
+            out = NULL;
+            value = crc_len = 0;
+            break;
+        }
+        case TRACE_TIME:
+        case TRACE_RAND:
+            /* callback was not made by this build */
+            replay_diverged++;
+            break;
+        default:
+            return set_error_status(sky_errno, SKY_ERROR_DECODE_ERROR);
+        }
+    }
+    *mismatches += replay_diverged;
+    replay_pos = replay_end = NULL;
+    return set_error_status(sky_errno, SKY_ERROR_NONE);
+}
@@ -0,0 +1,99 @@
+/*! \file libel/trace.h
+ *  \brief Skyhook Embedded Library session record and replay
+ *
+ * Copyright (c) 2019 Skyhook, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+#ifndef SKY_TRACE_H
+#define SKY_TRACE_H
+
+/*! \brief Trace record types
+ */
+typedef enum {
+    TRACE_OPEN = 1, /* sky_open arguments and restored state, without credentials */
+    TRACE_TIME, /* result of gettime callback */
+    TRACE_RAND, /* result of rand_bytes callback */
+    TRACE_NEW_REQUEST, /* uplink app data */
+    TRACE_ADD_BEACON, /* beacon passed to add_beacon */
+    TRACE_ADD_GNSS, /* sky_add_gnss arguments */
+    TRACE_SIZEOF, /* sky_sizeof_request_buf */
+    TRACE_FINALIZE, /* request buffer size */
+    TRACE_DECODE, /* server response */
+    TRACE_CLOSE, /* sky_close */
+    TRACE_RESULT, /* status, errno, value and crc of output of the preceding call */
+    TRACE_NEW_REQUEST_FROM, /* uplink app data of request started from the last */
+    TRACE_UPDATE_BEACON, /* beacon passed to update_beacon, when in workspace */
+    TRACE_REMOVE_BEACON, /* beacon passed to discard_beacon */
+    TRACE_ALLOW_STALE, /* sky_allow_stale flag */
+    TRACE_DEFER_SELECTION, /* sky_defer_selection flag */
+    TRACE_SCAN_UNCHANGED, /* sky_scan_unchanged fingerprint */
+    TRACE_SHARED_LOCATION, /* location of a coalesced request, added to cache */
+    TRACE_SELECT_BEACONS, /* selection from APs of a scan added by sky_add_ap_beacons */
+} Sky_trace_op_t;
+
+/* Calls are only recorded when built with SKY_TRACE, and only those of the
+ * instance which is being recorded */
+#if SKY_TRACE
+#define RECORD_OPEN(inst, ...) trace_open((inst), __VA_ARGS__)
+#define RECORD_CLOSE(inst) trace_close(inst)
+#define RECORD_CALL(inst, op, d, l) trace_op((inst), (op), (d), (l))
+#define RECORD_BEACON(inst, op, b) trace_beacon((inst), (op), (b))
+#define RECORD_GNSS(inst, ...) trace_add_gnss((inst), __VA_ARGS__)
+#define RECORD_LOCATION(inst, op, loc) trace_location((inst), (op), (loc))
+#define RECORD_RESULT(inst, ...) trace_result((inst), __VA_ARGS__)
+#else
+#define RECORD_OPEN(...) true
+#define RECORD_CLOSE(inst)                                                                         \
+    do {                                                                                           \
+    } while (0)
+#define RECORD_CALL(inst, op, d, l)                                                                \
+    do {                                                                                           \
+    } while (0)
+#define RECORD_BEACON(inst, op, b)                                                                 \
+    do {                                                                                           \
+    } while (0)
+#define RECORD_GNSS(...)                                                                           \
+    do {                                                                                           \
+    } while (0)
+#define RECORD_LOCATION(inst, op, loc)                                                             \
+    do {                                                                                           \
+    } while (0)
+#define RECORD_RESULT(...)                                                                         \
+    do {                                                                                           \
+    } while (0)
+#endif
+
+void replay_request_len(Sky_ctx_t *ctx, uint32_t len);
+#if SKY_TRACE
+Sky_instance_t *trace_instance(Sky_ctx_t *ctx);
+bool trace_open(Sky_instance_t *inst, uint32_t partner_id, char *sku, uint32_t cc,
+    void *state_buf, bool debounce, Sky_randfn_t *rand_bytes, Sky_timefn_t *gettime);
+void trace_close(Sky_instance_t *inst);
+void trace_op(Sky_instance_t *inst, Sky_trace_op_t op, const void *data, uint32_t len);
+void trace_beacon(Sky_instance_t *inst, Sky_trace_op_t op, Beacon_t *b);
+void trace_add_gnss(Sky_instance_t *inst, float lat, float lon, uint16_t hpe, float altitude,
+    uint16_t vpe, float speed, float bearing, uint16_t nsat, time_t timestamp);
+void trace_location(Sky_instance_t *inst, Sky_trace_op_t op, Sky_location_t *loc);
+void trace_result(Sky_instance_t *inst, int32_t status, Sky_errno_t sky_errno, uint32_t value,
+    void *out, uint32_t len);
+#endif
+
+#endif
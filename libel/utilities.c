@@ -50,7 +50,27 @@ Sky_status_t set_error_status(Sky_errno_t *sky_errno, Sky_errno_t code)
     return (code == SKY_ERROR_NONE) ? SKY_SUCCESS : SKY_ERROR;
 }
 
+/*! \brief generation token of the workspace
+ *
+ *  Mixes the generation, the start time of the request, the generation of its instance and
+ *  the address of the workspace, so that a damaged header or a copy of a workspace fails
+ *  validation.
+ *
+ *  @param ctx workspace buffer
+ *
+ *  @return token
+ */
+uint32_t workspace_token(Sky_ctx_t *ctx)
+{
+    return (ctx->generation * 2654435761u) ^ ctx->header.time ^ (uint32_t)(uintptr_t)ctx ^
+           (ctx->inst_generation * 40503u) ^ SKY_MAGIC;
+}
+
 /*! \brief validate the workspace buffer
+ *
+ *  Checks the header and generation token, that the instance has not been reused for
+ *  another device since the request was started, and with SKY_DEBUG_WORKSPACE the header
+ *  CRC and every beacon slot too
  *
  *  @param ctx workspace buffer
  *
@@ -58,7 +78,9 @@ Sky_status_t set_error_status(Sky_errno_t *sky_errno, Sky_errno_t code)
  */
 int validate_workspace(Sky_ctx_t *ctx)
 {
+#if SKY_DEBUG_WORKSPACE
     int i;
+#endif
 
     if (ctx == NULL) {
         // Can't use LOGFMT if ctx is bad
@@ -66,19 +88,28 @@ int validate_workspace(Sky_ctx_t *ctx)
         fprintf(stderr, "FATAL: NULL ctx\n");
         return false;
     }
-    if (NUM_BEACONS(ctx) > TOTAL_BEACONS + 1) {
+    if (ctx->header.magic != SKY_MAGIC || ctx->token != workspace_token(ctx)) {
+        LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Bad workspace token");
+        return false;
+    }
+    if (ctx->instance == NULL || ctx->inst_generation != ctx->instance->generation) {
+        LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Instance reused since request was started");
+        return false;
+    }
+    if (NUM_BEACONS(ctx) + ctx->dropped > STAGED_BEACONS) {
         LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Too many beacons");
         return false;
     }
-    if (NUM_APS(ctx) > MAX_AP_BEACONS + 1) {
+    if (NUM_APS(ctx) > STAGED_BEACONS) {
         LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Too many AP beacons");
         return false;
     }
+#if SKY_DEBUG_WORKSPACE
     if (ctx->header.crc32 == sky_crc32(&ctx->header.magic,
                                  (uint8_t *)&ctx->header.crc32 - (uint8_t *)&ctx->header.magic)) {
-        for (i = 0; i < TOTAL_BEACONS; i++) {
-            if (ctx->beacon[i].h.magic != BEACON_MAGIC || ctx->beacon[i].h.type > SKY_BEACON_MAX) {
-                LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Bad beacon #%d of %d", i, TOTAL_BEACONS);
+        for (i = 0; i < STAGED_BEACONS - 1; i++) {
+            if (ctx->slot[i].h.magic != BEACON_MAGIC || ctx->slot[i].h.type > SKY_BEACON_MAX) {
+                LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Bad beacon #%d of %d", i, STAGED_BEACONS - 1);
                 return false;
             }
         }
@@ -86,6 +117,7 @@ int validate_workspace(Sky_ctx_t *ctx)
         LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "CRC check failed");
         return false;
     }
+#endif
     return true;
 }
 
@@ -105,7 +137,7 @@ int validate_cache(Sky_state_t *s, Sky_loggerfn_t logf)
         return false;
     }
 
-    if (s->header.magic != SKY_MAGIC) {
+    if (s->header.magic != SKY_STATE_MAGIC) {
 #if SKY_DEBUG
         if (logf != NULL)
             (*logf)(SKY_LOG_LEVEL_ERROR, "Cache validation failed: bad magic in header");
@@ -183,6 +215,21 @@ int validate_mac(uint8_t mac[6], Sky_ctx_t *ctx)
     return true;
 }
 
+/*! \brief pack a mac address into an integer, first byte most significant
+ *
+ *  @param mac pointer to mac address
+ *
+ *  @return 48 bit mac address
+ */
+uint64_t pack_mac(const uint8_t mac[MAC_SIZE])
+{
+    uint64_t ret = 0;
+
+    for (int i = 0; i < MAC_SIZE; i++)
+        ret = (ret << 8) | mac[i];
+    return ret;
+}
+
 /*! \brief return true if library is configured for tbr authentication
  *
  *  @param ctx workspace buffer
@@ -194,6 +241,133 @@ bool is_tbr_enabled(Sky_ctx_t *ctx)
     return (ctx->state->sky_sku[0] != '\0');
 }
 
+#if SKY_THREAD_SAFE
+/*! \brief start a lock free read of a cacheline
+ *
+ *  Waits for any writer to finish, then returns the sequence count which
+ *  must be passed to cacheline_read_retry when the read is complete
+ *
+ *  @param cl the cacheline to be read
+ *
+ *  @return sequence count of cacheline
+ */
+uint32_t cacheline_read_begin(Sky_cacheline_t *cl)
+{
+    uint32_t seq;
+
+    while ((seq = cl->seq) & 1)
+        ; /* writer in progress */
+    SKY_MEMORY_BARRIER();
+    return seq;
+}
+
+/*! \brief check whether a cacheline was modified while it was being read
+ *
+ *  @param cl the cacheline which was read
+ *  @param seq sequence count returned by cacheline_read_begin
+ *
+ *  @return true if the read must be repeated
+ */
+bool cacheline_read_retry(Sky_cacheline_t *cl, uint32_t seq)
+{
+    SKY_MEMORY_BARRIER();
+    return cl->seq != seq;
+}
+
+/*! \brief gain exclusive write access to a cacheline
+ *
+ *  The sequence count is odd while the line is being written
+ *
+ *  @param cl the cacheline to be written
+ */
+void cacheline_write_begin(Sky_cacheline_t *cl)
+{
+    uint32_t seq;
+
+    do {
+        seq = cl->seq;
+    } while ((seq & 1) || !SKY_CAS(&cl->seq, seq, seq + 1));
+    SKY_MEMORY_BARRIER();
+}
+
+/*! \brief publish the changes made to a cacheline
+ *
+ *  @param cl the cacheline which was written
+ */
+void cacheline_write_end(Sky_cacheline_t *cl)
+{
+    SKY_MEMORY_BARRIER();
+    cl->seq++;
+}
+#endif
+
+#if CACHE_SIZE
+/*! \brief count a write to a cacheline, see sky_new_request_from
+ *
+ *  @param s state holding the cache
+ */
+void cache_changed(Sky_state_t *s)
+{
+    uint32_t n;
+
+    do {
+        n = s->cache_changes;
+    } while (!ATOMIC_CAS(&s->cache_changes, n, n + 1));
+}
+
+/*! \brief note when a cacheline ages out, if it is before any other
+ *
+ *  @param s state holding the cache
+ *  @param expiry time in seconds (from 1970 epoch) when the cacheline ages out
+ */
+void cache_expires(Sky_state_t *s, uint32_t expiry)
+{
+    uint32_t e;
+
+    do {
+        e = s->cache_expiry;
+        if (expiry >= e)
+            return;
+    } while (!ATOMIC_CAS(&s->cache_expiry, e, expiry));
+}
+#endif
+
+/*! \brief count a cache hit, unless there have been too many in a row
+ *
+ *  After 127 consecutive cache hits a request must be sent to refresh the cache
+ *
+ *  @param s state of the device
+ *
+ *  @return true if hit was counted, false if the cache must not be used
+ */
+bool count_cache_hit(Sky_state_t *s)
+{
+    uint8_t n;
+
+    do {
+        n = s->cache_hits;
+        if (n >= 127)
+            return false;
+    } while (!ATOMIC_CAS(&s->cache_hits, n, (uint8_t)(n + 1)));
+    return true;
+}
+
+/*! \brief clear the count of consecutive cache hits, after a cache miss
+ *
+ *  Cleared by compare and swap, as count_cache_hit counts, so that a reset is not
+ *  a plain store racing with hits counted by workspaces on other threads
+ *
+ *  @param s state of the device
+ */
+void reset_cache_hits(Sky_state_t *s)
+{
+    uint8_t n;
+
+    do {
+        n = s->cache_hits;
+    } while (n && !ATOMIC_CAS(&s->cache_hits, n, 0));
+}
+
 #if SKY_DEBUG
 /*! \brief basename return pointer to the basename of path or path
  *
@@ -392,8 +566,9 @@ void dump_beacon(Sky_ctx_t *ctx, char *str, Beacon_t *b, const char *file, const
     int idx_b, idx_c;
 
     /* Test whether beacon is in cache or workspace */
-    if (b >= ctx->beacon && b < ctx->beacon + TOTAL_BEACONS + 1) {
-        idx_b = b - ctx->beacon;
+    if (b >= ctx->slot && b < ctx->slot + STAGED_BEACONS) {
+        for (idx_b = 0; idx_b < NUM_BEACONS(ctx) && &BEACON_AT(ctx, idx_b) != b; idx_b++)
+            ;
         idx_c = 0;
         snprintf(prefixstr, sizeof(prefixstr), "%s     %-2d%s %6s", str, idx_b,
             b->h.connected ? "*" : " ", sky_pbeacon(b));
@@ -458,7 +633,7 @@ void dump_workspace(Sky_ctx_t *ctx, const char *file, const char *func)
         NUM_BEACONS(ctx), NUM_APS(ctx), is_tbr_enabled(ctx) ? ", TBR" : "",
         ctx->debounce ? ", Debounce" : "");
     for (i = 0; i < NUM_BEACONS(ctx); i++)
-        dump_beacon(ctx, "req", &ctx->beacon[i], file, func);
+        dump_beacon(ctx, "req", &BEACON_AT(ctx, i), file, func);
 
     if (CONFIG(ctx->state, last_config_time) == 0) {
         logfmt(file, func, ctx, SKY_LOG_LEVEL_DEBUG,
@@ -599,7 +774,7 @@ uint32_t get_ctx_id_length(Sky_ctx_t *ctx)
  */
 uint8_t *get_ctx_ul_app_data(Sky_ctx_t *ctx)
 {
-    return ctx->state->sky_ul_app_data;
+    return ctx->sky_ul_app_data;
 }
 
 /*! \brief field extraction for dynamic use of Nanopb (ctx sky_id_len)
@@ -610,7 +785,7 @@ uint8_t *get_ctx_ul_app_data(Sky_ctx_t *ctx)
  */
 uint32_t get_ctx_ul_app_data_length(Sky_ctx_t *ctx)
 {
-    return ctx->state->sky_ul_app_data_len;
+    return ctx->sky_ul_app_data_len;
 }
 
 /*! \brief field extraction for dynamic use of Nanopb (ctx sky_sku)
@@ -687,9 +862,9 @@ int32_t get_num_beacons(Sky_ctx_t *ctx, Sky_beacon_type_t t)
         return NUM_APS(ctx);
     } else {
         for (i = NUM_APS(ctx), b = 0; i < NUM_BEACONS(ctx); i++) {
-            if (ctx->beacon[i].h.type == t)
+            if (BEACON_AT(ctx, i).h.type == t)
                 b++;
-            if (b && ctx->beacon[i].h.type != t)
+            if (b && BEACON_AT(ctx, i).h.type != t)
                 break; /* End of beacons of this type */
         }
     }
@@ -712,7 +887,7 @@ int32_t get_num_cells(Sky_ctx_t *ctx)
     }
 
     for (i = NUM_APS(ctx), b = 0; i < NUM_BEACONS(ctx); i++) {
-        if (is_cell_type(&ctx->beacon[i]))
+        if (is_cell_type(&BEACON_AT(ctx, i)))
             b++;
     }
 
@@ -735,11 +910,11 @@ int get_base_beacons(Sky_ctx_t *ctx, Sky_beacon_type_t t)
         return 0;
     }
     if (t == SKY_BEACON_AP) {
-        if (ctx->beacon[0].h.type == t)
+        if (BEACON_AT(ctx, 0).h.type == t)
             return i;
     } else {
         for (i = NUM_APS(ctx); i < NUM_BEACONS(ctx); i++) {
-            if (ctx->beacon[i].h.type == t)
+            if (BEACON_AT(ctx, i).h.type == t)
                 return i;
         }
     }
@@ -774,7 +949,7 @@ uint8_t *get_ap_mac(Sky_ctx_t *ctx, uint32_t idx)
         // LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Bad param");
         return 0;
     }
-    return ctx->beacon[idx].ap.mac;
+    return BEACON_AT(ctx, idx).ap.mac;
 }
 
 /*! \brief field extraction for dynamic use of Nanopb (AP/freq)
@@ -790,7 +965,7 @@ int64_t get_ap_freq(Sky_ctx_t *ctx, uint32_t idx)
         // LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Bad param");
         return 0;
     }
-    return ctx->beacon[idx].ap.freq;
+    return BEACON_AT(ctx, idx).ap.freq;
 }
 
 /*! \brief field extraction for dynamic use of Nanopb (AP/rssi)
@@ -806,7 +981,7 @@ int64_t get_ap_rssi(Sky_ctx_t *ctx, uint32_t idx)
         // LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Bad param");
         return 0;
     }
-    return ctx->beacon[idx].h.rssi;
+    return BEACON_AT(ctx, idx).h.rssi;
 }
 
 /*! \brief field extraction for dynamic use of Nanopb (AP/is_connected)
@@ -822,7 +997,7 @@ bool get_ap_is_connected(Sky_ctx_t *ctx, uint32_t idx)
         // LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Bad param");
         return false;
     }
-    return ctx->beacon[idx].h.connected;
+    return BEACON_AT(ctx, idx).h.connected;
 }
 
 /*! \brief field extraction for dynamic use of Nanopb (AP/timestamp)
@@ -838,7 +1013,7 @@ int64_t get_ap_age(Sky_ctx_t *ctx, uint32_t idx)
         // LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Bad param");
         return 0;
     }
-    return ctx->beacon[idx].h.age;
+    return BEACON_AT(ctx, idx).h.age;
 }
 
 /*! \brief Get a cell
@@ -855,7 +1030,7 @@ Beacon_t *get_cell(Sky_ctx_t *ctx, uint32_t idx)
         return 0;
     }
 
-    return &ctx->beacon[NUM_APS(ctx) + idx];
+    return &BEACON_AT(ctx, NUM_APS(ctx) + idx);
 }
 
 /*! \brief Get cell type
@@ -1196,7 +1371,7 @@ int32_t get_num_vaps(Sky_ctx_t *ctx)
         return 0;
     }
     for (j = 0; j < NUM_APS(ctx); j++) {
-        w = &ctx->beacon[j];
+        w = &BEACON_AT(ctx, j);
         nv += (w->ap.vg[VAP_LENGTH].len ? 1 : 0);
 #if SKY_DEBUG
         total_vap += w->ap.vg[VAP_LENGTH].len;
@@ -1226,7 +1401,7 @@ uint8_t *get_vap_data(Sky_ctx_t *ctx, uint32_t idx)
     /* Walk through APs counting vap, when the idx is the current Virtual Group */
     /* return the Virtual AP data */
     for (j = 0; j < NUM_APS(ctx); j++) {
-        w = &ctx->beacon[j];
+        w = &BEACON_AT(ctx, j);
         // LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "AP: %d Group #: %d len: %d nvg: %d", j, idx, w->ap.vg_len, nvg);
         if (w->ap.vg[VAP_LENGTH].len && nvg == idx) {
             // LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Group: %d AP: %d idx: %d len: %d ap: %d", idx, j, idx,
@@ -1268,7 +1443,7 @@ uint8_t *select_vap(Sky_ctx_t *ctx)
         /* then walk through again, truncating the compressed bytes */
         no_more = true;
         for (j = 0; j < NUM_APS(ctx); j++) {
-            w = &ctx->beacon[j];
+            w = &BEACON_AT(ctx, j);
             if (w->ap.vg_len > cap_vap[j]) {
                 cap_vap[j]++;
                 nvap++;
@@ -1281,7 +1456,7 @@ uint8_t *select_vap(Sky_ctx_t *ctx)
     }
     /* Complete the virtual group patch bytes with index of parent and update length */
     for (j = 0; j < NUM_APS(ctx); j++) {
-        w = &ctx->beacon[j];
+        w = &BEACON_AT(ctx, j);
         w->ap.vg[VAP_PARENT].ap = j;
         LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "AP: %d len: %d -> %d", w->ap.vg[VAP_PARENT].ap,
             w->ap.vg[VAP_LENGTH].len, cap_vap[j] ? cap_vap[j] + VAP_PARENT : 0);
@@ -43,11 +43,54 @@
 #define LOG_BUFFER(c, l, b, s)
 #endif
 
+/* Readers of a cacheline repeat their work until CACHELINE_READ_RETRY is false */
+#if SKY_THREAD_SAFE
+#define CACHELINE_READ_BEGIN(cl) cacheline_read_begin(cl)
+#define CACHELINE_READ_RETRY(cl, seq) cacheline_read_retry((cl), (seq))
+#define CACHELINE_WRITE_BEGIN(cl) cacheline_write_begin(cl)
+#define CACHELINE_WRITE_END(cl) cacheline_write_end(cl)
+#else
+#define CACHELINE_READ_BEGIN(cl) ((void)(cl), 0)
+#define CACHELINE_READ_RETRY(cl, seq) ((void)(cl), (void)(seq), false)
+#define CACHELINE_WRITE_BEGIN(cl)                                                                  \
+    do {                                                                                           \
+    } while (0)
+#define CACHELINE_WRITE_END(cl)                                                                    \
+    do {                                                                                           \
+    } while (0)
+#endif
+
+/* Compare and swap, a plain store when not thread safe */
+#if SKY_THREAD_SAFE
+#define ATOMIC_CAS(p, old, new) SKY_CAS((p), (old), (new))
+#else
+#define ATOMIC_CAS(p, old, new) (*(p) = (new), true)
+#endif
+
 Sky_status_t set_error_status(Sky_errno_t *sky_errno, Sky_errno_t code);
+uint32_t workspace_token(Sky_ctx_t *ctx);
 int validate_workspace(Sky_ctx_t *ctx);
+#if SKY_DEBUG_WORKSPACE
+#define validate_workspace_internal(ctx) validate_workspace(ctx)
+#else
+#define validate_workspace_internal(ctx) ((ctx) != NULL)
+#endif
 int validate_cache(Sky_state_t *s, Sky_loggerfn_t logf);
 int validate_mac(uint8_t mac[6], Sky_ctx_t *ctx);
+uint64_t pack_mac(const uint8_t mac[MAC_SIZE]);
 bool is_tbr_enabled(Sky_ctx_t *ctx);
+#if SKY_THREAD_SAFE
+uint32_t cacheline_read_begin(Sky_cacheline_t *cl);
+bool cacheline_read_retry(Sky_cacheline_t *cl, uint32_t seq);
+void cacheline_write_begin(Sky_cacheline_t *cl);
+void cacheline_write_end(Sky_cacheline_t *cl);
+#endif
+#if CACHE_SIZE
+void cache_changed(Sky_state_t *s);
+void cache_expires(Sky_state_t *s, uint32_t expiry);
+#endif
+bool count_cache_hit(Sky_state_t *s);
+void reset_cache_hits(Sky_state_t *s);
 #if SKY_DEBUG
 const char *sky_basename(const char *path);
 int logfmt(
@@ -37,9 +37,9 @@
 
 #define MIN(x, y) ((x) > (y) ? (y) : (x))
 #define EFFECTIVE_RSSI(b) ((b) == -1 ? (-127) : (b))
-#define AP_BELOW_RSSI_THRESHOLD(ctx, idx)                                                          \
-    (EFFECTIVE_RSSI((ctx)->beacon[(idx)].h.rssi) <                                                 \
-        -(int)CONFIG((ctx)->state, cache_neg_rssi_threshold))
+#define RSSI_BELOW_THRESHOLD(ctx, rssi)                                                            \
+    (EFFECTIVE_RSSI(rssi) < -(int)CONFIG((ctx)->state, cache_neg_rssi_threshold))
+#define AP_BELOW_RSSI_THRESHOLD(ctx, idx) RSSI_BELOW_THRESHOLD((ctx), AP_RSSI((ctx), (idx)))
 
 /*! \brief compare beacons for equality
  *
@@ -76,46 +76,37 @@ static Sky_status_t equal(Sky_ctx_t *ctx, Beacon_t *a, Beacon_t *b, Sky_beacon_p
     return SKY_FAILURE;
 }
 
+/* lowest bit of each nibble of a MAC packed by pack_mac */
+#define NIBBLE_LSBS 0x111111111111ULL
+/* Local Administrative bit of a MAC packed by pack_mac */
+#define LOCAL_ADMIN_BIT ((uint64_t)LOCAL_ADMIN_MASK(0xFF) << (8 * (MAC_SIZE - 1)))
+
 /*! \brief test two MAC addresses for being members of same virtual Group
  *
  *   Similar means the two mac addresses differ only in one nibble AND
  *   if that nibble is the second-least-significant bit of second hex digit,
  *   then that bit must match too.
  *
- *  @param macA pointer to the first MAC
- *  @param macB pointer to the second MAC
- *  @param pn pointer to nibble index of where they differ if similar (0-11)
+ *   All nibbles are compared at once, by folding the bits of each nibble of
+ *   the difference into its lowest bit.
+ *
+ *  @param macA the first MAC, packed by pack_mac
+ *  @param macB the second MAC, packed by pack_mac
  *
  *  @return negative, 0 or positive
  *  return 0 when NOT similar, negative indicates parent is B, positive parent is A
- *  if macs are similar, and pn is not NULL, *pn is set to nibble index of difference
  */
-static int mac_similar(uint8_t macA[], uint8_t macB[], int *pn)
+static int mac_similar(uint64_t macA, uint64_t macB)
 {
-    size_t num_diff = 0; // Num hex digits which differ
-    size_t idx_diff = 0; // nibble digit which differs
-    size_t n;
-    int result = 1;
-
-    /* for each nibble, increment count if different */
-    for (n = 0; n < MAC_SIZE * 2; n++) {
-        if ((macA[n / 2] & NIBBLE_MASK(n)) != (macB[n / 2] & NIBBLE_MASK(n))) {
-            if (++num_diff > 1)
-                return 0;
-            idx_diff = n;
-            result = macA[n / 2] - macB[n / 2];
-        }
-    }
+    uint64_t diff = macA ^ macB;
+    uint64_t nibbles = diff | (diff >> 1);
 
-    /* Only one nibble different, but is the Local Administrative bit different */
-    if (LOCAL_ADMIN_MASK(macA[0]) != LOCAL_ADMIN_MASK(macB[0])) {
-        return 0; /* not similar */
-    }
+    nibbles = (nibbles | (nibbles >> 2)) & NIBBLE_LSBS;
 
-    /* report which nibble is different */
-    if (pn)
-        *pn = idx_diff;
-    return result;
+    /* more than one nibble different, or the Local Administrative bit is different */
+    if ((nibbles & (nibbles - 1)) || (diff & LOCAL_ADMIN_BIT))
+        return 0; /* not similar */
+    return macA < macB ? -1 : 1;
 }
 
 /*! \brief try to remove one AP by selecting an AP which leaves best spread of rssi values
@@ -132,19 +123,19 @@ static bool remove_worst_ap_by_rssi(Sky_ctx_t *ctx)
 {
     int i, reject, jump, up_down;
     float band_range, worst, difference;
-    float ideal_rssi[MAX_AP_BEACONS + 1];
+    float ideal_rssi[STAGED_BEACONS];
     Beacon_t *b;
 
     if (NUM_APS(ctx) <= CONFIG(ctx->state, max_ap_beacons))
         return false;
 
-    if (ctx->beacon[0].h.type != SKY_BEACON_AP)
+    if (BEACON_AT(ctx, 0).h.type != SKY_BEACON_AP)
         return false;
 
     /* what share of the range of rssi values does each beacon represent */
-    band_range = (EFFECTIVE_RSSI(ctx->beacon[0].h.rssi) -
-                     EFFECTIVE_RSSI(ctx->beacon[NUM_APS(ctx) - 1].h.rssi)) /
-                 ((float)NUM_APS(ctx) - 1);
+    band_range =
+        (EFFECTIVE_RSSI(AP_RSSI(ctx, 0)) - EFFECTIVE_RSSI(AP_RSSI(ctx, NUM_APS(ctx) - 1))) /
+        ((float)NUM_APS(ctx) - 1);
 
     /* if the rssi range is small
      * first, look for and remove an uncached *and* unconnected AP.
@@ -157,7 +148,7 @@ static bool remove_worst_ap_by_rssi(Sky_ctx_t *ctx)
         /* search from middle of range looking for uncached and unconnected beacon */
         for (jump = 0, up_down = -1, i = NUM_APS(ctx) / 2; i >= 0 && i < NUM_APS(ctx);
              jump++, i += up_down * jump, up_down = -up_down) {
-            b = &ctx->beacon[i];
+            b = &BEACON_AT(ctx, i);
             if (!b->ap.property.in_cache && !b->ap.h.connected) {
                 LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Warning: rssi range is small, %s beacon",
                     !jump ? "remove middle unconnected uncached" : "remove unconnected uncached");
@@ -166,7 +157,7 @@ static bool remove_worst_ap_by_rssi(Sky_ctx_t *ctx)
         }
         for (jump = 0, up_down = -1, i = NUM_APS(ctx) / 2; i >= 0 && i < NUM_APS(ctx);
              jump++, i += up_down * jump, up_down = -up_down) {
-            b = &ctx->beacon[i];
+            b = &BEACON_AT(ctx, i);
             if (!b->ap.property.in_cache) {
                 LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Warning: rssi range is small, %s beacon",
                     !jump ? "remove middle uncached" : "remove uncached");
@@ -183,13 +174,13 @@ static bool remove_worst_ap_by_rssi(Sky_ctx_t *ctx)
     if (AP_BELOW_RSSI_THRESHOLD(ctx, NUM_APS(ctx) - 1)) {
         /* find weak ap not connected amd not in cache if possible */
         for (i = NUM_APS(ctx) - 1, reject = -1; i > 0 && reject == -1; i--) {
-            if (AP_BELOW_RSSI_THRESHOLD(ctx, i) && !ctx->beacon[i].ap.h.connected &&
-                !ctx->beacon[i].ap.property.in_cache)
+            if (AP_BELOW_RSSI_THRESHOLD(ctx, i) && !BEACON_AT(ctx, i).ap.h.connected &&
+                !BEACON_AT(ctx, i).ap.property.in_cache)
                 reject = i;
         }
         /* Second, if none found, try to find uncached, weak, AP. */
         for (i = NUM_APS(ctx) - 1, reject = -1; i > 0 && reject == -1; i--) {
-            if (AP_BELOW_RSSI_THRESHOLD(ctx, i) && !ctx->beacon[i].ap.property.in_cache)
+            if (AP_BELOW_RSSI_THRESHOLD(ctx, i) && !BEACON_AT(ctx, i).ap.property.in_cache)
                 reject = i;
         }
         /* Third, if none found, remove weakest AP. */
@@ -205,14 +196,14 @@ static bool remove_worst_ap_by_rssi(Sky_ctx_t *ctx)
 
     /* for each beacon, work out it's ideal rssi value to give an even distribution */
     for (i = 0; i < NUM_APS(ctx); i++)
-        ideal_rssi[i] = EFFECTIVE_RSSI(ctx->beacon[0].h.rssi) - (i * band_range);
+        ideal_rssi[i] = EFFECTIVE_RSSI(AP_RSSI(ctx, 0)) - (i * band_range);
 
     /* find AP with poorest fit to ideal rssi */
     /* always keep lowest and highest rssi */
     /* unless all the middle candidates are connected or in the cache */
     for (i = 1, reject = -1, worst = 0; i < NUM_APS(ctx) - 1; i++) {
-        difference = fabs(EFFECTIVE_RSSI(ctx->beacon[i].h.rssi) - ideal_rssi[i]);
-        if (!ctx->beacon[i].ap.property.in_cache && !ctx->beacon[i].ap.h.connected &&
+        difference = fabs(EFFECTIVE_RSSI(AP_RSSI(ctx, i)) - ideal_rssi[i]);
+        if (!BEACON_AT(ctx, i).ap.property.in_cache && !BEACON_AT(ctx, i).ap.h.connected &&
             difference >= worst) {
             worst = difference;
             reject = i;
@@ -222,8 +213,8 @@ static bool remove_worst_ap_by_rssi(Sky_ctx_t *ctx)
     /* find poorest fit which may be in cache */
     if (reject == -1) {
         for (i = 1, worst = 0; i < NUM_APS(ctx) - 1; i++) {
-            difference = fabs(EFFECTIVE_RSSI(ctx->beacon[i].h.rssi) - ideal_rssi[i]);
-            if (!ctx->beacon[i].ap.h.connected && difference >= worst) {
+            difference = fabs(EFFECTIVE_RSSI(AP_RSSI(ctx, i)) - ideal_rssi[i]);
+            if (!BEACON_AT(ctx, i).ap.h.connected && difference >= worst) {
                 worst = difference;
                 reject = i;
             }
@@ -232,16 +223,16 @@ static bool remove_worst_ap_by_rssi(Sky_ctx_t *ctx)
     if (reject == -1) {
         /* haven't found a beacon to remove yet due to matching cached beacons or connected */
         /* Throw away either lowest or highest rssi valued beacons if not cached */
-        if (!ctx->beacon[NUM_APS(ctx) - 1].ap.property.in_cache)
+        if (!BEACON_AT(ctx, NUM_APS(ctx) - 1).ap.property.in_cache)
             reject = NUM_APS(ctx) - 1;
-        else if (!ctx->beacon[0].ap.property.in_cache)
+        else if (!BEACON_AT(ctx, 0).ap.property.in_cache)
             reject = 0;
         else
             reject = NUM_APS(ctx) / 2; /* remove middle beacon (all beacons are in cache) */
     }
 #if SKY_DEBUG
     for (i = 0; i < NUM_APS(ctx); i++) {
-        b = &ctx->beacon[i];
+        b = &BEACON_AT(ctx, i);
         LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG,
             "%-2d %s %s: %-2d, %s ideal %d.%02d fit %2d.%02d MAC %02X:%02X:%02X:%02X:%02X:%02X (%d)",
             i, b->ap.h.connected ? "*" : " ", (reject == i) ? "remove" : "      ", i,
@@ -271,11 +262,20 @@ static int count_cached_aps_in_workspace(Sky_ctx_t *ctx, Sky_cacheline_t *cl)
     int j, i;
     if (!ctx || !cl)
         return -1;
+#if SKY_AP_MIRROR
+    for (i = 0; i < NUM_APS(cl); i++) {
+        uint64_t mac = pack_mac(cl->beacon[i].ap.mac);
+
+        for (j = 0; j < NUM_APS(ctx); j++)
+            num_aps_cached += ctx->aps.mac[j] == mac;
+    }
+#else
     for (j = 0; j < NUM_APS(ctx); j++) {
         for (i = 0; i < NUM_APS(cl); i++) {
-            num_aps_cached += equal(ctx, &ctx->beacon[j], &cl->beacon[i], NULL) ? 1 : 0;
+            num_aps_cached += equal(ctx, &BEACON_AT(ctx, j), &cl->beacon[i], NULL) ? 1 : 0;
         }
     }
+#endif
 #ifdef VERBOSE_DEBUG
     LOGFMT(
         ctx, SKY_LOG_LEVEL_DEBUG, "%d APs in cache %d", num_aps_cached, cl - ctx->state->cacheline);
@@ -284,42 +284,94 @@ static int count_cached_aps_in_workspace(Sky_ctx_t *ctx, Sky_cacheline_t *cl)
 }
 #endif
 
-/*! \brief select between two virtual APs which should be removed,
- *  and then remove it
+/*! \brief move key down a heap until the keys below it are smaller
  *
- *  keep beacons with connectedness and then in_cache properties
+ *  @param key keys of heap
+ *  @param i index of key to move
+ *  @param n number of keys in heap
+ */
+static void sift_key(uint64_t key[], int i, int n)
+{
+    uint64_t tmp = key[i];
+    int child;
+
+    for (; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n && key[child + 1] > key[child])
+            child++;
+        if (key[child] <= tmp)
+            break;
+        key[i] = key[child];
+    }
+    key[i] = tmp;
+}
+
+/*! \brief sort keys in increasing order
+ *
+ *  Heap sort, so time is n log n and no more space is needed
+ *
+ *  @param key keys to sort
+ *  @param n number of keys
+ */
+static void sort_keys(uint64_t key[], int n)
+{
+    uint64_t tmp;
+    int i;
+
+    for (i = n / 2 - 1; i >= 0; i--)
+        sift_key(key, i, n);
+    for (i = n - 1; i > 0; i--) {
+        tmp = key[0];
+        key[0] = key[i];
+        key[i] = tmp;
+        sift_key(key, 0, i);
+    }
+}
+
+/*! \brief add AP as child of a virtual group
  *
  *  @param ctx Skyhook request context
+ *  @param parent beacon of parent AP
+ *  @param child beacon of child AP
+ *  @param n nibble index where child differs from parent (0-11)
  *
- *  @return true if beacon removed or false otherwise
+ *  @return true if child is in group, false if it has children itself or group is full
  */
-static bool remove_poorest_of_pair(Sky_ctx_t *ctx, int i, int j)
+static bool add_child_to_group(Sky_ctx_t *ctx, Beacon_t *parent, Beacon_t *child, int n)
 {
-    /* Assume we'll keep i and discard j. Then, apply following
-     * logic to see if this should be reversed:
-     * If j is connected and i is not, keep j
-     * If i and j have the same connected state and j is in cache and i is not,
-     * keep j.
-     */
-    int tmp;
-
-    if ((ctx->beacon[j].ap.h.connected && !ctx->beacon[i].ap.h.connected) ||
-        ((ctx->beacon[j].ap.h.connected == ctx->beacon[i].ap.h.connected) &&
-            (ctx->beacon[j].ap.property.in_cache && !ctx->beacon[i].ap.property.in_cache))) {
-        tmp = i;
-        i = j;
-        j = tmp;
-    }
-    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "remove_beacon: %d similar to %d%s%s", j, i,
-        ctx->beacon[i].ap.h.connected ? " (connected)" : "",
-        ctx->beacon[i].ap.property.in_cache ? " (cached)" : "");
-    return (remove_beacon(ctx, j) == SKY_SUCCESS);
+    Vap_t *patch = &parent->ap.vg[VAP_FIRST_DATA];
+    uint8_t value = (child->ap.mac[n / 2] & NIBBLE_MASK(n)) >> (4 * ((~n) & 1));
+    int i;
+
+    if (child->ap.vg_len)
+        return false;
+    /* child may have been reported again since it was added */
+    for (i = 0; i < parent->ap.vg_len; i++)
+        if (patch[i].data.nibble_idx == n && patch[i].data.value == value)
+            return true;
+    if (parent->ap.vg_len >= MIN(CONFIG(ctx->state, max_vap_per_ap), MAX_VAP_PER_AP))
+        return false;
+    patch = &patch[parent->ap.vg_len];
+    patch->data.nibble_idx = n;
+    patch->data.value = value;
+    parent->ap.vg_prop[parent->ap.vg_len] = child->ap.property;
+    parent->ap.vg_len++;
+    return true;
 }
 
+/* sort key of AP for virtual grouping, see remove_virtual_ap */
+#define GROUP_KEY(mac, rank, idx) (((mac) << 16) | ((uint64_t)(rank) << 8) | (uint64_t)(idx))
+#define GROUP_IDX(key) ((int)((key)&0xFF))
+
 /*! \brief try to reduce AP by filtering out virtual AP
  *
- *  When similar, remove beacon with highesr mac address
- *  unless it is in cache, then choose to remove the uncached beacon
+ *  APs which differ in one nibble of their mac, but not in the Local Administrative
+ *  bit, form a virtual group. For each nibble, APs are sorted by mac with that nibble
+ *  masked, so each group is a run of equal keys. In each group, the connected AP is
+ *  kept, then one in cache, then the one with the lowest mac. The others are removed,
+ *  weakest first, until the workspace holds no more APs than a request may carry.
+ *  An AP kept in one group may be removed in another, so groups form chains. Where it
+ *  can, a removed AP is recorded as a child of the nearest AP up its chain which is
+ *  kept, if the two differ in one nibble.
  *
  *  @param ctx Skyhook request context
  *
@@ -327,8 +379,15 @@ static bool remove_poorest_of_pair(Sky_ctx_t *ctx, int i, int j)
  */
 static bool remove_virtual_ap(Sky_ctx_t *ctx)
 {
-    int i, j;
-    int cmp;
+    uint64_t key[STAGED_BEACONS], mask;
+    int16_t parent[STAGED_BEACONS]; /* index of AP kept in group, -1 if not grouped */
+    uint8_t nibble[STAGED_BEACONS]; /* where AP differs from AP kept, MAC_SIZE * 2 if more */
+    uint8_t kept[STAGED_BEACONS]; /* slot of AP kept, as indexes change as APs are removed */
+    bool keeps[STAGED_BEACONS]; /* AP is kept in some group */
+    bool gone[STAGED_BEACONS]; /* AP is to be removed */
+    int i, j, n, run, num_aps = NUM_APS(ctx);
+    bool removed, grouped;
+    Beacon_t *w;
 
     LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "ap_len: %d APs of %d beacons", (int)NUM_APS(ctx),
         (int)NUM_BEACONS(ctx));
@@ -337,8 +396,12 @@ static bool remove_virtual_ap(Sky_ctx_t *ctx)
         return false;
     }
 
+    /* nothing to do if no AP has been added since the last search */
+    if (ctx->aps_distinct)
+        return false;
+
     /* look for any AP beacon that is 'similar' to another */
-    if (ctx->beacon[0].h.type != SKY_BEACON_AP) {
+    if (BEACON_AT(ctx, 0).h.type != SKY_BEACON_AP) {
         LOGFMT(ctx, SKY_LOG_LEVEL_CRITICAL, "beacon type not WiFi");
         return false;
     }
@@ -346,27 +409,69 @@ static bool remove_virtual_ap(Sky_ctx_t *ctx)
 #ifdef VERBOSE_DEBUG
     DUMP_WORKSPACE(ctx);
 #endif
-    /* Compare all beacons, looking for similar macs
-     * Try to keep lowest of two beacons with similar macs, unless
-     * the lower one is connected or in cache and the other is not
-     */
-    for (j = NUM_APS(ctx) - 1; j > 0; j--) {
-        for (i = j - 1; i >= 0; i--) {
-            if ((cmp = mac_similar(ctx->beacon[i].ap.mac, ctx->beacon[j].ap.mac, NULL)) < 0) {
-                /* j has higher mac so we will remove it unless connected or in cache indicate otherwise
-                 *
-                 */
-                return remove_poorest_of_pair(ctx, i, j);
-            } else if (cmp > 0) {
-                /* situation is exactly reversed (i has higher mac) but logic is otherwise
-                 * identical
-                 */
-                return remove_poorest_of_pair(ctx, j, i);
-            }
+    for (i = 0; i < num_aps; i++) {
+        parent[i] = -1;
+        keeps[i] = BEACON_AT(ctx, i).ap.vg_len != 0;
+    }
+    for (n = MAC_SIZE * 2 - 1; n >= 0; n--) {
+        mask = ~((uint64_t)0xF << (4 * (MAC_SIZE * 2 - 1 - n))) | LOCAL_ADMIN_BIT;
+        for (i = j = 0; i < num_aps; i++) {
+            w = &BEACON_AT(ctx, i);
+            if (parent[i] >= 0)
+                continue;
+            /* AP kept comes first, connected, then in cache, then with children, then by mac */
+            key[j++] = GROUP_KEY(AP_MAC(ctx, i) & mask,
+                (!w->ap.h.connected << 6) | (!w->ap.property.in_cache << 5) | (!keeps[i] << 4) |
+                    ((AP_MAC(ctx, i) & ~mask) >> (4 * (MAC_SIZE * 2 - 1 - n))),
+                i);
+        }
+        sort_keys(key, j);
+        for (i = 0; i < j; i = run) {
+            for (run = i + 1; run < j && (key[run] >> 16) == (key[i] >> 16); run++)
+                parent[GROUP_IDX(key[run])] = GROUP_IDX(key[i]);
+            if (run > i + 1)
+                keeps[GROUP_IDX(key[i])] = true;
         }
     }
-    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "no match");
-    return false;
+
+    /* weakest grouped APs go, until few enough are left */
+    for (i = num_aps - 1, n = num_aps - CONFIG(ctx->state, max_ap_beacons); i >= 0; i--) {
+        gone[i] = n > 0 && parent[i] >= 0;
+        n -= gone[i];
+    }
+    /* follow chain to AP kept, and find the nibble in which it differs, if only one */
+    for (i = 0; i < num_aps; i++) {
+        for (j = i; gone[j]; j = parent[j])
+            ;
+        kept[i] = ctx->order[j];
+        mask = AP_MAC(ctx, i) ^ AP_MAC(ctx, j);
+        for (n = 0; n < MAC_SIZE * 2; n++)
+            if (!(mask & ~((uint64_t)0xF << (4 * (MAC_SIZE * 2 - 1 - n)))))
+                break;
+        nibble[i] = n;
+    }
+
+    /* record each AP to go in its group, then remove them all at once */
+    for (i = num_aps - 1; i >= 0; i--) {
+        if (!gone[i])
+            continue;
+        w = &ctx->slot[kept[i]];
+        grouped = nibble[i] < MAC_SIZE * 2 &&
+                  add_child_to_group(ctx, w, &BEACON_AT(ctx, i), nibble[i]);
+        LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "remove_beacon: %d similar to %d%s%s%s", i, parent[i],
+            w->ap.h.connected ? " (connected)" : "", w->ap.property.in_cache ? " (cached)" : "",
+            grouped ? " (grouped)" : "");
+    }
+    removed = remove_beacons(ctx, gone, num_aps) > 0;
+    if (!removed) {
+        LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "no match");
+        ctx->aps_distinct = true;
+        return false;
+    }
+
+    /* APs with more children go first of those of equal rssi, see insert_beacon */
+    sort_aps(ctx);
+    return true;
 }
 
 /*! \brief try to reduce AP by filtering out the oldest one
@@ -388,11 +493,11 @@ static bool remove_worst_ap_by_age(Sky_ctx_t *ctx)
 
     /* Find the youngest and oldest APs. Search from weakest remembering oldest and weakest */
     for (i = NUM_APS(ctx) - 1; i >= 0; i--) {
-        if (ctx->beacon[i].h.age < youngest_age) {
-            youngest_age = ctx->beacon[i].h.age;
+        if (AP_AGE(ctx, i) < youngest_age) {
+            youngest_age = AP_AGE(ctx, i);
         }
-        if (ctx->beacon[i].h.age > oldest_age) {
-            oldest_age = ctx->beacon[i].h.age;
+        if (AP_AGE(ctx, i) > oldest_age) {
+            oldest_age = AP_AGE(ctx, i);
             oldest_idx = i;
         }
     }
@@ -407,6 +512,73 @@ static bool remove_worst_ap_by_age(Sky_ctx_t *ctx)
     return false;
 }
 
+/*! \brief tell whether remove_worst would remove a new AP as soon as it is added
+ *
+ *  Only worked out when no AP in the workspace is similar to another or to the new AP,
+ *  and the new AP would go by age or for being weak. Otherwise the AP is added.
+ *
+ *  @param ctx Skyhook request context
+ *  @param b the new beacon
+ *  @param idx index at which beacon would be inserted
+ *
+ *  @return SKY_FAILURE if AP would be removed, SKY_SUCCESS if it should be added
+ *  or SKY_ERROR if beacon is not an AP
+ */
+static Sky_status_t admit(Sky_ctx_t *ctx, Beacon_t *b, int idx)
+{
+    int i, n = NUM_APS(ctx);
+    uint32_t youngest = b->h.age, oldest = 0; /* oldest of APs in workspace */
+    bool oldest_after = false; /* an AP of oldest age would follow the new AP */
+    bool weak_after = false, weak = false; /* weak uncached AP would follow or precede it */
+    float band_range;
+    int16_t first, last;
+    uint64_t mac = pack_mac(b->ap.mac);
+
+    if (!is_ap_type(b))
+        return SKY_ERROR;
+    if (n != (int)CONFIG(ctx->state, max_ap_beacons) || !ctx->aps_distinct)
+        return SKY_SUCCESS;
+
+    for (i = 0; i < n; i++) {
+        if (mac_similar(AP_MAC(ctx, i), mac))
+            return SKY_SUCCESS; /* remove_virtual_ap decides */
+        if (AP_AGE(ctx, i) < youngest)
+            youngest = AP_AGE(ctx, i);
+        if (AP_AGE(ctx, i) > oldest) {
+            oldest = AP_AGE(ctx, i);
+            oldest_after = i >= idx;
+        } else if (AP_AGE(ctx, i) == oldest && i >= idx)
+            oldest_after = true;
+        if (AP_BELOW_RSSI_THRESHOLD(ctx, i) && !BEACON_AT(ctx, i).ap.property.in_cache) {
+            if (i >= idx)
+                weak_after = true;
+            else if (i > 0)
+                weak = true;
+        }
+    }
+
+    /* remove_worst_ap_by_age removes the last of the oldest APs */
+    if (youngest != (b->h.age > oldest ? b->h.age : oldest))
+        return (b->h.age > oldest || (b->h.age == oldest && !oldest_after)) ? SKY_FAILURE :
+                                                                             SKY_SUCCESS;
+
+    /* remove_worst_ap_by_rssi removes the last weak uncached AP, or the last AP */
+    first = idx == 0 ? b->h.rssi : AP_RSSI(ctx, 0);
+    last = idx == n ? b->h.rssi : AP_RSSI(ctx, n - 1);
+    band_range = (EFFECTIVE_RSSI(first) - EFFECTIVE_RSSI(last)) / (float)n;
+    if (band_range < 0.5 || !RSSI_BELOW_THRESHOLD(ctx, last) || weak_after)
+        return SKY_SUCCESS;
+    if (idx > 0 && RSSI_BELOW_THRESHOLD(ctx, b->h.rssi)) {
+#if CACHE_SIZE
+        if (!beacon_in_cache(ctx, b, NULL))
+            return SKY_FAILURE;
+#else
+        return SKY_FAILURE;
+#endif
+    }
+    return (!weak && idx == n) ? SKY_FAILURE : SKY_SUCCESS;
+}
+
 static Sky_status_t remove_worst(Sky_ctx_t *ctx)
 {
     /* beacon is AP and is subject to filtering */
@@ -418,6 +590,62 @@ static Sky_status_t remove_worst(Sky_ctx_t *ctx)
     return SKY_SUCCESS;
 }
 
+/* rank of AP for removal by select_aps, APs with the highest keys go */
+#define RANK_KEY(rank, score, idx)                                                                 \
+    (((uint64_t)(rank) << 48) | ((uint64_t)(score) << 8) | (uint64_t)(idx))
+#define RANK_IDX(key) ((int)((key)&0xFF))
+
+/*! \brief remove all the least desirable APs over the limit of a request
+ *
+ *  Chooses the same APs as calling remove_worst until the workspace is within the
+ *  limit. Virtual APs go first, then APs older than the youngest, oldest and
+ *  weakest first, each in a single pass. Removing those does not change which
+ *  others would go. The spread of rssi values changes with each AP removed, so the
+ *  rest go one at a time by remove_worst_ap_by_rssi.
+ *
+ *  @param ctx Skyhook request context
+ *
+ *  @return SKY_SUCCESS if APs removed or SKY_ERROR if there were none to remove
+ */
+static Sky_status_t select_aps(Sky_ctx_t *ctx)
+{
+    uint64_t key[STAGED_BEACONS];
+    bool gone[STAGED_BEACONS];
+    uint32_t youngest = UINT_MAX;
+    int i, n, num_aps;
+
+    if (NUM_APS(ctx) <= CONFIG(ctx->state, max_ap_beacons) ||
+        BEACON_AT(ctx, 0).h.type != SKY_BEACON_AP)
+        return SKY_ERROR;
+
+    /* virtual APs go in a pass of their own, as they are recorded in their groups */
+    remove_virtual_ap(ctx);
+    num_aps = NUM_APS(ctx);
+    if (num_aps <= (int)CONFIG(ctx->state, max_ap_beacons))
+        return SKY_SUCCESS;
+
+    /* APs older than the youngest go next, see remove_worst_ap_by_age */
+    for (i = 0; i < num_aps; i++)
+        if (AP_AGE(ctx, i) < youngest)
+            youngest = AP_AGE(ctx, i);
+    for (i = 0; i < num_aps; i++)
+        key[i] = AP_AGE(ctx, i) == youngest ? RANK_KEY(0, 0, i) : RANK_KEY(1, AP_AGE(ctx, i), i);
+    sort_keys(key, num_aps);
+    for (i = 0; i < num_aps; i++)
+        gone[i] = false;
+    for (i = num_aps - 1, n = num_aps - (int)CONFIG(ctx->state, max_ap_beacons);
+         n > 0 && (key[i] >> 48); i--, n--) {
+        gone[RANK_IDX(key[i])] = true;
+        LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "remove_beacon: %d oldest", RANK_IDX(key[i]));
+    }
+    remove_beacons(ctx, gone, num_aps);
+
+    /* spread of rssi values is worked out again for each AP removed */
+    while (remove_worst_ap_by_rssi(ctx))
+        ;
+    return SKY_SUCCESS;
+}
+
 /*! \brief find cache entry with a match to workspace
  *
  *   Expire any old cachelines
@@ -449,10 +677,13 @@ static Sky_status_t match(Sky_ctx_t *ctx, int *idx)
     int score; /* score is number of APs found in cacheline */
     int threshold; /* the threshold determined that ratio should meet */
     int num_aps_cached = 0;
+    int num_aps_cl = 0;
     int bestc = -1, bestput = -1;
     int bestthresh = 0;
     Sky_cacheline_t *cl;
     bool result = false;
+    bool empty;
+    uint32_t seq;
 
     if (!idx) {
         LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "Bad parameter");
@@ -466,7 +697,10 @@ static Sky_status_t match(Sky_ctx_t *ctx, int *idx)
         if (cl->time != 0 && ((uint32_t)(*ctx->gettime)(NULL)-cl->time) >
                                  (CONFIG(ctx->state, cache_age_threshold) * SECONDS_IN_HOUR)) {
             LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Cache line %d expired", i);
+            CACHELINE_WRITE_BEGIN(cl);
             cl->time = 0;
+            CACHELINE_WRITE_END(cl);
+            cache_changed(ctx->state);
         }
         /* if line is empty and it is the first one, remember it */
         if (cl->time == 0) {
@@ -489,20 +723,28 @@ static Sky_status_t match(Sky_ctx_t *ctx, int *idx)
     for (i = 0, err = false; i < CACHE_SIZE; i++) {
         cl = &ctx->state->cacheline[i];
         threshold = ratio = score = 0;
-        if (cl->time == 0 || cell_changed(ctx, cl) == true) {
+        do {
+            seq = CACHELINE_READ_BEGIN(cl);
+            empty = (cl->time == 0 || cell_changed(ctx, cl) == true);
+            if (!empty) {
+                /* count number of matching APs in workspace and cache */
+                num_aps_cached = count_cached_aps_in_workspace(ctx, cl);
+                num_aps_cl = NUM_APS(cl);
+            }
+        } while (CACHELINE_READ_RETRY(cl, seq));
+        if (empty) {
             LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG,
                 "Cache: %d: Score 0 for empty cacheline or cell change", i);
             continue;
         } else {
-            /* count number of matching APs in workspace and cache */
-            if ((num_aps_cached = count_cached_aps_in_workspace(ctx, cl)) < 0) {
+            if (num_aps_cached < 0) {
                 err = true;
                 break;
-            } else if (NUM_APS(ctx) && NUM_APS(cl)) {
+            } else if (NUM_APS(ctx) && num_aps_cl) {
                 /* Score based on ALL APs */
                 LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Cache: %d: Score based on ALL APs", i);
                 score = num_aps_cached;
-                int unionAB = NUM_APS(ctx) + NUM_APS(cl) - num_aps_cached;
+                int unionAB = NUM_APS(ctx) + num_aps_cl - num_aps_cached;
                 threshold = CONFIG(ctx->state, cache_match_used_threshold);
                 ratio = (float)score / unionAB;
                 LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Cache: %d: score %d (%d/%d) vs %d", i,
@@ -544,6 +786,9 @@ static Sky_status_t match(Sky_ctx_t *ctx, int *idx)
     if (result) {
         LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "No Cache match found. Cache %d, best score %d (vs %d)",
             bestc, (int)round(bestratio * 100), bestthresh);
+        /* note a near miss, which may provide a stale location */
+        if (bestc >= 0 && bestratio * 100 > bestthresh - CACHE_STALE_MARGIN)
+            ctx->stale_from = bestc;
         LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Best cacheline to save location: %d of %d score %d",
             bestput, CACHE_SIZE, (int)round(bestputratio * 100));
         return SKY_FAILURE;
@@ -575,6 +820,7 @@ static Sky_status_t to_cache(Sky_ctx_t *ctx, Sky_location_t *loc)
     int i = ctx->save_to;
     int j;
     uint32_t now = (*ctx->gettime)(NULL);
+    uint32_t expiry;
     Sky_cacheline_t *cl;
 
     if (CACHE_SIZE < 1) {
@@ -596,7 +842,10 @@ static Sky_status_t to_cache(Sky_ctx_t *ctx, Sky_location_t *loc)
     cl = &ctx->state->cacheline[i];
     if (loc->location_status != SKY_LOCATION_STATUS_SUCCESS) {
         LOGFMT(ctx, SKY_LOG_LEVEL_WARNING, "Won't add unknown location to cache");
+        CACHELINE_WRITE_BEGIN(cl);
         cl->time = 0; /* clear cacheline */
+        CACHELINE_WRITE_END(cl);
+        cache_changed(ctx->state);
         LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "clearing cache %d of %d", i, CACHE_SIZE);
         return SKY_ERROR;
     } else if (cl->time == 0)
@@ -604,17 +853,24 @@ static Sky_status_t to_cache(Sky_ctx_t *ctx, Sky_location_t *loc)
     else
         LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Saving to cache %d of %d", i, CACHE_SIZE);
 
+    CACHELINE_WRITE_BEGIN(cl);
     cl->len = NUM_BEACONS(ctx);
     cl->ap_len = NUM_APS(ctx);
     cl->loc = *loc;
     cl->time = now;
+    cl->fingerprint = summary_fingerprint(&ctx->summary);
+    /* keep note of earliest time any cacheline ages out, see sky_new_request */
+    expiry = now + CONFIG(ctx->state, cache_age_threshold) * SECONDS_IN_HOUR;
+    cache_expires(ctx->state, expiry);
 
     for (j = 0; j < NUM_BEACONS(ctx); j++) {
-        cl->beacon[j] = ctx->beacon[j];
+        cl->beacon[j] = BEACON_AT(ctx, j);
         if (cl->beacon[j].h.type == SKY_BEACON_AP) {
             cl->beacon[j].ap.property.in_cache = true;
         }
     }
+    CACHELINE_WRITE_END(cl);
+    cache_changed(ctx->state);
     DUMP_CACHE(ctx);
     return SKY_SUCCESS;
 #else
@@ -641,5 +897,7 @@ Sky_plugin_table_t ap_plugin_basic_table = {
     .equal = equal, /*Compare two beacons for equality */
     .remove_worst = remove_worst, /* Remove least desirable beacon from workspace */
     .cache_match = match, /* Find best match between workspace and cache lines */
-    .add_to_cache = to_cache /* Copy workspace beacons to a cacheline */
+    .add_to_cache = to_cache, /* Copy workspace beacons to a cacheline */
+    .admit = admit, /* Tell whether remove_worst would keep a new beacon */
+    .select = select_aps /* Remove all least desirable APs at once */
 };
@@ -110,7 +110,7 @@ static Sky_status_t equal(Sky_ctx_t *ctx, Beacon_t *a, Beacon_t *b, Sky_beacon_p
 static Sky_status_t remove_worst(Sky_ctx_t *ctx)
 {
     int i = NUM_BEACONS(ctx) - 1; /* index of last cell */
-    Beacon_t *b = &ctx->beacon[i];
+    Beacon_t *b = &BEACON_AT(ctx, i);
 
     LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "%d cells present. Max %d", NUM_BEACONS(ctx) - NUM_APS(ctx),
         CONFIG(ctx->state, total_beacons) - CONFIG(ctx->state, max_ap_beacons));
@@ -135,6 +135,47 @@ static Sky_status_t remove_worst(Sky_ctx_t *ctx)
     return SKY_ERROR;
 }
 
+/*! \brief tell whether remove_worst would remove a new cell as soon as it is added
+ *
+ *  @param ctx Skyhook request context
+ *  @param b the new beacon
+ *  @param idx index at which beacon would be inserted
+ *
+ *  @return SKY_FAILURE if cell would be removed, SKY_SUCCESS if it should be added
+ *  or SKY_ERROR if beacon is not a cell
+ */
+static Sky_status_t admit(Sky_ctx_t *ctx, Beacon_t *b, int idx)
+{
+    if (!is_cell_type(b))
+        return SKY_ERROR;
+    if (NUM_CELLS(ctx) != CONFIG(ctx->state, total_beacons) - CONFIG(ctx->state, max_ap_beacons))
+        return SKY_SUCCESS;
+    /* remove_worst removes the last beacon */
+    return idx == NUM_BEACONS(ctx) ? SKY_FAILURE : SKY_SUCCESS;
+}
+
+/*! \brief remove all the least desirable cells over the limit of a request at once
+ *
+ *  @param ctx Skyhook request context
+ *
+ *  @return SKY_SUCCESS if cells removed or SKY_ERROR if there were none to remove
+ */
+static Sky_status_t select_cells(Sky_ctx_t *ctx)
+{
+    bool gone[STAGED_BEACONS];
+    int i, keep = NUM_APS(ctx) + CONFIG(ctx->state, total_beacons) -
+                  CONFIG(ctx->state, max_ap_beacons);
+
+    if (NUM_BEACONS(ctx) <= keep)
+        return SKY_ERROR;
+    /* cells are in priority order, so the last ones go */
+    for (i = 0; i < NUM_BEACONS(ctx); i++)
+        gone[i] = i >= keep;
+    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "remove %d least desirable cells", NUM_BEACONS(ctx) - keep);
+    remove_beacons(ctx, gone, NUM_BEACONS(ctx));
+    return SKY_SUCCESS;
+}
+
 /*! \brief find cache entry with a match to workspace
  *
  *   Expire any old cachelines
@@ -167,6 +208,8 @@ static Sky_status_t match(Sky_ctx_t *ctx, int *idx)
     int bestthresh = 0;
     Sky_cacheline_t *cl;
     bool result = false;
+    bool empty;
+    uint32_t seq;
 
     DUMP_WORKSPACE(ctx);
     DUMP_CACHE(ctx);
@@ -183,7 +226,10 @@ static Sky_status_t match(Sky_ctx_t *ctx, int *idx)
         if (cl->time != 0 && ((uint32_t)(*ctx->gettime)(NULL)-cl->time) >
                                  (CONFIG(ctx->state, cache_age_threshold) * SECONDS_IN_HOUR)) {
             LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Cache line %d expired", i);
+            CACHELINE_WRITE_BEGIN(cl);
             cl->time = 0;
+            CACHELINE_WRITE_END(cl);
+            cache_changed(ctx->state);
         }
         /* if line is empty and it is the first one, remember it */
         if (cl->time == 0) {
@@ -198,7 +244,11 @@ static Sky_status_t match(Sky_ctx_t *ctx, int *idx)
     for (i = 0, err = false; i < CACHE_SIZE; i++) {
         cl = &ctx->state->cacheline[i];
         threshold = ratio = score = 0;
-        if (cl->time == 0 || cell_changed(ctx, cl) == true) {
+        do {
+            seq = CACHELINE_READ_BEGIN(cl);
+            empty = (cl->time == 0 || cell_changed(ctx, cl) == true);
+        } while (CACHELINE_READ_RETRY(cl, seq));
+        if (empty) {
             LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG,
                 "Cache: %d: Score 0 for empty cacheline or cell change", i);
             continue;
@@ -206,17 +256,20 @@ static Sky_status_t match(Sky_ctx_t *ctx, int *idx)
             /* count number of matching cells */
             LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Cache: %d: Score based on cell beacons", i);
             threshold = 100.0; /* 100% match */
-            score = 0.0;
-            for (int j = NUM_APS(ctx) - 1; j < NUM_BEACONS(ctx); j++) {
-                if (beacon_in_cacheline(ctx, &ctx->beacon[j], &ctx->state->cacheline[i], NULL)) {
+            do {
+                seq = CACHELINE_READ_BEGIN(cl);
+                score = 0.0;
+                for (int j = NUM_APS(ctx) - 1; j < NUM_BEACONS(ctx); j++) {
+                    if (beacon_in_cacheline(ctx, &BEACON_AT(ctx, j), cl, NULL)) {
 #ifdef VERBOSE_DEBUG
-                    LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG,
-                        "Cell Beacon %d type %s matches cache %d of %d Score %d", j,
-                        sky_pbeacon(&ctx->beacon[j]), i, CACHE_SIZE, (int)score);
+                        LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG,
+                            "Cell Beacon %d type %s matches cache %d of %d Score %d", j,
+                            sky_pbeacon(&BEACON_AT(ctx, j)), i, CACHE_SIZE, (int)score);
 #endif
-                    score = score + 1.0;
+                        score = score + 1.0;
+                    }
                 }
-            }
+            } while (CACHELINE_READ_RETRY(cl, seq));
             /* cell score = number of matching cells / cells in workspace */
             ratio = (float)score / NUM_BEACONS(ctx);
             LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "cache: %d: score %d (%d/%d) vs %d", i,
@@ -280,6 +333,7 @@ static Sky_status_t match(Sky_ctx_t *ctx, int *idx)
  *   remove_worst - find least desirable beacon and remove it
  *   cache_match  - determine if cache has a good match
  *   add_to_cache - Save workspace in cache
+ *   select       - remove all least desirable beacons over the limit
  */
 
 Sky_plugin_table_t cell_plugin_basic_table = {
@@ -290,5 +344,7 @@ Sky_plugin_table_t cell_plugin_basic_table = {
     .equal = equal, /*Compare two beacons for equality */
     .remove_worst = remove_worst, /* Remove least desirable beacon from workspace */
     .cache_match = match, /* Find best match between workspace and cache lines */
-    .add_to_cache = NULL /* Copy workspace beacons to a cacheline */
+    .add_to_cache = NULL, /* Copy workspace beacons to a cacheline */
+    .admit = admit, /* Tell whether remove_worst would keep a new beacon */
+    .select = select_cells /* Remove all least desirable cells at once */
 };
@@ -310,6 +310,17 @@ static time_t mytime(time_t *t)
         return time(NULL);
 }
 
+static void report_location(Sky_location_t *loc)
+{
+    char hex_data[200];
+    printf("Skyhook location: status: %s, lat: %d.%06d, lon: %d.%06d, hpe: %d, source: %d\n",
+        sky_pserver_status(loc->location_status), (int)loc->lat,
+        (int)fabs(round(1000000 * (loc->lat - (int)loc->lat))), (int)loc->lon,
+        (int)fabs(round(1000000 * (loc->lon - (int)loc->lon))), loc->hpe, loc->location_source);
+    bin2hex(hex_data, sizeof(hex_data), loc->dl_app_data, loc->dl_app_data_len);
+    printf("Downlink data: %s(%d)\n", hex_data, loc->dl_app_data_len);
+}
+
 /*! \brief locate function
  *
  *  Add a set of beacon scans to workspace and process the request
@@ -339,6 +350,7 @@ static int locate(Sky_ctx_t *ctx, uint32_t bufsize, Config_t *config, struct ap_
     time_t timestamp = mytime(NULL);
     Sky_status_t ret_status;
     Sky_errno_t sky_errno;
+    Sky_location_t stale;
 
     /* Start new request */
     if (sky_new_request(ctx, bufsize, ul_data, data_len, &sky_errno) != ctx) {
@@ -346,6 +358,10 @@ static int locate(Sky_ctx_t *ctx, uint32_t bufsize, Config_t *config, struct ap_
         return false;
     }
 
+    /* Accept an aging cached location while the server refreshes it */
+    if (sky_allow_stale(ctx, &sky_errno, true) != SKY_SUCCESS)
+        printf("sky_allow_stale sky_errno contains '%s'\n", sky_perror(sky_errno));
+
     /* Add APs to the request */
     for (i = 0; true; i++, ap++) {
         uint8_t mac[MAC_SIZE];
@@ -439,12 +455,25 @@ retry_after_auth:
         printf("sky_finalize_request error '%s'", sky_perror(sky_errno));
         return false;
         break;
+    case SKY_FINALIZE_PENDING:
+        /* Only returned by sky_finalize_coalesced, which is not used here */
+        free(prequest);
+        return false;
     case SKY_FINALIZE_LOCATION:
         /* Location was found in the cache. No need to go to server. */
         printf("Location found in cache\n");
         if (!server_request)
             break;
         printf("Making server request\n");
+        /* fall through */
+    case SKY_FINALIZE_STALE: /* Only returned if allowed by sky_allow_stale */
+        if (finalize == SKY_FINALIZE_STALE) {
+            /* Location from the cache may be used until the server responds */
+            printf("Stale location found in cache, refreshing\n");
+            report_location(loc);
+            stale = *loc;
+        }
+        /* fall through */
     case SKY_FINALIZE_REQUEST:
         /* send the request to the server. */
         response = malloc(response_size);
@@ -464,6 +493,11 @@ retry_after_auth:
         else {
             free(response);
             printf("ERROR: No response from server!\n");
+            if (finalize == SKY_FINALIZE_STALE) {
+                printf("Using stale location\n");
+                *loc = stale;
+                return true;
+            }
             return false;
         }
 
@@ -479,23 +513,18 @@ retry_after_auth:
                 /* Repeat request if Authentication was required for last message */
                 goto retry_after_auth;
             }
+            if (finalize == SKY_FINALIZE_STALE) {
+                /* Refresh failed, stale location is better than none */
+                printf("Using stale location\n");
+                *loc = stale;
+                return true;
+            }
         }
         break;
     }
     return false;
 }
 
-static void report_location(Sky_location_t *loc)
-{
-    char hex_data[200];
-    printf("Skyhook location: status: %s, lat: %d.%06d, lon: %d.%06d, hpe: %d, source: %d\n",
-        sky_pserver_status(loc->location_status), (int)loc->lat,
-        (int)fabs(round(1000000 * (loc->lat - (int)loc->lat))), (int)loc->lon,
-        (int)fabs(round(1000000 * (loc->lon - (int)loc->lon))), loc->hpe, loc->location_source);
-    bin2hex(hex_data, sizeof(hex_data), loc->dl_app_data, loc->dl_app_data_len);
-    printf("Downlink data: %s(%d)\n", hex_data, loc->dl_app_data_len);
-}
-
 /*! \brief validate fundamental functionality of the Embedded Library
  *
  *  @param argc count
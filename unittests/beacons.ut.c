@@ -1,3 +1,124 @@
+/*! \brief compare a beacon to one in workspace
+ *
+ *  Reference for the order given by beacon_priority
+ *
+ *  if beacon is duplicate, return true
+ *
+ *  if both are AP, return false and set diff to difference in rssi
+ *  if both are cell and same cell type, return false and set diff as below
+ *   connected cell
+ *   youngest
+ *   in cache
+ *   strongest
+ *
+ *  @param ctx Skyhook request context
+ *  @param bA pointer to beacon A
+ *  @param wb pointer to beacon B
+ *
+ *  @return true if match or false and set diff
+ *   diff is 0 if beacons can't be compared
+ *           +ve if beacon A is better
+ *           -ve if beacon B is better
+ */
+static bool beacon_compare(Sky_ctx_t *ctx, Beacon_t *new, Beacon_t *wb, int *diff)
+{
+    Sky_status_t equality = SKY_ERROR;
+    bool ret = false;
+    int better = 1; // beacon B is better (-ve), or A is better (+ve)
+
+    if (!ctx || !new || !wb) {
+        LOGFMT(ctx, SKY_LOG_LEVEL_ERROR, "bad params");
+        if (diff)
+            *diff = 0; /* can't compare */
+        return false;
+    }
+
+    /* if beacons can't be compared for equality (different types), order like this */
+    if ((equality = sky_plugin_equal(ctx, NULL, new, wb, NULL)) == SKY_ERROR) {
+        if (new->h.connected != wb->h.connected)
+            /* connected is best */
+            better = new->h.connected ? 1 : -1;
+        if (is_cell_nmr(new) != is_cell_nmr(wb))
+            /* fully qualified is next */
+            better = (!is_cell_nmr(new) ? 1 : -1);
+        else
+            /* then type which increase in value as they become lower priority */
+            /* so we have to invert the sign of the comparison value */
+            better = -(new->h.type - wb->h.type);
+#ifdef VERBOSE_DEBUG
+        dump_beacon(ctx, "A: ", new, __FILE__, __FUNCTION__);
+        dump_beacon(ctx, "B: ", wb, __FILE__, __FUNCTION__);
+        LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Different types %d (%s)", better,
+            better < 0 ? "B is better" : "A is better");
+#endif
+    } else if (equality == SKY_SUCCESS) // if beacons are equivalent, return true
+        ret = true;
+    else {
+        /* if the beacons can be compared and are not equivalent, determine which is better */
+        if (new->h.type == SKY_BEACON_AP || new->h.type == SKY_BEACON_BLE) {
+            /* Compare APs by rssi */
+            if (EFFECTIVE_RSSI(new->h.rssi) != EFFECTIVE_RSSI(wb->h.rssi)) {
+                better = EFFECTIVE_RSSI(new->h.rssi) - EFFECTIVE_RSSI(wb->h.rssi);
+#ifdef VERBOSE_DEBUG
+                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "WiFi rssi score %d (%s)", better,
+                    better < 0 ? "B is better" : "A is better");
+#endif
+            } else
+                /* vg with most members is better */
+                better = new->ap.vg_len - wb->ap.vg_len;
+        } else {
+        /* Compare cells of same type - priority is connected, non-nmr, youngest, or stongest */
+#ifdef VERBOSE_DEBUG
+            dump_beacon(ctx, "A: ", new, __FILE__, __FUNCTION__);
+            dump_beacon(ctx, "B: ", wb, __FILE__, __FUNCTION__);
+#endif
+            if (new->h.connected || wb->h.connected) {
+                better = (new->h.connected ? 1 : -1);
+#ifdef VERBOSE_DEBUG
+                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "cell connected score %d (%s)", better,
+                    better < 0 ? "B is better" : "A is better");
+#endif
+            } else if (is_cell_nmr(new) != is_cell_nmr(wb)) {
+                /* fully qualified is best */
+                better = (!is_cell_nmr(new) ? 1 : -1);
+#ifdef VERBOSE_DEBUG
+                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "cell nmr score %d (%s)", better,
+                    better < 0 ? "B is better" : "A is better");
+#endif
+            } else if (new->h.age != wb->h.age) {
+                /* youngest is best */
+                better = -(new->h.age - wb->h.age);
+#ifdef VERBOSE_DEBUG
+                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "cell age score %d (%s)", better,
+                    better < 0 ? "B is better" : "A is better");
+#endif
+            } else if (EFFECTIVE_RSSI(new->h.rssi) != EFFECTIVE_RSSI(wb->h.rssi)) {
+                /* highest signal strength is best */
+                better = EFFECTIVE_RSSI(new->h.rssi) - EFFECTIVE_RSSI(wb->h.rssi);
+#ifdef VERBOSE_DEBUG
+                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "cell signal strength score %d (%s)", better,
+                    better < 0 ? "B is better" : "A is better");
+#endif
+            } else {
+                better = 1;
+#ifdef VERBOSE_DEBUG
+                LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "cell similar, pick one (%s)",
+                    better < 0 ? "B is better" : "A is better");
+#endif
+            }
+        }
+    }
+
+    if (!ret && diff)
+        *diff = better;
+
+#ifdef VERBOSE_DEBUG
+    if (ret)
+        LOGFMT(ctx, SKY_LOG_LEVEL_DEBUG, "Beacons match");
+#endif
+    return ret;
+}
+
 TEST_FUNC(test_validate_workspace)
 {
     /* check the following:
@@ -6,7 +127,7 @@ TEST_FUNC(test_validate_workspace)
         ctx->len > TOTAL_BEACONS + 1
         ctx->ap_len > MAX_AP_BEACONS + 1
         ctx->header.crc32 == sky_crc32(...)
-        ctx->beacon[i].h.magic != BEACON_MAGIC || ctx->beacon[i].h.type > SKY_BEACON_MAX
+        BEACON_AT(ctx, i).h.magic != BEACON_MAGIC || BEACON_AT(ctx, i).h.type > SKY_BEACON_MAX
         */
     TEST("should return false with NULL ctx", ctx, { ASSERT(false == validate_workspace(NULL)); });
 
@@ -27,20 +148,35 @@ TEST_FUNC(test_validate_workspace)
         ASSERT(false == validate_workspace(ctx));
     });
 
+    TEST("should return false with bad token in ctx", ctx, {
+        ctx->generation++;
+        ASSERT(false == validate_workspace(ctx));
+    });
+
+    TEST("should return false with workspace copied elsewhere", ctx, {
+        Sky_ctx_t *copy = malloc(sizeof(Sky_ctx_t));
+
+        memcpy(copy, ctx, sizeof(Sky_ctx_t));
+        ASSERT(false == validate_workspace(copy));
+        free(copy);
+    });
+
+#if SKY_DEBUG_WORKSPACE
     TEST("should return false with bad crc in ctx", ctx, {
         ctx->header.crc32 = 1234;
         ASSERT(false == validate_workspace(ctx));
     });
 
     TEST("should return false with corrupt beacon in ctx (magic)", ctx, {
-        ctx->beacon[0].h.magic = 1234;
+        BEACON_AT(ctx, 0).h.magic = 1234;
         ASSERT(false == validate_workspace(ctx));
     });
 
     TEST("should return false with corrupt beacon in ctx (type)", ctx, {
-        ctx->beacon[0].h.type = 1234;
+        BEACON_AT(ctx, 0).h.type = 123;
         ASSERT(false == validate_workspace(ctx));
     });
+#endif
 }
 
 TEST_FUNC(test_compare)
@@ -421,40 +557,107 @@ TEST_FUNC(test_insert)
             ASSERT(SKY_ERROR_BAD_PARAMETERS == sky_errno);
         });
 
-    TEST("should insert beacon in ctx->beacon[] at index 0 with NULL index", ctx, {
+    TEST("should insert beacon in workspace at index 0 with NULL index", ctx, {
         AP(a, "ABCDEF010203", 1605633264, -108, 2, true);
         Sky_errno_t sky_errno;
 
         ASSERT(SKY_SUCCESS == insert_beacon(ctx, &sky_errno, &a, NULL));
-        ASSERT(AP_EQ(&a, ctx->beacon));
+        ASSERT(AP_EQ(&a, &BEACON_AT(ctx, 0)));
     });
 
-    TEST("should insert beacon in ctx->beacon[] at index 0", ctx, {
+    TEST("should insert beacon in workspace at index 0", ctx, {
         AP(a, "ABCDEF010203", 1605633264, -108, 2, true);
         Sky_errno_t sky_errno;
         int i;
 
         ASSERT(SKY_SUCCESS == insert_beacon(ctx, &sky_errno, &a, &i));
-        ASSERT(AP_EQ(&a, ctx->beacon));
+        ASSERT(AP_EQ(&a, &BEACON_AT(ctx, 0)));
         ASSERT(i == 0);
     });
 
-    TEST("should insert 2 beacons in ctx->beacon[] and set index", ctx, {
+    TEST("should insert 2 beacons in workspace and set index", ctx, {
         AP(a, "ABCDEF010203", 1605633264, -108, 2, true);
         AP(b, "ABCDEF010201", 1605633264, -108, 2, true);
         Sky_errno_t sky_errno;
 
         int insert_idx;
         ASSERT(SKY_SUCCESS == insert_beacon(ctx, &sky_errno, &a, &insert_idx));
-        ASSERT(AP_EQ(&a, ctx->beacon));
+        ASSERT(AP_EQ(&a, &BEACON_AT(ctx, 0)));
         ASSERT(insert_idx == 0);
 
         ASSERT(SKY_SUCCESS == insert_beacon(ctx, &sky_errno, &b, &insert_idx));
-        ASSERT(AP_EQ(&b, ctx->beacon));
+        ASSERT(AP_EQ(&b, &BEACON_AT(ctx, 0)));
         ASSERT(insert_idx == 0);
 
         ASSERT(NUM_BEACONS(ctx) == 2);
-        ASSERT(AP_EQ(&a, ctx->beacon + 1));
+        ASSERT(AP_EQ(&a, &BEACON_AT(ctx, 1)));
+    });
+
+    TEST("should replace weaker duplicate after beacons have moved", ctx, {
+        AP(a, "ABCDEF010203", 1605633264, -90, 2, false);
+        AP(b, "ABCDEF010201", 1605633264, -50, 2, false);
+        AP(c, "ABCDEF010205", 1605633264, -70, 2, false);
+        AP(d, "ABCDEF010203", 1605633264, -40, 2, false);
+        Sky_errno_t sky_errno;
+
+        ASSERT(SKY_SUCCESS == insert_beacon(ctx, &sky_errno, &a, NULL));
+        ASSERT(SKY_SUCCESS == insert_beacon(ctx, &sky_errno, &b, NULL));
+        ASSERT(SKY_SUCCESS == insert_beacon(ctx, &sky_errno, &c, NULL));
+        ASSERT(SKY_SUCCESS == remove_beacon(ctx, 0));
+        ASSERT(SKY_SUCCESS == insert_beacon(ctx, &sky_errno, &d, NULL));
+        ASSERT(NUM_BEACONS(ctx) == 2);
+        ASSERT(AP_EQ(&d, &BEACON_AT(ctx, 0)));
+        ASSERT(AP_EQ(&c, &BEACON_AT(ctx, 1)));
+    });
+
+#if SKY_AP_MIRROR
+    TEST("should keep AP mirror in workspace order", ctx, {
+        AP(a, "ABCDEF010203", 10, -90, 2412, false);
+        AP(b, "ABCDEF010201", 20, -50, 5180, false);
+        AP(c, "ABCDEF010205", 30, -70, 2437, false);
+        LTE(d, 10, -108, false, 311, 480, 25614, 25664526, 387, 1000);
+        Sky_errno_t sky_errno;
+        int i, same = 0;
+
+        ASSERT(SKY_SUCCESS == insert_beacon(ctx, &sky_errno, &a, NULL));
+        ASSERT(SKY_SUCCESS == insert_beacon(ctx, &sky_errno, &d, NULL));
+        ASSERT(SKY_SUCCESS == insert_beacon(ctx, &sky_errno, &b, NULL));
+        ASSERT(SKY_SUCCESS == insert_beacon(ctx, &sky_errno, &c, NULL));
+        ASSERT(SKY_SUCCESS == remove_beacon(ctx, 0));
+        for (i = 0; i < NUM_APS(ctx); i++) {
+            if (ctx->aps.mac[i] == pack_mac(BEACON_AT(ctx, i).ap.mac) &&
+                AP_RSSI(ctx, i) == BEACON_AT(ctx, i).h.rssi &&
+                AP_AGE(ctx, i) == BEACON_AT(ctx, i).h.age &&
+                ctx->aps.freq[i] == BEACON_AT(ctx, i).ap.freq)
+                same++;
+        }
+        ASSERT(NUM_APS(ctx) == 2 && same == 2);
+        ASSERT(ctx->aps.mac[0] == 0xABCDEF010205);
+    });
+#endif
+}
+
+TEST_FUNC(test_priority)
+{
+    TEST("should order beacons as beacon_compare does", ctx, {
+        AP(a, "ABCDEFAACCDD", 10, -60, 4433, false);
+        AP(b, "ABCDEFAACCFD", 10, -80, 4433, true);
+        LTE(c, 10, -108, true, 311, 480, 25614, 25664526, 387, 1000);
+        LTE(d, 20, -90, false, 311, 480, 25614, 25664527, 387, 1000);
+        LTE(e, 10, -100, false, 311, 480, 25614, 25664528, 387, 1000);
+        GSM(f, 10, -108, false, 515, 2, 20263, 22265, 0, 0);
+        LTE_NMR(g, 10, -108, false, 387, 1000);
+        Beacon_t *w[] = { &a, &b, &c, &d, &e, &f, &g };
+        int i, j, diff, agree = 0;
+
+        for (i = 0; i < 7; i++) {
+            for (j = 0; j < 7; j++) {
+                if (i != j && beacon_compare(ctx, w[i], w[j], &diff) == false &&
+                    (diff >= 0) == (beacon_priority(w[i]) <= beacon_priority(w[j])))
+                    agree++;
+            }
+        }
+        ASSERT(agree == 7 * 6);
     });
 }
 
@@ -463,5 +666,6 @@ BEGIN_TESTS(beacon_test)
 GROUP_CALL("validate_workspace", test_validate_workspace);
 GROUP_CALL("beacon_compare", test_compare);
 GROUP_CALL("beacon_insert", test_insert);
+GROUP_CALL("beacon_priority", test_priority);
 
 END_TESTS();
@@ -0,0 +1,1937 @@
+static time_t fake_now = TIMESTAMP_2019_03_01 + SECONDS_IN_HOUR;
+
+static time_t fake_time(time_t *t)
+{
+    if (t != NULL)
+        *t = fake_now;
+    return fake_now;
+}
+
+/* repeatable pseudo random numbers, 0 to 32767 */
+static int test_rand(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (int)(*seed >> 16 & 0x7FFF);
+}
+
+#if SKY_THREAD_SAFE && CACHE_SIZE
+#include <pthread.h>
+
+#define STRESS_LOOPS 2000
+
+/* request on one thread of a stress test of the shared cache */
+typedef struct {
+    Sky_ctx_t *ctx;
+    uint64_t fingerprint;
+    int hits; /* successful calls of sky_scan_unchanged */
+    int saves; /* successful calls of sky_plugin_add_to_cache */
+} Stress_t;
+
+static void *stress_cache(void *arg)
+{
+    Stress_t *t = (Stress_t *)arg;
+    Sky_errno_t sky_errno;
+    Sky_location_t loc = { 0 }, found;
+    int i;
+
+    loc.lat = 42.0;
+    loc.lon = -71.0;
+    loc.hpe = 20;
+    loc.location_status = SKY_LOCATION_STATUS_SUCCESS;
+    for (i = 0; i < STRESS_LOOPS; i++) {
+        t->saves += sky_plugin_add_to_cache(t->ctx, &sky_errno, &loc) == SKY_SUCCESS;
+        if (sky_scan_unchanged(t->ctx->instance, &sky_errno, t->fingerprint, &found) ==
+            SKY_SUCCESS)
+            t->hits += found.lat == loc.lat && found.lon == loc.lon;
+    }
+    return NULL;
+}
+#endif
+
+/* devices seen by the callbacks of a store, by first byte of device ID */
+static uint8_t saved[4];
+static int saves, loads;
+
+static Sky_status_t store_save(uint8_t *device_id, uint32_t id_len, void *sky_state, uint32_t size)
+{
+    (void)id_len;
+    (void)sky_state;
+    (void)size;
+    saved[saves++ % 4] = device_id[0];
+    return SKY_SUCCESS;
+}
+
+static Sky_status_t store_load(
+    uint8_t *device_id, uint32_t id_len, void *state_buf, uint32_t bufsize)
+{
+    (void)device_id;
+    (void)id_len;
+    (void)state_buf;
+    (void)bufsize;
+    loads++;
+    return SKY_FAILURE;
+}
+
+/* add_beacons callback of a batch, scan is the mac of one AP */
+static Sky_status_t batch_add(Sky_ctx_t *ctx, Sky_errno_t *sky_errno, void *scan)
+{
+    return sky_add_ap_beacon(ctx, sky_errno, scan, ctx->header.time, -50, 2412, false);
+}
+
+#if SKY_TRACE
+static uint8_t trace_buf[8192];
+static uint32_t trace_len;
+
+static void trace_sink(const void *data, uint32_t len)
+{
+    if (trace_len + len <= sizeof(trace_buf))
+        memcpy(trace_buf + trace_len, data, len);
+    trace_len += len;
+}
+
+/* count the records of one type in the trace */
+static int trace_count(uint8_t op)
+{
+    uint32_t pos = 0, len;
+    int n = 0;
+
+    while (pos + 5 <= trace_len) {
+        memcpy(&len, trace_buf + pos + 1, sizeof(len));
+        n += trace_buf[pos] == op;
+        pos += 5 + len;
+    }
+    return n;
+}
+
+/* find the payload of the result of the first call of one type in the trace, or 0 */
+static uint32_t trace_result_of(uint8_t op)
+{
+    uint32_t pos = 0, len;
+    bool called = false;
+
+    while (pos + 5 <= trace_len) {
+        memcpy(&len, trace_buf + pos + 1, sizeof(len));
+        if (called && trace_buf[pos] == TRACE_RESULT)
+            return pos + 5;
+        called |= trace_buf[pos] == op;
+        pos += 5 + len;
+    }
+    return 0;
+}
+#endif
+
+BEGIN_TESTS(libel_test)
+
+GROUP("sky_schedule_request");
+
+TEST("should admit cache hits without limit", ctx, {
+    Sky_scheduler_t sched;
+    Sky_errno_t sky_errno;
+    time_t retry_at;
+
+    ASSERT(sky_open_scheduler(&sched, sizeof(sched), &sky_errno, 1, 1, 1, fake_time) != NULL);
+    ctx->get_from = 0;
+    ASSERT(sky_schedule_request(&sched, ctx, &sky_errno, &retry_at) == SKY_ADMIT_CACHE);
+    ASSERT(sky_schedule_request(&sched, ctx, &sky_errno, &retry_at) == SKY_ADMIT_CACHE);
+    ASSERT(sched.in_flight == 0);
+});
+
+TEST("should defer device until its bucket refills", ctx, {
+    Sky_scheduler_t sched;
+    Sky_errno_t sky_errno;
+    time_t retry_at;
+
+    ASSERT(sky_open_scheduler(&sched, sizeof(sched), &sky_errno, 10, 2, 2, fake_time) != NULL);
+    ctx->get_from = -1;
+    ASSERT(sky_schedule_request(&sched, ctx, &sky_errno, &retry_at) == SKY_ADMIT_SEND);
+    ASSERT(sky_schedule_request(&sched, ctx, &sky_errno, &retry_at) == SKY_ADMIT_SEND);
+    ASSERT(sky_schedule_request(&sched, ctx, &sky_errno, &retry_at) == SKY_ADMIT_DEFER);
+    ASSERT(retry_at == fake_now + SECONDS_IN_HOUR / 2);
+    fake_now = retry_at;
+    ASSERT(sky_schedule_request(&sched, ctx, &sky_errno, &retry_at) == SKY_ADMIT_SEND);
+});
+
+TEST("should defer when too many requests are in flight", ctx, {
+    Sky_scheduler_t sched;
+    Sky_errno_t sky_errno;
+    time_t retry_at;
+
+    ASSERT(sky_open_scheduler(&sched, sizeof(sched), &sky_errno, 1, 0, 0, fake_time) != NULL);
+    ctx->get_from = -1;
+    ASSERT(sky_schedule_request(&sched, ctx, &sky_errno, &retry_at) == SKY_ADMIT_SEND);
+    ASSERT(sky_schedule_request(&sched, ctx, &sky_errno, &retry_at) == SKY_ADMIT_DEFER);
+    ASSERT(retry_at == 0);
+    sky_schedule_done(&sched, ctx);
+    ASSERT(sky_schedule_request(&sched, ctx, &sky_errno, &retry_at) == SKY_ADMIT_SEND);
+});
+
+TEST("should give back slot of request whose workspace is reused, evicted or released", ctx, {
+    Sky_scheduler_t sched;
+    Sky_errno_t sky_errno;
+    Sky_instance_t *inst = ctx->instance;
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    void *pool = malloc(sky_sizeof_workspace_pool(1));
+    time_t retry_at;
+
+    ASSERT(sky_open_scheduler(&sched, sizeof(sched), &sky_errno, 1, 0, 0, fake_time) != NULL);
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    ws->get_from = -1;
+    ASSERT(sky_schedule_request(&sched, ws, &sky_errno, &retry_at) == SKY_ADMIT_SEND);
+    /* workspace reused before the request is done */
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    ASSERT(sched.in_flight == 0);
+    ws->get_from = -1;
+    ASSERT(sky_schedule_request(&sched, ws, &sky_errno, &retry_at) == SKY_ADMIT_SEND);
+    /* device evicted from a store, so workspace is no longer valid */
+    inst->generation++;
+    ASSERT(!validate_workspace(ws));
+    sky_schedule_done(&sched, ws);
+    ASSERT(sched.in_flight == 0);
+    sky_schedule_done(&sched, ws);
+    ASSERT(sched.in_flight == 0);
+    /* workspace released to pool before the request is done */
+    ASSERT(sky_workspace_pool_init(inst, &sky_errno, pool, sky_sizeof_workspace_pool(1)) ==
+           SKY_SUCCESS);
+    free(ws);
+    ASSERT((ws = sky_workspace_acquire(inst)) != NULL);
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    ws->get_from = -1;
+    ASSERT(sky_schedule_request(&sched, ws, &sky_errno, &retry_at) == SKY_ADMIT_SEND);
+    ASSERT(sky_workspace_release(inst, ws) == SKY_SUCCESS);
+    ASSERT(sched.in_flight == 0);
+    inst->pool = NULL;
+    free(pool);
+});
+
+GROUP("sky_workspace_pool");
+
+TEST("should hand out each workspace once until the pool is exhausted", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_instance_t *inst = ctx->instance;
+    void *pool = malloc(sky_sizeof_workspace_pool(3));
+    void *ws[4];
+    int i;
+
+    ASSERT(sky_sizeof_workspace_pool(0) == 0);
+    ASSERT(sky_workspace_acquire(inst) == NULL);
+    ASSERT(sky_workspace_pool_init(inst, &sky_errno, pool, sky_sizeof_workspace_pool(3)) ==
+           SKY_SUCCESS);
+    for (i = 0; i < 3; i++) {
+        ASSERT((ws[i] = sky_workspace_acquire(inst)) != NULL);
+        ASSERT((uintptr_t)ws[i] % SKY_CACHE_LINE_BYTES == 0);
+        ASSERT(i == 0 || ws[i] != ws[i - 1]);
+    }
+    ASSERT(ws[0] != ws[2]);
+    ASSERT(sky_workspace_acquire(inst) == NULL);
+    /* workspace released is the next one acquired, and may be used for a request */
+    ASSERT(sky_workspace_release(inst, ws[1]) == SKY_SUCCESS);
+    ASSERT((ws[3] = sky_workspace_acquire(inst)) == ws[1]);
+    ASSERT(sky_new_instance_request(inst, ws[3], sky_sizeof_workspace(), NULL, 0, &sky_errno) ==
+           ws[3]);
+    ASSERT(sky_workspace_acquire(inst) == NULL);
+    inst->pool = NULL;
+    free(pool);
+});
+
+TEST("should reject workspace released twice or not from the pool", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_instance_t *inst = ctx->instance;
+    void *pool = malloc(sky_sizeof_workspace_pool(2));
+    uint8_t *a, *b;
+
+    ASSERT(sky_workspace_pool_init(inst, &sky_errno, pool, sky_sizeof_workspace_pool(2)) ==
+           SKY_SUCCESS);
+    ASSERT((a = sky_workspace_acquire(inst)) != NULL);
+    ASSERT((b = sky_workspace_acquire(inst)) != NULL);
+    ASSERT(sky_workspace_release(inst, a) == SKY_SUCCESS);
+    ASSERT(sky_workspace_release(inst, a) == SKY_ERROR);
+    ASSERT(sky_workspace_release(inst, a + 1) == SKY_ERROR);
+    ASSERT(sky_workspace_release(inst, ctx) == SKY_ERROR);
+    /* workspace is on the free list only once */
+    ASSERT(sky_workspace_acquire(inst) == a);
+    ASSERT(sky_workspace_acquire(inst) == NULL);
+    ASSERT(sky_workspace_release(inst, b) == SKY_SUCCESS);
+    ASSERT(sky_workspace_release(inst, a) == SKY_SUCCESS);
+    ASSERT(sky_workspace_release(inst, b) == SKY_ERROR);
+    ASSERT(sky_workspace_acquire(inst) == a && sky_workspace_acquire(inst) == b);
+    inst->pool = NULL;
+    free(pool);
+});
+
+GROUP("sky_new_request");
+
+TEST("should reset reused workspace to an empty request", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B };
+    int i, used = 0;
+
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    for (i = 0; i < 3; i++) {
+        mac[5] = (uint8_t)(i * 0x20);
+        ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac, ws->header.time, -50 - i, 2412, false) ==
+               SKY_SUCCESS);
+    }
+    ASSERT(sky_add_cell_lte_beacon(ws, &sky_errno, 3, 1234, 310, 470, 310, 5000, SKY_UNKNOWN_TA,
+               ws->header.time, -100, true) == SKY_SUCCESS);
+    ASSERT(remove_beacon(ws, 1) == SKY_SUCCESS);
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    ASSERT(NUM_BEACONS(ws) == 0 && NUM_APS(ws) == 0 && validate_workspace(ws));
+    for (i = 0; i < BEACON_INDEX_SIZE; i++)
+        used += ws->beacon_index[i] != 0;
+    ASSERT(used == 0 && isnan(ws->gps.lat));
+    ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac, ws->header.time, -50, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(NUM_BEACONS(ws) == 1 && !memcmp(BEACON_AT(ws, 0).ap.mac, mac, MAC_SIZE));
+    free(ws);
+});
+
+TEST("should clear reused workspace in full when its order is corrupt", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B };
+    int i;
+
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    for (i = 0; i < 2; i++) {
+        mac[5] = (uint8_t)(i * 0x20);
+        ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac, ws->header.time, -50 - i, 2412, false) ==
+               SKY_SUCCESS);
+    }
+    /* slot of first AP is listed twice, so slot of second AP would not be cleared */
+    ws->order[1] = ws->order[0];
+    ASSERT(sky_new_request_from(ws, sky_sizeof_workspace(), ws, NULL, 0, &sky_errno) == ws);
+    ASSERT(NUM_BEACONS(ws) == 0 && validate_workspace(ws));
+    for (i = 0; i < STAGED_BEACONS; i++)
+        if (ws->order[i] != i)
+            break;
+    ASSERT(i == STAGED_BEACONS);
+    ws->order[STAGED_BEACONS - 1] = STAGED_BEACONS;
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    ASSERT(ws->order[STAGED_BEACONS - 1] == STAGED_BEACONS - 1);
+    free(ws);
+});
+
+TEST("should find each beacon by identity as others move ahead of it", ctx, {
+    Sky_errno_t sky_errno;
+    Beacon_t b;
+    int i, j, used;
+
+    /* each AP is stronger than the last, so goes ahead of all of them */
+    for (i = 0; i < 5; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, (uint8_t)(i * 0x11), 0x17, 0x4B };
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -90 + i * 5, 2412,
+                   false) == SKY_SUCCESS);
+    }
+    ASSERT(remove_beacon(ctx, 1) == SKY_SUCCESS);
+    ASSERT(remove_beacon(ctx, 3) == SKY_SUCCESS);
+    /* each AP is found, so is replaced rather than added again */
+    for (i = 0; i < 3; i++) {
+        b = BEACON_AT(ctx, i);
+        ASSERT(sky_update_ap_beacon(ctx, &sky_errno, b.ap.mac, ctx->header.time, b.h.rssi, 2412,
+                   false) == SKY_SUCCESS);
+        ASSERT(NUM_APS(ctx) == 3 && !memcmp(BEACON_AT(ctx, i).ap.mac, b.ap.mac, MAC_SIZE));
+    }
+    for (i = used = 0; i < BEACON_INDEX_SIZE; i++) {
+        used += ctx->beacon_index[i] != 0;
+        for (j = 0; ctx->beacon_index[i] && j < NUM_BEACONS(ctx); j++)
+            if (ctx->order[j] == ctx->beacon_index[i] - 1)
+                break;
+        ASSERT(j < NUM_BEACONS(ctx) || !ctx->beacon_index[i]);
+    }
+    ASSERT(used == NUM_BEACONS(ctx));
+});
+
+TEST("should keep uplink app data of each request in its workspace", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), (uint8_t *)"other", 6, &sky_errno) == ws);
+    ASSERT(get_ctx_ul_app_data_length(ctx) == 16 && get_ctx_ul_app_data_length(ws) == 6);
+    ASSERT(!memcmp(get_ctx_ul_app_data(ctx), "uplink app data", 16));
+    ASSERT(!memcmp(get_ctx_ul_app_data(ws), "other", 6));
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), (uint8_t *)"x", SKY_MAX_UL_APP_DATA + 1,
+               &sky_errno) == NULL);
+    ASSERT(sky_errno == SKY_ERROR_BAD_PARAMETERS);
+    free(ws);
+});
+
+GROUP("sky_add_ap_beacons");
+
+TEST("should fill workspace as adding each AP in turn then selecting once", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ap_scan_t scan[TOTAL_BEACONS];
+    Sky_ctx_t *seq = malloc(sky_sizeof_workspace());
+    int i;
+
+    ASSERT(sky_new_request(seq, sky_sizeof_workspace(), NULL, 0, &sky_errno) == seq);
+    ASSERT(sky_defer_selection(seq, &sky_errno, true) == SKY_SUCCESS);
+    for (i = 0; i < TOTAL_BEACONS; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 7), (uint8_t)(i & 3) };
+        memcpy(scan[i].mac, mac, MAC_SIZE);
+        scan[i].timestamp = ctx->header.time - (i % 3);
+        scan[i].rssi = -40 - (i * 13) % 50;
+        scan[i].frequency = 2412;
+        scan[i].is_connected = i == 5;
+        ASSERT(sky_add_ap_beacon(seq, &sky_errno, scan[i].mac, scan[i].timestamp, scan[i].rssi,
+                   scan[i].frequency, scan[i].is_connected) == SKY_SUCCESS);
+    }
+    ASSERT(select_beacons(seq, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_add_ap_beacons(ctx, &sky_errno, scan, TOTAL_BEACONS) == SKY_SUCCESS);
+    ASSERT(NUM_APS(ctx) == CONFIG(ctx->state, max_ap_beacons) && !ctx->defer_selection);
+    ASSERT(NUM_BEACONS(ctx) == NUM_BEACONS(seq));
+    for (i = 0; i < NUM_BEACONS(ctx); i++)
+        if (memcmp(&BEACON_AT(ctx, i), &BEACON_AT(seq, i), sizeof(Beacon_t)) != 0)
+            break;
+    ASSERT(i == NUM_BEACONS(ctx));
+    free(seq);
+});
+
+TEST("should select from a scan larger than the staging area as adding each AP", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ap_scan_t scan[STAGED_BEACONS + 20];
+    Sky_ctx_t *seq = malloc(sky_sizeof_workspace());
+    int i, n = STAGED_BEACONS + 20;
+
+    ASSERT(sky_new_request(seq, sky_sizeof_workspace(), NULL, 0, &sky_errno) == seq);
+    ASSERT(sky_defer_selection(seq, &sky_errno, true) == SKY_SUCCESS);
+    for (i = 0; i < n; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, (uint8_t)i, (uint8_t)(i * 7), 0x4B };
+        memcpy(scan[i].mac, mac, MAC_SIZE);
+        scan[i].timestamp = ctx->header.time - (i % 3);
+        scan[i].rssi = -40 - (i * 13) % 50;
+        scan[i].frequency = 2412;
+        scan[i].is_connected = i == 5;
+        ASSERT(sky_add_ap_beacon(seq, &sky_errno, scan[i].mac, scan[i].timestamp, scan[i].rssi,
+                   scan[i].frequency, scan[i].is_connected) == SKY_SUCCESS);
+    }
+    ASSERT(select_beacons(seq, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_add_ap_beacons(ctx, &sky_errno, scan, n) == SKY_SUCCESS);
+    ASSERT(NUM_APS(ctx) == CONFIG(ctx->state, max_ap_beacons));
+    ASSERT(NUM_BEACONS(ctx) == NUM_BEACONS(seq));
+    for (i = 0; i < NUM_BEACONS(ctx); i++)
+        if (memcmp(&BEACON_AT(ctx, i), &BEACON_AT(seq, i), sizeof(Beacon_t)) != 0)
+            break;
+    ASSERT(i == NUM_BEACONS(ctx));
+    free(seq);
+});
+
+TEST("should reject whole scan with bad mac", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ap_scan_t scan[2] = {
+        { { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B }, (time_t)-1, -50, 2412, false },
+        { { 0, 0, 0, 0, 0, 0 }, (time_t)-1, -60, 2412, false },
+    };
+
+    ASSERT(sky_add_ap_beacons(ctx, &sky_errno, scan, 2) == SKY_ERROR);
+    ASSERT(sky_errno == SKY_ERROR_BAD_PARAMETERS);
+    ASSERT(NUM_BEACONS(ctx) == 0);
+});
+
+GROUP("scan age");
+
+TEST("should hold age of very old scan at MAX_BEACON_AGE", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *old = malloc(sky_sizeof_workspace());
+    uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B };
+    uint64_t age;
+
+    fake_now += 100000;
+    ASSERT(sky_new_request(old, sky_sizeof_workspace(), NULL, 0, &sky_errno) == old);
+    ASSERT(sky_add_ap_beacon(old, &sky_errno, mac, TIMESTAMP_2019_03_01 + 1, -50, 2412, false) ==
+           SKY_SUCCESS);
+    age = old->header.time - (TIMESTAMP_2019_03_01 + 1);
+    ASSERT(BEACON_AT(old, 0).h.age == (age > MAX_BEACON_AGE ? MAX_BEACON_AGE : age));
+    free(old);
+});
+
+GROUP("sky_new_request_from");
+
+TEST("should start from beacons of last request and apply changes", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    Sky_ctx_t *copy = malloc(sky_sizeof_workspace());
+    uint8_t mac[3][MAC_SIZE] = { { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B },
+        { 0x4C, 0x5E, 0x0C, 0xB0, 0x28, 0x11 }, { 0x4C, 0x5E, 0x0C, 0xB0, 0x39, 0x22 } };
+
+    ctx->instance->gettime = fake_time;
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac[0], ws->header.time - 1, -50, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac[1], ws->header.time - 1, -60, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac[2], ws->header.time - 1, -70, 2412, false) ==
+           SKY_SUCCESS);
+    fake_now += 5;
+    ASSERT(sky_new_request_from(copy, sky_sizeof_workspace(), ws, NULL, 0, &sky_errno) == copy);
+    ASSERT(validate_workspace(copy) && NUM_APS(copy) == 3 && BEACON_AT(copy, 0).h.age == 6);
+    ASSERT(sky_new_request_from(ws, sky_sizeof_workspace(), ws, NULL, 0, &sky_errno) == ws);
+    ASSERT(validate_workspace(ws) && NUM_APS(ws) == 3 && BEACON_AT(ws, 2).h.age == 6);
+    /* weakest AP is now strongest, and middle AP has gone */
+    ASSERT(sky_update_ap_beacon(ws, &sky_errno, mac[2], ws->header.time, -40, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(sky_remove_ap_beacon(ws, &sky_errno, mac[1]) == SKY_SUCCESS);
+    ASSERT(sky_remove_ap_beacon(ws, &sky_errno, mac[1]) == SKY_SUCCESS);
+    ASSERT(NUM_APS(ws) == 2 && !memcmp(BEACON_AT(ws, 0).ap.mac, mac[2], MAC_SIZE));
+    ASSERT(BEACON_AT(ws, 0).h.age == 0 && BEACON_AT(ws, 1).h.age == 6);
+    free(copy);
+    free(ws);
+});
+
+TEST("should leave last request untouched when backoff denies the next", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    uint8_t mac[2][MAC_SIZE] = { { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B },
+        { 0x4C, 0x5E, 0x0C, 0xB0, 0x28, 0x11 } };
+
+    ctx->instance->gettime = fake_time;
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac[0], ws->header.time - 1, -50, 2412, false) ==
+           SKY_SUCCESS);
+    /* scan time unknown */
+    ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac[1], (time_t)-1, -60, 2412, false) ==
+           SKY_SUCCESS);
+    ctx->state->backoff = SKY_AUTH_RETRY_1D;
+    ctx->state->header.time = ws->header.time;
+    fake_now += 5;
+    ASSERT(sky_new_request_from(ws, sky_sizeof_workspace(), ws, NULL, 0, &sky_errno) == NULL);
+    ASSERT(sky_errno == SKY_ERROR_SERVICE_DENIED);
+    ASSERT(validate_workspace(ws) && NUM_APS(ws) == 2 && BEACON_AT(ws, 0).h.age == 1);
+    ctx->state->backoff = SKY_ERROR_NONE;
+    ASSERT(sky_new_request_from(ws, sky_sizeof_workspace(), ws, NULL, 0, &sky_errno) == ws);
+    ASSERT(NUM_APS(ws) == 2 && BEACON_AT(ws, 0).h.age == 6 && BEACON_AT(ws, 1).h.age == 0);
+    free(ws);
+});
+
+TEST("should leave scheduler slot and flight of last request with it when copied", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_scheduler_t sched;
+    Sky_coalescer_t *co = malloc(sky_sizeof_coalescer(1));
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    Sky_ctx_t *copy = malloc(sky_sizeof_workspace());
+    Sky_location_t found;
+    uint8_t rq[1024];
+    uint32_t size;
+    time_t retry_at;
+    int i;
+
+    ASSERT(sky_open_scheduler(&sched, sizeof(sched), &sky_errno, 2, 0, 0, fake_time) != NULL);
+    ASSERT(sky_open_coalescer(co, sky_sizeof_coalescer(1), &sky_errno) == co);
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    for (i = 0; i < 3; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 0x11), 0x4B };
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -50 - i * 10, 2412,
+                   false) == SKY_SUCCESS);
+        ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac, ws->header.time, -50 - i * 10, 2412,
+                   false) == SKY_SUCCESS);
+    }
+    ASSERT(sky_sizeof_request_buf(ctx, &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_sizeof_request_buf(ws, &size, &sky_errno) == SKY_SUCCESS);
+    ctx->get_from = -1;
+    ASSERT(sky_schedule_request(&sched, ctx, &sky_errno, &retry_at) == SKY_ADMIT_SEND);
+    ASSERT(sky_finalize_coalesced(co, ctx, &sky_errno, rq, sizeof(rq), &found, &size) ==
+           SKY_FINALIZE_REQUEST);
+    ASSERT(sky_finalize_coalesced(co, ws, &sky_errno, rq, sizeof(rq), &found, &size) ==
+           SKY_FINALIZE_PENDING);
+    ASSERT(sched.in_flight == 1 && co->flight[0].waiters == 1);
+    /* next request of each built in a workspace of its own */
+    ASSERT(sky_new_request_from(copy, sky_sizeof_workspace(), ctx, NULL, 0, &sky_errno) == copy);
+    ASSERT(copy->scheduled == NULL && copy->coalescer == NULL && copy->flight == 0);
+    ASSERT(sched.in_flight == 1 && co->flight[0].state == FLIGHT_PENDING);
+    ASSERT(sky_new_request_from(copy, sky_sizeof_workspace(), ws, NULL, 0, &sky_errno) == copy);
+    ASSERT(co->flight[0].waiters == 1 && co->flight[0].state == FLIGHT_PENDING);
+    /* last requests still give back what they hold */
+    sky_schedule_done(&sched, ctx);
+    ASSERT(sched.in_flight == 0);
+    sky_coalesce_cancel(co, ws, SKY_ERROR_SERVER_ERROR);
+    ASSERT(co->flight[0].waiters == 0 && co->flight[0].state == FLIGHT_PENDING);
+    sky_coalesce_cancel(co, ctx, SKY_ERROR_SERVER_ERROR);
+    ASSERT(co->flight[0].state == FLIGHT_FREE);
+    free(copy);
+    free(ws);
+    free(co);
+});
+
+TEST("should give the same request from the changes to a scan as from the whole scan", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *ws[2] = { malloc(sky_sizeof_workspace()), malloc(sky_sizeof_workspace()) };
+    Sky_log_level_t level = ctx->instance->min_level;
+    int16_t rssi[30];
+    bool present[30] = { false }, used;
+    uint32_t size, seed = 1;
+    int i, j, scan;
+    /* whole scan fits in the staging area, so no beacon is filtered as it is added */
+    int n = STAGED_BEACONS - 1 < 30 ? (STAGED_BEACONS - 1) / 3 * 3 : 30;
+
+    /* logging every add makes the test too slow */
+    ctx->instance->min_level = SKY_LOG_LEVEL_CRITICAL;
+    ctx->instance->gettime = fake_time;
+    ASSERT(sky_new_request(ws[0], sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws[0]);
+    ASSERT(sky_defer_selection(ws[0], &sky_errno, true) == SKY_SUCCESS);
+    for (scan = 0; scan < 500; scan++) {
+        if (scan) {
+            ASSERT(sky_new_request_from(ws[0], sky_sizeof_workspace(), ws[0], NULL, 0,
+                       &sky_errno) == ws[0]);
+        }
+        for (i = 0; i < n; i++) {
+            /* groups of three APs which differ in one nibble, so some are virtual APs */
+            uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i / 3),
+                (uint8_t)((i % 3) << 4 | 1) };
+
+            j = test_rand(&seed) % 8;
+            if (present[i] && j == 0) {
+                present[i] = false;
+                ASSERT(sky_remove_ap_beacon(ws[0], &sky_errno, mac) == SKY_SUCCESS);
+                continue;
+            }
+            if (scan && present[i] == (j > 2))
+                continue;
+            /* no two APs of equal strength, so order does not depend on how scan is added */
+            do {
+                rssi[i] = (int16_t)(-20 - test_rand(&seed) % 90);
+                for (used = false, j = 0; j < n; j++)
+                    used |= j != i && present[j] && rssi[j] == rssi[i];
+            } while (used);
+            if (present[i]) {
+                ASSERT(sky_update_ap_beacon(ws[0], &sky_errno, mac, (time_t)-1, rssi[i], 2412,
+                           false) == SKY_SUCCESS);
+            } else {
+                ASSERT(sky_add_ap_beacon(ws[0], &sky_errno, mac, (time_t)-1, rssi[i], 2412,
+                           false) == SKY_SUCCESS);
+            }
+            present[i] = true;
+        }
+        ASSERT(sky_new_request(ws[1], sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws[1]);
+        ASSERT(sky_defer_selection(ws[1], &sky_errno, true) == SKY_SUCCESS);
+        for (i = 0; i < n; i++) {
+            uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i / 3),
+                (uint8_t)((i % 3) << 4 | 1) };
+
+            if (present[i]) {
+                ASSERT(sky_add_ap_beacon(ws[1], &sky_errno, mac, (time_t)-1, rssi[i], 2412,
+                           false) == SKY_SUCCESS);
+            }
+        }
+        if (summary_fingerprint(&ws[0]->summary) != summary_fingerprint(&ws[1]->summary) ||
+            ws[0]->summary.ap_len != ws[1]->summary.ap_len) {
+            break;
+        }
+        for (j = 0; j < 2; j++) {
+            ASSERT(sky_sizeof_request_buf(ws[j], &size, &sky_errno) == SKY_SUCCESS);
+        }
+        if (NUM_BEACONS(ws[0]) != NUM_BEACONS(ws[1])) {
+            break;
+        }
+        for (i = 0; i < NUM_BEACONS(ws[0]); i++)
+            if (memcmp(&BEACON_AT(ws[0], i), &BEACON_AT(ws[1], i), sizeof(Beacon_t)) != 0)
+                break;
+        if (i != NUM_BEACONS(ws[0])) {
+            break;
+        }
+    }
+    ctx->instance->min_level = level;
+    ASSERT(scan == 500);
+    free(ws[1]);
+    free(ws[0]);
+});
+
+GROUP("sky_scan_unchanged");
+
+TEST("should find location of scan with same strongest APs", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ap_scan_t scan[SKY_FINGERPRINT_APS + 2], rev[SKY_FINGERPRINT_APS + 2];
+    Sky_location_t loc = { 0 }, found = { 0 };
+    uint64_t fp;
+    int i, n = SKY_FINGERPRINT_APS + 2;
+
+    memset(scan, 0, sizeof(scan));
+    for (i = 0; i < n; i++) {
+        scan[i].mac[0] = 0x4C;
+        scan[i].mac[4] = (uint8_t)(i * 0x11);
+        scan[i].mac[5] = (uint8_t)(0xF0 - i * 0x13);
+        scan[i].timestamp = ctx->header.time;
+        scan[i].rssi = -40 - i * 5;
+        scan[i].frequency = 2412;
+        rev[n - 1 - i] = scan[i];
+    }
+    fp = sky_scan_fingerprint(scan, n, NULL, 0);
+    ASSERT(fp != 0 && fp == sky_scan_fingerprint(rev, n, NULL, 0));
+    ASSERT(sky_add_ap_beacons(ctx, &sky_errno, rev, n) == SKY_SUCCESS);
+    ASSERT(summary_fingerprint(&ctx->summary) == fp);
+    /* weakest AP changing does not change fingerprint, strongest does */
+    scan[n - 1].mac[3] = 0x01;
+    ASSERT(sky_scan_fingerprint(scan, n, NULL, 0) == fp);
+    scan[0].mac[3] = 0x01;
+    ASSERT(sky_scan_fingerprint(scan, n, NULL, 0) != fp);
+#if CACHE_SIZE
+    ASSERT(sky_scan_unchanged(ctx->instance, &sky_errno, fp, &found) == SKY_FAILURE);
+    loc.lat = 42.0;
+    loc.lon = -71.0;
+    loc.hpe = 20;
+    loc.location_status = SKY_LOCATION_STATUS_SUCCESS;
+    ASSERT(sky_plugin_add_to_cache(ctx, &sky_errno, &loc) == SKY_SUCCESS);
+    ASSERT(sky_scan_unchanged(ctx->instance, &sky_errno, fp, &found) == SKY_SUCCESS);
+    ASSERT(found.lat == loc.lat && found.lon == loc.lon && found.hpe == loc.hpe);
+    ASSERT(sky_scan_unchanged(ctx->instance, &sky_errno, fp + 1, &found) == SKY_FAILURE);
+#else
+    (void)loc;
+    ASSERT(sky_scan_unchanged(ctx->instance, &sky_errno, fp, &found) == SKY_FAILURE);
+#endif
+});
+
+TEST("should fingerprint a raw scan as a workspace built from it", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ap_scan_t aps[5];
+    Sky_cell_scan_t cells[5];
+    uint64_t fp;
+    int i;
+
+    memset(aps, 0, sizeof(aps));
+    for (i = 0; i < 5; i++) {
+        aps[i].mac[0] = 0x4C;
+        aps[i].mac[4] = (uint8_t)(i * 0x11);
+        aps[i].mac[5] = (uint8_t)(0xF0 - i * 0x13);
+        aps[i].timestamp = ctx->header.time;
+        aps[i].rssi = -40 - i * 5;
+        aps[i].frequency = 2412;
+    }
+    memset(aps[2].mac, 0, MAC_SIZE); /* invalid, strong enough to be fingerprinted */
+    memset(cells, 0, sizeof(cells));
+    for (i = 0; i < 5; i++) {
+        cells[i].type = SKY_CELL_LTE;
+        cells[i].mcc = 310;
+        cells[i].mnc = 410;
+        cells[i].area = 1234;
+        cells[i].id = 12345 + i;
+        cells[i].pci = 10;
+        cells[i].channel = 5230;
+        cells[i].ta = SKY_UNKNOWN_TA;
+        cells[i].timestamp = ctx->header.time;
+        cells[i].rssi = -80;
+        cells[i].is_connected = true;
+    }
+    cells[1] = cells[0]; /* serving cell reported twice */
+    cells[2].mcc = 100; /* out of range */
+    cells[3].mcc = SKY_UNKNOWN_ID1; /* neighbor */
+    cells[3].mnc = SKY_UNKNOWN_ID2;
+    cells[3].id = SKY_UNKNOWN_ID4;
+    cells[3].is_connected = false;
+
+    for (i = 0; i < 5; i++) {
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, aps[i].mac, aps[i].timestamp, aps[i].rssi,
+                   aps[i].frequency, aps[i].is_connected) == (i == 2 ? SKY_ERROR : SKY_SUCCESS));
+        ASSERT(sky_add_cell_beacons(ctx, &sky_errno, &cells[i], 1) ==
+               (i == 2 ? SKY_ERROR : SKY_SUCCESS));
+    }
+    fp = sky_scan_fingerprint(aps, 5, cells, 5);
+    ASSERT(fp != 0 && summary_fingerprint(&ctx->summary) == fp);
+    /* the same as the scan without the duplicate and the beacons rejected */
+    aps[2] = aps[4];
+    cells[1] = cells[4];
+    ASSERT(sky_scan_fingerprint(aps, 4, &cells[0], 2) == fp);
+});
+
+#if SKY_THREAD_SAFE && CACHE_SIZE
+TEST("should count cache writes and hits of two threads exactly", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    Stress_t t[2];
+    pthread_t thread[2];
+    uint32_t changes;
+    int i;
+
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    for (i = 0; i < 4; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 0x11), 0x4B };
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -40 - i * 5, 2412,
+                   false) == SKY_SUCCESS);
+        ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac, ws->header.time, -40 - i * 5, 2412,
+                   false) == SKY_SUCCESS);
+    }
+    memset(t, 0, sizeof(t));
+    t[0].ctx = ctx;
+    t[1].ctx = ws;
+    t[0].fingerprint = t[1].fingerprint = summary_fingerprint(&ctx->summary);
+    changes = ctx->state->cache_changes;
+    ctx->state->cache_hits = 0;
+    ASSERT(pthread_create(&thread[0], NULL, stress_cache, &t[0]) == 0);
+    ASSERT(pthread_create(&thread[1], NULL, stress_cache, &t[1]) == 0);
+    pthread_join(thread[0], NULL);
+    pthread_join(thread[1], NULL);
+    ASSERT(t[0].saves == STRESS_LOOPS && t[1].saves == STRESS_LOOPS);
+    ASSERT(ctx->state->cache_changes - changes == 2 * STRESS_LOOPS);
+    ASSERT(t[0].hits + t[1].hits == 127 && ctx->state->cache_hits == 127);
+    free(ws);
+});
+#endif
+
+GROUP("beacon admission");
+
+TEST("should skip AP which filtering would remove at once", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *seq = malloc(sky_sizeof_workspace());
+    uint8_t old[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x12, 0x34 };
+    uint32_t size;
+    int i, n = CONFIG(ctx->state, max_ap_beacons) + 1;
+
+    ASSERT(sky_new_request(seq, sky_sizeof_workspace(), NULL, 0, &sky_errno) == seq);
+    for (i = 0; i < n; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 0x11), (uint8_t)(i * 0x11) };
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -40 - i * 2, 2412,
+                   false) == SKY_SUCCESS);
+        ASSERT(sky_add_ap_beacon(seq, &sky_errno, mac, seq->header.time, -40 - i * 2, 2412,
+                   false) == SKY_SUCCESS);
+    }
+    /* older than the rest, so it is the one removed if added */
+    ASSERT(sky_add_ap_beacon(ctx, &sky_errno, old, ctx->header.time - 10, -45, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(sky_defer_selection(seq, &sky_errno, true) == SKY_SUCCESS);
+    ASSERT(sky_add_ap_beacon(seq, &sky_errno, old, seq->header.time - 10, -45, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(NUM_APS(seq) == n);
+    ASSERT(sky_sizeof_request_buf(seq, &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_sizeof_request_buf(ctx, &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(NUM_BEACONS(ctx) == NUM_BEACONS(seq));
+    for (i = 0; i < NUM_BEACONS(ctx); i++)
+        if (memcmp(&BEACON_AT(ctx, i), &BEACON_AT(seq, i), sizeof(Beacon_t)) != 0)
+            break;
+    ASSERT(i == NUM_BEACONS(ctx));
+    free(seq);
+});
+
+TEST("should reject a UMTS cell of a scan with uarfcn out of range", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_cell_scan_t cell;
+
+    memset(&cell, 0, sizeof(cell));
+    cell.type = SKY_CELL_UMTS;
+    cell.area = 32768;
+    cell.id = 16852275;
+    cell.mcc = 310;
+    cell.mnc = 410;
+    cell.pci = 195;
+    cell.channel = 0x10000 + 4385; /* 4385 once truncated to 16 bits */
+    cell.timestamp = ctx->header.time;
+    cell.rssi = -100;
+    ASSERT(sky_add_cell_beacons(ctx, &sky_errno, &cell, 1) == SKY_ERROR);
+    ASSERT(sky_errno == SKY_ERROR_BAD_PARAMETERS && NUM_BEACONS(ctx) == 0);
+    cell.channel = 4385;
+    ASSERT(sky_add_cell_beacons(ctx, &sky_errno, &cell, 1) == SKY_SUCCESS);
+    ASSERT(NUM_BEACONS(ctx) == 1);
+});
+
+GROUP("virtual groups");
+
+TEST("should record removed virtual APs as children of the AP kept", ctx, {
+    Sky_errno_t sky_errno;
+    Beacon_t b;
+    uint8_t child[2][MAC_SIZE] = { { 0x4C, 0x5E, 0x0C, 0xB0, 0x00, 0x07 },
+        { 0x4C, 0x5E, 0x0C, 0xB0, 0x00, 0x70 } };
+    uint8_t local[MAC_SIZE] = { 0x4E, 0x5E, 0x0C, 0xB0, 0x00, 0x00 };
+    int i, n = CONFIG(ctx->state, max_ap_beacons);
+
+    for (i = 0; i < n; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 0x11), 0x00 };
+        mac[5] = mac[4];
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -40 - i * 2, 2412,
+                   false) == SKY_SUCCESS);
+    }
+    ASSERT(sky_add_ap_beacon(ctx, &sky_errno, child[0], ctx->header.time, -30, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(sky_add_ap_beacon(ctx, &sky_errno, child[1], ctx->header.time, -31, 2412, false) ==
+           SKY_SUCCESS);
+    /* differs from parent in Local Administrative bit, so is not a child */
+    ASSERT(sky_add_ap_beacon(ctx, &sky_errno, local, ctx->header.time, -99, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(NUM_APS(ctx) == n && BEACON_AT(ctx, 0).ap.mac[5] == 0x00);
+    ASSERT(BEACON_AT(ctx, 0).ap.vg_len == 2);
+    memset(&b, 0, sizeof(b));
+    b.h.magic = BEACON_MAGIC;
+    b.h.type = SKY_BEACON_AP;
+    memcpy(b.ap.mac, child[1], MAC_SIZE);
+    ASSERT(ap_beacon_in_vg(ctx, &b, &BEACON_AT(ctx, 0), NULL) == 1);
+    memcpy(b.ap.mac, local, MAC_SIZE);
+    ASSERT(ap_beacon_in_vg(ctx, &b, &BEACON_AT(ctx, 0), NULL) == 0);
+});
+
+TEST("should record removed AP as child of AP kept down a chain of groups", ctx, {
+    Sky_errno_t sky_errno;
+    /* C is grouped with B, which is grouped with connected A */
+    uint8_t a[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x00, 0x00 };
+    uint8_t b[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x00, 0x10 };
+    uint8_t c[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x00, 0x17 };
+    int i, n = CONFIG(ctx->state, max_ap_beacons);
+
+    for (i = 1; i < n - 1; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, (uint8_t)(i * 0x11), 0x99, 0x99 };
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -50 - i, 2412,
+                   false) == SKY_SUCCESS);
+    }
+    ASSERT(sky_add_ap_beacon(ctx, &sky_errno, a, ctx->header.time, -40, 2412, true) ==
+           SKY_SUCCESS);
+    ASSERT(sky_add_ap_beacon(ctx, &sky_errno, b, ctx->header.time, -45, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(sky_add_ap_beacon(ctx, &sky_errno, c, ctx->header.time, -90, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(NUM_APS(ctx) == n);
+    ASSERT(!memcmp(BEACON_AT(ctx, 0).ap.mac, a, MAC_SIZE) && BEACON_AT(ctx, 0).ap.vg_len == 0);
+    ASSERT(!memcmp(BEACON_AT(ctx, 1).ap.mac, b, MAC_SIZE) && BEACON_AT(ctx, 1).ap.vg_len == 1);
+});
+
+TEST("should order APs with more children first of equal rssi when several groups form", ctx, {
+    Sky_errno_t sky_errno;
+    int i, k, vaps = 0, n = CONFIG(ctx->state, max_ap_beacons);
+
+    for (i = 0; i < n; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 0x11), 0x00 };
+        mac[5] = mac[4];
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -50, 2412, false) ==
+               SKY_SUCCESS);
+    }
+    /* one child of the third AP, two of the last */
+    for (k = 0; k < 3; k++) {
+        uint8_t m = (uint8_t)((k == 0 ? 2 : n - 1) * 0x11);
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, m, (uint8_t)(m ^ (k == 2 ? 2 : 1)) };
+
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -50, 2412, false) ==
+               SKY_SUCCESS);
+    }
+    ASSERT(NUM_APS(ctx) == n && order_valid(ctx));
+    for (i = 0; i < n; i++) {
+        vaps += BEACON_AT(ctx, i).ap.vg_len;
+        ASSERT(i == 0 || BEACON_AT(ctx, i - 1).ap.vg_len >= BEACON_AT(ctx, i).ap.vg_len);
+#if SKY_AP_MIRROR
+        ASSERT(AP_MAC(ctx, i) == pack_mac(BEACON_AT(ctx, i).ap.mac));
+#endif
+    }
+    ASSERT(vaps == 3 && BEACON_AT(ctx, 0).ap.vg_len == 2 && BEACON_AT(ctx, 1).ap.vg_len == 1);
+});
+
+TEST("should keep virtual APs of an AP in the next request", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    Sky_location_t loc = { 0 };
+    uint8_t parent[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x00, 0x00 };
+    uint8_t child[2][MAC_SIZE] = { { 0x4C, 0x5E, 0x0C, 0xB0, 0x00, 0x07 },
+        { 0x4C, 0x5E, 0x0C, 0xB0, 0x00, 0x70 } };
+    int i, j, n = CONFIG(ctx->state, max_ap_beacons);
+
+    for (i = 0; i < n; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 0x11), 0x00 };
+        mac[5] = mac[4];
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -40 - i * 2, 2412,
+                   false) == SKY_SUCCESS);
+    }
+    for (j = 0; j < 2; j++) {
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, child[j], ctx->header.time, -30 - j, 2412,
+                   false) == SKY_SUCCESS);
+    }
+    ASSERT(BEACON_AT(ctx, 0).ap.vg_len == 2);
+
+    /* cache a location of the first child on its own */
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    ASSERT(sky_add_ap_beacon(ws, &sky_errno, child[0], ws->header.time, -30, 2412, false) ==
+           SKY_SUCCESS);
+    loc.lat = 42.0;
+    loc.lon = -71.0;
+    loc.hpe = 20;
+    loc.location_status = SKY_LOCATION_STATUS_SUCCESS;
+    ASSERT(sky_plugin_add_to_cache(ws, &sky_errno, &loc) == SKY_SUCCESS);
+
+    ASSERT(sky_new_request_from(ctx, sky_sizeof_workspace(), ctx, NULL, 0, &sky_errno) == ctx);
+    ASSERT(!memcmp(BEACON_AT(ctx, 0).ap.mac, parent, MAC_SIZE));
+    ASSERT(BEACON_AT(ctx, 0).ap.vg_len == 2);
+    ASSERT(CACHE_SIZE == 0 || BEACON_AT(ctx, 0).ap.vg_prop[0].in_cache);
+    ASSERT(!BEACON_AT(ctx, 0).ap.vg_prop[1].in_cache);
+    ASSERT(sky_update_ap_beacon(ctx, &sky_errno, parent, ctx->header.time, -20, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(BEACON_AT(ctx, 0).ap.vg_len == 2);
+    free(ws);
+});
+
+GROUP("sky_finalize_coalesced");
+
+TEST("should park request for the same APs in a different order", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_coalescer_t *co = malloc(sky_sizeof_coalescer(2));
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    Sky_location_t loc = { 0 }, found = { 0 };
+    uint8_t rq[2][1024];
+    uint32_t size;
+    int i;
+
+    ASSERT(sky_open_coalescer(co, sky_sizeof_coalescer(2), &sky_errno) == co);
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    for (i = 0; i < 3; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 0x11), 0x4B };
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -50 - i * 10, 2412,
+                   false) == SKY_SUCCESS);
+        ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac, ws->header.time, -70 + i * 10, 2412,
+                   false) == SKY_SUCCESS);
+    }
+    ASSERT(sky_sizeof_request_buf(ctx, &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_sizeof_request_buf(ws, &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_finalize_coalesced(co, ctx, &sky_errno, rq[0], sizeof(rq[0]), &found, &size) ==
+           SKY_FINALIZE_REQUEST);
+    ASSERT(sky_finalize_coalesced(co, ws, &sky_errno, rq[1], sizeof(rq[1]), &found, &size) ==
+           SKY_FINALIZE_PENDING);
+    ASSERT(sky_coalesced_result(co, ws, &sky_errno, &found) == SKY_FAILURE);
+    /* as sky_decode_coalesced does once the response is decoded */
+    loc.lat = 42.0;
+    loc.lon = -71.0;
+    loc.hpe = 20;
+    loc.location_status = SKY_LOCATION_STATUS_SUCCESS;
+    flight_land(&co->flight[ctx->flight - 1], SKY_SUCCESS, SKY_ERROR_NONE, &loc);
+    ASSERT(sky_coalesced_result(co, ws, &sky_errno, &found) == SKY_SUCCESS);
+    ASSERT(found.lat == loc.lat && found.lon == loc.lon && found.hpe == loc.hpe);
+    ASSERT(co->flight[0].state == FLIGHT_FREE);
+    free(ws);
+    free(co);
+});
+
+TEST("should free flight of waiting workspace which is reused or evicted", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_coalescer_t *co = malloc(sky_sizeof_coalescer(1));
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    Sky_location_t found;
+    uint8_t rq[1024];
+    uint32_t size;
+    int i, j;
+
+    ASSERT(sky_open_coalescer(co, sky_sizeof_coalescer(1), &sky_errno) == co);
+    for (j = 0; j < 2; j++) {
+        ASSERT(sky_new_request(ctx, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ctx);
+        ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+        for (i = 0; i < 3; i++) {
+            uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 0x11), 0x4B };
+            ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -50 - i * 10, 2412,
+                       false) == SKY_SUCCESS);
+            ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac, ws->header.time, -50 - i * 10, 2412,
+                       false) == SKY_SUCCESS);
+        }
+        ASSERT(sky_sizeof_request_buf(ctx, &size, &sky_errno) == SKY_SUCCESS);
+        ASSERT(sky_sizeof_request_buf(ws, &size, &sky_errno) == SKY_SUCCESS);
+        ASSERT(sky_finalize_coalesced(co, ctx, &sky_errno, rq, sizeof(rq), &found, &size) ==
+               SKY_FINALIZE_REQUEST);
+        ASSERT(sky_finalize_coalesced(co, ws, &sky_errno, rq, sizeof(rq), &found, &size) ==
+               SKY_FINALIZE_PENDING);
+        ASSERT(co->flight[0].waiters == 1);
+        if (j == 0) {
+            /* parked workspace reused, then request sent is reused */
+            ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+            ASSERT(co->flight[0].waiters == 0 && co->flight[0].state == FLIGHT_PENDING);
+            ASSERT(sky_new_request(ctx, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ctx);
+        } else {
+            /* device evicted, so neither workspace is valid */
+            ctx->instance->generation++;
+            ASSERT(sky_coalesced_result(co, ws, &sky_errno, &found) == SKY_ERROR);
+            ASSERT(sky_errno == SKY_ERROR_BAD_WORKSPACE && co->flight[0].waiters == 0);
+            sky_coalesce_cancel(co, ctx, SKY_ERROR_SERVER_ERROR);
+        }
+        ASSERT(co->flight[0].state == FLIGHT_FREE);
+    }
+    free(ws);
+    free(co);
+});
+
+TEST("should send request whose beacons differ from those in flight", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_coalescer_t *co = malloc(sky_sizeof_coalescer(4));
+    Sky_ctx_t *ws[3];
+    Sky_location_t found;
+    uint8_t rq[1024];
+    uint32_t size;
+    int i, j;
+
+    ASSERT(sky_open_coalescer(co, sky_sizeof_coalescer(4), &sky_errno) == co);
+    for (j = 0; j < 3; j++) {
+        ws[j] = malloc(sky_sizeof_workspace());
+        ASSERT(sky_new_request(ws[j], sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws[j]);
+    }
+    for (i = 0; i < 4; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 0x11), 0x4B };
+        if (i < 3) {
+            ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -50 - i, 2412,
+                       false) == SKY_SUCCESS);
+            ASSERT(sky_add_ap_beacon(ws[2], &sky_errno, mac, ctx->header.time, -50 - i, 2412,
+                       false) == SKY_SUCCESS);
+        }
+        ASSERT(sky_add_ap_beacon(ws[0], &sky_errno, mac, ctx->header.time, -50 - i, 2412,
+                   false) == SKY_SUCCESS);
+        mac[3] = 0x01;
+        ASSERT(sky_add_ap_beacon(ws[1], &sky_errno, mac, ctx->header.time, -50 - i, 2412,
+                   false) == SKY_SUCCESS);
+    }
+    ASSERT(sky_sizeof_request_buf(ctx, &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_finalize_coalesced(co, ctx, &sky_errno, rq, sizeof(rq), &found, &size) ==
+           SKY_FINALIZE_REQUEST);
+    /* one more AP */
+    ASSERT(sky_sizeof_request_buf(ws[0], &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_finalize_coalesced(co, ws[0], &sky_errno, rq, sizeof(rq), &found, &size) ==
+           SKY_FINALIZE_REQUEST);
+    /* other APs, with a fingerprint which collides with the request in flight */
+    co->flight[ctx->flight - 1].fingerprint = scan_fingerprint(ws[1]);
+    ASSERT(sky_sizeof_request_buf(ws[1], &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_finalize_coalesced(co, ws[1], &sky_errno, rq, sizeof(rq), &found, &size) ==
+           SKY_FINALIZE_REQUEST);
+    ASSERT(ws[0]->flight > 0 && ws[1]->flight > 0 && co->flight[ctx->flight - 1].waiters == 0);
+    /* same APs, but device must register before its requests can be shared */
+    co->flight[ctx->flight - 1].fingerprint = scan_fingerprint(ctx);
+    ws[2]->auth_state = STATE_TBR_UNREGISTERED;
+    ASSERT(sky_sizeof_request_buf(ws[2], &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_finalize_coalesced(co, ws[2], &sky_errno, rq, sizeof(rq), &found, &size) ==
+           SKY_FINALIZE_REQUEST);
+    ASSERT(ws[2]->flight == 0 && co->flight[ctx->flight - 1].waiters == 0);
+    for (j = 0; j < 3; j++)
+        free(ws[j]);
+    free(co);
+});
+
+TEST("should only share location or location unknown with parked requests", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_coalescer_t *co = malloc(sky_sizeof_coalescer(1));
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    Sky_location_t found;
+    uint8_t rq[1024];
+    uint32_t size;
+    uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B };
+
+    ASSERT(sky_open_coalescer(co, sky_sizeof_coalescer(1), &sky_errno) == co);
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -50, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac, ws->header.time, -60, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(sky_sizeof_request_buf(ctx, &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_sizeof_request_buf(ws, &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_finalize_coalesced(co, ctx, &sky_errno, rq, sizeof(rq), &found, &size) ==
+           SKY_FINALIZE_REQUEST);
+    ASSERT(sky_finalize_coalesced(co, ws, &sky_errno, rq, sizeof(rq), &found, &size) ==
+           SKY_FINALIZE_PENDING);
+    /* sender must authenticate again, which is not for the parked request to do */
+    flight_land(&co->flight[0], SKY_ERROR, SKY_AUTH_RETRY, NULL);
+    ctx->flight = 0;
+    ASSERT(sky_coalesced_result(co, ws, &sky_errno, &found) == SKY_ERROR);
+    ASSERT(sky_errno == SKY_ERROR_SERVER_ERROR && co->flight[0].state == FLIGHT_FREE);
+    ASSERT(sky_finalize_coalesced(co, ctx, &sky_errno, rq, sizeof(rq), &found, &size) ==
+           SKY_FINALIZE_REQUEST);
+    ASSERT(sky_finalize_coalesced(co, ws, &sky_errno, rq, sizeof(rq), &found, &size) ==
+           SKY_FINALIZE_PENDING);
+    flight_land(&co->flight[0], SKY_ERROR, SKY_ERROR_LOCATION_UNKNOWN, NULL);
+    ASSERT(sky_coalesced_result(co, ws, &sky_errno, &found) == SKY_ERROR);
+    ASSERT(sky_errno == SKY_ERROR_LOCATION_UNKNOWN);
+    free(ws);
+    free(co);
+});
+
+GROUP("sky_step");
+
+TEST("should register again at once then wait out the backoff", ctx, {
+    Sky_errno_t sky_errno;
+    uint8_t buf[1024];
+    /* response header only, status AUTH_ERROR */
+    uint8_t auth_error[] = { 2, 0x18, SKY_LOCATION_STATUS_AUTH_ERROR };
+    uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B };
+    Sky_step_io_t io;
+
+    memset(&io, 0, sizeof(io));
+    io.buf = buf;
+    io.bufsize = sizeof(buf);
+    ctx->gettime = ctx->instance->gettime = fake_time;
+    strcpy(ctx->state->sky_sku, "sku");
+    ctx->state->sky_token_id = 1234;
+    ctx->auth_state = STATE_TBR_REGISTERED;
+    ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -50, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(sky_step(ctx, &sky_errno, SKY_EVENT_START, &io) == SKY_STEP_NEED_SEND && io.len > 0);
+    ASSERT(sky_step(ctx, &sky_errno, SKY_EVENT_SENT, &io) == SKY_STEP_NEED_RECV);
+    /* token rejected, registration is sent straight away */
+    memcpy(buf, auth_error, sizeof(auth_error));
+    io.len = sizeof(auth_error);
+    ASSERT(sky_step(ctx, &sky_errno, SKY_EVENT_RECEIVED, &io) == SKY_STEP_NEED_SEND);
+    ASSERT(ctx->auth_state == STATE_TBR_UNREGISTERED && ctx->step_retries == 1);
+    ASSERT(sky_step(ctx, &sky_errno, SKY_EVENT_SENT, &io) == SKY_STEP_NEED_RECV);
+    /* registration rejected again, so next one waits */
+    memcpy(buf, auth_error, sizeof(auth_error));
+    io.len = sizeof(auth_error);
+    ASSERT(sky_step(ctx, &sky_errno, SKY_EVENT_RECEIVED, &io) == SKY_STEP_WAIT_UNTIL);
+    ASSERT(sky_errno == SKY_AUTH_RETRY_8H && io.until == fake_now + 8 * SECONDS_IN_HOUR);
+    /* a timer reported early, or an unexpected event, does not send */
+    fake_now += SECONDS_IN_HOUR;
+    ASSERT(sky_step(ctx, &sky_errno, SKY_EVENT_TIMER, &io) == SKY_STEP_WAIT_UNTIL);
+    ASSERT(sky_step(ctx, &sky_errno, SKY_EVENT_SENT, &io) == SKY_STEP_ERROR);
+    ASSERT(sky_errno == SKY_ERROR_BAD_PARAMETERS);
+    fake_now = io.until;
+    ASSERT(sky_step(ctx, &sky_errno, SKY_EVENT_TIMER, &io) == SKY_STEP_NEED_SEND && io.len > 0);
+});
+
+#if CACHE_SIZE
+TEST("should report stale location while request refreshes it", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    Sky_location_t loc = { 0 };
+    uint8_t buf[1024];
+    Sky_step_io_t io;
+    int i;
+
+    memset(&io, 0, sizeof(io));
+    io.buf = buf;
+    io.bufsize = sizeof(buf);
+    ctx->gettime = ctx->instance->gettime = fake_time;
+    for (i = 0; i < 5; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 0x11), 0x4B };
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -40 - i * 5, 2412,
+                   false) == SKY_SUCCESS);
+    }
+    loc.lat = 42.0;
+    loc.lon = -71.0;
+    loc.hpe = 20;
+    loc.location_status = SKY_LOCATION_STATUS_SUCCESS;
+    ASSERT(sky_plugin_add_to_cache(ctx, &sky_errno, &loc) == SKY_SUCCESS);
+
+    /* same scan once the cached location is aging */
+    fake_now += (CACHE_STALE_AGE + 1) * SECONDS_IN_HOUR;
+    ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    for (i = 0; i < 5; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 0x11), 0x4B };
+        ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac, ws->header.time, -40 - i * 5, 2412,
+                   false) == SKY_SUCCESS);
+    }
+    ASSERT(sky_allow_stale(ws, &sky_errno, true) == SKY_SUCCESS);
+    ASSERT(sky_step(ws, &sky_errno, SKY_EVENT_START, &io) == SKY_STEP_STALE && io.len > 0);
+    ASSERT(io.loc.lat == loc.lat && io.loc.lon == loc.lon && io.loc.hpe == loc.hpe);
+    ASSERT(sky_step(ws, &sky_errno, SKY_EVENT_SENT, &io) == SKY_STEP_NEED_RECV);
+    free(ws);
+});
+#endif
+
+GROUP("sky_allow_stale");
+
+TEST("should reject workspace which is not a request", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *ws = calloc(1, sky_sizeof_workspace());
+
+    ASSERT(sky_allow_stale(ws, &sky_errno, true) == SKY_ERROR);
+    ASSERT(sky_errno == SKY_ERROR_BAD_WORKSPACE);
+    free(ws);
+});
+
+#if CACHE_SIZE
+TEST("should report aging cached location only when allowed", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    Sky_location_t loc = { 0 }, found;
+    uint8_t buf[1024];
+    uint32_t size;
+    int i, j;
+
+    ctx->gettime = ctx->instance->gettime = fake_time;
+    for (i = 0; i < 5; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 0x11), 0x4B };
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -40 - i * 5, 2412,
+                   false) == SKY_SUCCESS);
+    }
+    loc.lat = 42.0;
+    loc.lon = -71.0;
+    loc.hpe = 20;
+    loc.location_status = SKY_LOCATION_STATUS_SUCCESS;
+    ASSERT(sky_plugin_add_to_cache(ctx, &sky_errno, &loc) == SKY_SUCCESS);
+
+    /* same scan while cached location is fresh, then once it is aging, then allowed */
+    for (j = 0; j < 3; j++) {
+        if (j == 1) {
+            fake_now += (CACHE_STALE_AGE + 1) * SECONDS_IN_HOUR;
+        }
+        ASSERT(sky_new_request(ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+        ASSERT(sky_allow_stale(ws, &sky_errno, j != 1) == SKY_SUCCESS);
+        for (i = 0; i < 5; i++) {
+            uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 0x11), 0x4B };
+            ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac, ws->header.time, -40 - i * 5, 2412,
+                       false) == SKY_SUCCESS);
+        }
+        memset(&found, 0, sizeof(found));
+        ASSERT(sky_sizeof_request_buf(ws, &size, &sky_errno) == SKY_SUCCESS);
+        ASSERT(sky_finalize_request(ws, &sky_errno, buf, sizeof(buf), &found, &size) ==
+               (j == 0 ? SKY_FINALIZE_LOCATION :
+                         j == 1 ? SKY_FINALIZE_REQUEST : SKY_FINALIZE_STALE));
+        if (j != 1) {
+            ASSERT(found.lat == loc.lat && found.lon == loc.lon && found.hpe == loc.hpe);
+        }
+    }
+    free(ws);
+});
+#endif
+
+GROUP("sky_defer_selection");
+
+TEST("should keep all APs until request size is determined", ctx, {
+    Sky_errno_t sky_errno;
+    uint32_t size;
+    int i;
+
+    ASSERT(sky_defer_selection(ctx, &sky_errno, true) == SKY_SUCCESS);
+    for (i = 0; i < TOTAL_BEACONS; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 7), 0x4B };
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -40 - i * 2, 2412,
+                   false) == SKY_SUCCESS);
+    }
+    ASSERT(NUM_APS(ctx) == TOTAL_BEACONS);
+    ASSERT(sky_sizeof_request_buf(ctx, &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(NUM_APS(ctx) == CONFIG(ctx->state, max_ap_beacons));
+});
+
+TEST("should select from the staged APs each time the staging area fills", ctx, {
+    Sky_errno_t sky_errno;
+    int i;
+
+    ASSERT(sky_defer_selection(ctx, &sky_errno, true) == SKY_SUCCESS);
+    for (i = 0; i < STAGED_BEACONS + 1; i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, (uint8_t)i, (uint8_t)(i * 7), 0x4B };
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ctx->header.time, -40 - i, 2412,
+                   false) == SKY_SUCCESS);
+        if (i == STAGED_BEACONS - 2) {
+            ASSERT(NUM_APS(ctx) == STAGED_BEACONS - 1);
+        }
+    }
+    /* staging filled once, and the selection left room for the rest of the scan */
+    ASSERT(NUM_APS(ctx) == CONFIG(ctx->state, max_ap_beacons) + 1);
+    ASSERT(ctx->defer_selection);
+});
+
+TEST("should select the same APs as when each AP is added", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *seq = malloc(sky_sizeof_workspace());
+    /* 0-14 are kept, 15 is a virtual AP of 3, 16-18 are old and 19 is weak */
+    int order[] = { 16, 19, 0, 1, 2, 3, 4, 5, 6, 15, 17, 7, 8, 9, 10, 11, 12, 13, 14, 18 };
+    uint32_t size;
+    int i, j;
+
+    ASSERT(sky_new_request(seq, sky_sizeof_workspace(), NULL, 0, &sky_errno) == seq);
+    ASSERT(sky_defer_selection(seq, &sky_errno, true) == SKY_SUCCESS);
+    for (i = 0; i < (int)(sizeof(order) / sizeof(order[0])); i++) {
+        uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, 0, 0 };
+        time_t ts = ctx->header.time;
+        int16_t rssi;
+
+        j = order[i];
+        if (j < 15) {
+            mac[4] = mac[5] = (uint8_t)(j * 0x11);
+            rssi = -40 - j * 2;
+        } else if (j == 15) {
+            mac[4] = 0x33, mac[5] = 0x3A;
+            rssi = -47;
+        } else if (j < 19) {
+            mac[0] = 0x28, mac[4] = mac[5] = (uint8_t)(j * 0x11);
+            ts -= 10;
+            rssi = -50 - j;
+        } else {
+            mac[0] = 0x38, mac[4] = mac[5] = (uint8_t)(j * 0x11);
+            rssi = -73 - j;
+        }
+        ASSERT(sky_add_ap_beacon(ctx, &sky_errno, mac, ts, rssi, 2412, false) == SKY_SUCCESS);
+        ASSERT(sky_add_ap_beacon(seq, &sky_errno, mac, ts, rssi, 2412, false) == SKY_SUCCESS);
+    }
+    /* whole scan is staged, then selected from at once */
+    ASSERT(NUM_APS(seq) == (int)(sizeof(order) / sizeof(order[0])));
+    ASSERT(sky_sizeof_request_buf(seq, &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_sizeof_request_buf(ctx, &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(NUM_APS(seq) == CONFIG(ctx->state, max_ap_beacons));
+    ASSERT(NUM_BEACONS(ctx) == NUM_BEACONS(seq));
+    for (i = 0; i < NUM_BEACONS(ctx); i++)
+        if (memcmp(&BEACON_AT(ctx, i), &BEACON_AT(seq, i), sizeof(Beacon_t)) != 0)
+            break;
+    ASSERT(i == NUM_BEACONS(ctx));
+    ASSERT(BEACON_AT(seq, 3).ap.vg_len == 1);
+    free(seq);
+});
+
+TEST("should select the same APs as removing the worst one at a time", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_ctx_t *ws[2] = { malloc(sky_sizeof_workspace()), malloc(sky_sizeof_workspace()) };
+    Sky_log_level_t level = ctx->instance->min_level;
+    uint32_t seed = 1;
+    int i, j, n, scan;
+
+    /* logging every add makes the test too slow */
+    ctx->instance->min_level = SKY_LOG_LEVEL_CRITICAL;
+    /* both workspaces start at the same time, so beacon ages match */
+    ctx->instance->gettime = fake_time;
+    for (scan = 0; scan < 5000; scan++) {
+        n = (int)CONFIG(ctx->state, max_ap_beacons) + 1 + test_rand(&seed) % 15;
+        n = n > STAGED_BEACONS ? STAGED_BEACONS : n;
+        for (j = 0; j < 2; j++) {
+            ASSERT(sky_new_request(ws[j], sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws[j]);
+            ASSERT(sky_defer_selection(ws[j], &sky_errno, true) == SKY_SUCCESS);
+        }
+        for (i = 0; i < n; i++) {
+            /* MACs differ in more than one nibble, so none are virtual APs */
+            uint8_t mac[MAC_SIZE] = { 0x4C, (uint8_t)i, (uint8_t)i, (uint8_t)i, 0, 0 };
+            int16_t rssi = (int16_t)(-30 - test_rand(&seed) % 70);
+            time_t ts = ws[0]->header.time - (test_rand(&seed) % 8 == 0);
+            bool connected = test_rand(&seed) % 8 == 0;
+
+            mac[4] = (uint8_t)test_rand(&seed);
+            mac[5] = (uint8_t)test_rand(&seed);
+            for (j = 0; j < 2; j++) {
+                ASSERT(sky_add_ap_beacon(ws[j], &sky_errno, mac, ts, rssi, 2412, connected) ==
+                       SKY_SUCCESS);
+            }
+        }
+        if (NUM_APS(ws[0]) != NUM_APS(ws[1])) {
+            break;
+        }
+        /* ranked selection against the policy of each add */
+        ASSERT(select_beacons(ws[0], &sky_errno) == SKY_SUCCESS);
+        while (NUM_APS(ws[1]) > (int)CONFIG(ctx->state, max_ap_beacons) &&
+               sky_plugin_remove_worst(ws[1], &sky_errno) == SKY_SUCCESS)
+            ;
+        if (NUM_BEACONS(ws[0]) != NUM_BEACONS(ws[1])) {
+            break;
+        }
+        for (i = 0; i < NUM_BEACONS(ws[0]); i++)
+            if (memcmp(&BEACON_AT(ws[0], i), &BEACON_AT(ws[1], i), sizeof(Beacon_t)) != 0)
+                break;
+        if (i != NUM_BEACONS(ws[0])) {
+            break;
+        }
+    }
+    ctx->instance->min_level = level;
+    ASSERT(scan == 5000);
+    free(ws[1]);
+    free(ws[0]);
+});
+
+GROUP("sky_open_instance");
+
+TEST("should share the plugin chain linked once between instances", ctx, {
+    Sky_errno_t sky_errno;
+    uint8_t id[] = { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC };
+    uint8_t key[AES_KEYLEN] = { 0 };
+    Sky_instance_t *inst = malloc(sky_sizeof_instance());
+    Sky_plugin_table_t *head = ctx->instance->plugin, *next = head->next, marker = *next;
+
+    /* a table which is relinked while another instance walks the chain is seen */
+    head->next = &marker;
+    ASSERT(sky_open_instance(inst, sky_sizeof_instance(), &sky_errno, id, sizeof(id),
+               TEST_PARTNER_ID, key, NULL, 0, NULL, SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time,
+               false) == inst);
+    ASSERT(inst->plugin == head && head->next == &marker);
+    head->next = next;
+    ASSERT(sky_close_instance(inst, &sky_errno, NULL) == SKY_SUCCESS);
+    free(inst);
+});
+
+TEST("should discard a state buffer saved with the layout of an older release", ctx, {
+    Sky_errno_t sky_errno;
+    uint8_t id[] = { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC };
+    uint8_t key[AES_KEYLEN] = { 0 };
+    Sky_instance_t *inst = malloc(sky_sizeof_instance());
+    Sky_state_t *old = malloc(sizeof(Sky_state_t));
+    void *state;
+
+    ASSERT(sky_open_instance(inst, sky_sizeof_instance(), &sky_errno, id, sizeof(id),
+               TEST_PARTNER_ID, key, NULL, 0, NULL, SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time,
+               false) == inst);
+    inst->state.sky_token_id = 0x5AC3A55C;
+#if CACHE_SIZE
+    inst->state.cacheline[0].len = 1;
+#endif
+    ASSERT(sky_close_instance(inst, &sky_errno, &state) == SKY_SUCCESS);
+    memcpy(old, state, sizeof(Sky_state_t));
+    old->header.magic = SKY_MAGIC;
+    old->header.crc32 = sky_crc32(
+        &old->header.magic, (uint8_t *)&old->header.crc32 - (uint8_t *)&old->header.magic);
+    ASSERT(sky_sizeof_state(old) == 0);
+
+    ASSERT(sky_open_instance(inst, sky_sizeof_instance(), &sky_errno, id, sizeof(id),
+               TEST_PARTNER_ID, key, NULL, 0, old, SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time,
+               false) == inst);
+    ASSERT(inst->state.header.magic == SKY_STATE_MAGIC);
+    ASSERT(inst->state.sky_token_id == TBR_TOKEN_UNKNOWN);
+#if CACHE_SIZE
+    ASSERT(inst->state.cacheline[0].len == 0);
+#endif
+    ASSERT(sky_close_instance(inst, &sky_errno, NULL) == SKY_SUCCESS);
+    free(old);
+    free(inst);
+});
+
+TEST("should keep the state of each instance apart", ctx, {
+    Sky_errno_t sky_errno;
+    uint8_t id[2][6] = { { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC },
+        { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBD } };
+    uint8_t key[AES_KEYLEN] = { 0 };
+    Sky_instance_t *inst[2];
+    Sky_ctx_t *ws[2];
+    Sky_location_t loc = { 0 }, found;
+    uint8_t buf[1024];
+    uint32_t size;
+    int i, j;
+
+    for (j = 0; j < 2; j++) {
+        inst[j] = malloc(sky_sizeof_instance());
+        ws[j] = malloc(sky_sizeof_workspace());
+        ASSERT(sky_open_instance(inst[j], sky_sizeof_instance(), &sky_errno, id[j], sizeof(id[j]),
+                   TEST_PARTNER_ID, key, NULL, 0, NULL, SKY_LOG_LEVEL_DEBUG, NULL, NULL,
+                   fake_time, false) == inst[j]);
+        ASSERT(sky_new_instance_request(inst[j], ws[j], sky_sizeof_workspace(), NULL, 0,
+                   &sky_errno) == ws[j]);
+        for (i = 0; i < 5; i++) {
+            uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, (uint8_t)(i * 0x11), 0x4B };
+            ASSERT(sky_add_ap_beacon(ws[j], &sky_errno, mac, ws[j]->header.time, -40 - i * 5,
+                       2412, false) == SKY_SUCCESS);
+        }
+    }
+    ASSERT(!memcmp(inst[0]->state.sky_device_id, id[0], sizeof(id[0])));
+    ASSERT(!memcmp(inst[1]->state.sky_device_id, id[1], sizeof(id[1])));
+
+#if CACHE_SIZE
+    /* location cached by one instance is only found by the same instance */
+    loc.lat = 42.0;
+    loc.lon = -71.0;
+    loc.hpe = 20;
+    loc.location_status = SKY_LOCATION_STATUS_SUCCESS;
+    ASSERT(sky_plugin_add_to_cache(ws[0], &sky_errno, &loc) == SKY_SUCCESS);
+    ASSERT(sky_sizeof_request_buf(ws[1], &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_finalize_request(ws[1], &sky_errno, buf, sizeof(buf), &found, &size) ==
+           SKY_FINALIZE_REQUEST);
+    ASSERT(sky_sizeof_request_buf(ws[0], &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(sky_finalize_request(ws[0], &sky_errno, buf, sizeof(buf), &found, &size) ==
+           SKY_FINALIZE_LOCATION);
+    ASSERT(found.lat == loc.lat && found.lon == loc.lon);
+#else
+    (void)loc;
+    (void)found;
+    (void)buf;
+    (void)size;
+#endif
+
+    /* backoff of one instance does not deny requests of the other */
+    inst[0]->state.backoff = SKY_AUTH_RETRY_1D;
+    inst[0]->state.header.time = (uint32_t)fake_now;
+    ASSERT(sky_new_instance_request(inst[0], ws[0], sky_sizeof_workspace(), NULL, 0,
+               &sky_errno) == NULL);
+    ASSERT(sky_errno == SKY_ERROR_SERVICE_DENIED);
+    ASSERT(sky_new_instance_request(inst[1], ws[1], sky_sizeof_workspace(), NULL, 0,
+               &sky_errno) == ws[1]);
+    for (j = 0; j < 2; j++) {
+        ASSERT(sky_close_instance(inst[j], &sky_errno, NULL) == SKY_SUCCESS);
+        free(ws[j]);
+        free(inst[j]);
+    }
+});
+
+GROUP("sky_store_get_instance");
+
+TEST("should return the resident instance of a device", ctx, {
+    Sky_errno_t sky_errno;
+    uint8_t key[AES_KEYLEN] = { 0 };
+    uint8_t a[] = { 'A', 1, 2, 3, 4, 5 }, b[] = { 'B', 1, 2, 3, 4, 5 };
+    Sky_store_t *store = malloc(sky_sizeof_store(2));
+    Sky_instance_t *inst;
+
+    ASSERT(sky_open_store(store, sky_sizeof_store(2), &sky_errno, TEST_PARTNER_ID, key, NULL, 0,
+               SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time, false, store_save,
+               store_load) == store);
+    ASSERT((inst = sky_store_get_instance(store, &sky_errno, a, sizeof(a))) != NULL);
+    ASSERT(sky_store_get_instance(store, &sky_errno, b, sizeof(b)) != inst);
+    ASSERT(sky_store_get_instance(store, &sky_errno, a, sizeof(a)) == inst);
+    ASSERT(!memcmp(inst->state.sky_device_id, a, sizeof(a)));
+    ASSERT(loads == 2 && saves == 0);
+    ASSERT(sky_close_store(store, &sky_errno) == SKY_SUCCESS);
+    ASSERT(saves == 2);
+    free(store);
+});
+
+TEST("should evict the least recently used device", ctx, {
+    Sky_errno_t sky_errno;
+    uint8_t key[AES_KEYLEN] = { 0 };
+    uint8_t a[] = { 'A', 1, 2, 3, 4, 5 }, b[] = { 'B', 1, 2, 3, 4, 5 };
+    uint8_t c[] = { 'C', 1, 2, 3, 4, 5 };
+    Sky_store_t *store = malloc(sky_sizeof_store(2));
+    Sky_instance_t *inst;
+
+    ASSERT(sky_open_store(store, sky_sizeof_store(2), &sky_errno, TEST_PARTNER_ID, key, NULL, 0,
+               SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time, false, store_save,
+               store_load) == store);
+    ASSERT((inst = sky_store_get_instance(store, &sky_errno, a, sizeof(a))) != NULL);
+    ASSERT(sky_store_get_instance(store, &sky_errno, b, sizeof(b)) != NULL);
+    ASSERT(sky_store_get_instance(store, &sky_errno, a, sizeof(a)) == inst);
+    ASSERT(sky_store_get_instance(store, &sky_errno, c, sizeof(c)) != NULL);
+    ASSERT(saves == 1 && saved[0] == 'B' && loads == 3);
+    /* A is still resident, and B is loaded again */
+    ASSERT(sky_store_get_instance(store, &sky_errno, a, sizeof(a)) == inst);
+    ASSERT(sky_store_get_instance(store, &sky_errno, b, sizeof(b)) != NULL);
+    ASSERT(saves == 2 && saved[1] == 'C' && loads == 4);
+    free(store);
+});
+
+TEST("should fail a request in flight of a device which was evicted", ctx, {
+    Sky_errno_t sky_errno;
+    uint8_t key[AES_KEYLEN] = { 0 };
+    uint8_t a[] = { 'A', 1, 2, 3, 4, 5 }, b[] = { 'B', 1, 2, 3, 4, 5 };
+    uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B };
+    Sky_store_t *store = malloc(sky_sizeof_store(1));
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    Sky_instance_t *inst;
+
+    ASSERT(sky_open_store(store, sky_sizeof_store(1), &sky_errno, TEST_PARTNER_ID, key, NULL, 0,
+               SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time, false, store_save,
+               store_load) == store);
+    ASSERT((inst = sky_store_get_instance(store, &sky_errno, a, sizeof(a))) != NULL);
+    ASSERT(sky_new_instance_request(inst, ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac, ws->header.time, -50, 2412, false) ==
+           SKY_SUCCESS);
+    /* B takes the instance of A */
+    ASSERT(sky_store_get_instance(store, &sky_errno, b, sizeof(b)) == inst);
+    ASSERT(saves == 1 && saved[0] == 'A');
+    ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac, ws->header.time, -50, 2412, false) ==
+           SKY_ERROR);
+    ASSERT(sky_errno == SKY_ERROR_BAD_WORKSPACE);
+    ASSERT(sky_new_instance_request(inst, ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac, ws->header.time, -50, 2412, false) ==
+           SKY_SUCCESS);
+    free(ws);
+    free(store);
+});
+
+GROUP("sky_locate_batch");
+
+TEST("should only accept items with an instance of their own", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_batch_t batch;
+    Sky_batch_item_t item[3];
+    Sky_instance_t *other = malloc(sky_sizeof_instance());
+    Sky_instance_t *third = malloc(sky_sizeof_instance());
+
+    memset(item, 0, sizeof(item));
+    item[0].inst = ctx->instance;
+    ASSERT(sky_batch_init(&batch, &sky_errno, item, 2, batch_add) == SKY_ERROR);
+    ASSERT(sky_errno == SKY_ERROR_BAD_PARAMETERS);
+    item[1].inst = ctx->instance;
+    ASSERT(sky_batch_init(&batch, &sky_errno, item, 2, batch_add) == SKY_ERROR);
+    ASSERT(sky_errno == SKY_ERROR_BAD_PARAMETERS);
+    item[1].inst = other;
+    item[2].inst = ctx->instance;
+    ASSERT(sky_batch_init(&batch, &sky_errno, item, 3, batch_add) == SKY_ERROR);
+    ASSERT(sky_errno == SKY_ERROR_BAD_PARAMETERS);
+    /* instances of a rejected batch are left unmarked */
+    item[2].inst = third;
+    ASSERT(sky_batch_init(&batch, &sky_errno, item, 3, batch_add) == SKY_SUCCESS);
+    ASSERT(sky_batch_init(&batch, &sky_errno, item, 2, batch_add) == SKY_SUCCESS);
+    free(third);
+    free(other);
+});
+
+TEST("should finalize the request of each item with its instance", ctx, {
+    Sky_errno_t sky_errno;
+    Sky_batch_t batch;
+    Sky_batch_item_t item[2];
+    uint8_t key[AES_KEYLEN] = { 0 };
+    uint8_t mac[2][MAC_SIZE] = { { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B },
+        { 0x4C, 0x5E, 0x0C, 0xB0, 0x28, 0x11 } };
+    uint8_t id[2][6] = { { 'A', 1, 2, 3, 4, 5 }, { 'B', 1, 2, 3, 4, 5 } };
+    uint8_t request[2][1024];
+    int i;
+
+    memset(item, 0, sizeof(item));
+    for (i = 0; i < 2; i++) {
+        item[i].inst = sky_open_instance(malloc(sky_sizeof_instance()), sky_sizeof_instance(),
+            &sky_errno, id[i], sizeof(id[i]), TEST_PARTNER_ID, key, NULL, 0, NULL,
+            SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time, false);
+        item[i].scan = mac[i];
+        item[i].workspace_buf = malloc(sky_sizeof_workspace());
+        item[i].request_buf = request[i];
+        item[i].request_bufsize = sizeof(request[i]);
+        ASSERT(item[i].inst != NULL);
+    }
+    ASSERT(sky_batch_init(&batch, &sky_errno, item, 2, batch_add) == SKY_SUCCESS);
+    ASSERT(sky_locate_batch(&batch) == 2);
+    ASSERT(sky_locate_batch(&batch) == 0);
+    for (i = 0; i < 2; i++) {
+        ASSERT(item[i].result == SKY_FINALIZE_REQUEST && item[i].request_size > 0);
+        ASSERT(item[i].ctx == item[i].workspace_buf && item[i].ctx->instance == item[i].inst);
+        ASSERT(NUM_APS(item[i].ctx) == 1);
+        ASSERT(!memcmp(BEACON_AT(item[i].ctx, 0).ap.mac, mac[i], MAC_SIZE));
+    }
+    for (i = 0; i < 2; i++) {
+        free(item[i].workspace_buf);
+        free(item[i].inst);
+    }
+});
+
+#if SKY_TRACE
+GROUP("sky_replay");
+
+TEST("should replay recorded calls with the same results and no credentials", ctx, {
+    Sky_errno_t sky_errno;
+    uint8_t id[] = { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC };
+    uint8_t key[AES_KEYLEN] = { 0xA5, 0x5A, 0xC3, 0x3C, 0x96, 0x69, 0xF0, 0x0F, 0xE1, 0x1E,
+        0xD2, 0x2D, 0xB4, 0x4B, 0x87, 0x78 };
+    uint8_t mac[3][MAC_SIZE] = { { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B },
+        { 0x4C, 0x5E, 0x0C, 0xB0, 0x28, 0x11 }, { 0x4C, 0x5E, 0x0C, 0xB0, 0x39, 0x22 } };
+    Sky_instance_t *inst = malloc(sky_sizeof_instance());
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    uint8_t request[1024];
+    uint32_t size, mismatches = 1;
+    Sky_location_t loc;
+    void *replay = NULL;
+    int32_t replay_size;
+    uint32_t i;
+    int j;
+
+    trace_len = 0;
+    ASSERT(sky_trace_start(&sky_errno, trace_sink) == SKY_SUCCESS);
+    ASSERT(sky_open_instance(inst, sky_sizeof_instance(), &sky_errno, id, sizeof(id),
+               TEST_PARTNER_ID, key, NULL, 0, NULL, SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time,
+               false) == inst);
+    ASSERT(sky_new_instance_request(inst, ws, sky_sizeof_workspace(), (uint8_t *)"app", 4,
+               &sky_errno) == ws);
+    ASSERT(sky_allow_stale(ws, &sky_errno, true) == SKY_SUCCESS);
+    ASSERT(sky_defer_selection(ws, &sky_errno, true) == SKY_SUCCESS);
+    for (j = 0; j < 3; j++) {
+        ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac[j], ws->header.time - 1, -50 - j * 10,
+                   2412, false) == SKY_SUCCESS);
+    }
+    fake_now += 5;
+    ASSERT(sky_new_request_from(ws, sky_sizeof_workspace(), ws, NULL, 0, &sky_errno) == ws);
+    ASSERT(sky_update_ap_beacon(ws, &sky_errno, mac[2], ws->header.time, -40, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(sky_remove_ap_beacon(ws, &sky_errno, mac[1]) == SKY_SUCCESS);
+    ASSERT(sky_sizeof_request_buf(ws, &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(size <= sizeof(request));
+    ASSERT(sky_finalize_request(ws, &sky_errno, request, size, &loc, &size) ==
+           SKY_FINALIZE_REQUEST);
+    ASSERT(sky_close_instance(inst, &sky_errno, NULL) == SKY_SUCCESS);
+    sky_trace_stop();
+    ASSERT(trace_len <= sizeof(trace_buf));
+
+    /* each call is recorded as itself */
+    ASSERT(trace_count(TRACE_NEW_REQUEST) == 1 && trace_count(TRACE_NEW_REQUEST_FROM) == 1);
+    ASSERT(trace_count(TRACE_ADD_BEACON) == 3 && trace_count(TRACE_UPDATE_BEACON) == 1);
+    ASSERT(trace_count(TRACE_REMOVE_BEACON) == 1 && trace_count(TRACE_ALLOW_STALE) == 1);
+    ASSERT(trace_count(TRACE_DEFER_SELECTION) == 1 && trace_count(TRACE_CLOSE) == 1);
+    /* credentials are not recorded */
+    for (i = 0; i + AES_KEYLEN <= trace_len; i++) {
+        if (!memcmp(trace_buf + i, key, AES_KEYLEN) || !memcmp(trace_buf + i, id, sizeof(id)))
+            break;
+    }
+    ASSERT(i + AES_KEYLEN > trace_len);
+
+    ASSERT((replay_size = sky_sizeof_replay(trace_buf, trace_len)) > 0);
+    replay = malloc(replay_size);
+    ASSERT(sky_replay(trace_buf, trace_len, id, sizeof(id), NULL, TBR_TOKEN_UNKNOWN, replay,
+               replay_size, SKY_LOG_LEVEL_DEBUG, NULL, &sky_errno, &mismatches) == SKY_ERROR);
+    ASSERT(sky_replay(trace_buf, trace_len, id, sizeof(id), key, TBR_TOKEN_UNKNOWN, replay,
+               replay_size, SKY_LOG_LEVEL_DEBUG, NULL, &sky_errno, &mismatches) == SKY_SUCCESS);
+    ASSERT(mismatches == 0);
+    /* request recorded one byte shorter than replayed, with the crc of the bytes recorded */
+    ASSERT((i = trace_result_of(TRACE_FINALIZE)) != 0);
+    memcpy(&size, trace_buf + i + 8, sizeof(size));
+    ASSERT(size > 1 && size <= sizeof(request));
+    size--;
+    memcpy(trace_buf + i + 8, &size, sizeof(size));
+    size = sky_crc32(request, size);
+    memcpy(trace_buf + i + 12, &size, sizeof(size));
+    ASSERT(sky_replay(trace_buf, trace_len, id, sizeof(id), key, TBR_TOKEN_UNKNOWN, replay,
+               replay_size, SKY_LOG_LEVEL_DEBUG, NULL, &sky_errno, &mismatches) == SKY_SUCCESS);
+    ASSERT(mismatches == 1);
+    free(replay);
+    free(ws);
+    free(inst);
+});
+
+TEST("should replay state without recording its TBR token", ctx, {
+    Sky_errno_t sky_errno;
+    uint8_t id[] = { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC };
+    uint8_t key[AES_KEYLEN] = { 0 };
+    uint32_t token = 0x5AC3A55C, mismatches = 1, i;
+    Sky_instance_t *inst = malloc(sky_sizeof_instance());
+    void *state, *saved, *replay;
+    int32_t replay_size;
+
+    ASSERT(sky_open_instance(inst, sky_sizeof_instance(), &sky_errno, id, sizeof(id),
+               TEST_PARTNER_ID, key, NULL, 0, NULL, SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time,
+               false) == inst);
+    inst->state.sky_token_id = token;
+    ASSERT(sky_close_instance(inst, &sky_errno, &state) == SKY_SUCCESS);
+    saved = malloc(sky_sizeof_state(state));
+    memcpy(saved, state, sky_sizeof_state(state));
+
+    trace_len = 0;
+    ASSERT(sky_trace_start(&sky_errno, trace_sink) == SKY_SUCCESS);
+    ASSERT(sky_open_instance(inst, sky_sizeof_instance(), &sky_errno, id, sizeof(id),
+               TEST_PARTNER_ID, key, NULL, 0, saved, SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time,
+               false) == inst);
+    ASSERT(inst->state.sky_token_id == token);
+    ASSERT(sky_close_instance(inst, &sky_errno, NULL) == SKY_SUCCESS);
+    sky_trace_stop();
+    ASSERT(trace_len <= sizeof(trace_buf));
+    for (i = 0; i + sizeof(token) <= trace_len; i++) {
+        if (!memcmp(trace_buf + i, &token, sizeof(token)))
+            break;
+    }
+    ASSERT(i + sizeof(token) > trace_len);
+
+    ASSERT((replay_size = sky_sizeof_replay(trace_buf, trace_len)) > 0);
+    replay = malloc(replay_size);
+    ASSERT(sky_replay(trace_buf, trace_len, id, sizeof(id), key, token, replay, replay_size,
+               SKY_LOG_LEVEL_DEBUG, NULL, &sky_errno, &mismatches) == SKY_SUCCESS);
+    ASSERT(mismatches == 0 && ((Sky_instance_t *)replay)->state.sky_token_id == token);
+    free(replay);
+    free(saved);
+    free(inst);
+});
+
+TEST("should replay selection from APs added at once", ctx, {
+    Sky_errno_t sky_errno;
+    uint8_t id[] = { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC };
+    uint8_t key[AES_KEYLEN] = { 0 };
+    uint8_t mac[MAC_SIZE] = { 0x4C, 0x5E, 0x0C, 0xB0, 0x17, 0x4B };
+    Sky_ap_scan_t scan[TOTAL_BEACONS];
+    Sky_instance_t *inst = malloc(sky_sizeof_instance());
+    Sky_ctx_t *ws = malloc(sky_sizeof_workspace());
+    uint8_t request[1024];
+    uint32_t size, mismatches = 1;
+    Sky_location_t loc;
+    void *replay = NULL;
+    int32_t replay_size;
+    int i;
+
+    trace_len = 0;
+    ASSERT(sky_trace_start(&sky_errno, trace_sink) == SKY_SUCCESS);
+    ASSERT(sky_open_instance(inst, sky_sizeof_instance(), &sky_errno, id, sizeof(id),
+               TEST_PARTNER_ID, key, NULL, 0, NULL, SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time,
+               false) == inst);
+    ASSERT(sky_new_instance_request(inst, ws, sky_sizeof_workspace(), NULL, 0, &sky_errno) == ws);
+    memset(scan, 0, sizeof(scan));
+    for (i = 0; i < TOTAL_BEACONS; i++) {
+        scan[i].mac[0] = 0x4C;
+        scan[i].mac[4] = scan[i].mac[5] = (uint8_t)(i * 0x11);
+        scan[i].timestamp = ws->header.time - (i % 3);
+        scan[i].rssi = -40 - (i * 13) % 50;
+        scan[i].frequency = 2412;
+    }
+    ASSERT(sky_add_ap_beacons(ws, &sky_errno, scan, TOTAL_BEACONS) == SKY_SUCCESS);
+    ASSERT(NUM_APS(ws) == CONFIG(ws->state, max_ap_beacons));
+    /* an AP added next is filtered against the selected APs */
+    ASSERT(sky_add_ap_beacon(ws, &sky_errno, mac, ws->header.time, -45, 2412, false) ==
+           SKY_SUCCESS);
+    ASSERT(sky_sizeof_request_buf(ws, &size, &sky_errno) == SKY_SUCCESS);
+    ASSERT(size <= sizeof(request));
+    ASSERT(sky_finalize_request(ws, &sky_errno, request, size, &loc, &size) ==
+           SKY_FINALIZE_REQUEST);
+    ASSERT(sky_close_instance(inst, &sky_errno, NULL) == SKY_SUCCESS);
+    sky_trace_stop();
+    ASSERT(trace_len <= sizeof(trace_buf));
+    ASSERT(trace_count(TRACE_SELECT_BEACONS) == 1);
+
+    ASSERT((replay_size = sky_sizeof_replay(trace_buf, trace_len)) > 0);
+    replay = malloc(replay_size);
+    ASSERT(sky_replay(trace_buf, trace_len, id, sizeof(id), key, TBR_TOKEN_UNKNOWN, replay,
+               replay_size, SKY_LOG_LEVEL_DEBUG, NULL, &sky_errno, &mismatches) == SKY_SUCCESS);
+    ASSERT(mismatches == 0);
+    /* request recorded one byte shorter than replayed, with the crc of the bytes recorded */
+    ASSERT((i = trace_result_of(TRACE_FINALIZE)) != 0);
+    memcpy(&size, trace_buf + i + 8, sizeof(size));
+    ASSERT(size > 1 && size <= sizeof(request));
+    size--;
+    memcpy(trace_buf + i + 8, &size, sizeof(size));
+    size = sky_crc32(request, size);
+    memcpy(trace_buf + i + 12, &size, sizeof(size));
+    ASSERT(sky_replay(trace_buf, trace_len, id, sizeof(id), key, TBR_TOKEN_UNKNOWN, replay,
+               replay_size, SKY_LOG_LEVEL_DEBUG, NULL, &sky_errno, &mismatches) == SKY_SUCCESS);
+    ASSERT(mismatches == 1);
+    free(replay);
+    free(ws);
+    free(inst);
+});
+
+TEST("should reject open record whose lengths do not add up", ctx, {
+    Sky_errno_t sky_errno;
+    uint8_t id[] = { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC };
+    uint8_t key[AES_KEYLEN] = { 0 };
+    /* op, payload length, then partner id, sku length, cc, debounce, state length, state */
+    uint8_t trace[5 + 14 + 8] = { TRACE_OPEN };
+    uint32_t len = 14 + 8, state_len, mismatches;
+    int32_t replay_size = sky_sizeof_instance() + sky_sizeof_workspace() + sizeof(trace);
+    void *replay = malloc(replay_size);
+    int i;
+
+    memcpy(trace + 1, &len, sizeof(len));
+    /* state claimed longer, then shorter, than the state which follows, then sku too long */
+    for (i = 0; i < 3; i++) {
+        state_len = i == 0 ? 100 : i == 1 ? 4 : 8;
+        memcpy(trace + 5 + 10, &state_len, sizeof(state_len));
+        trace[5 + 4] = i == 2 ? 20 : 0;
+        ASSERT(sky_replay(trace, sizeof(trace), id, sizeof(id), key, TBR_TOKEN_UNKNOWN, replay,
+                   replay_size, SKY_LOG_LEVEL_DEBUG, NULL, &sky_errno, &mismatches) == SKY_ERROR);
+        ASSERT(sky_errno == SKY_ERROR_DECODE_ERROR);
+    }
+    free(replay);
+});
+
+TEST("should record one instance at a time", ctx, {
+    Sky_errno_t sky_errno;
+    uint8_t id[] = { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC };
+    uint8_t key[AES_KEYLEN] = { 0 };
+    Sky_instance_t *a = malloc(sky_sizeof_instance());
+    Sky_instance_t *b = malloc(sky_sizeof_instance());
+
+    trace_len = 0;
+    ASSERT(sky_trace_start(&sky_errno, trace_sink) == SKY_SUCCESS);
+    ASSERT(sky_open_instance(a, sky_sizeof_instance(), &sky_errno, id, sizeof(id),
+               TEST_PARTNER_ID, key, NULL, 0, NULL, SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time,
+               false) == a);
+    ASSERT(sky_open_instance(b, sky_sizeof_instance(), &sky_errno, id, sizeof(id),
+               TEST_PARTNER_ID, key, NULL, 0, NULL, SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time,
+               false) == NULL);
+    ASSERT(sky_errno == SKY_ERROR_RESOURCE_UNAVAILABLE);
+    /* instance opened before recording is not recorded */
+    ASSERT(sky_add_ap_beacon(ctx, &sky_errno, (uint8_t *)"\x4C\x5E\x0C\xB0\x17\x4B",
+               ctx->header.time, -50, 2412, false) == SKY_SUCCESS);
+    ASSERT(trace_count(TRACE_ADD_BEACON) == 0);
+    ASSERT(sky_close_instance(a, &sky_errno, NULL) == SKY_SUCCESS);
+    ASSERT(sky_open_instance(b, sky_sizeof_instance(), &sky_errno, id, sizeof(id),
+               TEST_PARTNER_ID, key, NULL, 0, NULL, SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time,
+               false) == b);
+    ASSERT(trace_count(TRACE_OPEN) == 2);
+    sky_trace_stop();
+    free(b);
+    free(a);
+});
+
+TEST("should record another instance once one fails to open or recording restarts", ctx, {
+    Sky_errno_t sky_errno;
+    uint8_t id[] = { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC };
+    uint8_t key[AES_KEYLEN] = { 0 };
+    Sky_instance_t *a = malloc(sky_sizeof_instance());
+    Sky_instance_t *b = malloc(sky_sizeof_instance());
+
+    trace_len = 0;
+    ASSERT(sky_trace_start(&sky_errno, trace_sink) == SKY_SUCCESS);
+    ASSERT(sky_open_instance(a, sky_sizeof_instance(), &sky_errno, id, sizeof(id), 0, key, NULL,
+               0, NULL, SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time, false) == NULL);
+    ASSERT(sky_errno == SKY_ERROR_BAD_PARAMETERS);
+    ASSERT(sky_open_instance(b, sky_sizeof_instance(), &sky_errno, id, sizeof(id),
+               TEST_PARTNER_ID, key, NULL, 0, NULL, SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time,
+               false) == b);
+    /* b is dropped without sky_close, and its memory reused */
+    memset(b, 0xA5, sky_sizeof_instance());
+    ASSERT(sky_open_instance(a, sky_sizeof_instance(), &sky_errno, id, sizeof(id),
+               TEST_PARTNER_ID, key, NULL, 0, NULL, SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time,
+               false) == NULL);
+    ASSERT(sky_errno == SKY_ERROR_RESOURCE_UNAVAILABLE);
+    ASSERT(sky_trace_start(&sky_errno, trace_sink) == SKY_SUCCESS);
+    ASSERT(sky_open_instance(a, sky_sizeof_instance(), &sky_errno, id, sizeof(id),
+               TEST_PARTNER_ID, key, NULL, 0, NULL, SKY_LOG_LEVEL_DEBUG, NULL, NULL, fake_time,
+               false) == a);
+    ASSERT(trace_count(TRACE_OPEN) == 3);
+    ASSERT(sky_close_instance(a, &sky_errno, NULL) == SKY_SUCCESS);
+    sky_trace_stop();
+    free(b);
+    free(a);
+});
+#endif
+
+END_TESTS();